@@ -0,0 +1,417 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/perf_merchant_httpd_eventloop.c
+ * @brief measure the cost of an event loop wakeup of MHD in external
+ *        select() mode (as used by taler-merchant-httpd by default)
+ *        versus epoll() mode ("USE_EPOLL"), as a function of the
+ *        number of idle and suspended connections.
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <microhttpd.h>
+#include <gnunet/gnunet_util_lib.h>
+#include <gnunet/gnunet_mhd_compat.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+/**
+ * How many requests do we time per configuration?
+ */
+#define ROUNDS 2000
+
+/**
+ * Maximum number of connections we park in total.
+ */
+#define MAX_PARKED 20000
+
+
+/**
+ * Suspended connections (simulating long pollers).
+ */
+static struct MHD_Connection *suspended[MAX_PARKED];
+
+/**
+ * Number of entries in #suspended.
+ */
+static unsigned int num_suspended;
+
+
+/**
+ * Handle a request. "/suspend" is suspended forever (until
+ * the end of the run), everything else gets a tiny response.
+ *
+ * @param cls response to return
+ * @param connection the connection
+ * @param url requested URL
+ * @param method HTTP method
+ * @param version HTTP version
+ * @param upload_data uploaded data
+ * @param upload_data_size number of bytes in @a upload_data
+ * @param con_cls per-request state
+ * @return MHD result code
+ */
+static MHD_RESULT
+access_cb (void *cls,
+           struct MHD_Connection *connection,
+           const char *url,
+           const char *method,
+           const char *version,
+           const char *upload_data,
+           size_t *upload_data_size,
+           void **con_cls)
+{
+  struct MHD_Response *resp = cls;
+  static int marker;
+
+  (void) method;
+  (void) version;
+  (void) upload_data;
+  (void) upload_data_size;
+  if (0 == strcmp (url,
+                   "/suspend"))
+  {
+    if (&marker == *con_cls)
+      return MHD_NO; /* resumed at the end, close */
+    *con_cls = &marker;
+    GNUNET_assert (num_suspended < MAX_PARKED);
+    suspended[num_suspended++] = connection;
+    MHD_suspend_connection (connection);
+    return MHD_YES;
+  }
+  return MHD_queue_response (connection,
+                             MHD_HTTP_OK,
+                             resp);
+}
+
+
+/**
+ * Run one iteration of MHD's event loop, waiting at most
+ * @a max_wait_ms for activity.
+ *
+ * @param d daemon to run
+ * @param epoll_fd MHD's epoll FD, -1 for select() mode
+ * @param max_wait_ms maximum time to block
+ */
+static void
+run_once (struct MHD_Daemon *d,
+          int epoll_fd,
+          int max_wait_ms)
+{
+  if (-1 == epoll_fd)
+  {
+    fd_set rs;
+    fd_set ws;
+    fd_set es;
+    MHD_socket max = -1;
+    struct timeval tv;
+
+    FD_ZERO (&rs);
+    FD_ZERO (&ws);
+    FD_ZERO (&es);
+    GNUNET_assert (MHD_YES ==
+                   MHD_get_fdset (d,
+                                  &rs,
+                                  &ws,
+                                  &es,
+                                  &max));
+    tv.tv_sec = 0;
+    tv.tv_usec = max_wait_ms * 1000;
+    (void) select (max + 1,
+                   &rs,
+                   &ws,
+                   &es,
+                   &tv);
+  }
+  else
+  {
+    struct pollfd pfd = {
+      .fd = epoll_fd,
+      .events = POLLIN
+    };
+
+    (void) poll (&pfd,
+                 1,
+                 max_wait_ms);
+  }
+  GNUNET_assert (MHD_YES == MHD_run (d));
+}
+
+
+/**
+ * Open a client TCP connection to @a sa.
+ *
+ * @param sa address to connect to
+ * @return socket, -1 on error
+ */
+static int
+connect_client (const struct sockaddr_in *sa)
+{
+  int fd;
+
+  fd = socket (AF_INET,
+               SOCK_STREAM,
+               0);
+  if (-1 == fd)
+    return -1;
+  if (0 != connect (fd,
+                    (const struct sockaddr *) sa,
+                    sizeof (*sa)))
+  {
+    GNUNET_break (0 == close (fd));
+    return -1;
+  }
+  return fd;
+}
+
+
+/**
+ * Measure the average time to serve a request over a keep-alive
+ * connection while @a idle idle and @a parked suspended connections
+ * exist.
+ *
+ * @param use_epoll #GNUNET_YES to use MHD's epoll mode
+ * @param idle number of idle connections
+ * @param parked number of suspended connections
+ * @return average latency in microseconds, 0 on error
+ */
+static unsigned long long
+measure (int use_epoll,
+         unsigned int idle,
+         unsigned int parked)
+{
+  static const char req[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+  static const char sreq[] = "GET /suspend HTTP/1.1\r\nHost: bench\r\n\r\n";
+  struct MHD_Response *resp;
+  struct MHD_Daemon *d;
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof (sa);
+  int *cfds;
+  int lsock;
+  int epoll_fd = -1;
+  int active;
+  struct GNUNET_TIME_Absolute start;
+  struct GNUNET_TIME_Relative total;
+
+  memset (&sa,
+          0,
+          sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  lsock = socket (AF_INET,
+                  SOCK_STREAM,
+                  0);
+  if ( (-1 == lsock) ||
+       (0 != bind (lsock,
+                   (const struct sockaddr *) &sa,
+                   sizeof (sa))) ||
+       (0 != listen (lsock,
+                     1024)) ||
+       (0 != getsockname (lsock,
+                          (struct sockaddr *) &sa,
+                          &sa_len)) )
+  {
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                         "bind");
+    return 0;
+  }
+  resp = MHD_create_response_from_buffer (2,
+                                          "ok",
+                                          MHD_RESPMEM_PERSISTENT);
+  d = MHD_start_daemon (MHD_USE_SUSPEND_RESUME
+                        | ((GNUNET_YES == use_epoll) ? MHD_USE_EPOLL : 0),
+                        0,
+                        NULL, NULL,
+                        &access_cb, resp,
+                        MHD_OPTION_LISTEN_SOCKET, lsock,
+                        MHD_OPTION_CONNECTION_LIMIT,
+                        (unsigned int) (MAX_PARKED * 2 + 16),
+                        MHD_OPTION_END);
+  if (NULL == d)
+  {
+    GNUNET_break (0);
+    MHD_destroy_response (resp);
+    return 0;
+  }
+  if (GNUNET_YES == use_epoll)
+    epoll_fd = MHD_get_daemon_info (d,
+                                    MHD_DAEMON_INFO_EPOLL_FD)->epoll_fd;
+  cfds = GNUNET_new_array (idle + parked + 1,
+                           int);
+  for (unsigned int i = 0; i<=idle + parked; i++)
+    cfds[i] = -1;
+  num_suspended = 0;
+  for (unsigned int i = 0; i<idle + parked; i++)
+  {
+    cfds[i] = connect_client (&sa);
+    if (-1 == cfds[i])
+    {
+      GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                           "connect");
+      total = GNUNET_TIME_UNIT_ZERO;
+      goto cleanup;
+    }
+    if ( (i >= idle) &&
+         (sizeof (sreq) - 1 !=
+          write (cfds[i],
+                 sreq,
+                 sizeof (sreq) - 1)) )
+      GNUNET_break (0);
+    /* keep the listen backlog short */
+    if (0 == i % 64)
+      run_once (d,
+                epoll_fd,
+                0);
+  }
+  while (num_suspended < parked)
+    run_once (d,
+              epoll_fd,
+              10);
+  active = connect_client (&sa);
+  cfds[idle + parked] = active;
+  GNUNET_assert (-1 != active);
+
+  total = GNUNET_TIME_UNIT_ZERO;
+  for (unsigned int r = 0; r<ROUNDS; r++)
+  {
+    char buf[1024];
+    size_t off = 0;
+
+    start = GNUNET_TIME_absolute_get ();
+    GNUNET_assert (sizeof (req) - 1 ==
+                   write (active,
+                          req,
+                          sizeof (req) - 1));
+    while (1)
+    {
+      struct pollfd pfd = {
+        .fd = active,
+        .events = POLLIN
+      };
+      ssize_t got;
+
+      run_once (d,
+                epoll_fd,
+                100);
+      if (1 != poll (&pfd,
+                     1,
+                     0))
+        continue;
+      got = read (active,
+                  &buf[off],
+                  sizeof (buf) - off - 1);
+      GNUNET_assert (got > 0);
+      off += got;
+      buf[off] = '\0';
+      if ( (NULL != strstr (buf,
+                            "\r\n\r\n")) &&
+           (0 == strcmp (&buf[off - 2],
+                         "ok")) )
+        break;
+    }
+    total = GNUNET_TIME_relative_add (total,
+                                      GNUNET_TIME_absolute_get_duration (
+                                        start));
+  }
+cleanup:
+  for (unsigned int i = 0; i<num_suspended; i++)
+    MHD_resume_connection (suspended[i]);
+  for (unsigned int i = 0; i<=idle + parked; i++)
+    if (-1 != cfds[i])
+      GNUNET_break (0 == close (cfds[i]));
+  GNUNET_free (cfds);
+  run_once (d,
+            epoll_fd,
+            0);
+  MHD_stop_daemon (d);
+  MHD_destroy_response (resp);
+  return total.rel_value_us / ROUNDS;
+}
+
+
+int
+main (int argc,
+      char *const *argv)
+{
+  static const unsigned int counts[] = {
+    0, 100, 500, 1000, 5000, 10000
+  };
+  struct rlimit rl;
+  int have_epoll;
+
+  (void) argc;
+  (void) argv;
+  GNUNET_log_setup ("perf-merchant-httpd-eventloop",
+                    "WARNING",
+                    NULL);
+  if (0 == getrlimit (RLIMIT_NOFILE,
+                      &rl))
+  {
+    rl.rlim_cur = rl.rlim_max;
+    (void) setrlimit (RLIMIT_NOFILE,
+                      &rl);
+  }
+  have_epoll = (MHD_YES == MHD_is_feature_supported (MHD_FEATURE_EPOLL));
+  fprintf (stdout,
+           "%10s %10s %14s %14s\n",
+           "idle",
+           "suspended",
+           "select [us]",
+           "epoll [us]");
+  for (unsigned int i = 0; i<sizeof (counts) / sizeof (counts[0]); i++)
+    for (unsigned int j = 0; j<sizeof (counts) / sizeof (counts[0]); j++)
+    {
+      unsigned int idle = counts[i];
+      unsigned int parked = counts[j];
+      char sel[32];
+      char epo[32];
+
+      if ( (2 * (idle + parked) + 16 > rl.rlim_cur) ||
+           (parked > MAX_PARKED) )
+        continue;
+      /* both ends of each connection live in this process */
+      if (2 * (idle + parked) + 16 < FD_SETSIZE)
+        GNUNET_snprintf (sel,
+                         sizeof (sel),
+                         "%llu",
+                         measure (GNUNET_NO,
+                                  idle,
+                                  parked));
+      else
+        strcpy (sel,
+                "FD_SETSIZE");
+      if (have_epoll)
+        GNUNET_snprintf (epo,
+                         sizeof (epo),
+                         "%llu",
+                         measure (GNUNET_YES,
+                                  idle,
+                                  parked));
+      else
+        strcpy (epo,
+                "n/a");
+      fprintf (stdout,
+               "%10u %10u %14s %14s\n",
+               idle,
+               parked,
+               sel,
+               epo);
+    }
+  return 0;
+}
+
+
+/* end of perf_merchant_httpd_eventloop.c */
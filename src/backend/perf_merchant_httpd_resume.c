@@ -0,0 +1,542 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/perf_merchant_httpd_resume.c
+ * @brief measure the latency of waking up many long-polling requests
+ *        on the same order, when MHD is run after each resumed
+ *        connection versus once per batch of resumed connections
+ * @author Christian Grothoff
+ *
+ * MHD is driven by the GNUnet scheduler in external epoll() mode
+ * (external select() mode cannot handle more than FD_SETSIZE
+ * sockets).  We park #NUM_POLLERS requests, resume all of them in
+ * one task (as TMH_long_poll_resume() does when a payment arrives)
+ * and measure the time until the last response was sent.
+ */
+#include "platform.h"
+#include <microhttpd.h>
+#include <gnunet/gnunet_util_lib.h>
+#include <gnunet/gnunet_mhd_compat.h>
+#include <sys/resource.h>
+
+/**
+ * Number of requests long-polling on the same order.
+ */
+#define NUM_POLLERS 10000
+
+/**
+ * How many clients do we connect per task (to keep the listen
+ * backlog short)?
+ */
+#define CONNECT_BATCH 64
+
+
+/**
+ * Our HTTP daemon.
+ */
+static struct MHD_Daemon *mhd;
+
+/**
+ * MHD's epoll() file descriptor.
+ */
+static struct GNUNET_NETWORK_Handle *mhd_epoll_fd;
+
+/**
+ * Task running MHD.
+ */
+static struct GNUNET_SCHEDULER_Task *mhd_task;
+
+/**
+ * Task running MHD after connections were resumed (batched mode).
+ */
+static struct GNUNET_SCHEDULER_Task *trigger_task;
+
+/**
+ * Task connecting clients.
+ */
+static struct GNUNET_SCHEDULER_Task *connect_task;
+
+/**
+ * Set if we should immediately #MHD_run again.
+ */
+static int triggered;
+
+/**
+ * #GNUNET_YES to run MHD once per batch of resumed connections,
+ * #GNUNET_NO to run it after each resumed connection.
+ */
+static int batched;
+
+/**
+ * Response we return.
+ */
+static struct MHD_Response *resp;
+
+/**
+ * Address of our daemon.
+ */
+static struct sockaddr_in sa;
+
+/**
+ * Client sockets.
+ */
+static int cfds[NUM_POLLERS];
+
+/**
+ * Number of clients that connected.
+ */
+static unsigned int num_clients;
+
+/**
+ * Suspended connections.
+ */
+static struct MHD_Connection *suspended[NUM_POLLERS];
+
+/**
+ * Number of entries in #suspended.
+ */
+static unsigned int num_suspended;
+
+/**
+ * Number of requests that were answered.
+ */
+static unsigned int num_completed;
+
+/**
+ * When did we start to resume the connections?
+ */
+static struct GNUNET_TIME_Absolute wakeup_start;
+
+/**
+ * Number of calls to MHD_run() since the wakeup.
+ */
+static unsigned int mhd_runs;
+
+/**
+ * Return value from main().
+ */
+static int result;
+
+
+/**
+ * Start measuring a mode.
+ *
+ * @param cls NULL
+ */
+static void
+start_phase (void *cls);
+
+
+/**
+ * Call MHD and schedule the next run.
+ *
+ * @param cls NULL
+ */
+static void
+run_daemon (void *cls)
+{
+  MHD_UNSIGNED_LONG_LONG timeout;
+  struct GNUNET_TIME_Relative tv;
+
+  (void) cls;
+  mhd_task = NULL;
+  if (NULL != trigger_task)
+  {
+    GNUNET_SCHEDULER_cancel (trigger_task);
+    trigger_task = NULL;
+  }
+  do {
+    triggered = 0;
+    mhd_runs++;
+    GNUNET_assert (MHD_YES == MHD_run (mhd));
+  } while (0 != triggered);
+  if (MHD_YES == MHD_get_timeout (mhd,
+                                  &timeout))
+    tv.rel_value_us = (uint64_t) timeout * 1000LL;
+  else
+    tv = GNUNET_TIME_UNIT_FOREVER_REL;
+  mhd_task = GNUNET_SCHEDULER_add_read_net_with_priority (
+    tv,
+    GNUNET_SCHEDULER_PRIORITY_HIGH,
+    mhd_epoll_fd,
+    &run_daemon,
+    NULL);
+}
+
+
+/**
+ * Run MHD for the connections resumed since it last ran.
+ *
+ * @param cls NULL
+ */
+static void
+run_triggered (void *cls)
+{
+  (void) cls;
+  trigger_task = NULL;
+  if (NULL == mhd_task)
+    return;
+  GNUNET_SCHEDULER_cancel (mhd_task);
+  mhd_task = NULL;
+  run_daemon (NULL);
+}
+
+
+/**
+ * Kick MHD after a connection was resumed, using the strategy
+ * selected by #batched.
+ */
+static void
+trigger_daemon (void)
+{
+  if (NULL == mhd_task)
+  {
+    triggered = 1;
+    return;
+  }
+  if (GNUNET_YES == batched)
+  {
+    if (NULL == trigger_task)
+      trigger_task = GNUNET_SCHEDULER_add_with_priority (
+        GNUNET_SCHEDULER_PRIORITY_HIGH,
+        &run_triggered,
+        NULL);
+    return;
+  }
+  GNUNET_SCHEDULER_cancel (mhd_task);
+  mhd_task = NULL;
+  run_daemon (NULL);
+}
+
+
+/**
+ * Resume all suspended connections, like a payment would.
+ *
+ * @param cls NULL
+ */
+static void
+wakeup (void *cls)
+{
+  (void) cls;
+  mhd_runs = 0;
+  wakeup_start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<num_suspended; i++)
+  {
+    MHD_resume_connection (suspended[i]);
+    trigger_daemon ();
+  }
+}
+
+
+/**
+ * Stop the daemon and close all client connections.
+ */
+static void
+stop_daemon (void)
+{
+  if (NULL != mhd_task)
+  {
+    GNUNET_SCHEDULER_cancel (mhd_task);
+    mhd_task = NULL;
+  }
+  if (NULL != trigger_task)
+  {
+    GNUNET_SCHEDULER_cancel (trigger_task);
+    trigger_task = NULL;
+  }
+  if (NULL != connect_task)
+  {
+    GNUNET_SCHEDULER_cancel (connect_task);
+    connect_task = NULL;
+  }
+  for (unsigned int i = 0; i<num_clients; i++)
+    GNUNET_break (0 == close (cfds[i]));
+  num_clients = 0;
+  GNUNET_NETWORK_socket_free_memory_only_ (mhd_epoll_fd);
+  mhd_epoll_fd = NULL;
+  MHD_stop_daemon (mhd);
+  mhd = NULL;
+}
+
+
+/**
+ * All requests were answered, report and clean up.
+ *
+ * @param cls NULL
+ */
+static void
+finish_phase (void *cls)
+{
+  struct GNUNET_TIME_Relative latency;
+
+  (void) cls;
+  latency = GNUNET_TIME_absolute_get_duration (wakeup_start);
+  fprintf (stdout,
+           "%-10s %10u %14llu %14u\n",
+           (GNUNET_YES == batched) ? "batched" : "immediate",
+           num_suspended,
+           (unsigned long long) latency.rel_value_us,
+           mhd_runs);
+  stop_daemon ();
+  if (GNUNET_YES == batched)
+  {
+    MHD_destroy_response (resp);
+    resp = NULL;
+    return;
+  }
+  batched = GNUNET_YES;
+  GNUNET_SCHEDULER_add_now (&start_phase,
+                            NULL);
+}
+
+
+/**
+ * Handle a request: suspend it the first time, answer it
+ * once it was resumed.
+ *
+ * @param cls NULL
+ * @param connection the connection
+ * @param url requested URL
+ * @param method HTTP method
+ * @param version HTTP version
+ * @param upload_data uploaded data
+ * @param upload_data_size number of bytes in @a upload_data
+ * @param con_cls per-request state
+ * @return MHD result code
+ */
+static MHD_RESULT
+access_cb (void *cls,
+           struct MHD_Connection *connection,
+           const char *url,
+           const char *method,
+           const char *version,
+           const char *upload_data,
+           size_t *upload_data_size,
+           void **con_cls)
+{
+  static int marker;
+
+  (void) cls;
+  (void) url;
+  (void) method;
+  (void) version;
+  (void) upload_data;
+  (void) upload_data_size;
+  if (&marker == *con_cls)
+    return MHD_queue_response (connection,
+                               MHD_HTTP_OK,
+                               resp);
+  *con_cls = &marker;
+  GNUNET_assert (num_suspended < NUM_POLLERS);
+  suspended[num_suspended++] = connection;
+  MHD_suspend_connection (connection);
+  if (NUM_POLLERS == num_suspended)
+    GNUNET_SCHEDULER_add_now (&wakeup,
+                              NULL);
+  return MHD_YES;
+}
+
+
+/**
+ * A request was completed.
+ *
+ * @param cls NULL
+ * @param connection the connection
+ * @param con_cls per-request state
+ * @param toe reason for completion
+ */
+static void
+completed_cb (void *cls,
+              struct MHD_Connection *connection,
+              void **con_cls,
+              enum MHD_RequestTerminationCode toe)
+{
+  (void) cls;
+  (void) connection;
+  (void) con_cls;
+  if (MHD_REQUEST_TERMINATED_COMPLETED_OK != toe)
+    return;
+  num_completed++;
+  if (NUM_POLLERS == num_completed)
+    GNUNET_SCHEDULER_add_now (&finish_phase,
+                              NULL);
+}
+
+
+/**
+ * Connect the next batch of clients and send their requests.
+ *
+ * @param cls NULL
+ */
+static void
+connect_clients (void *cls)
+{
+  static const char req[] =
+    "GET /public/poll-payment HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+  (void) cls;
+  connect_task = NULL;
+  for (unsigned int i = 0;
+       (i < CONNECT_BATCH) && (num_clients < NUM_POLLERS);
+       i++)
+  {
+    int fd;
+
+    fd = socket (AF_INET,
+                 SOCK_STREAM,
+                 0);
+    if ( (-1 == fd) ||
+         (0 != connect (fd,
+                        (const struct sockaddr *) &sa,
+                        sizeof (sa))) )
+    {
+      GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                           "connect");
+      if (-1 != fd)
+        GNUNET_break (0 == close (fd));
+      stop_daemon ();
+      MHD_destroy_response (resp);
+      resp = NULL;
+      result = 1;
+      return;
+    }
+    GNUNET_assert (sizeof (req) - 1 ==
+                   write (fd,
+                          req,
+                          sizeof (req) - 1));
+    cfds[num_clients++] = fd;
+  }
+  if (num_clients < NUM_POLLERS)
+    connect_task = GNUNET_SCHEDULER_add_now (&connect_clients,
+                                             NULL);
+}
+
+
+static void
+start_phase (void *cls)
+{
+  socklen_t sa_len = sizeof (sa);
+  int lsock;
+
+  (void) cls;
+  num_clients = 0;
+  num_suspended = 0;
+  num_completed = 0;
+  memset (&sa,
+          0,
+          sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  lsock = socket (AF_INET,
+                  SOCK_STREAM,
+                  0);
+  if ( (-1 == lsock) ||
+       (0 != bind (lsock,
+                   (const struct sockaddr *) &sa,
+                   sizeof (sa))) ||
+       (0 != listen (lsock,
+                     1024)) ||
+       (0 != getsockname (lsock,
+                          (struct sockaddr *) &sa,
+                          &sa_len)) )
+  {
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                         "bind");
+    MHD_destroy_response (resp);
+    resp = NULL;
+    result = 1;
+    return;
+  }
+  mhd = MHD_start_daemon (MHD_USE_SUSPEND_RESUME | MHD_USE_EPOLL,
+                          0,
+                          NULL, NULL,
+                          &access_cb, NULL,
+                          MHD_OPTION_LISTEN_SOCKET, lsock,
+                          MHD_OPTION_NOTIFY_COMPLETED, &completed_cb, NULL,
+                          MHD_OPTION_CONNECTION_LIMIT,
+                          (unsigned int) (NUM_POLLERS + 16),
+                          MHD_OPTION_END);
+  if (NULL == mhd)
+  {
+    GNUNET_break (0);
+    MHD_destroy_response (resp);
+    resp = NULL;
+    result = 1;
+    return;
+  }
+  mhd_epoll_fd = GNUNET_NETWORK_socket_box_native (
+    MHD_get_daemon_info (mhd,
+                         MHD_DAEMON_INFO_EPOLL_FD)->epoll_fd);
+  run_daemon (NULL);
+  connect_task = GNUNET_SCHEDULER_add_now (&connect_clients,
+                                           NULL);
+}
+
+
+/**
+ * Setup and run the measurements.
+ *
+ * @param cls NULL
+ */
+static void
+run (void *cls)
+{
+  (void) cls;
+  resp = MHD_create_response_from_buffer (2,
+                                          "ok",
+                                          MHD_RESPMEM_PERSISTENT);
+  fprintf (stdout,
+           "%-10s %10s %14s %14s\n",
+           "mode",
+           "pollers",
+           "latency [us]",
+           "MHD_run calls");
+  batched = GNUNET_NO;
+  start_phase (NULL);
+}
+
+
+int
+main (int argc,
+      char *const *argv)
+{
+  struct rlimit rl;
+
+  (void) argc;
+  (void) argv;
+  GNUNET_log_setup ("perf-merchant-httpd-resume",
+                    "WARNING",
+                    NULL);
+  if (MHD_YES != MHD_is_feature_supported (MHD_FEATURE_EPOLL))
+  {
+    fprintf (stderr,
+             "MHD lacks epoll() support, skipping\n");
+    return 77;
+  }
+  if (0 == getrlimit (RLIMIT_NOFILE,
+                      &rl))
+  {
+    rl.rlim_cur = rl.rlim_max;
+    (void) setrlimit (RLIMIT_NOFILE,
+                      &rl);
+  }
+  GNUNET_SCHEDULER_run (&run,
+                        NULL);
+  return result;
+}
+
+
+/* end of perf_merchant_httpd_resume.c */
@@ -0,0 +1,186 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/perf_merchant_httpd_router.c
+ * @brief measure the cost of resolving a request with the routing
+ *        table of taler-merchant-httpd, compared to a linear scan
+ *        over the handler array, as a function of the number of
+ *        endpoints
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include "taler-merchant-httpd_router.h"
+
+/**
+ * How many lookups do we time per configuration?
+ */
+#define ROUNDS 1000000
+
+
+/**
+ * Resolve @a url the way url_handler() did before we had a routing
+ * table: strip the prefixes and compare against every handler.
+ *
+ * @param handlers array of handlers, terminated by a NULL URL
+ * @param url URL to resolve
+ * @param method method to resolve
+ * @return NULL if not found
+ */
+static struct TMH_RequestHandler *
+linear_resolve (struct TMH_RequestHandler *handlers,
+                const char *url,
+                const char *method)
+{
+  const char *path = url;
+
+  if (0 == strncmp (path,
+                    "/instances/",
+                    strlen ("/instances/")))
+  {
+    const char *istart = path + strlen ("/instances/");
+    const char *slash = strchr (istart,
+                                '/');
+    char *instance_id;
+
+    if (NULL == slash)
+      return NULL;
+    instance_id = GNUNET_strndup (istart,
+                                  slash - istart);
+    GNUNET_free (instance_id);
+    path = slash;
+  }
+  for (unsigned int i = 0; NULL != handlers[i].url; i++)
+  {
+    struct TMH_RequestHandler *rh = &handlers[i];
+
+    if (0 != strcasecmp (path,
+                         rh->url))
+      continue;
+    if ( (NULL != rh->method) &&
+         (0 != strcasecmp (method,
+                           rh->method)) )
+      continue;
+    return rh;
+  }
+  return NULL;
+}
+
+
+/**
+ * Measure lookups with @a n endpoints.
+ *
+ * @param n number of endpoints
+ */
+static void
+measure (unsigned int n)
+{
+  struct TMH_RequestHandler *handlers;
+  char **urls;
+  char **requests;
+  struct TMH_Router *r;
+  struct GNUNET_TIME_Absolute start;
+  struct GNUNET_TIME_Relative linear;
+  struct GNUNET_TIME_Relative trie;
+  unsigned int found = 0;
+
+  handlers = GNUNET_new_array (n + 1,
+                               struct TMH_RequestHandler);
+  urls = GNUNET_new_array (n,
+                           char *);
+  requests = GNUNET_new_array (n,
+                               char *);
+  for (unsigned int i = 0; i<n; i++)
+  {
+    GNUNET_asprintf (&urls[i],
+                     "/endpoint-%u/action",
+                     i);
+    GNUNET_asprintf (&requests[i],
+                     "/instances/shop%u/endpoint-%u/action",
+                     i % 16,
+                     i);
+    handlers[i].url = urls[i];
+    handlers[i].method = MHD_HTTP_METHOD_GET;
+  }
+  r = TMH_router_create ();
+  TMH_router_add (r,
+                  GNUNET_NO,
+                  handlers);
+
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<ROUNDS; i++)
+    if (NULL != linear_resolve (handlers,
+                                requests[(i * 7919) % n],
+                                MHD_HTTP_METHOD_GET))
+      found++;
+  linear = GNUNET_TIME_absolute_get_duration (start);
+
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<ROUNDS; i++)
+  {
+    struct TMH_Route route;
+
+    if (TMH_ROUTE_FOUND ==
+        TMH_router_resolve (r,
+                            requests[(i * 7919) % n],
+                            MHD_HTTP_METHOD_GET,
+                            &route))
+      found++;
+  }
+  trie = GNUNET_TIME_absolute_get_duration (start);
+  GNUNET_break (2 * ROUNDS == found);
+
+  fprintf (stdout,
+           "%10u %14llu %14llu\n",
+           n,
+           (unsigned long long) (linear.rel_value_us * 1000LLU / ROUNDS),
+           (unsigned long long) (trie.rel_value_us * 1000LLU / ROUNDS));
+  TMH_router_destroy (r);
+  for (unsigned int i = 0; i<n; i++)
+  {
+    GNUNET_free (urls[i]);
+    GNUNET_free (requests[i]);
+  }
+  GNUNET_free (urls);
+  GNUNET_free (requests);
+  GNUNET_free (handlers);
+}
+
+
+int
+main (int argc,
+      char *const *argv)
+{
+  static const unsigned int counts[] = {
+    16, 64, 256, 1024, 4096
+  };
+
+  (void) argc;
+  (void) argv;
+  GNUNET_log_setup ("perf-merchant-httpd-router",
+                    "WARNING",
+                    NULL);
+  fprintf (stdout,
+           "%10s %14s %14s\n",
+           "endpoints",
+           "linear [ns]",
+           "router [ns]");
+  for (unsigned int i = 0; i<sizeof (counts) / sizeof (counts[0]); i++)
+    measure (counts[i]);
+  return 0;
+}
+
+
+/* end of perf_merchant_httpd_router.c */
@@ -0,0 +1,312 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/perf_merchant_httpd_timer_wheel.c
+ * @brief measure the cost of managing long-poll timeouts with the
+ *        timer wheel of taler-merchant-httpd, compared to the
+ *        min-heap plus re-scheduled task we used before
+ * @author Christian Grothoff
+ *
+ * We suspend 1M synthetic connections with timeouts spread over a
+ * minute, resume half of them (as if the payment arrived) and let the
+ * others time out, advancing a simulated clock in steps of the
+ * resolution of the wheel.
+ */
+#include "platform.h"
+#include "taler-merchant-httpd_timer-wheel.h"
+
+/**
+ * Number of synthetic connections.
+ */
+#define NUM_CONNECTIONS 1000000
+
+/**
+ * Longest timeout, in seconds.
+ */
+#define MAX_TIMEOUT 60
+
+/**
+ * Resolution of the wheel (and of our simulated clock).
+ */
+#define RESOLUTION GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_MILLISECONDS, 250)
+
+
+/**
+ * A synthetic suspended connection.
+ */
+struct Connection
+{
+  /**
+   * Node in the heap.
+   */
+  struct GNUNET_CONTAINER_HeapNode *hn;
+
+  /**
+   * Entry in the wheel.
+   */
+  struct TMH_TimerWheelEntry twe;
+
+  /**
+   * Timeout of the connection.
+   */
+  struct GNUNET_TIME_Absolute timeout;
+};
+
+
+/**
+ * Our connections.
+ */
+static struct Connection *connections;
+
+/**
+ * Start of the simulated time.
+ */
+static struct GNUNET_TIME_Absolute t0;
+
+/**
+ * Task scheduled for the earliest timeout (heap variant).
+ */
+static struct GNUNET_SCHEDULER_Task *timeout_task;
+
+/**
+ * Number of connections that timed out.
+ */
+static unsigned int expired;
+
+
+/**
+ * Task that would resume connections, never runs.
+ *
+ * @param cls NULL
+ */
+static void
+do_timeout (void *cls)
+{
+  (void) cls;
+  GNUNET_assert (0);
+}
+
+
+/**
+ * Print the result of one phase.
+ *
+ * @param name name of the phase
+ * @param start when the phase started
+ * @param n number of operations in the phase
+ */
+static void
+report (const char *name,
+        struct GNUNET_TIME_Absolute start,
+        unsigned int n)
+{
+  struct GNUNET_TIME_Relative d = GNUNET_TIME_absolute_get_duration (start);
+
+  fprintf (stdout,
+           "%-28s %10llu ms %8llu ns/op\n",
+           name,
+           (unsigned long long) (d.rel_value_us / 1000LLU),
+           (unsigned long long) (d.rel_value_us * 1000LLU / n));
+}
+
+
+/**
+ * Measure the min-heap with a task re-scheduled on each suspend.
+ */
+static void
+measure_heap (void)
+{
+  struct GNUNET_CONTAINER_Heap *heap;
+  struct GNUNET_TIME_Absolute start;
+  struct GNUNET_TIME_Absolute now;
+
+  heap = GNUNET_CONTAINER_heap_create (GNUNET_CONTAINER_HEAP_ORDER_MIN);
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_CONNECTIONS; i++)
+  {
+    struct Connection *c = &connections[i];
+    struct Connection *first;
+
+    c->hn = GNUNET_CONTAINER_heap_insert (heap,
+                                          c,
+                                          c->timeout.abs_value_us);
+    if (NULL != timeout_task)
+      GNUNET_SCHEDULER_cancel (timeout_task);
+    first = GNUNET_CONTAINER_heap_peek (heap);
+    timeout_task = GNUNET_SCHEDULER_add_at (first->timeout,
+                                            &do_timeout,
+                                            NULL);
+  }
+  report ("heap: suspend",
+          start,
+          NUM_CONNECTIONS);
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_CONNECTIONS; i += 2)
+  {
+    GNUNET_CONTAINER_heap_remove_node (connections[i].hn);
+    connections[i].hn = NULL;
+  }
+  report ("heap: resume by payment",
+          start,
+          NUM_CONNECTIONS / 2);
+  expired = 0;
+  start = GNUNET_TIME_absolute_get ();
+  for (now = t0;
+       now.abs_value_us <= t0.abs_value_us
+       + MAX_TIMEOUT * GNUNET_TIME_UNIT_SECONDS.rel_value_us
+       + RESOLUTION.rel_value_us;
+       now = GNUNET_TIME_absolute_add (now,
+                                       RESOLUTION))
+  {
+    struct Connection *c;
+
+    while ( (NULL != (c = GNUNET_CONTAINER_heap_peek (heap))) &&
+            (c->timeout.abs_value_us <= now.abs_value_us) )
+    {
+      GNUNET_CONTAINER_heap_remove_root (heap);
+      c->hn = NULL;
+      expired++;
+    }
+    if (NULL != timeout_task)
+      GNUNET_SCHEDULER_cancel (timeout_task);
+    timeout_task = (NULL == c)
+                   ? NULL
+                   : GNUNET_SCHEDULER_add_at (c->timeout,
+                                              &do_timeout,
+                                              NULL);
+  }
+  report ("heap: resume by timeout",
+          start,
+          NUM_CONNECTIONS / 2);
+  GNUNET_break (NUM_CONNECTIONS / 2 == expired);
+  GNUNET_CONTAINER_heap_destroy (heap);
+}
+
+
+/**
+ * Count an expired connection.
+ *
+ * @param cls NULL
+ * @param entry_cls the `struct Connection`
+ */
+static void
+count_expired (void *cls,
+               void *entry_cls)
+{
+  struct Connection *c = entry_cls;
+
+  (void) cls;
+  GNUNET_assert (c->timeout.abs_value_us <=
+                 t0.abs_value_us
+                 + MAX_TIMEOUT * GNUNET_TIME_UNIT_SECONDS.rel_value_us
+                 + RESOLUTION.rel_value_us);
+  expired++;
+}
+
+
+/**
+ * Measure the timer wheel; the periodic tick is not a scheduler
+ * operation per connection, so it is not simulated here.
+ */
+static void
+measure_wheel (void)
+{
+  struct TMH_TimerWheel *tw;
+  struct GNUNET_TIME_Absolute start;
+  struct GNUNET_TIME_Absolute now;
+
+  tw = TMH_timer_wheel_create (RESOLUTION,
+                               t0);
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_CONNECTIONS; i++)
+    TMH_timer_wheel_insert (tw,
+                            &connections[i].twe,
+                            connections[i].timeout,
+                            &connections[i]);
+  report ("wheel: suspend",
+          start,
+          NUM_CONNECTIONS);
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_CONNECTIONS; i += 2)
+    TMH_timer_wheel_remove (tw,
+                            &connections[i].twe);
+  report ("wheel: resume by payment",
+          start,
+          NUM_CONNECTIONS / 2);
+  expired = 0;
+  start = GNUNET_TIME_absolute_get ();
+  for (now = t0;
+       now.abs_value_us <= t0.abs_value_us
+       + MAX_TIMEOUT * GNUNET_TIME_UNIT_SECONDS.rel_value_us
+       + RESOLUTION.rel_value_us;
+       now = GNUNET_TIME_absolute_add (now,
+                                       RESOLUTION))
+    TMH_timer_wheel_advance (tw,
+                             now,
+                             &count_expired,
+                             NULL);
+  report ("wheel: resume by timeout",
+          start,
+          NUM_CONNECTIONS / 2);
+  GNUNET_break (NUM_CONNECTIONS / 2 == expired);
+  GNUNET_break (0 == TMH_timer_wheel_size (tw));
+  TMH_timer_wheel_destroy (tw);
+}
+
+
+/**
+ * Run the measurements (within the scheduler, as the heap
+ * variant needs to schedule tasks).
+ *
+ * @param cls NULL
+ */
+static void
+run (void *cls)
+{
+  (void) cls;
+  t0 = GNUNET_TIME_absolute_get ();
+  connections = GNUNET_new_array (NUM_CONNECTIONS,
+                                  struct Connection);
+  for (unsigned int i = 0; i<NUM_CONNECTIONS; i++)
+    connections[i].timeout
+      = GNUNET_TIME_absolute_add (
+          t0,
+          GNUNET_TIME_relative_multiply (
+            GNUNET_TIME_UNIT_MILLISECONDS,
+            1 + GNUNET_CRYPTO_random_u32 (GNUNET_CRYPTO_QUALITY_WEAK,
+                                          MAX_TIMEOUT * 1000)));
+  measure_heap ();
+  measure_wheel ();
+  GNUNET_free (connections);
+}
+
+
+int
+main (int argc,
+      char *const *argv)
+{
+  (void) argc;
+  (void) argv;
+  GNUNET_log_setup ("perf-merchant-httpd-timer-wheel",
+                    "WARNING",
+                    NULL);
+  GNUNET_SCHEDULER_run (&run,
+                        NULL);
+  return 0;
+}
+
+
+/* end of perf_merchant_httpd_timer_wheel.c */
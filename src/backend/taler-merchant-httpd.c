@@ -31,10 +31,13 @@
 #include <taler/taler_exchange_service.h>
 #include "taler_merchantdb_lib.h"
 #include "taler-merchant-httpd.h"
+#include "taler-merchant-httpd_admission.h"
+#include "taler-merchant-httpd_arena.h"
 #include "taler-merchant-httpd_auditors.h"
 #include "taler-merchant-httpd_check-payment.h"
 #include "taler-merchant-httpd_exchanges.h"
 #include "taler-merchant-httpd_history.h"
+#include "taler-merchant-httpd_metrics.h"
 #include "taler-merchant-httpd_mhd.h"
 #include "taler-merchant-httpd_order.h"
 #include "taler-merchant-httpd_pay.h"
@@ -43,6 +46,7 @@
 #include "taler-merchant-httpd_refund.h"
 #include "taler-merchant-httpd_refund_increase.h"
 #include "taler-merchant-httpd_refund_lookup.h"
+#include "taler-merchant-httpd_router.h"
 #include "taler-merchant-httpd_track-transaction.h"
 #include "taler-merchant-httpd_track-transfer.h"
 #include "taler-merchant-httpd_tip-authorize.h"
@@ -56,6 +60,24 @@
  */
 #define UNIX_BACKLOG 500
 
+/**
+ * Granularity of the timeouts of long-polling requests.
+ */
+#define LONG_POLL_RESOLUTION GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_MILLISECONDS, 250)
+
+/**
+ * How far ahead we make sure the database has partitions for
+ * the contracts we store.
+ */
+#define PARTITIONS_AHEAD GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_DAYS, 90)
+
+/**
+ * How often we check for partitions to create.
+ */
+#define PARTITIONS_FREQUENCY GNUNET_TIME_UNIT_DAYS
+
 
 /**
  * Used by the iterator of the various merchant's instances given
@@ -84,6 +106,34 @@ struct IterateInstancesCls
 };
 
 
+/**
+ * Entry in the #instance_index.
+ */
+struct InstanceIndexEntry
+{
+
+  /**
+   * Next entry in the same bucket.
+   */
+  struct InstanceIndexEntry *next;
+
+  /**
+   * The instance.
+   */
+  struct MerchantInstance *mi;
+
+  /**
+   * strlen() of the instance's identifier.
+   */
+  size_t id_len;
+
+  /**
+   * Hash of the instance's identifier.
+   */
+  uint32_t hash;
+};
+
+
 /**
  * Hashmap pointing at merchant instances by 'id'. An 'id' is
  * just a string that identifies a merchant instance. When a frontend
@@ -98,6 +148,23 @@ struct GNUNET_CONTAINER_MultiHashMap *by_id_map;
  */
 struct GNUNET_CONTAINER_MultiHashMap *by_kpub_map;
 
+/**
+ * Index of the instances by 'id' used to resolve requests; uses a
+ * cheap (non-cryptographic) hash as it is queried for every request.
+ * Array of length #instance_index_size, a power of two.
+ */
+static struct InstanceIndexEntry **instance_index;
+
+/**
+ * Number of buckets in #instance_index.
+ */
+static unsigned int instance_index_size;
+
+/**
+ * The "default" instance.
+ */
+static struct MerchantInstance *default_mi;
+
 /**
  * The port we are running on
  */
@@ -154,11 +221,40 @@ char *TMH_currency;
  */
 int TMH_force_audit;
 
+/**
+ * Should long-polling requests release all state they do not need
+ * to answer while they are suspended (global option)?
+ */
+int TMH_long_poll_compact;
+
+/**
+ * Slab for the contexts of long-polling requests.
+ */
+static struct TMH_Slab *long_poll_slab;
+
 /**
  * Task running the HTTP server.
  */
 static struct GNUNET_SCHEDULER_Task *mhd_task;
 
+/**
+ * Set if we should immediately #MHD_run again.
+ */
+static int triggered;
+
+/**
+ * Task to run MHD after connections were resumed.  All connections
+ * resumed in the same iteration of the event loop are handled by a
+ * single #MHD_run().
+ */
+static struct GNUNET_SCHEDULER_Task *trigger_task;
+
+/**
+ * Task to periodically create the partitions of the database
+ * for the coming months.
+ */
+static struct GNUNET_SCHEDULER_Task *partition_task;
+
 /**
  * Global return code
  */
@@ -175,10 +271,17 @@ struct TALER_MERCHANTDB_Plugin *db;
 static struct MHD_Daemon *mhd;
 
 /**
- * MIN-Heap of suspended connections to resume when the timeout expires,
- * ordered by timeout. Values are of type `struct MHD_Connection`
+ * MHD's epoll() file descriptor, NULL unless we run MHD in
+ * epoll mode (see "USE_EPOLL" option).  In that case, we only
+ * wait on this single descriptor instead of the full fd_sets.
+ */
+static struct GNUNET_NETWORK_Handle *mhd_epoll_fd;
+
+/**
+ * Timer wheel of suspended connections to resume when the timeout
+ * expires.  Entries are of type `struct TMH_SuspendedConnection`.
  */
-struct GNUNET_CONTAINER_Heap *resume_timeout_heap;
+struct TMH_TimerWheel *resume_timeout_wheel;
 
 /**
  * Hash map from H(order_id,merchant_pub) to `struct MHD_Connection`
@@ -187,7 +290,14 @@ struct GNUNET_CONTAINER_Heap *resume_timeout_heap;
 struct GNUNET_CONTAINER_MultiHashMap *payment_trigger_map;
 
 /**
- * Task responsible for timeouts in the #resume_timeout_heap.
+ * Hash map from H(order_id,merchant_pub) to the `struct TMH_PaymentStatus`
+ * shared by the connections resumed because of a payment or refund.
+ */
+static struct GNUNET_CONTAINER_MultiHashMap *payment_status_map;
+
+/**
+ * Task advancing the #resume_timeout_wheel, runs once per
+ * tick while the wheel is not empty.
  */
 struct GNUNET_SCHEDULER_Task *resume_timeout_task;
 
@@ -196,6 +306,45 @@ struct GNUNET_SCHEDULER_Task *resume_timeout_task;
  */
 static struct GNUNET_CONFIGURATION_Handle *cfg;
 
+/**
+ * Head of connections suspended on asynchronous database operations.
+ */
+static struct TMH_DbSuspension *ds_head;
+
+/**
+ * Tail of connections suspended on asynchronous database operations.
+ */
+static struct TMH_DbSuspension *ds_tail;
+
+/**
+ * Routing table mapping URLs to #handlers and #public_handlers.
+ */
+static struct TMH_Router *router;
+
+/**
+ * Number of worker processes to run (from the command line).
+ * 0 or 1 means we serve all requests in this process; our
+ * workers are started with 1.
+ */
+static unsigned int num_workers;
+
+/**
+ * Command line we were started with, used to launch the
+ * worker processes.
+ */
+static char *const *main_argv;
+
+/**
+ * Array of length #num_workers with our worker processes, NULL
+ * unless we are the supervisor of a multi-process setup.
+ */
+static struct GNUNET_OS_Process **workers;
+
+/**
+ * Task periodically checking that all of our #workers are still alive.
+ */
+static struct GNUNET_SCHEDULER_Task *worker_check_task;
+
 
 /**
  * Callback that frees all the elements in the hashmap
@@ -228,6 +377,7 @@ hashmap_free (void *cls,
   GNUNET_free (mi->keyfile);
   GNUNET_free (mi->name);
   GNUNET_free_non_null (mi->tip_exchange);
+  TMH_METRICS_free_instance (mi);
   GNUNET_free (mi);
   return GNUNET_YES;
 }
@@ -291,6 +441,30 @@ TMH_compute_pay_key (const char *order_id,
 }
 
 
+/**
+ * Resume a suspended connection that was removed from the
+ * #resume_timeout_wheel.
+ *
+ * @param cls NULL
+ * @param entry_cls a `struct TMH_SuspendedConnection`
+ */
+static void
+resume_expired (void *cls,
+                void *entry_cls)
+{
+  struct TMH_SuspendedConnection *sc = entry_cls;
+
+  (void) cls;
+  GNUNET_assert (GNUNET_YES ==
+                 GNUNET_CONTAINER_multihashmap_remove (payment_trigger_map,
+                                                       &sc->key,
+                                                       sc));
+  GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+              "Resuming long polled job due to timeout\n");
+  MHD_resume_connection (sc->con);
+}
+
+
 /**
  * Resume processing all suspended connections past timeout.
  *
@@ -299,33 +473,17 @@ TMH_compute_pay_key (const char *order_id,
 static void
 do_resume (void *cls)
 {
-  struct TMH_SuspendedConnection *sc;
-
   (void) cls;
   resume_timeout_task = NULL;
-  while (1)
-  {
-    sc = GNUNET_CONTAINER_heap_peek (resume_timeout_heap);
-    if (NULL == sc)
-      return;
-    if  (0 !=
-         GNUNET_TIME_absolute_get_remaining (
-           sc->long_poll_timeout).rel_value_us)
-      break;
-    GNUNET_assert (sc ==
-                   GNUNET_CONTAINER_heap_remove_root (resume_timeout_heap));
-    sc->hn = NULL;
-    GNUNET_assert (GNUNET_YES ==
-                   GNUNET_CONTAINER_multihashmap_remove (payment_trigger_map,
-                                                         &sc->key,
-                                                         sc));
-    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
-                "Resuming long polled job due to timeout\n");
-    MHD_resume_connection (sc->con);
-  }
-  resume_timeout_task = GNUNET_SCHEDULER_add_at (sc->long_poll_timeout,
-                                                 &do_resume,
-                                                 NULL);
+  if (0 < TMH_timer_wheel_advance (resume_timeout_wheel,
+                                   GNUNET_TIME_absolute_get (),
+                                   &resume_expired,
+                                   NULL))
+    TMH_trigger_daemon ();
+  if (0 != TMH_timer_wheel_size (resume_timeout_wheel))
+    resume_timeout_task = GNUNET_SCHEDULER_add_delayed (LONG_POLL_RESOLUTION,
+                                                        &do_resume,
+                                                        NULL);
 }
 
 
@@ -340,6 +498,7 @@ void
 TMH_long_poll_suspend (struct TMH_SuspendedConnection *sc,
                        const struct TALER_Amount *min_refund)
 {
+  TMH_long_poll_release (sc);
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
               "Suspending operation on key %s\n",
               GNUNET_h2s (&sc->key));
@@ -353,26 +512,130 @@ TMH_long_poll_suspend (struct TMH_SuspendedConnection *sc,
     sc->awaiting_refund = GNUNET_YES;
     sc->refund_expected = *min_refund;
   }
-  sc->hn = GNUNET_CONTAINER_heap_insert (resume_timeout_heap,
-                                         sc,
-                                         sc->long_poll_timeout.abs_value_us);
+  if (0 == TMH_timer_wheel_size (resume_timeout_wheel))
+  {
+    /* wheel was idle, fast-forward it to the current time */
+    GNUNET_break (0 ==
+                  TMH_timer_wheel_advance (resume_timeout_wheel,
+                                           GNUNET_TIME_absolute_get (),
+                                           &resume_expired,
+                                           NULL));
+  }
+  TMH_timer_wheel_insert (resume_timeout_wheel,
+                          &sc->twe,
+                          sc->long_poll_timeout,
+                          sc);
   MHD_suspend_connection (sc->con);
-  if (NULL != resume_timeout_task)
+  if (NULL == resume_timeout_task)
+    resume_timeout_task = GNUNET_SCHEDULER_add_delayed (LONG_POLL_RESOLUTION,
+                                                        &do_resume,
+                                                        NULL);
+  if (NULL != sc->hc)
   {
-    GNUNET_SCHEDULER_cancel (resume_timeout_task);
-    resume_timeout_task = NULL;
+    /* if we are still in the first call to the handler, call_handler()
+       releases the slot once the handler returns */
+    sc->hc->parked = GNUNET_YES;
+    if (TMH_AC_NONE != sc->hc->ac)
+    {
+      TMH_ADMISSION_release (sc->hc->ac);
+      sc->hc->ac = TMH_AC_NONE;
+    }
   }
-  sc = GNUNET_CONTAINER_heap_peek (resume_timeout_heap);
-  resume_timeout_task = GNUNET_SCHEDULER_add_at (sc->long_poll_timeout,
-                                                 &do_resume,
-                                                 NULL);
 }
 
 
+/**
+ * Drop a reference to @a ps, freeing it if it was the last one.
+ *
+ * @param[in] ps payment status to release
+ */
+static void
+payment_status_decref (struct TMH_PaymentStatus *ps)
+{
+  GNUNET_assert (0 < ps->rc);
+  if (0 != --ps->rc)
+    return;
+  GNUNET_assert (GNUNET_YES ==
+                 GNUNET_CONTAINER_multihashmap_remove (payment_status_map,
+                                                       &ps->key,
+                                                       ps));
+  GNUNET_free (ps);
+}
+
+
+void *
+TMH_long_poll_record_alloc (size_t size)
+{
+  GNUNET_assert (size <= TMH_LONG_POLL_RECORD_SIZE);
+  return TMH_slab_alloc (long_poll_slab);
+}
+
+
+void
+TMH_long_poll_record_free (void *record)
+{
+  TMH_slab_free (long_poll_slab,
+                 record);
+}
+
+
+void
+TMH_long_poll_get_statistics (struct TMH_SlabStatistics *stats)
+{
+  if (NULL == long_poll_slab)
+  {
+    memset (stats,
+            0,
+            sizeof (*stats));
+    return;
+  }
+  TMH_slab_get_statistics (long_poll_slab,
+                           stats);
+}
+
+
+void
+TMH_long_poll_release (struct TMH_SuspendedConnection *sc)
+{
+  if (NULL == sc->ps)
+    return;
+  payment_status_decref (sc->ps);
+  sc->ps = NULL;
+}
+
+
+/**
+ * Closure for #resume_operation().
+ */
+struct ResumeContext
+{
+  /**
+   * Refund amount that triggered the resumption, NULL for payments.
+   */
+  const struct TALER_Amount *have_refund;
+
+  /**
+   * #GNUNET_YES to also resume connections awaiting a refund
+   * larger than @e have_refund, as we do not know it.
+   */
+  int force;
+
+  /**
+   * Payment status to share among the resumed connections.
+   */
+  struct TMH_PaymentStatus *ps;
+
+  /**
+   * Number of connections we resumed.
+   */
+  unsigned int resumed;
+};
+
+
 /**
  * Function called to resume suspended connections.
  *
- * @param cls pointer to a `struct TALER_Amount` indicating the refund amount, or NULL
+ * @param cls a `struct ResumeContext`
  * @param key key in the #payment_trigger_map
  * @param value a `struct TMH_SuspendedConnection` to resume
  * @return #GNUNET_OK (continue to iterate)
@@ -382,10 +645,12 @@ resume_operation (void *cls,
                   const struct GNUNET_HashCode *key,
                   void *value)
 {
-  const struct TALER_Amount *have_refund = cls;
+  struct ResumeContext *rc = cls;
+  const struct TALER_Amount *have_refund = rc->have_refund;
   struct TMH_SuspendedConnection *sc = value;
 
-  if ( (GNUNET_YES == sc->awaiting_refund) &&
+  if ( (GNUNET_YES != rc->force) &&
+       (GNUNET_YES == sc->awaiting_refund) &&
        ( (NULL == have_refund) ||
          (1 != TALER_amount_cmp (have_refund,
                                  &sc->refund_expected)) ) )
@@ -402,18 +667,182 @@ resume_operation (void *cls,
                  GNUNET_CONTAINER_multihashmap_remove (payment_trigger_map,
                                                        key,
                                                        sc));
-  GNUNET_assert (sc ==
-                 GNUNET_CONTAINER_heap_remove_node (sc->hn));
-  sc->hn = NULL;
+  TMH_timer_wheel_remove (resume_timeout_wheel,
+                          &sc->twe);
+  GNUNET_assert (NULL == sc->ps);
+  sc->ps = rc->ps;
+  sc->ps->rc++;
   MHD_resume_connection (sc->con);
-  TMH_trigger_daemon ();
+  rc->resumed++;
+  return GNUNET_OK;
+}
+
+
+/**
+ * Resume the operations suspended pending payment on @a key.
+ *
+ * @param key key of the order, see TMH_compute_pay_key()
+ * @param have_refund refunded amount, if the trigger was a refund, otherwise NULL
+ * @param force #GNUNET_YES to resume all operations on @a key, even
+ *        those awaiting a larger refund than @a have_refund
+ */
+static void
+resume_by_key (const struct GNUNET_HashCode *key,
+               const struct TALER_Amount *have_refund,
+               int force)
+{
+  struct ResumeContext rc = {
+    .have_refund = have_refund,
+    .force = force
+  };
+
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Resuming operations suspended pending payment on key %s\n",
+              GNUNET_h2s (key));
+  rc.ps = GNUNET_CONTAINER_multihashmap_get (payment_status_map,
+                                             key);
+  if (NULL == rc.ps)
+  {
+    rc.ps = GNUNET_new (struct TMH_PaymentStatus);
+    rc.ps->key = *key;
+    GNUNET_assert (GNUNET_OK ==
+                   GNUNET_CONTAINER_multihashmap_put (
+                     payment_status_map,
+                     &rc.ps->key,
+                     rc.ps,
+                     GNUNET_CONTAINER_MULTIHASHMAPOPTION_UNIQUE_ONLY));
+  }
+  else
+  {
+    /* connections resumed earlier that did not yet run must not
+       use the status from before this event */
+    rc.ps->paid_known = GNUNET_NO;
+    rc.ps->refunds_known = GNUNET_NO;
+  }
+  rc.ps->rc++;
+  GNUNET_CONTAINER_multihashmap_get_multiple (payment_trigger_map,
+                                              key,
+                                              &resume_operation,
+                                              &rc);
+  payment_status_decref (rc.ps);
+  if (0 != rc.resumed)
+    TMH_trigger_daemon ();
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "%u operations remain suspended pending payment\n",
+              GNUNET_CONTAINER_multihashmap_size (payment_trigger_map));
+}
+
+
+/**
+ * Remember @a key in the array of keys given in @a cls.
+ *
+ * @param cls a `struct GNUNET_CONTAINER_MultiHashMap` of keys
+ * @param key key in the #payment_trigger_map
+ * @param value a `struct TMH_SuspendedConnection`, unused
+ * @return #GNUNET_OK (continue to iterate)
+ */
+static int
+collect_key (void *cls,
+             const struct GNUNET_HashCode *key,
+             void *value)
+{
+  struct GNUNET_CONTAINER_MultiHashMap *keys = cls;
+
+  (void) value;
+  /* fails for all but the first connection on @a key, which is fine */
+  (void) GNUNET_CONTAINER_multihashmap_put (
+    keys,
+    key,
+    NULL,
+    GNUNET_CONTAINER_MULTIHASHMAPOPTION_UNIQUE_ONLY);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Resume all operations suspended on @a key, see #resume_all().
+ *
+ * @param cls NULL
+ * @param key key in the #payment_trigger_map
+ * @param value NULL
+ * @return #GNUNET_OK (continue to iterate)
+ */
+static int
+resume_key (void *cls,
+            const struct GNUNET_HashCode *key,
+            void *value)
+{
+  (void) cls;
+  (void) value;
+  resume_by_key (key,
+                 NULL,
+                 GNUNET_YES);
   return GNUNET_OK;
 }
 
 
+/**
+ * Resume all operations suspended pending a payment, refund or wire
+ * transfer, so that they check the database again.  Used if events
+ * may have been lost.
+ */
+static void
+resume_all (void)
+{
+  struct GNUNET_CONTAINER_MultiHashMap *keys;
+  unsigned int size;
+
+  size = GNUNET_CONTAINER_multihashmap_size (payment_trigger_map);
+  if (0 == size)
+    return;
+  GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+              "Resuming all %u operations suspended pending payment\n",
+              size);
+  /* resume_by_key() modifies the #payment_trigger_map, so first
+     collect the keys */
+  keys = GNUNET_CONTAINER_multihashmap_create (GNUNET_MIN (size,
+                                                           1024),
+                                               GNUNET_NO);
+  GNUNET_CONTAINER_multihashmap_iterate (payment_trigger_map,
+                                         &collect_key,
+                                         keys);
+  GNUNET_CONTAINER_multihashmap_iterate (keys,
+                                         &resume_key,
+                                         NULL);
+  GNUNET_CONTAINER_multihashmap_destroy (keys);
+}
+
+
+/**
+ * Another process recorded a payment or refund, resume the
+ * operations we suspended pending it.
+ *
+ * @param cls NULL
+ * @param key key of the order, see TMH_compute_pay_key(); NULL if
+ *        events may have been lost, then we resume all operations
+ * @param refund_amount refunded amount, if the event was a refund, otherwise NULL
+ */
+static void
+payment_event_cb (void *cls,
+                  const struct GNUNET_HashCode *key,
+                  const struct TALER_Amount *refund_amount)
+{
+  (void) cls;
+  if (NULL == key)
+  {
+    resume_all ();
+    return;
+  }
+  resume_by_key (key,
+                 refund_amount,
+                 GNUNET_NO);
+}
+
+
 /**
  * Find out if we have any clients long-polling for @a order_id to be
  * confirmed at merchant @a mpub, and if so, tell them to resume.
+ * Other processes using the same database are notified as well.
  *
  * @param order_id the order that was paid
  * @param mpub the merchant's public key of the instance where the payment happened
@@ -429,16 +858,163 @@ TMH_long_poll_resume (const char *order_id,
   TMH_compute_pay_key (order_id,
                        mpub,
                        &key);
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Resuming operations suspended pending payment on key %s\n",
-              GNUNET_h2s (&key));
-  GNUNET_CONTAINER_multihashmap_get_multiple (payment_trigger_map,
-                                              &key,
-                                              &resume_operation,
-                                              (void *) have_refund);
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "%u operations remain suspended pending payment\n",
-              GNUNET_CONTAINER_multihashmap_size (payment_trigger_map));
+  resume_by_key (&key,
+                 have_refund,
+                 GNUNET_NO);
+  /* wake up clients long-polling on other processes as well */
+  db->notify_payment_event (db->cls,
+                            &key,
+                            have_refund);
+}
+
+
+/**
+ * Compute @a key to use for clients long-polling on the wire transfer
+ * of the contract @a h_contract_terms at merchant @a mpub.
+ *
+ * @param h_contract_terms hash of the contract
+ * @param mpub an instance public key
+ * @param key[out] set to the hash map key to use
+ */
+void
+TMH_compute_transfer_key (const struct GNUNET_HashCode *h_contract_terms,
+                          const struct TALER_MerchantPublicKeyP *mpub,
+                          struct GNUNET_HashCode *key)
+{
+  static const char tag[] = "wire-transfer";
+  char buf[sizeof (tag) + sizeof (*mpub) + sizeof (*h_contract_terms)];
+
+  /* the tag keeps the key distinct from any key of TMH_compute_pay_key() */
+  memcpy (buf,
+          tag,
+          sizeof (tag));
+  memcpy (&buf[sizeof (tag)],
+          mpub,
+          sizeof (*mpub));
+  memcpy (&buf[sizeof (tag) + sizeof (*mpub)],
+          h_contract_terms,
+          sizeof (*h_contract_terms));
+  GNUNET_CRYPTO_hash (buf,
+                      sizeof (buf),
+                      key);
+}
+
+
+/**
+ * Find out if we have any clients long-polling for the wire transfer
+ * of the contract @a h_contract_terms at merchant @a mpub, and if so,
+ * tell them to resume.  Other processes using the same database are
+ * notified as well.
+ *
+ * @param h_contract_terms hash of the contract whose wire transfer became known
+ * @param mpub the merchant's public key of the instance
+ */
+void
+TMH_long_poll_resume_transfer (const struct GNUNET_HashCode *h_contract_terms,
+                               const struct TALER_MerchantPublicKeyP *mpub)
+{
+  struct GNUNET_HashCode key;
+
+  TMH_compute_transfer_key (h_contract_terms,
+                            mpub,
+                            &key);
+  resume_by_key (&key,
+                 NULL,
+                 GNUNET_NO);
+  db->notify_payment_event (db->cls,
+                            &key,
+                            NULL);
+}
+
+
+void
+TMH_long_poll_resume_transfers (const struct
+                                TALER_TrackTransferDetails *details,
+                                unsigned int details_length,
+                                const struct TALER_MerchantPublicKeyP *mpub)
+{
+  struct GNUNET_CONTAINER_MultiHashMap *seen;
+
+  if (0 == details_length)
+    return;
+  seen = GNUNET_CONTAINER_multihashmap_create (
+    GNUNET_MIN (details_length,
+                1024),
+    GNUNET_YES);
+  for (unsigned int i = 0; i<details_length; i++)
+  {
+    if (GNUNET_OK !=
+        GNUNET_CONTAINER_multihashmap_put (
+          seen,
+          &details[i].h_contract_terms,
+          (void *) &details[i],
+          GNUNET_CONTAINER_MULTIHASHMAPOPTION_UNIQUE_ONLY))
+      continue; /* already woken up */
+    TMH_long_poll_resume_transfer (&details[i].h_contract_terms,
+                                   mpub);
+  }
+  GNUNET_CONTAINER_multihashmap_destroy (seen);
+}
+
+
+/**
+ * Suspend @a con while we wait for the database operation @a ah.
+ * The callback of @a ah must call #TMH_db_resume().
+ *
+ * @param ds suspension record to use (usually in the handler context)
+ * @param con connection to suspend
+ * @param ah the pending database operation
+ */
+void
+TMH_db_suspend (struct TMH_DbSuspension *ds,
+                struct MHD_Connection *con,
+                struct TALER_MERCHANTDB_AsyncHandle *ah)
+{
+  GNUNET_assert (NULL == ds->ah);
+  ds->con = con;
+  ds->ah = ah;
+  GNUNET_CONTAINER_DLL_insert (ds_head,
+                               ds_tail,
+                               ds);
+  MHD_suspend_connection (con);
+}
+
+
+/**
+ * The database operation of @a ds completed, resume the connection.
+ *
+ * @param ds suspension record given to #TMH_db_suspend()
+ */
+void
+TMH_db_resume (struct TMH_DbSuspension *ds)
+{
+  GNUNET_assert (NULL != ds->ah);
+  ds->ah = NULL;
+  GNUNET_CONTAINER_DLL_remove (ds_head,
+                               ds_tail,
+                               ds);
+  MHD_resume_connection (ds->con);
+  TMH_trigger_daemon ();
+}
+
+
+/**
+ * Cancel the database operation of @a ds (if any).  To be
+ * called when cleaning up the handler context.
+ *
+ * @param ds suspension record, may not be in use
+ */
+void
+TMH_db_cancel (struct TMH_DbSuspension *ds)
+{
+  if (NULL == ds->ah)
+    return;
+  db->async_cancel (db->cls,
+                    ds->ah);
+  ds->ah = NULL;
+  GNUNET_CONTAINER_DLL_remove (ds_head,
+                               ds_tail,
+                               ds);
 }
 
 
@@ -518,8 +1094,6 @@ TMH_make_taler_pay_uri (struct MHD_Connection *con,
 static void
 do_shutdown (void *cls)
 {
-  struct TMH_SuspendedConnection *sc;
-
   (void) cls;
   MH_force_pc_resume ();
   MH_force_trh_resume ();
@@ -530,34 +1104,100 @@ do_shutdown (void *cls)
     GNUNET_SCHEDULER_cancel (mhd_task);
     mhd_task = NULL;
   }
+  if (NULL != trigger_task)
+  {
+    GNUNET_SCHEDULER_cancel (trigger_task);
+    trigger_task = NULL;
+  }
+  if (NULL != partition_task)
+  {
+    GNUNET_SCHEDULER_cancel (partition_task);
+    partition_task = NULL;
+  }
   /* resume all suspended connections, must be done before stopping #mhd */
-  if (NULL != resume_timeout_heap)
   {
-    while (NULL != (sc = GNUNET_CONTAINER_heap_remove_root (
-                      resume_timeout_heap)))
-    {
-      sc->hn = NULL;
-      GNUNET_assert (GNUNET_YES ==
-                     GNUNET_CONTAINER_multihashmap_remove (payment_trigger_map,
-                                                           &sc->key,
-                                                           sc));
-      MHD_resume_connection (sc->con);
-    }
-    GNUNET_CONTAINER_heap_destroy (resume_timeout_heap);
-    resume_timeout_heap = NULL;
+    struct TMH_AdmissionStatistics as;
+    struct TMH_ArenaStatistics ars;
+
+    TMH_ADMISSION_force_resume ();
+    TMH_arena_get_statistics (&ars);
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Request arenas: %llu arenas served %llu allocations (%llu bytes) using %llu malloc() calls\n",
+                ars.arenas,
+                ars.allocations,
+                ars.bytes,
+                ars.blocks);
+    TMH_ADMISSION_get_statistics (&as);
+    for (unsigned int i = TMH_AC_NONE + 1; i<TMH_AC_MAX; i++)
+      GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                  "Admission class %u: %llu requests admitted, %llu shed\n",
+                  i,
+                  as.admitted[i],
+                  as.shed[i]);
+  }
+  while (NULL != ds_head)
+  {
+    struct TMH_DbSuspension *ds = ds_head;
+
+    db->async_cancel (db->cls,
+                      ds->ah);
+    ds->ah = NULL;
+    GNUNET_CONTAINER_DLL_remove (ds_head,
+                                 ds_tail,
+                                 ds);
+    MHD_resume_connection (ds->con);
+  }
+  if (NULL != resume_timeout_wheel)
+  {
+    TMH_timer_wheel_clear (resume_timeout_wheel,
+                           &resume_expired,
+                           NULL);
+    TMH_timer_wheel_destroy (resume_timeout_wheel);
+    resume_timeout_wheel = NULL;
   }
   if (NULL != resume_timeout_task)
   {
     GNUNET_SCHEDULER_cancel (resume_timeout_task);
     resume_timeout_task = NULL;
   }
+  if (NULL != mhd_epoll_fd)
+  {
+    GNUNET_NETWORK_socket_free_memory_only_ (mhd_epoll_fd);
+    mhd_epoll_fd = NULL;
+  }
   if (NULL != mhd)
   {
     MHD_stop_daemon (mhd);
     mhd = NULL;
   }
+  if (NULL != long_poll_slab)
+  {
+    struct TMH_SlabStatistics ss;
+
+    /* all long-polling requests were completed by MHD_stop_daemon() */
+    TMH_slab_get_statistics (long_poll_slab,
+                             &ss);
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Long-polling contexts: at most %u of %u bytes each, using %llu bytes\n",
+                ss.peak,
+                (unsigned int) ss.record_size,
+                ss.bytes);
+    TMH_slab_destroy (long_poll_slab);
+    long_poll_slab = NULL;
+  }
   if (NULL != db)
   {
+    struct TALER_MERCHANTDB_PoolStatistics ps;
+
+    db->get_pool_statistics (db->cls,
+                             &ps);
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Async DB pool: %llu queries on %u connections, waited %llu us in total (max %llu us), at most %u queued\n",
+                ps.queries,
+                ps.size,
+                (unsigned long long) ps.total_wait.rel_value_us,
+                (unsigned long long) ps.max_wait.rel_value_us,
+                ps.max_queue_length);
     TALER_MERCHANTDB_plugin_unload (db);
     db = NULL;
   }
@@ -571,6 +1211,28 @@ do_shutdown (void *cls)
     GNUNET_CONTAINER_multihashmap_destroy (payment_trigger_map);
     payment_trigger_map = NULL;
   }
+  if (NULL != payment_status_map)
+  {
+    /* all connections (and thus their references) are gone by now */
+    GNUNET_break (0 ==
+                  GNUNET_CONTAINER_multihashmap_size (payment_status_map));
+    GNUNET_CONTAINER_multihashmap_destroy (payment_status_map);
+    payment_status_map = NULL;
+  }
+  for (unsigned int i = 0; i<instance_index_size; i++)
+  {
+    struct InstanceIndexEntry *ie;
+
+    while (NULL != (ie = instance_index[i]))
+    {
+      instance_index[i] = ie->next;
+      GNUNET_free (ie);
+    }
+  }
+  GNUNET_array_grow (instance_index,
+                     instance_index_size,
+                     0);
+  default_mi = NULL;
   if (NULL != by_id_map)
   {
     GNUNET_CONTAINER_multihashmap_iterate (by_id_map,
@@ -584,6 +1246,12 @@ do_shutdown (void *cls)
     GNUNET_CONTAINER_multihashmap_destroy (by_kpub_map);
     by_kpub_map = NULL;
   }
+  if (NULL != router)
+  {
+    TMH_router_destroy (router);
+    router = NULL;
+  }
+  TMH_METRICS_done ();
 }
 
 
@@ -608,6 +1276,7 @@ handle_mhd_completion_callback (void *cls,
                                 enum MHD_RequestTerminationCode toe)
 {
   struct TM_HandlerContext *hc = *con_cls;
+  struct TMH_Arena *arena;
 
   if (NULL == hc)
     return;
@@ -615,7 +1284,17 @@ handle_mhd_completion_callback (void *cls,
               "Finished handling request for `%s' with status %d\n",
               hc->rh->url,
               (int) toe);
+  if (TMH_AC_NONE != hc->ac)
+    TMH_ADMISSION_release (hc->ac);
+  if (GNUNET_YES != TMH_ADMISSION_is_ticket (hc))
+    TMH_METRICS_record_request (hc->rh,
+                                hc->mi,
+                                connection,
+                                hc->start);
+  arena = hc->arena;
   hc->cc (hc);
+  if (NULL != arena)
+    TMH_arena_destroy (arena);
   *con_cls = NULL;
 }
 
@@ -629,12 +1308,6 @@ static struct GNUNET_SCHEDULER_Task *
 prepare_daemon (void);
 
 
-/**
- * Set if we should immediately #MHD_run again.
- */
-static int triggered;
-
-
 /**
  * Call MHD to process pending requests and then go back
  * and schedule the next run.
@@ -645,6 +1318,12 @@ static void
 run_daemon (void *cls)
 {
   mhd_task = NULL;
+  if (NULL != trigger_task)
+  {
+    /* we are running anyway */
+    GNUNET_SCHEDULER_cancel (trigger_task);
+    trigger_task = NULL;
+  }
   do {
     triggered = 0;
     GNUNET_assert (MHD_YES == MHD_run (mhd));
@@ -654,24 +1333,73 @@ run_daemon (void *cls)
 
 
 /**
- * Kick MHD to run now, to be called after MHD_resume_connection().
+ * Run MHD for the connections resumed since it last ran.
+ *
+ * @param cls NULL
+ */
+static void
+run_triggered (void *cls)
+{
+  (void) cls;
+  trigger_task = NULL;
+  if (NULL == mhd_task)
+    return;
+  GNUNET_SCHEDULER_cancel (mhd_task);
+  mhd_task = NULL;
+  run_daemon (NULL);
+}
+
+
+/**
+ * Kick MHD to run, to be called after MHD_resume_connection().
  * Basically, we need to explicitly resume MHD's event loop whenever
- * we made progress serving a request.  This function re-schedules
- * the task processing MHD's activities to run immediately.
+ * we made progress serving a request.  MHD is run once the current
+ * task is done, so resuming many connections in one go (i.e. when a
+ * popular order was paid) only costs one run of MHD, not one per
+ * connection.
  */
 void
 TMH_trigger_daemon ()
 {
-  if (NULL != mhd_task)
-  {
-    GNUNET_SCHEDULER_cancel (mhd_task);
-    mhd_task = NULL;
-    run_daemon (NULL);
-  }
-  else
+  if (NULL == mhd_task)
   {
+    /* we are within run_daemon(), just run MHD once more */
     triggered = 1;
+    return;
   }
+  if (NULL != trigger_task)
+    return;
+  trigger_task = GNUNET_SCHEDULER_add_with_priority (
+    GNUNET_SCHEDULER_PRIORITY_HIGH,
+    &run_triggered,
+    NULL);
+}
+
+
+/**
+ * Function that queries MHD's timeout and starts the task waiting
+ * for MHD's epoll() file descriptor.  Unlike the select()-based
+ * logic, the cost of this does not depend on the number of (idle or
+ * suspended) connections MHD has.
+ *
+ * @return task running MHD
+ */
+static struct GNUNET_SCHEDULER_Task *
+prepare_daemon_epoll (void)
+{
+  MHD_UNSIGNED_LONG_LONG timeout;
+  struct GNUNET_TIME_Relative tv;
+
+  if (MHD_YES == MHD_get_timeout (mhd,
+                                  &timeout))
+    tv.rel_value_us = (uint64_t) timeout * 1000LL;
+  else
+    tv = GNUNET_TIME_UNIT_FOREVER_REL;
+  return GNUNET_SCHEDULER_add_read_net_with_priority (tv,
+                                                     GNUNET_SCHEDULER_PRIORITY_HIGH,
+                                                     mhd_epoll_fd,
+                                                     &run_daemon,
+                                                     NULL);
 }
 
 
@@ -679,7 +1407,7 @@ TMH_trigger_daemon ()
  * Function that queries MHD's select sets and
  * starts the task waiting for them.
  *
- * @param daemon_handle HTTP server to prepare to run
+ * @return task running MHD
  */
 static struct GNUNET_SCHEDULER_Task *
 prepare_daemon (void)
@@ -695,6 +1423,8 @@ prepare_daemon (void)
   int haveto;
   struct GNUNET_TIME_Relative tv;
 
+  if (NULL != mhd_epoll_fd)
+    return prepare_daemon_epoll ();
   FD_ZERO (&rs);
   FD_ZERO (&ws);
   FD_ZERO (&es);
@@ -1198,46 +1928,128 @@ instances_iterator_cb (void *cls,
       .mi = mi
     };
 
-    GNUNET_CONFIGURATION_iterate_sections (cfg,
-                                           &wireformat_iterator_cb,
-                                           &wfic);
-  }
-  if (NULL == mi->wm_head)
-  {
-    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
-                "Failed to load wire formats for instance `%s'\n",
-                mi->id);
-    iic->ret = GNUNET_SYSERR;
-  }
+    GNUNET_CONFIGURATION_iterate_sections (cfg,
+                                           &wireformat_iterator_cb,
+                                           &wfic);
+  }
+  if (NULL == mi->wm_head)
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "Failed to load wire formats for instance `%s'\n",
+                mi->id);
+    iic->ret = GNUNET_SYSERR;
+  }
+
+}
+
+
+/**
+ * Compute the hash of an instance identifier for the #instance_index
+ * (32-bit FNV-1a).
+ *
+ * @param instance_id identifier to hash, NOT 0-terminated
+ * @param instance_id_len number of bytes in @a instance_id
+ * @return the hash
+ */
+static uint32_t
+hash_instance_id (const char *instance_id,
+                  size_t instance_id_len)
+{
+  uint32_t h = 2166136261U;
+
+  for (size_t i = 0; i<instance_id_len; i++)
+  {
+    h ^= (unsigned char) instance_id[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+/**
+ * Add an instance to the #instance_index.
+ *
+ * @param cls NULL
+ * @param key unused
+ * @param value a `struct MerchantInstance`
+ * @return #GNUNET_YES (continue to iterate)
+ */
+static int
+index_instance (void *cls,
+                const struct GNUNET_HashCode *key,
+                void *value)
+{
+  struct MerchantInstance *mi = value;
+  struct InstanceIndexEntry *ie;
+  unsigned int off;
+
+  (void) cls;
+  (void) key;
+  ie = GNUNET_new (struct InstanceIndexEntry);
+  ie->mi = mi;
+  ie->id_len = strlen (mi->id);
+  ie->hash = hash_instance_id (mi->id,
+                               ie->id_len);
+  off = ie->hash & (instance_index_size - 1);
+  ie->next = instance_index[off];
+  instance_index[off] = ie;
+  if (0 == strcasecmp ("default",
+                       mi->id))
+    default_mi = mi;
+  return GNUNET_YES;
+}
+
 
+/**
+ * Build the #instance_index from the #by_id_map.
+ */
+static void
+build_instance_index (void)
+{
+  unsigned int size = 1;
+
+  while (size < 2 * GNUNET_CONTAINER_multihashmap_size (by_id_map))
+    size *= 2;
+  GNUNET_array_grow (instance_index,
+                     instance_index_size,
+                     size);
+  GNUNET_CONTAINER_multihashmap_iterate (by_id_map,
+                                         &index_instance,
+                                         NULL);
 }
 
 
 /**
  * Lookup a merchant instance by its instance ID.
  *
- * @param instance_id identifier of the instance to resolve
+ * @param instance_id identifier of the instance to resolve,
+ *        NOT 0-terminated; NULL for the default instance
+ * @param instance_id_len number of bytes in @a instance_id
  * @return NULL if that instance is unknown to us
  */
 static struct MerchantInstance *
-lookup_instance (const char *instance_id)
+lookup_instance (const char *instance_id,
+                 size_t instance_id_len)
 {
-  struct GNUNET_HashCode h_instance;
+  uint32_t h;
 
   if (NULL == instance_id)
-    instance_id = "default";
-
-  GNUNET_CRYPTO_hash (instance_id,
-                      strlen (instance_id),
-                      &h_instance);
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Looking for by-id key %s of '%s' in hashmap\n",
-              GNUNET_h2s (&h_instance),
-              instance_id);
+    return default_mi;
+  h = hash_instance_id (instance_id,
+                        instance_id_len);
+  for (struct InstanceIndexEntry *ie
+         = instance_index[h & (instance_index_size - 1)];
+       NULL != ie;
+       ie = ie->next)
+    if ( (h == ie->hash) &&
+         (instance_id_len == ie->id_len) &&
+         (0 == memcmp (instance_id,
+                       ie->mi->id,
+                       instance_id_len)) )
+      return ie->mi;
   /* We're fine if that returns NULL, the calling routine knows how
      to handle that */
-  return GNUNET_CONTAINER_multihashmap_get (by_id_map,
-                                            &h_instance);
+  return NULL;
 }
 
 
@@ -1288,10 +2100,176 @@ iterate_instances (void)
                 "At least one instance was not successfully parsed\n");
     return GNUNET_SYSERR;
   }
+  build_instance_index ();
   return GNUNET_OK;
 }
 
 
+/**
+ * Handlers for URLs that are not public.
+ */
+static struct TMH_RequestHandler handlers[] = {
+  /* Landing page, tell humans to go away. */
+  { "/", MHD_HTTP_METHOD_GET, "text/plain",
+    "Hello, I'm a merchant's Taler backend. This HTTP server is not for humans.\n",
+    0,
+    &TMH_MHD_handler_static_response, MHD_HTTP_OK },
+  { "/agpl", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &TMH_MHD_handler_agpl_redirect, MHD_HTTP_FOUND },
+  { "/track/transfer", MHD_HTTP_METHOD_GET, "application/json",
+    NULL, 0,
+    &MH_handler_track_transfer, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/track/transfer", NULL, "text/plain",
+    "Only GET is allowed", 0,
+    &TMH_MHD_handler_static_response, MHD_HTTP_OK},
+  { "/track/transaction", MHD_HTTP_METHOD_GET, "application/json",
+    NULL, 0,
+    &MH_handler_track_transaction, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/track/transaction", NULL, "text/plain",
+    "Only GET is allowed", 0,
+    &TMH_MHD_handler_static_response, MHD_HTTP_OK},
+  { "/history", MHD_HTTP_METHOD_GET, "text/plain",
+    "Only GET is allowed", 0,
+    &MH_handler_history, MHD_HTTP_OK,
+    TMH_AC_SCAN },
+  { "/order", MHD_HTTP_METHOD_POST, "application/json",
+    NULL, 0,
+    &MH_handler_order_post, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/refund", MHD_HTTP_METHOD_POST, "application/json",
+    NULL, 0,
+    &MH_handler_refund_increase, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/tip-authorize", MHD_HTTP_METHOD_POST, "text/plain",
+    NULL, 0,
+    &MH_handler_tip_authorize, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/tip-query", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_tip_query, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/check-payment", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_check_payment, MHD_HTTP_OK,
+    TMH_AC_BACKOFFICE },
+  { "/config", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_config, MHD_HTTP_OK},
+  { "/metrics", MHD_HTTP_METHOD_GET, "text/plain; version=0.0.4",
+    NULL, 0,
+    &TMH_METRICS_handler, MHD_HTTP_OK},
+  {NULL, NULL, NULL, NULL, 0, 0 }
+};
+/**
+ * Handlers for URLs that are also reachable under "/public".
+ */
+static struct TMH_RequestHandler public_handlers[] = {
+  { "/pay", MHD_HTTP_METHOD_POST, "application/json",
+    NULL, 0,
+    &MH_handler_pay, MHD_HTTP_OK,
+    TMH_AC_PAY },
+  { "/proposal", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_proposal_lookup, MHD_HTTP_OK,
+    TMH_AC_WALLET },
+  { "/tip-pickup", MHD_HTTP_METHOD_POST, "text/plain",
+    NULL, 0,
+    &MH_handler_tip_pickup, MHD_HTTP_OK,
+    TMH_AC_WALLET },
+  { "/refund", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_refund_lookup, MHD_HTTP_OK,
+    TMH_AC_WALLET },
+  { "/tip-pickup", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_tip_pickup_get, MHD_HTTP_OK,
+    TMH_AC_WALLET },
+  { "/poll-payment", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_poll_payment, MHD_HTTP_OK,
+    TMH_AC_POLL },
+  { "/config", MHD_HTTP_METHOD_GET, "text/plain",
+    NULL, 0,
+    &MH_handler_config, MHD_HTTP_OK},
+  {NULL, NULL, NULL, NULL, 0, 0 }
+};
+/**
+ * Handler for URLs we do not know.
+ */
+static struct TMH_RequestHandler h404 = {
+  "", NULL, "text/html",
+  "<html><title>404: not found</title><body>404: not found</body></html>", 0,
+  &TMH_MHD_handler_static_response, MHD_HTTP_NOT_FOUND
+};
+
+
+/**
+ * Run the handler @a rh for the first time for a request that
+ * was admitted.
+ *
+ * @param rh handler to run
+ * @param mi instance the request is for
+ * @param aid async scope of the request
+ * @param start when we received the request
+ * @param connection the connection
+ * @param con_cls connection closure, NULL before the call
+ * @param upload_data upload data
+ * @param[in,out] upload_data_size number of bytes (left) in @a upload_data
+ * @return MHD result code
+ */
+static MHD_RESULT
+call_handler (struct TMH_RequestHandler *rh,
+              struct MerchantInstance *mi,
+              const struct GNUNET_AsyncScopeId *aid,
+              struct GNUNET_TIME_Absolute start,
+              struct MHD_Connection *connection,
+              void **con_cls,
+              const char *upload_data,
+              size_t *upload_data_size)
+{
+  struct TM_HandlerContext *hc;
+  MHD_RESULT ret;
+
+  ret = rh->handler (rh,
+                     connection,
+                     con_cls,
+                     upload_data,
+                     upload_data_size,
+                     mi);
+  hc = *con_cls;
+  if (NULL == hc)
+  {
+    /* request was handled right away */
+    if (TMH_AC_NONE != rh->admission)
+      TMH_ADMISSION_release (rh->admission);
+    TMH_METRICS_record_request (rh,
+                                mi,
+                                connection,
+                                start);
+    return ret;
+  }
+  hc->rh = rh;
+  hc->mi = mi;
+  hc->start = start;
+  /* Store the async context ID, so we can restore it if
+   * we get another callback for this request. */
+  hc->async_scope_id = *aid;
+  if (GNUNET_YES == hc->parked)
+  {
+    /* long-polling, do not hold a slot while waiting */
+    if (TMH_AC_NONE != rh->admission)
+      TMH_ADMISSION_release (rh->admission);
+    return ret;
+  }
+  /* keep our slot until the request is completed */
+  hc->ac = rh->admission;
+  return ret;
+}
+
+
 /**
  * A client has requested the given url using the given method
  * (#MHD_HTTP_METHOD_GET, #MHD_HTTP_METHOD_PUT,
@@ -1341,96 +2319,19 @@ url_handler (void *cls,
              size_t *upload_data_size,
              void **con_cls)
 {
-  static struct TMH_RequestHandler handlers[] = {
-    /* Landing page, tell humans to go away. */
-    { "/", MHD_HTTP_METHOD_GET, "text/plain",
-      "Hello, I'm a merchant's Taler backend. This HTTP server is not for humans.\n",
-      0,
-      &TMH_MHD_handler_static_response, MHD_HTTP_OK },
-    { "/agpl", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &TMH_MHD_handler_agpl_redirect, MHD_HTTP_FOUND },
-    { "/track/transfer", MHD_HTTP_METHOD_GET, "application/json",
-      NULL, 0,
-      &MH_handler_track_transfer, MHD_HTTP_OK},
-    { "/track/transfer", NULL, "text/plain",
-      "Only GET is allowed", 0,
-      &TMH_MHD_handler_static_response, MHD_HTTP_OK},
-    { "/track/transaction", MHD_HTTP_METHOD_GET, "application/json",
-      NULL, 0,
-      &MH_handler_track_transaction, MHD_HTTP_OK},
-    { "/track/transaction", NULL, "text/plain",
-      "Only GET is allowed", 0,
-      &TMH_MHD_handler_static_response, MHD_HTTP_OK},
-    { "/history", MHD_HTTP_METHOD_GET, "text/plain",
-      "Only GET is allowed", 0,
-      &MH_handler_history, MHD_HTTP_OK},
-    { "/order", MHD_HTTP_METHOD_POST, "application/json",
-      NULL, 0,
-      &MH_handler_order_post, MHD_HTTP_OK },
-    { "/refund", MHD_HTTP_METHOD_POST, "application/json",
-      NULL, 0,
-      &MH_handler_refund_increase, MHD_HTTP_OK},
-    { "/tip-authorize", MHD_HTTP_METHOD_POST, "text/plain",
-      NULL, 0,
-      &MH_handler_tip_authorize, MHD_HTTP_OK},
-    { "/tip-query", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_tip_query, MHD_HTTP_OK},
-    { "/check-payment", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_check_payment, MHD_HTTP_OK},
-    { "/config", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_config, MHD_HTTP_OK},
-    {NULL, NULL, NULL, NULL, 0, 0 }
-  };
-  static struct TMH_RequestHandler public_handlers[] = {
-    { "/pay", MHD_HTTP_METHOD_POST, "application/json",
-      NULL, 0,
-      &MH_handler_pay, MHD_HTTP_OK },
-    { "/proposal", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_proposal_lookup, MHD_HTTP_OK },
-    { "/tip-pickup", MHD_HTTP_METHOD_POST, "text/plain",
-      NULL, 0,
-      &MH_handler_tip_pickup, MHD_HTTP_OK },
-    { "/refund", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_refund_lookup, MHD_HTTP_OK },
-    { "/tip-pickup", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_tip_pickup_get, MHD_HTTP_OK },
-    { "/poll-payment", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_poll_payment, MHD_HTTP_OK},
-    { "/config", MHD_HTTP_METHOD_GET, "text/plain",
-      NULL, 0,
-      &MH_handler_config, MHD_HTTP_OK},
-    {NULL, NULL, NULL, NULL, 0, 0 }
-  };
-  static struct TMH_RequestHandler h404 = {
-    "", NULL, "text/html",
-    "<html><title>404: not found</title><body>404: not found</body></html>", 0,
-    &TMH_MHD_handler_static_response, MHD_HTTP_NOT_FOUND
-  };
-
   struct TM_HandlerContext *hc = *con_cls;
   struct GNUNET_AsyncScopeId aid;
   const char *correlation_id = NULL;
   struct MerchantInstance *instance;
-  const char *effective_url;
-  /* Is a publicly facing endpoint being requested? */
-  int is_public;
-  /* Matching URL found, but maybe method doesn't match */
-  int url_found = GNUNET_NO;
-  MHD_RESULT ret;
-  struct TMH_RequestHandler *selected_handler = NULL;
+  struct TMH_Route route;
+  enum TMH_RouteStatus rs;
+  struct GNUNET_TIME_Absolute start;
 
   (void) cls;
   (void) version;
   if (NULL == hc)
   {
+    start = GNUNET_TIME_absolute_get ();
     GNUNET_async_scope_fresh (&aid);
     /* We only read the correlation ID on the first callback for every client */
     correlation_id = MHD_lookup_connection_value (connection,
@@ -1447,6 +2348,7 @@ url_handler (void *cls,
   else
   {
     aid = hc->async_scope_id;
+    start = hc->start;
   }
 
   GNUNET_SCHEDULER_begin_async_scope (&aid);
@@ -1463,59 +2365,54 @@ url_handler (void *cls,
                 method,
                 url);
 
-  effective_url = url;
-
-  {
-    const char *public_prefix = "/public/";
-
-    if (0 == strncmp (effective_url,
-                      public_prefix,
-                      strlen (public_prefix)))
-    {
-      is_public = GNUNET_YES;
-      effective_url = effective_url + strlen (public_prefix) - 1;
-    }
-    else
-    {
-      is_public = GNUNET_NO;
-    }
-  }
-
-  /* Find out the merchant backend instance for the request.
-   * If there is an instance, remove the instance specification
-   * from the beginning of the request URL. */
+  if (NULL != hc)
   {
-    const char *instance_prefix = "/instances/";
+    struct TMH_RequestHandler *rh = hc->rh;
+    struct MerchantInstance *mi = hc->mi;
 
-    if (0 == strncmp (effective_url,
-                      instance_prefix,
-                      strlen (instance_prefix)))
+    if (GNUNET_YES != TMH_ADMISSION_is_ticket (hc))
     {
-      /* url starts with "/instances/" */
-      const char *istart = effective_url + strlen (instance_prefix);
-      const char *slash = strchr (istart, '/');
-      char *instance_id;
-
-      if (NULL == slash)
-      {
-        return TMH_MHD_handler_static_response (&h404,
-                                                connection,
-                                                con_cls,
-                                                upload_data,
-                                                upload_data_size,
-                                                NULL);
-      }
-      instance_id = GNUNET_strndup (istart,
-                                    slash - istart);
-      instance = lookup_instance (instance_id);
-      GNUNET_free (instance_id);
-      effective_url = slash;
+      /* further callback for a request we already resolved */
+      return rh->handler (rh,
+                          connection,
+                          con_cls,
+                          upload_data,
+                          upload_data_size,
+                          mi);
     }
-    else
+    /* request was queued by admission control and resumed */
+    switch (TMH_ADMISSION_redeem (con_cls))
     {
-      instance = lookup_instance (NULL);
+    case TMH_ADMISSION_RUN:
+      return call_handler (rh,
+                           mi,
+                           &aid,
+                           start,
+                           connection,
+                           con_cls,
+                           upload_data,
+                           upload_data_size);
+    case TMH_ADMISSION_QUEUED:
+      GNUNET_break (0);
+      return MHD_YES;
+    case TMH_ADMISSION_SHED:
+      return TMH_ADMISSION_reply_shed (connection);
     }
   }
+  rs = TMH_router_resolve (router,
+                           url,
+                           method,
+                           &route);
+  if (TMH_ROUTE_MALFORMED == rs)
+    return TMH_MHD_handler_static_response (&h404,
+                                            connection,
+                                            con_cls,
+                                            upload_data,
+                                            upload_data_size,
+                                            NULL);
+  /* Find out the merchant backend instance for the request. */
+  instance = lookup_instance (route.instance_id,
+                              route.instance_id_len);
   if (NULL == instance)
     return TALER_MHD_reply_json_pack (connection,
                                       MHD_HTTP_NOT_FOUND,
@@ -1524,64 +2421,24 @@ url_handler (void *cls,
                                       (json_int_t) TALER_EC_INSTANCE_UNKNOWN,
                                       "error",
                                       "merchant instance unknown");
-
-  if (GNUNET_NO == is_public)
-  {
-    for (unsigned int i = 0; NULL != handlers[i].url; i++)
-    {
-      struct TMH_RequestHandler *rh = &handlers[i];
-
-      if ( (0 != strcasecmp (effective_url, rh->url)) )
-        continue;
-      url_found = GNUNET_YES;
-      if (0 == strcasecmp (method,
-                           MHD_HTTP_METHOD_OPTIONS))
-      {
-        return TALER_MHD_reply_cors_preflight (connection);
-      }
-      if ( (rh->method != NULL) &&
-           (0 != strcasecmp (method, rh->method)) )
-        continue;
-      selected_handler = rh;
-      break;
-    }
-  }
-
-  if (NULL == selected_handler)
-  {
-    for (unsigned int i = 0; NULL != public_handlers[i].url; i++)
-    {
-      struct TMH_RequestHandler *rh = &public_handlers[i];
-
-      if ( (0 != strcasecmp (effective_url, rh->url)) )
-        continue;
-      url_found = GNUNET_YES;
-      if (0 == strcasecmp (method,
-                           MHD_HTTP_METHOD_OPTIONS))
-      {
-        return TALER_MHD_reply_cors_preflight (connection);
-      }
-      if ( (rh->method != NULL) && (0 != strcasecmp (method, rh->method)) )
-        continue;
-      selected_handler = rh;
-      break;
-    }
-  }
-
-  if (NULL == selected_handler)
+  switch (rs)
   {
-    if (GNUNET_YES == url_found)
-    {
-      GNUNET_log (GNUNET_ERROR_TYPE_INFO,
-                  "invalid request: method '%s' for '%s' not allowed\n",
-                  method,
-                  url);
-      return TALER_MHD_reply_json_pack (connection,
-                                        MHD_HTTP_METHOD_NOT_ALLOWED,
-                                        "{s:s}",
-                                        "error",
-                                        "method not allowed");
-    }
+  case TMH_ROUTE_FOUND:
+    break;
+  case TMH_ROUTE_PREFLIGHT:
+    return TALER_MHD_reply_cors_preflight (connection);
+  case TMH_ROUTE_METHOD_NOT_ALLOWED:
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "invalid request: method '%s' for '%s' not allowed\n",
+                method,
+                url);
+    return TALER_MHD_reply_json_pack (connection,
+                                      MHD_HTTP_METHOD_NOT_ALLOWED,
+                                      "{s:s}",
+                                      "error",
+                                      "method not allowed");
+  case TMH_ROUTE_NOT_FOUND:
+  default:
     GNUNET_log (GNUNET_ERROR_TYPE_INFO,
                 "invalid request: URL '%s' not handled\n",
                 url);
@@ -1593,21 +2450,346 @@ url_handler (void *cls,
                                             instance);
   }
 
-  ret = selected_handler->handler (selected_handler,
-                                   connection,
-                                   con_cls,
-                                   upload_data,
-                                   upload_data_size,
-                                   instance);
-  hc = *con_cls;
-  if (NULL != hc)
+  switch (TMH_ADMISSION_admit (connection,
+                               route.rh,
+                               instance,
+                               &aid,
+                               con_cls))
   {
-    hc->rh = selected_handler;
-    /* Store the async context ID, so we can restore it if
-     * we get another callback for this request. */
-    hc->async_scope_id = aid;
+  case TMH_ADMISSION_RUN:
+    break;
+  case TMH_ADMISSION_QUEUED:
+    /* time spent waiting counts towards the latency */
+    ((struct TM_HandlerContext *) *con_cls)->start = start;
+    return MHD_YES;
+  case TMH_ADMISSION_SHED:
+    return TMH_ADMISSION_reply_shed (connection);
   }
-  return ret;
+  return call_handler (route.rh,
+                       instance,
+                       &aid,
+                       start,
+                       connection,
+                       con_cls,
+                       upload_data,
+                       upload_data_size);
+}
+
+
+/**
+ * Make sure the database has partitions for the contracts we
+ * store in the next #PARTITIONS_AHEAD, so that they do not end up
+ * in the default partitions (which are never archived).  Failing
+ * to do so is logged, but we keep serving: contracts then go to the
+ * default partitions until the operator fixes the problem.
+ */
+static void
+create_partitions (void)
+{
+  enum GNUNET_DB_QueryStatus qs;
+  unsigned int cnt;
+
+  qs = db->create_partitions (db->cls,
+                              GNUNET_TIME_relative_to_absolute (
+                                PARTITIONS_AHEAD),
+                              &cnt);
+  if (0 > qs)
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "Failed to create the partitions of the database for the coming months, see the database log; new contracts will not be archived until this is fixed\n");
+    return;
+  }
+  if (0 != cnt)
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Created %u partitions\n",
+                cnt);
+}
+
+
+/**
+ * Periodically create the partitions of the database, in case
+ * we run for longer than #PARTITIONS_AHEAD.
+ *
+ * @param cls NULL
+ */
+static void
+maintain_partitions (void *cls)
+{
+  (void) cls;
+  partition_task = NULL;
+  create_partitions ();
+  partition_task = GNUNET_SCHEDULER_add_delayed (PARTITIONS_FREQUENCY,
+                                                 &maintain_partitions,
+                                                 NULL);
+}
+
+
+/**
+ * Shutdown task of the supervisor process: terminate all
+ * of our workers and wait for them to exit.
+ *
+ * @param cls NULL
+ */
+static void
+do_shutdown_workers (void *cls)
+{
+  (void) cls;
+  if (NULL != worker_check_task)
+  {
+    GNUNET_SCHEDULER_cancel (worker_check_task);
+    worker_check_task = NULL;
+  }
+  for (unsigned int i = 0; i<num_workers; i++)
+  {
+    if (NULL == workers[i])
+      continue;
+    if (0 != GNUNET_OS_process_kill (workers[i],
+                                     SIGTERM))
+      GNUNET_log_strerror (GNUNET_ERROR_TYPE_WARNING,
+                           "kill");
+    if (GNUNET_OK !=
+        GNUNET_OS_process_wait (workers[i]))
+      GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                  "Failed to wait for worker %u\n",
+                  i);
+    GNUNET_OS_process_destroy (workers[i]);
+    workers[i] = NULL;
+  }
+  GNUNET_free_non_null (workers);
+  workers = NULL;
+}
+
+
+/**
+ * Check that all of our workers are still running.  If any
+ * of them died, we shut down the entire service, as we would
+ * otherwise silently serve with reduced capacity.
+ *
+ * @param cls NULL
+ */
+static void
+check_workers (void *cls)
+{
+  (void) cls;
+  worker_check_task = NULL;
+  for (unsigned int i = 0; i<num_workers; i++)
+  {
+    enum GNUNET_OS_ProcessStatusType type;
+    unsigned long code;
+
+    if (GNUNET_NO ==
+        GNUNET_OS_process_status (workers[i],
+                                  &type,
+                                  &code))
+      continue; /* still running */
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "Worker %u terminated (status %d/%lu), shutting down\n",
+                i,
+                (int) type,
+                code);
+    GNUNET_OS_process_destroy (workers[i]);
+    workers[i] = NULL;
+    result = GNUNET_SYSERR;
+    GNUNET_SCHEDULER_shutdown ();
+    return;
+  }
+  worker_check_task
+    = GNUNET_SCHEDULER_add_delayed (GNUNET_TIME_UNIT_SECONDS,
+                                    &check_workers,
+                                    NULL);
+}
+
+
+/**
+ * Open a dual-stack TCP listen socket on @a lport.  Used by the
+ * supervisor, as with multiple workers the socket must exist
+ * before MHD is started so that the workers can share it.
+ *
+ * @param lport port to listen on
+ * @return listen socket, -1 on error
+ */
+static int
+open_listen_socket (uint16_t lport)
+{
+  struct sockaddr_in6 sa;
+  const int on = 1;
+  const int off = 0;
+  int fd;
+
+  fd = socket (AF_INET6,
+               SOCK_STREAM,
+               0);
+  if (-1 == fd)
+  {
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                         "socket");
+    return -1;
+  }
+  if (0 != setsockopt (fd,
+                       SOL_SOCKET,
+                       SO_REUSEADDR,
+                       &on,
+                       sizeof (on)))
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_WARNING,
+                         "setsockopt");
+  if (0 != setsockopt (fd,
+                       IPPROTO_IPV6,
+                       IPV6_V6ONLY,
+                       &off,
+                       sizeof (off)))
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_WARNING,
+                         "setsockopt");
+  memset (&sa,
+          0,
+          sizeof (sa));
+  sa.sin6_family = AF_INET6;
+  sa.sin6_port = htons (lport);
+  sa.sin6_addr = in6addr_any;
+  if ( (0 != bind (fd,
+                   (const struct sockaddr *) &sa,
+                   sizeof (sa))) ||
+       (0 != listen (fd,
+                     UNIX_BACKLOG)) )
+  {
+    GNUNET_log_strerror (GNUNET_ERROR_TYPE_ERROR,
+                         "bind");
+    GNUNET_break (0 == close (fd));
+    return -1;
+  }
+  return fd;
+}
+
+
+/**
+ * Check if our supervisor passed us a listen socket
+ * (systemd-style, via the "LISTEN_FDS" environment variable).
+ * Like sd_listen_fds(), we only trust the variable if "LISTEN_PID"
+ * is our PID, as it may be left over from some process that started
+ * us.  Our own supervisor (via GNUNET_OS_start_process_v()) does not
+ * set "LISTEN_PID", so without it we only trust the variable if we
+ * are a worker, i.e. were started with "-w 1".
+ *
+ * @return the inherited listen socket, -1 if we have none
+ */
+static int
+get_inherited_socket (void)
+{
+  const char *env;
+  const char *pid_env;
+  unsigned int cnt;
+  unsigned long long pid;
+  int ok;
+
+  env = getenv ("LISTEN_FDS");
+  if (NULL == env)
+    return -1;
+  pid_env = getenv ("LISTEN_PID");
+  if (NULL != pid_env)
+    ok = ( (1 == sscanf (pid_env,
+                         "%llu",
+                         &pid)) &&
+           (pid == (unsigned long long) getpid ()) );
+  else
+    ok = (1 == num_workers);
+  ok = ok &&
+       (1 == sscanf (env,
+                     "%u",
+                     &cnt)) &&
+       (1 == cnt);
+  /* do not pass them on to processes we may start */
+  GNUNET_break (0 == unsetenv ("LISTEN_FDS"));
+  GNUNET_break (0 == unsetenv ("LISTEN_PID"));
+  if (! ok)
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                "Ignoring LISTEN_FDS, it is not meant for us\n");
+    return -1;
+  }
+  return 3; /* SD_LISTEN_FDS_START */
+}
+
+
+/**
+ * Run as supervisor: bind the listen socket once, then start
+ * #num_workers copies of ourselves sharing it.  Each worker is a
+ * complete merchant backend with its own event loop, HTTP daemon,
+ * exchange connections and database connection, so that we can
+ * use multiple cores without having to make the (single-threaded)
+ * scheduler logic thread-safe.
+ *
+ * @param config configuration to use
+ */
+static void
+start_workers (const struct GNUNET_CONFIGURATION_Handle *config)
+{
+  int lsocks[2];
+  const char **wargv;
+  unsigned int argc;
+  int fh;
+
+  GNUNET_SCHEDULER_add_shutdown (&do_shutdown_workers,
+                                 NULL);
+  fh = TALER_MHD_bind (config,
+                       "merchant",
+                       &port);
+  if ( (0 == port) &&
+       (-1 == fh) )
+  {
+    GNUNET_SCHEDULER_shutdown ();
+    return;
+  }
+  if (-1 == fh)
+    fh = open_listen_socket (port);
+  if (-1 == fh)
+  {
+    GNUNET_SCHEDULER_shutdown ();
+    return;
+  }
+  for (argc = 0; NULL != main_argv[argc]; argc++)
+    ;
+  wargv = GNUNET_new_array (argc + 3,
+                            const char *);
+  for (unsigned int i = 0; i<argc; i++)
+    wargv[i] = main_argv[i];
+  /* the last occurrence of the option wins */
+  wargv[argc] = "-w";
+  wargv[argc + 1] = "1";
+  lsocks[0] = fh;
+  lsocks[1] = -1;
+  workers = GNUNET_new_array (num_workers,
+                              struct GNUNET_OS_Process *);
+  for (unsigned int i = 0; i<num_workers; i++)
+  {
+    workers[i] = GNUNET_OS_start_process_v (GNUNET_NO,
+                                            GNUNET_OS_INHERIT_STD_ALL,
+                                            lsocks,
+                                            main_argv[0],
+                                            (char *const *) wargv);
+    if (NULL == workers[i])
+    {
+      GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                  "Failed to start worker %u\n",
+                  i);
+      break;
+    }
+  }
+  GNUNET_free (wargv);
+  /* only the workers accept() on the socket */
+  GNUNET_break (0 == close (fh));
+  for (unsigned int i = 0; i<num_workers; i++)
+    if (NULL == workers[i])
+    {
+      GNUNET_SCHEDULER_shutdown ();
+      return;
+    }
+  GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+              "Started %u worker processes\n",
+              num_workers);
+  result = GNUNET_OK;
+  worker_check_task
+    = GNUNET_SCHEDULER_add_delayed (GNUNET_TIME_UNIT_SECONDS,
+                                    &check_workers,
+                                    NULL);
 }
 
 
@@ -1628,6 +2810,8 @@ run (void *cls,
 {
   int fh;
   enum TALER_MHD_GlobalOptions go;
+  unsigned int mhd_flags;
+  unsigned long long connection_memory_limit;
 
   (void) cls;
   (void) args;
@@ -1640,6 +2824,11 @@ run (void *cls,
   TALER_MHD_setup (go);
 
   result = GNUNET_SYSERR;
+  if (num_workers > 1)
+  {
+    start_workers (config);
+    return;
+  }
   GNUNET_SCHEDULER_add_shutdown (&do_shutdown,
                                  NULL);
   if (GNUNET_OK !=
@@ -1654,6 +2843,11 @@ run (void *cls,
                                             "merchant",
                                             "FORCE_AUDIT"))
     TMH_force_audit = GNUNET_YES;
+  if (GNUNET_YES ==
+      GNUNET_CONFIGURATION_get_value_yesno (config,
+                                            "merchant",
+                                            "LONG_POLL_COMPACT"))
+    TMH_long_poll_compact = GNUNET_YES;
   if (GNUNET_SYSERR ==
       TMH_EXCHANGES_init (config))
   {
@@ -1756,6 +2950,21 @@ run (void *cls,
     return;
   }
   iterate_locations ();
+  if (GNUNET_OK !=
+      TMH_ADMISSION_init (config))
+  {
+    GNUNET_SCHEDULER_shutdown ();
+    return;
+  }
+  TMH_METRICS_init (handlers,
+                    public_handlers);
+  router = TMH_router_create ();
+  TMH_router_add (router,
+                  GNUNET_NO,
+                  handlers);
+  TMH_router_add (router,
+                  GNUNET_YES,
+                  public_handlers);
 
   if (NULL ==
       (db = TALER_MERCHANTDB_plugin_load (cfg)))
@@ -1763,22 +2972,56 @@ run (void *cls,
     GNUNET_SCHEDULER_shutdown ();
     return;
   }
+  create_partitions ();
+  partition_task = GNUNET_SCHEDULER_add_delayed (PARTITIONS_FREQUENCY,
+                                                 &maintain_partitions,
+                                                 NULL);
 
-  fh = TALER_MHD_bind (config,
-                       "merchant",
-                       &port);
-  if ( (0 == port) &&
-       (-1 == fh) )
+  fh = get_inherited_socket ();
+  if (-1 == fh)
   {
-    GNUNET_SCHEDULER_shutdown ();
-    return;
+    fh = TALER_MHD_bind (config,
+                         "merchant",
+                         &port);
+    if ( (0 == port) &&
+         (-1 == fh) )
+    {
+      GNUNET_SCHEDULER_shutdown ();
+      return;
+    }
   }
-  resume_timeout_heap
-    = GNUNET_CONTAINER_heap_create (GNUNET_CONTAINER_HEAP_ORDER_MIN);
+  resume_timeout_wheel
+    = TMH_timer_wheel_create (LONG_POLL_RESOLUTION,
+                              GNUNET_TIME_absolute_get ());
+  long_poll_slab = TMH_slab_create (TMH_LONG_POLL_RECORD_SIZE);
   payment_trigger_map
     = GNUNET_CONTAINER_multihashmap_create (16,
                                             GNUNET_YES);
-  mhd = MHD_start_daemon (MHD_USE_SUSPEND_RESUME | MHD_USE_DUAL_STACK,
+  payment_status_map
+    = GNUNET_CONTAINER_multihashmap_create (16,
+                                            GNUNET_YES);
+  db->listen_payment_events (db->cls,
+                             &payment_event_cb,
+                             NULL);
+  mhd_flags = MHD_USE_SUSPEND_RESUME | MHD_USE_DUAL_STACK;
+  if (GNUNET_YES ==
+      GNUNET_CONFIGURATION_get_value_yesno (config,
+                                            "merchant",
+                                            "USE_EPOLL"))
+  {
+    if (MHD_YES == MHD_is_feature_supported (MHD_FEATURE_EPOLL))
+      mhd_flags |= MHD_USE_EPOLL;
+    else
+      GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                  "USE_EPOLL requested, but MHD lacks epoll() support, falling back to select()\n");
+  }
+  if (GNUNET_OK !=
+      GNUNET_CONFIGURATION_get_value_size (config,
+                                           "merchant",
+                                           "CONNECTION_MEMORY_LIMIT",
+                                           &connection_memory_limit))
+    connection_memory_limit = 32 * 1024; /* MHD's default */
+  mhd = MHD_start_daemon (mhd_flags,
                           port,
                           NULL, NULL,
                           &url_handler, NULL,
@@ -1787,6 +3030,8 @@ run (void *cls,
                           &handle_mhd_completion_callback, NULL,
                           MHD_OPTION_CONNECTION_TIMEOUT,
                           (unsigned int) 10 /* 10s */,
+                          MHD_OPTION_CONNECTION_MEMORY_LIMIT,
+                          (size_t) connection_memory_limit,
                           MHD_OPTION_END);
   if (NULL == mhd)
   {
@@ -1795,6 +3040,21 @@ run (void *cls,
     GNUNET_SCHEDULER_shutdown ();
     return;
   }
+  if (0 != (mhd_flags & MHD_USE_EPOLL))
+  {
+    const union MHD_DaemonInfo *di;
+
+    di = MHD_get_daemon_info (mhd,
+                              MHD_DAEMON_INFO_EPOLL_FD);
+    if ( (NULL == di) ||
+         (NULL == (mhd_epoll_fd
+                     = GNUNET_NETWORK_socket_box_native (di->epoll_fd))) )
+    {
+      GNUNET_break (0);
+      GNUNET_SCHEDULER_shutdown ();
+      return;
+    }
+  }
   result = GNUNET_OK;
   mhd_task = prepare_daemon ();
 }
@@ -1818,9 +3078,15 @@ main (int argc,
                                &TMH_merchant_connection_close),
     GNUNET_GETOPT_option_timetravel ('T',
                                      "timetravel"),
+    GNUNET_GETOPT_option_uint ('w',
+                               "workers",
+                               "NUMBER",
+                               "number of worker processes to serve requests with (default: 1)",
+                               &num_workers),
     GNUNET_GETOPT_OPTION_END
   };
 
+  main_argv = argv;
   if (GNUNET_OK !=
       GNUNET_PROGRAM_run (argc, argv,
                           "taler-merchant-httpd",
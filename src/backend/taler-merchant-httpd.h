@@ -26,6 +26,8 @@
 #include <microhttpd.h>
 #include <taler/taler_mhd_lib.h>
 #include <gnunet/gnunet_mhd_compat.h>
+#include "taler-merchant-httpd_timer-wheel.h"
+#include "taler-merchant-httpd_slab.h"
 
 /**
  * Shorthand for exit jumps.
@@ -74,6 +76,12 @@ struct WireMethod
 };
 
 
+/**
+ * Request metrics of an instance, see taler-merchant-httpd_metrics.h.
+ */
+struct TMH_EndpointMetrics;
+
+
 /**
  * Information that defines a merchant "instance". That way, a single
  * backend can account for several merchants, as used to do in donation
@@ -130,6 +138,57 @@ struct MerchantInstance
    * Only valid if @e tip_exchange is non-null.
    */
   struct TALER_ReservePrivateKeyP tip_reserve;
+
+  /**
+   * Metrics about requests for this instance, indexed by the
+   * @e metrics_id of the handler; NULL until the first request.
+   */
+  struct TMH_EndpointMetrics *metrics;
+};
+
+
+/**
+ * Classes of requests for admission control.  Each class has its
+ * own concurrency limit; when requests have to wait, classes with
+ * lower values take priority.
+ */
+enum TMH_AdmissionClass
+{
+
+  /**
+   * Cheap requests that are not subject to admission control.
+   */
+  TMH_AC_NONE = 0,
+
+  /**
+   * Payments by wallets (these talk to the exchange).
+   */
+  TMH_AC_PAY,
+
+  /**
+   * Other requests from wallets.
+   */
+  TMH_AC_WALLET,
+
+  /**
+   * Long-polling requests.
+   */
+  TMH_AC_POLL,
+
+  /**
+   * Requests from the merchant's back office.
+   */
+  TMH_AC_BACKOFFICE,
+
+  /**
+   * Back office requests that scan (large parts of) the database.
+   */
+  TMH_AC_SCAN,
+
+  /**
+   * Number of classes, must be last.
+   */
+  TMH_AC_MAX
 };
 
 
@@ -187,6 +246,16 @@ struct TMH_RequestHandler
    * Default response code.
    */
   unsigned int response_code;
+
+  /**
+   * Admission control class of requests for this handler.
+   */
+  enum TMH_AdmissionClass admission;
+
+  /**
+   * Index of this handler for metrics, set at startup.
+   */
+  unsigned int metrics_id;
 };
 
 
@@ -198,6 +267,12 @@ struct TMH_RequestHandler
  */
 struct TM_HandlerContext;
 
+
+/**
+ * Arena allocator, see taler-merchant-httpd_arena.h.
+ */
+struct TMH_Arena;
+
 /**
  * Signature of a function used to clean up the context
  * we keep in the "connection_cls" of MHD when handling
@@ -227,17 +302,94 @@ struct TM_HandlerContext
   /**
    * Which request handler is handling this request?
    */
-  const struct TMH_RequestHandler *rh;
+  struct TMH_RequestHandler *rh;
+
+  /**
+   * Which merchant instance is this request for?  Resolved on
+   * the first callback for the request and reused afterwards.
+   */
+  struct MerchantInstance *mi;
 
   /**
    * Asynchronous request context id.
    */
   struct GNUNET_AsyncScopeId async_scope_id;
+
+  /**
+   * Admission control class this request holds a slot in,
+   * #TMH_AC_NONE if none.
+   */
+  enum TMH_AdmissionClass ac;
+
+  /**
+   * #GNUNET_YES once the request was suspended to long-poll.  From
+   * then on it no longer holds an admission slot, as waiting clients
+   * cost us (almost) nothing.  See #TMH_long_poll_suspend().
+   */
+  int parked;
+
+  /**
+   * Memory arena of the request, NULL if not yet used.  Released
+   * after @e cc was called.  See #TMH_handler_arena().
+   */
+  struct TMH_Arena *arena;
+
+  /**
+   * When did we receive the request?
+   */
+  struct GNUNET_TIME_Absolute start;
+};
+
+
+/**
+ * Payment status of an order.  Looked up by the first long-polling
+ * request that needs it after a payment or refund woke up the
+ * requests waiting on the order, and shared with the others.
+ */
+struct TMH_PaymentStatus
+{
+  /**
+   * Key of the order, see TMH_compute_pay_key().
+   */
+  struct GNUNET_HashCode key;
+
+  /**
+   * Total refunds granted for the order, only valid if
+   * @e refunds_known and @e refunded are set.
+   */
+  struct TALER_Amount refund_amount;
+
+  /**
+   * Number of suspended connections using this status.
+   */
+  unsigned int rc;
+
+  /**
+   * #GNUNET_YES if @e paid is valid.
+   */
+  int paid_known;
+
+  /**
+   * #GNUNET_YES if the order was paid (regardless of the session).
+   */
+  int paid;
+
+  /**
+   * #GNUNET_YES if @e refunded is valid.
+   */
+  int refunds_known;
+
+  /**
+   * #GNUNET_YES if the order was refunded.
+   */
+  int refunded;
+
 };
 
 
 /**
- * Entry in a #resume_timeout_heap.
+ * Connection suspended while long-polling, kept in the
+ * #payment_trigger_map and the #resume_timeout_wheel.
  */
 struct TMH_SuspendedConnection
 {
@@ -247,9 +399,15 @@ struct TMH_SuspendedConnection
   struct MHD_Connection *con;
 
   /**
-   * Associated heap node.
+   * Handler context of the request, its admission slot is
+   * released while the request is suspended.
    */
-  struct GNUNET_CONTAINER_HeapNode *hn;
+  struct TM_HandlerContext *hc;
+
+  /**
+   * Entry in the #resume_timeout_wheel.
+   */
+  struct TMH_TimerWheelEntry twe;
 
   /**
    * Key of this entry in the #payment_trigger_map
@@ -267,6 +425,13 @@ struct TMH_SuspendedConnection
    */
   struct TALER_Amount refund_expected;
 
+  /**
+   * Payment status shared with the other connections resumed
+   * together with this one, NULL if we were not resumed because
+   * of a payment or refund.
+   */
+  struct TMH_PaymentStatus *ps;
+
   /**
    * #GNUNET_YES if we are waiting for a refund.
    */
@@ -275,6 +440,35 @@ struct TMH_SuspendedConnection
 };
 
 
+/**
+ * Information we keep for a connection that is suspended while
+ * we wait for an asynchronous database operation to complete.
+ */
+struct TMH_DbSuspension
+{
+  /**
+   * Kept in a DLL.
+   */
+  struct TMH_DbSuspension *next;
+
+  /**
+   * Kept in a DLL.
+   */
+  struct TMH_DbSuspension *prev;
+
+  /**
+   * Which connection was suspended.
+   */
+  struct MHD_Connection *con;
+
+  /**
+   * The pending database operation, NULL if none.
+   */
+  struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+};
+
+
 /**
  * Locations from the configuration.  Mapping from
  * label to location data.
@@ -300,13 +494,14 @@ extern struct TALER_Amount default_max_deposit_fee;
 extern unsigned long long default_wire_fee_amortization;
 
 /**
- * MIN-Heap of suspended connections to resume when the timeout expires,
- * ordered by timeout. Values are of type `struct TMH_SuspendedConnection`
+ * Timer wheel of suspended connections to resume when the timeout
+ * expires.  Entries are of type `struct TMH_SuspendedConnection`.
  */
-extern struct GNUNET_CONTAINER_Heap *resume_timeout_heap;
+extern struct TMH_TimerWheel *resume_timeout_wheel;
 
 /**
- * Task responsible for timeouts in the #resume_timeout_heap.
+ * Task advancing the #resume_timeout_wheel, runs once per
+ * tick while the wheel is not empty.
  */
 extern struct GNUNET_SCHEDULER_Task *resume_timeout_task;
 
@@ -326,6 +521,12 @@ extern char *TMH_currency;
  */
 extern int TMH_force_audit;
 
+/**
+ * Should long-polling requests release all state they do not need
+ * to answer while they are suspended (global option)?
+ */
+extern int TMH_long_poll_compact;
+
 /**
  * Hash of our wire format details as given in #j_wire.
  */
@@ -368,10 +569,11 @@ extern struct GNUNET_TIME_Relative default_wire_transfer_delay;
 extern struct GNUNET_TIME_Relative default_pay_deadline;
 
 /**
- * Kick MHD to run now, to be called after MHD_resume_connection().
+ * Kick MHD to run, to be called after MHD_resume_connection().
  * Basically, we need to explicitly resume MHD's event loop whenever
- * we made progress serving a request.  This function re-schedules
- * the task processing MHD's activities to run immediately.
+ * we made progress serving a request.  This function schedules
+ * the task processing MHD's activities to run once the current
+ * task is done; calling it many times in one task is cheap.
  */
 void
 TMH_trigger_daemon (void);
@@ -393,6 +595,9 @@ TMH_compute_pay_key (const char *order_id,
 
 /**
  * Suspend connection from @a sc until payment has been received.
+ * The request gives up its admission slot (if any), so that clients
+ * waiting for a long time do not lock out other requests of their
+ * class.
  *
  * @param sc connection to suspend
  * @param min_refund refund amount we are waiting on to be exceeded before resuming,
@@ -403,9 +608,58 @@ TMH_long_poll_suspend (struct TMH_SuspendedConnection *sc,
                        const struct TALER_Amount *min_refund);
 
 
+/**
+ * Size of the contexts of long-polling requests.  Must be large
+ * enough for the context of any long-polling request handler.
+ */
+#define TMH_LONG_POLL_RECORD_SIZE 512
+
+
+/**
+ * Allocate a zero-initialized context of @a size bytes for a
+ * long-polling request.  All such contexts are records of the same
+ * fixed size in a slab, so that the memory used for waiting clients
+ * is bounded and can be monitored.
+ *
+ * @param size size of the context, must be at most #TMH_LONG_POLL_RECORD_SIZE
+ * @return the context
+ */
+void *
+TMH_long_poll_record_alloc (size_t size);
+
+
+/**
+ * Free a context allocated with #TMH_long_poll_record_alloc().
+ *
+ * @param record context to free
+ */
+void
+TMH_long_poll_record_free (void *record);
+
+
+/**
+ * Obtain statistics about the contexts of long-polling requests.
+ *
+ * @param[out] stats set to the current statistics
+ */
+void
+TMH_long_poll_get_statistics (struct TMH_SlabStatistics *stats);
+
+
+/**
+ * Stop using the payment status shared with the other connections
+ * resumed together with @a sc (if any).
+ *
+ * @param sc connection that was resumed
+ */
+void
+TMH_long_poll_release (struct TMH_SuspendedConnection *sc);
+
+
 /**
  * Find out if we have any clients long-polling for @a order_id to be
  * confirmed at merchant @a mpub, and if so, tell them to resume.
+ * Other processes using the same database are notified as well.
  *
  * @param order_id the order that was paid
  * @param mpub the merchant's public key of the instance where the payment happened
@@ -417,6 +671,90 @@ TMH_long_poll_resume (const char *order_id,
                       const struct TALER_Amount *refund_amount);
 
 
+/**
+ * Compute @a key to use for clients long-polling on the wire transfer
+ * of the contract @a h_contract_terms at merchant @a mpub.
+ *
+ * @param h_contract_terms hash of the contract
+ * @param mpub an instance public key
+ * @param key[out] set to the hash map key to use
+ */
+void
+TMH_compute_transfer_key (const struct GNUNET_HashCode *h_contract_terms,
+                          const struct TALER_MerchantPublicKeyP *mpub,
+                          struct GNUNET_HashCode *key);
+
+
+/**
+ * Find out if we have any clients long-polling for the wire transfer
+ * of the contract @a h_contract_terms at merchant @a mpub, and if so,
+ * tell them to resume.  Other processes using the same database are
+ * notified as well.
+ *
+ * @param h_contract_terms hash of the contract whose wire transfer became known
+ * @param mpub the merchant's public key of the instance
+ */
+void
+TMH_long_poll_resume_transfer (const struct GNUNET_HashCode *h_contract_terms,
+                               const struct TALER_MerchantPublicKeyP *mpub);
+
+
+/**
+ * Details about a coin aggregated into a wire transfer, see
+ * `taler_exchange_service.h`.
+ */
+struct TALER_TrackTransferDetails;
+
+
+/**
+ * Call #TMH_long_poll_resume_transfer() once for each contract with
+ * coins in @a details.  A wire transfer may aggregate many coins
+ * of the same contract; each contract is woken up only once.
+ *
+ * @param details coins aggregated into a wire transfer
+ * @param details_length length of the @a details array
+ * @param mpub the merchant's public key of the instance
+ */
+void
+TMH_long_poll_resume_transfers (const struct
+                                TALER_TrackTransferDetails *details,
+                                unsigned int details_length,
+                                const struct TALER_MerchantPublicKeyP *mpub);
+
+
+/**
+ * Suspend @a con while we wait for the database operation @a ah.
+ * The callback of @a ah must call #TMH_db_resume().
+ *
+ * @param ds suspension record to use (usually in the handler context)
+ * @param con connection to suspend
+ * @param ah the pending database operation
+ */
+void
+TMH_db_suspend (struct TMH_DbSuspension *ds,
+                struct MHD_Connection *con,
+                struct TALER_MERCHANTDB_AsyncHandle *ah);
+
+
+/**
+ * The database operation of @a ds completed, resume the connection.
+ *
+ * @param ds suspension record given to #TMH_db_suspend()
+ */
+void
+TMH_db_resume (struct TMH_DbSuspension *ds);
+
+
+/**
+ * Cancel the database operation of @a ds (if any).  To be
+ * called when cleaning up the handler context.
+ *
+ * @param ds suspension record, may not be in use
+ */
+void
+TMH_db_cancel (struct TMH_DbSuspension *ds);
+
+
 /**
  * Create a taler://pay/ URI for the given @a con and @a order_id
  * and @a session_id and @a instance_id.
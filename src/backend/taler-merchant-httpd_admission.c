@@ -0,0 +1,383 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_admission.c
+ * @brief limit the number of requests we process concurrently
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <taler/taler_mhd_lib.h>
+#include "taler-merchant-httpd_admission.h"
+
+
+/**
+ * Ticket of a request that waits for admission.
+ */
+struct Ticket
+{
+
+  /**
+   * Must be first for #handle_mhd_completion_callback.  The
+   * handler and instance of the request are kept in here.
+   */
+  struct TM_HandlerContext hc;
+
+  /**
+   * Kept in a DLL per class.
+   */
+  struct Ticket *next;
+
+  /**
+   * Kept in a DLL per class.
+   */
+  struct Ticket *prev;
+
+  /**
+   * Connection of the request (suspended while queued).
+   */
+  struct MHD_Connection *connection;
+
+  /**
+   * Class of the request.
+   */
+  enum TMH_AdmissionClass ac;
+
+  /**
+   * #TMH_ADMISSION_QUEUED while waiting, #TMH_ADMISSION_RUN once
+   * admitted (we then hold a slot), #TMH_ADMISSION_SHED if rejected.
+   */
+  enum TMH_AdmissionStatus state;
+};
+
+
+/**
+ * Names of the classes, used as configuration options.
+ */
+static const char *class_names[TMH_AC_MAX] = {
+  [TMH_AC_PAY] = "PAY",
+  [TMH_AC_WALLET] = "WALLET",
+  [TMH_AC_POLL] = "POLL",
+  [TMH_AC_BACKOFFICE] = "BACKOFFICE",
+  [TMH_AC_SCAN] = "SCAN"
+};
+
+/**
+ * Default limits for the classes.
+ */
+static const unsigned int default_limits[TMH_AC_MAX] = {
+  [TMH_AC_PAY] = 256,
+  [TMH_AC_WALLET] = 512,
+  [TMH_AC_POLL] = 4096,
+  [TMH_AC_BACKOFFICE] = 64,
+  [TMH_AC_SCAN] = 4
+};
+
+/**
+ * Maximum number of requests of each class we process at the
+ * same time, 0 for no limit.
+ */
+static unsigned int limits[TMH_AC_MAX];
+
+/**
+ * Heads of the queues of waiting requests, by class.
+ */
+static struct Ticket *q_head[TMH_AC_MAX];
+
+/**
+ * Tails of the queues of waiting requests, by class.
+ */
+static struct Ticket *q_tail[TMH_AC_MAX];
+
+/**
+ * Number of requests waiting, over all classes.
+ */
+static unsigned int total_queued;
+
+/**
+ * Maximum value for #total_queued.
+ */
+static unsigned long long max_queued;
+
+/**
+ * Value for the "Retry-After" header when rejecting requests.
+ */
+static struct GNUNET_TIME_Relative retry_after;
+
+/**
+ * Our statistics.
+ */
+static struct TMH_AdmissionStatistics ac_stats;
+
+
+int
+TMH_ADMISSION_init (const struct GNUNET_CONFIGURATION_Handle *cfg)
+{
+  for (unsigned int i = TMH_AC_NONE + 1; i<TMH_AC_MAX; i++)
+  {
+    unsigned long long limit;
+
+    if (GNUNET_OK !=
+        GNUNET_CONFIGURATION_get_value_number (cfg,
+                                               "merchant-admission",
+                                               class_names[i],
+                                               &limit))
+      limit = default_limits[i];
+    if (limit > UINT_MAX)
+    {
+      GNUNET_log_config_invalid (GNUNET_ERROR_TYPE_ERROR,
+                                 "merchant-admission",
+                                 class_names[i],
+                                 "value too large");
+      return GNUNET_SYSERR;
+    }
+    limits[i] = (unsigned int) limit;
+  }
+  if (GNUNET_OK !=
+      GNUNET_CONFIGURATION_get_value_number (cfg,
+                                             "merchant-admission",
+                                             "MAX_QUEUED",
+                                             &max_queued))
+    max_queued = 1024;
+  if (GNUNET_OK !=
+      GNUNET_CONFIGURATION_get_value_time (cfg,
+                                           "merchant-admission",
+                                           "RETRY_AFTER",
+                                           &retry_after))
+    retry_after = GNUNET_TIME_relative_multiply (GNUNET_TIME_UNIT_SECONDS,
+                                                 5);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Check if another request of class @a ac may run.
+ *
+ * @param ac class to check
+ * @return #GNUNET_YES if there is room for another request
+ */
+static int
+can_run (enum TMH_AdmissionClass ac)
+{
+  return ( (0 == limits[ac]) ||
+           (ac_stats.active[ac] < limits[ac]) ) ? GNUNET_YES : GNUNET_NO;
+}
+
+
+/**
+ * Remove @a t from its queue.
+ *
+ * @param t ticket to remove
+ */
+static void
+dequeue (struct Ticket *t)
+{
+  GNUNET_CONTAINER_DLL_remove (q_head[t->ac],
+                               q_tail[t->ac],
+                               t);
+  total_queued--;
+  ac_stats.queued[t->ac]--;
+}
+
+
+/**
+ * Reject the waiting request @a t and resume its connection.
+ *
+ * @param t ticket to reject
+ */
+static void
+shed (struct Ticket *t)
+{
+  dequeue (t);
+  t->state = TMH_ADMISSION_SHED;
+  ac_stats.shed[t->ac]++;
+  MHD_resume_connection (t->connection);
+}
+
+
+/**
+ * Function called when a connection with a ticket is done.
+ *
+ * @param hc the `struct Ticket`
+ */
+static void
+ticket_cleanup (struct TM_HandlerContext *hc)
+{
+  struct Ticket *t = (struct Ticket *) hc;
+
+  switch (t->state)
+  {
+  case TMH_ADMISSION_QUEUED:
+    dequeue (t);
+    break;
+  case TMH_ADMISSION_RUN:
+    /* admitted, but the client went away before we ran it */
+    TMH_ADMISSION_release (t->ac);
+    break;
+  case TMH_ADMISSION_SHED:
+    break;
+  }
+  GNUNET_free (t);
+}
+
+
+enum TMH_AdmissionStatus
+TMH_ADMISSION_admit (struct MHD_Connection *connection,
+                     struct TMH_RequestHandler *rh,
+                     struct MerchantInstance *mi,
+                     const struct GNUNET_AsyncScopeId *aid,
+                     void **con_cls)
+{
+  enum TMH_AdmissionClass ac = rh->admission;
+  struct Ticket *t;
+
+  if (TMH_AC_NONE == ac)
+    return TMH_ADMISSION_RUN;
+  if ( (NULL == q_head[ac]) &&
+       (GNUNET_YES == can_run (ac)) )
+  {
+    ac_stats.active[ac]++;
+    ac_stats.admitted[ac]++;
+    return TMH_ADMISSION_RUN;
+  }
+  if (total_queued >= max_queued)
+  {
+    struct Ticket *victim = NULL;
+
+    /* make room by rejecting the latest request of the
+       least important class that is less important than us */
+    for (unsigned int i = TMH_AC_MAX - 1; i > ac; i--)
+      if (NULL != (victim = q_tail[i]))
+        break;
+    if (NULL == victim)
+    {
+      ac_stats.shed[ac]++;
+      return TMH_ADMISSION_SHED;
+    }
+    shed (victim);
+    TMH_trigger_daemon ();
+  }
+  t = GNUNET_new (struct Ticket);
+  t->hc.cc = &ticket_cleanup;
+  t->hc.rh = rh;
+  t->hc.mi = mi;
+  t->hc.async_scope_id = *aid;
+  t->connection = connection;
+  t->ac = ac;
+  t->state = TMH_ADMISSION_QUEUED;
+  GNUNET_CONTAINER_DLL_insert_tail (q_head[ac],
+                                    q_tail[ac],
+                                    t);
+  total_queued++;
+  ac_stats.queued[ac]++;
+  ac_stats.max_queued = GNUNET_MAX (ac_stats.max_queued,
+                                 total_queued);
+  MHD_suspend_connection (connection);
+  *con_cls = t;
+  return TMH_ADMISSION_QUEUED;
+}
+
+
+int
+TMH_ADMISSION_is_ticket (const struct TM_HandlerContext *hc)
+{
+  return (&ticket_cleanup == hc->cc) ? GNUNET_YES : GNUNET_NO;
+}
+
+
+enum TMH_AdmissionStatus
+TMH_ADMISSION_redeem (void **con_cls)
+{
+  struct Ticket *t = *con_cls;
+  enum TMH_AdmissionStatus ret = t->state;
+
+  if (TMH_ADMISSION_QUEUED == ret)
+    return ret;
+  GNUNET_free (t);
+  *con_cls = NULL;
+  return ret;
+}
+
+
+void
+TMH_ADMISSION_release (enum TMH_AdmissionClass ac)
+{
+  struct Ticket *t;
+  int resumed = GNUNET_NO;
+
+  GNUNET_assert (0 < ac_stats.active[ac]);
+  ac_stats.active[ac]--;
+  while ( (NULL != (t = q_head[ac])) &&
+          (GNUNET_YES == can_run (ac)) )
+  {
+    dequeue (t);
+    t->state = TMH_ADMISSION_RUN;
+    ac_stats.active[ac]++;
+    ac_stats.admitted[ac]++;
+    MHD_resume_connection (t->connection);
+    resumed = GNUNET_YES;
+  }
+  if (GNUNET_YES == resumed)
+    TMH_trigger_daemon ();
+}
+
+
+MHD_RESULT
+TMH_ADMISSION_reply_shed (struct MHD_Connection *connection)
+{
+  struct MHD_Response *resp;
+  char ra[24];
+  MHD_RESULT ret;
+
+  resp = TALER_MHD_make_json_pack ("{s:s}",
+                                   "error",
+                                   "service overloaded, try again later");
+  if (NULL == resp)
+    return MHD_NO;
+  GNUNET_snprintf (ra,
+                   sizeof (ra),
+                   "%llu",
+                   (unsigned long long) (retry_after.rel_value_us
+                                         / GNUNET_TIME_UNIT_SECONDS.
+                                         rel_value_us));
+  GNUNET_break (MHD_YES ==
+                MHD_add_response_header (resp,
+                                         MHD_HTTP_HEADER_RETRY_AFTER,
+                                         ra));
+  ret = MHD_queue_response (connection,
+                            MHD_HTTP_SERVICE_UNAVAILABLE,
+                            resp);
+  MHD_destroy_response (resp);
+  return ret;
+}
+
+
+void
+TMH_ADMISSION_get_statistics (struct TMH_AdmissionStatistics *stats)
+{
+  *stats = ac_stats;
+}
+
+
+void
+TMH_ADMISSION_force_resume (void)
+{
+  for (unsigned int i = 0; i<TMH_AC_MAX; i++)
+    while (NULL != q_head[i])
+      shed (q_head[i]);
+}
+
+
+/* end of taler-merchant-httpd_admission.c */
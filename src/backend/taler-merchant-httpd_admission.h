@@ -0,0 +1,175 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_admission.h
+ * @brief limit the number of requests we process concurrently
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_ADMISSION_H
+#define TALER_MERCHANT_HTTPD_ADMISSION_H
+
+#include "taler-merchant-httpd.h"
+
+
+/**
+ * Decision about a request.
+ */
+enum TMH_AdmissionStatus
+{
+
+  /**
+   * Process the request now.
+   */
+  TMH_ADMISSION_RUN,
+
+  /**
+   * The request was queued and its connection suspended; it will
+   * be resumed once it may run (or must be rejected).
+   */
+  TMH_ADMISSION_QUEUED,
+
+  /**
+   * We are overloaded, reject the request
+   * using #TMH_ADMISSION_reply_shed().
+   */
+  TMH_ADMISSION_SHED
+};
+
+
+/**
+ * Statistics about admission control.
+ */
+struct TMH_AdmissionStatistics
+{
+
+  /**
+   * Number of requests currently processed, by class.
+   */
+  unsigned int active[TMH_AC_MAX];
+
+  /**
+   * Number of requests currently waiting, by class.
+   */
+  unsigned int queued[TMH_AC_MAX];
+
+  /**
+   * Number of requests admitted so far, by class.
+   */
+  unsigned long long admitted[TMH_AC_MAX];
+
+  /**
+   * Number of requests rejected so far, by class.
+   */
+  unsigned long long shed[TMH_AC_MAX];
+
+  /**
+   * Largest number of requests that were ever waiting at once.
+   */
+  unsigned int max_queued;
+
+};
+
+
+/**
+ * Load the admission control limits from @a cfg.
+ *
+ * @param cfg configuration to use
+ * @return #GNUNET_OK on success
+ */
+int
+TMH_ADMISSION_init (const struct GNUNET_CONFIGURATION_Handle *cfg);
+
+
+/**
+ * Decide whether a new request for @a rh may be processed.  If the
+ * request is queued, a ticket is stored in @a con_cls; further calls
+ * to the access handler must then be passed to #TMH_ADMISSION_redeem().
+ *
+ * @param connection connection of the request
+ * @param rh handler for the request
+ * @param mi instance the request is for
+ * @param aid async scope of the request
+ * @param[out] con_cls connection closure, set to the ticket if queued
+ * @return admission decision
+ */
+enum TMH_AdmissionStatus
+TMH_ADMISSION_admit (struct MHD_Connection *connection,
+                     struct TMH_RequestHandler *rh,
+                     struct MerchantInstance *mi,
+                     const struct GNUNET_AsyncScopeId *aid,
+                     void **con_cls);
+
+
+/**
+ * Check if @a hc is a ticket created by #TMH_ADMISSION_admit().
+ *
+ * @param hc handler context to check
+ * @return #GNUNET_YES if @a hc is a ticket
+ */
+int
+TMH_ADMISSION_is_ticket (const struct TM_HandlerContext *hc);
+
+
+/**
+ * The connection of a queued request was resumed; find out what
+ * to do with it.  Unless the request is still waiting, the ticket
+ * is freed and @a con_cls set to NULL.  The handler and instance
+ * of the request remain available in the ticket until then.
+ *
+ * @param[in,out] con_cls connection closure containing a ticket
+ * @return #TMH_ADMISSION_RUN if the request may run now
+ */
+enum TMH_AdmissionStatus
+TMH_ADMISSION_redeem (void **con_cls);
+
+
+/**
+ * A request of class @a ac that was admitted is done.
+ *
+ * @param ac class of the request
+ */
+void
+TMH_ADMISSION_release (enum TMH_AdmissionClass ac);
+
+
+/**
+ * Reply to a request that we reject because we are overloaded.
+ *
+ * @param connection connection to reply on
+ * @return MHD result code
+ */
+MHD_RESULT
+TMH_ADMISSION_reply_shed (struct MHD_Connection *connection);
+
+
+/**
+ * Obtain statistics about admission control.
+ *
+ * @param[out] stats set to the current statistics
+ */
+void
+TMH_ADMISSION_get_statistics (struct TMH_AdmissionStatistics *stats);
+
+
+/**
+ * Resume all queued requests so that they are rejected.
+ * Called during shutdown, before stopping MHD.
+ */
+void
+TMH_ADMISSION_force_resume (void);
+
+
+#endif
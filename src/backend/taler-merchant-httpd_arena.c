@@ -0,0 +1,218 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_arena.c
+ * @brief per-request arena allocator
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include "taler-merchant-httpd_arena.h"
+
+
+/**
+ * Alignment of all allocations.
+ */
+#define ARENA_ALIGNMENT 16
+
+/**
+ * Usable size of the first block of an arena.
+ */
+#define ARENA_INITIAL_SIZE 2048
+
+/**
+ * Maximum usable size of blocks we allocate when an arena grows;
+ * larger requests get a block of their own.
+ */
+#define ARENA_MAX_BLOCK_SIZE (64 * 1024)
+
+/**
+ * Round @a n up to a multiple of #ARENA_ALIGNMENT.
+ */
+#define ARENA_ROUND(n) \
+  (((n) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+
+/**
+ * Header of a block of memory of an arena.  The usable memory
+ * follows the header (at offset #ARENA_ROUND of its size).
+ */
+struct ArenaBlock
+{
+  /**
+   * Next (older) block of the arena.
+   */
+  struct ArenaBlock *next;
+
+  /**
+   * Usable size of this block.
+   */
+  size_t size;
+
+  /**
+   * Number of bytes of this block in use.
+   */
+  size_t used;
+};
+
+
+/**
+ * An arena.  The first block is allocated together with
+ * this struct.
+ */
+struct TMH_Arena
+{
+  /**
+   * Block we currently allocate from; all blocks are
+   * reachable from here.
+   */
+  struct ArenaBlock *head;
+
+  /**
+   * Usable size of the next block we allocate.
+   */
+  size_t next_size;
+};
+
+
+/**
+ * Our statistics.
+ */
+static struct TMH_ArenaStatistics arena_stats;
+
+
+/**
+ * Get the usable memory of block @a b.
+ *
+ * @param b a block
+ * @return pointer to the first usable byte of @a b
+ */
+static char *
+block_data (struct ArenaBlock *b)
+{
+  return ((char *) b) + ARENA_ROUND (sizeof (struct ArenaBlock));
+}
+
+
+struct TMH_Arena *
+TMH_arena_create (void)
+{
+  struct TMH_Arena *arena;
+  struct ArenaBlock *first;
+
+  arena = GNUNET_malloc (ARENA_ROUND (sizeof (struct TMH_Arena))
+                         + ARENA_ROUND (sizeof (struct ArenaBlock))
+                         + ARENA_INITIAL_SIZE);
+  first = (struct ArenaBlock *) (((char *) arena)
+                                 + ARENA_ROUND (sizeof (struct TMH_Arena)));
+  first->size = ARENA_INITIAL_SIZE;
+  arena->head = first;
+  arena->next_size = 2 * ARENA_INITIAL_SIZE;
+  arena_stats.arenas++;
+  arena_stats.blocks++;
+  return arena;
+}
+
+
+void *
+TMH_arena_alloc (struct TMH_Arena *arena,
+                 size_t size)
+{
+  struct ArenaBlock *b = arena->head;
+  void *ret;
+
+  GNUNET_assert (size < SIZE_MAX - ARENA_ALIGNMENT);
+  size = ARENA_ROUND (size);
+  arena_stats.allocations++;
+  arena_stats.bytes += size;
+  if (b->size - b->used < size)
+  {
+    size_t bsize = GNUNET_MAX (arena->next_size,
+                               size);
+
+    /* GNUNET_malloc() zeroes the memory for us */
+    b = GNUNET_malloc (ARENA_ROUND (sizeof (struct ArenaBlock)) + bsize);
+    b->size = bsize;
+    arena_stats.blocks++;
+    if (size > arena->next_size)
+    {
+      /* dedicated block, keep allocating from the current one */
+      b->next = arena->head->next;
+      arena->head->next = b;
+      b->used = size;
+      return block_data (b);
+    }
+    b->next = arena->head;
+    arena->head = b;
+    arena->next_size = GNUNET_MIN (2 * arena->next_size,
+                                   ARENA_MAX_BLOCK_SIZE);
+  }
+  ret = block_data (b) + b->used;
+  b->used += size;
+  return ret;
+}
+
+
+char *
+TMH_arena_strdup (struct TMH_Arena *arena,
+                  const char *str)
+{
+  size_t len = strlen (str) + 1;
+  char *ret;
+
+  ret = TMH_arena_alloc (arena,
+                         len);
+  memcpy (ret,
+          str,
+          len);
+  return ret;
+}
+
+
+void
+TMH_arena_destroy (struct TMH_Arena *arena)
+{
+  struct ArenaBlock *b;
+  struct ArenaBlock *first;
+
+  first = (struct ArenaBlock *) (((char *) arena)
+                                 + ARENA_ROUND (sizeof (struct TMH_Arena)));
+  while (NULL != (b = arena->head))
+  {
+    arena->head = b->next;
+    if (first != b)
+      GNUNET_free (b);
+  }
+  GNUNET_free (arena);
+}
+
+
+struct TMH_Arena *
+TMH_handler_arena (struct TM_HandlerContext *hc)
+{
+  if (NULL == hc->arena)
+    hc->arena = TMH_arena_create ();
+  return hc->arena;
+}
+
+
+void
+TMH_arena_get_statistics (struct TMH_ArenaStatistics *stats)
+{
+  *stats = arena_stats;
+}
+
+
+/* end of taler-merchant-httpd_arena.c */
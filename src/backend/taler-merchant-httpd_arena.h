@@ -0,0 +1,148 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_arena.h
+ * @brief per-request arena allocator; memory allocated from an
+ *        arena is released all at once when the request completes
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_ARENA_H
+#define TALER_MERCHANT_HTTPD_ARENA_H
+
+#include "taler-merchant-httpd.h"
+
+
+/**
+ * Statistics about arena use, over all arenas.
+ */
+struct TMH_ArenaStatistics
+{
+
+  /**
+   * Number of arenas created.
+   */
+  unsigned long long arenas;
+
+  /**
+   * Number of allocations served from arenas.
+   */
+  unsigned long long allocations;
+
+  /**
+   * Number of bytes served from arenas.
+   */
+  unsigned long long bytes;
+
+  /**
+   * Number of blocks arenas obtained from malloc(),
+   * including the initial block of each arena.
+   */
+  unsigned long long blocks;
+
+};
+
+
+/**
+ * Create a new arena.
+ *
+ * @return the arena
+ */
+struct TMH_Arena *
+TMH_arena_create (void);
+
+
+/**
+ * Allocate @a size bytes of zeroed memory from @a arena.  The memory
+ * must not be freed individually, it is released by
+ * #TMH_arena_destroy().
+ *
+ * @param arena arena to allocate from
+ * @param size number of bytes to allocate
+ * @return the memory, never NULL
+ */
+void *
+TMH_arena_alloc (struct TMH_Arena *arena,
+                 size_t size);
+
+
+/**
+ * Allocate a struct of type @a type from @a arena.
+ *
+ * @param arena arena to allocate from
+ * @param type type of the struct
+ */
+#define TMH_arena_new(arena, type) \
+  ((type *) TMH_arena_alloc (arena, sizeof (type)))
+
+
+/**
+ * Allocate an array of @a n elements of type @a type from @a arena.
+ *
+ * @param arena arena to allocate from
+ * @param n number of elements
+ * @param type type of the elements
+ */
+#define TMH_arena_new_array(arena, n, type)                      \
+  ({                                                             \
+    GNUNET_assert (SIZE_MAX / sizeof (type) >= (size_t) (n));    \
+    (type *) TMH_arena_alloc (arena, (n) * sizeof (type));       \
+  })
+
+
+/**
+ * Copy string @a str into @a arena.
+ *
+ * @param arena arena to allocate from
+ * @param str string to copy
+ * @return copy of @a str
+ */
+char *
+TMH_arena_strdup (struct TMH_Arena *arena,
+                  const char *str);
+
+
+/**
+ * Release all memory allocated from @a arena.
+ *
+ * @param arena arena to destroy
+ */
+void
+TMH_arena_destroy (struct TMH_Arena *arena);
+
+
+/**
+ * Get the arena of the request with handler context @a hc,
+ * creating it if necessary.  The arena is destroyed after
+ * the request completed and the cleanup function of @a hc
+ * was called.
+ *
+ * @param hc handler context of the request
+ * @return the arena of the request
+ */
+struct TMH_Arena *
+TMH_handler_arena (struct TM_HandlerContext *hc);
+
+
+/**
+ * Obtain statistics about arena use.
+ *
+ * @param[out] stats set to the current statistics
+ */
+void
+TMH_arena_get_statistics (struct TMH_ArenaStatistics *stats);
+
+
+#endif
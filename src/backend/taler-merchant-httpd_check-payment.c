@@ -47,20 +47,21 @@ struct CheckPaymentRequestContext
   struct TM_HandlerContext hc;
 
   /**
-   * Entry in the #resume_timeout_heap for this check payment, if we are
+   * Entry in the #resume_timeout_wheel for this check payment, if we are
    * suspended.
    */
   struct TMH_SuspendedConnection sc;
 
   /**
-   * Which merchant instance is this for?
+   * Suspension while we wait for the database to return the
+   * contract terms.
    */
-  struct MerchantInstance *mi;
+  struct TMH_DbSuspension ds;
 
   /**
-   * URL where the final contract can be found for this payment.
+   * Which merchant instance is this for?
    */
-  char *final_contract_url;
+  struct MerchantInstance *mi;
 
   /**
    * order ID for the payment
@@ -78,20 +79,13 @@ struct CheckPaymentRequestContext
   const char *session_id;
 
   /**
-   * fulfillment URL of the contract (valid as long as
-   * @e contract_terms is valid).
+   * fulfillment URL of the contract (or order), NULL if
+   * not (yet) known.
    */
-  const char *fulfillment_url;
+  char *fulfillment_url;
 
   /**
-   * Contract terms of the payment we are checking. NULL when they
-   * are not (yet) known.
-   */
-  json_t *contract_terms;
-
-  /**
-   * Hash of @e contract_terms, set only once @e contract_terms
-   * is available.
+   * Hash of the contract terms, set only if @e have_info is set.
    */
   struct GNUNET_HashCode h_contract_terms;
 
@@ -113,6 +107,30 @@ struct CheckPaymentRequestContext
    */
   int ret;
 
+  /**
+   * Status of the (asynchronous) contract terms lookup, only
+   * valid if @e have_lookup_result is set.
+   */
+  enum GNUNET_DB_QueryStatus lookup_qs;
+
+  /**
+   * Set to #GNUNET_YES once the contract terms lookup for the
+   * current invocation of the handler completed.
+   */
+  int have_lookup_result;
+
+  /**
+   * Set to #GNUNET_YES if @e h_contract_terms and
+   * @e fulfillment_url of the contract are known.
+   */
+  int have_info;
+
+  /**
+   * Set to #GNUNET_YES if the last lookup of the contract
+   * told us that it is paid.
+   */
+  int paid;
+
 };
 
 
@@ -127,10 +145,98 @@ cprc_cleanup (struct TM_HandlerContext *hc)
   struct CheckPaymentRequestContext *cprc = (struct
                                              CheckPaymentRequestContext *) hc;
 
-  if (NULL != cprc->contract_terms)
-    json_decref (cprc->contract_terms);
-  GNUNET_free_non_null (cprc->final_contract_url);
-  GNUNET_free (cprc);
+  TMH_db_cancel (&cprc->ds);
+  TMH_long_poll_release (&cprc->sc);
+  GNUNET_free_non_null (cprc->fulfillment_url);
+  TMH_long_poll_record_free (cprc);
+}
+
+
+/**
+ * Remember the fulfillment URL of @a ci in @a cprc.
+ *
+ * @param cprc context to update
+ * @param ci information about the order or contract
+ */
+static void
+set_fulfillment_url (struct CheckPaymentRequestContext *cprc,
+                     const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  GNUNET_free_non_null (cprc->fulfillment_url);
+  cprc->fulfillment_url = ('\0' == ci->fulfillment_url[0])
+                          ? NULL
+                          : GNUNET_strdup (ci->fulfillment_url);
+}
+
+
+/**
+ * Function called with the result of looking up the contract
+ * terms.  Stores the result and resumes the handler.
+ *
+ * @param cls a `struct CheckPaymentRequestContext`
+ * @param qs transaction status
+ * @param ci information about the contract, if found
+ */
+static void
+contract_info_cb (void *cls,
+                  enum GNUNET_DB_QueryStatus qs,
+                  const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  struct CheckPaymentRequestContext *cprc = cls;
+
+  GNUNET_assert (GNUNET_YES != cprc->have_info);
+  cprc->lookup_qs = qs;
+  if (NULL != ci)
+  {
+    cprc->h_contract_terms = ci->h_contract_terms;
+    set_fulfillment_url (cprc,
+                         ci);
+    cprc->paid = ci->paid;
+    cprc->have_info = GNUNET_YES;
+  }
+  cprc->have_lookup_result = GNUNET_YES;
+  TMH_db_resume (&cprc->ds);
+}
+
+
+/**
+ * Function called with the result of looking up the order.
+ *
+ * @param cls a `struct CheckPaymentRequestContext`
+ * @param qs transaction status
+ * @param ci information about the order, if found
+ */
+static void
+order_info_cb (void *cls,
+               enum GNUNET_DB_QueryStatus qs,
+               const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  struct CheckPaymentRequestContext *cprc = cls;
+
+  (void) qs;
+  if (NULL != ci)
+    set_fulfillment_url (cprc,
+                         ci);
+}
+
+
+/**
+ * Function called with the result of checking whether the
+ * contract was paid.
+ *
+ * @param cls a `struct CheckPaymentRequestContext`
+ * @param qs transaction status
+ * @param ci information about the contract, if found
+ */
+static void
+paid_info_cb (void *cls,
+              enum GNUNET_DB_QueryStatus qs,
+              const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  struct CheckPaymentRequestContext *cprc = cls;
+
+  (void) qs;
+  cprc->paid = (NULL != ci) ? ci->paid : GNUNET_NO;
 }
 
 
@@ -182,12 +288,24 @@ send_pay_request (struct CheckPaymentRequestContext *cprc)
   int ret;
   char *already_paid_order_id = NULL;
   char *taler_pay_uri;
+  char *final_contract_url = NULL;
+  const char *contract_url;
   struct GNUNET_TIME_Relative remaining;
 
   remaining = GNUNET_TIME_absolute_get_remaining (cprc->sc.long_poll_timeout);
   if (0 != remaining.rel_value_us)
   {
     /* long polling: do not queue a response, suspend connection instead */
+    if ( (GNUNET_YES == TMH_long_poll_compact) ||
+         (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == cprc->lookup_qs) )
+    {
+      /* Drop what we know about the contract (or the order, if the
+         contract terms did not exist yet), we look it up again when
+         woken up. */
+      GNUNET_free_non_null (cprc->fulfillment_url);
+      cprc->fulfillment_url = NULL;
+      cprc->have_info = GNUNET_NO;
+    }
     TMH_compute_pay_key (cprc->order_id,
                          &cprc->mi->pubkey,
                          &cprc->sc.key);
@@ -229,14 +347,26 @@ send_pay_request (struct CheckPaymentRequestContext *cprc)
                                           cprc->order_id,
                                           cprc->session_id,
                                           cprc->mi->id);
+  contract_url = cprc->contract_url;
+  if (NULL == contract_url)
+  {
+    final_contract_url = TALER_url_absolute_mhd (cprc->sc.con,
+                                                 "/public/proposal",
+                                                 "instance", cprc->mi->id,
+                                                 "order_id", cprc->order_id,
+                                                 NULL);
+    GNUNET_assert (NULL != final_contract_url);
+    contract_url = final_contract_url;
+  }
   ret = TALER_MHD_reply_json_pack (cprc->sc.con,
                                    MHD_HTTP_OK,
                                    "{s:s, s:s, s:b, s:s?}",
                                    "taler_pay_uri", taler_pay_uri,
-                                   "contract_url", cprc->final_contract_url,
+                                   "contract_url", contract_url,
                                    "paid", 0,
                                    "already_paid_order_id",
                                    already_paid_order_id);
+  GNUNET_free_non_null (final_contract_url);
   GNUNET_free (taler_pay_uri);
   GNUNET_free_non_null (already_paid_order_id);
   return ret;
@@ -244,9 +374,8 @@ send_pay_request (struct CheckPaymentRequestContext *cprc)
 
 
 /**
- * Parse the "contract_terms" in @a cprc and set the
- * "fulfillment_url" and the "h_contract_terms" in @a cprc
- * accordingly.
+ * Check that the contract (or order) of @a cprc has a fulfillment
+ * URL.
  *
  * On errors, the response is being queued and the status
  * code set in @cprc "ret".
@@ -255,18 +384,9 @@ send_pay_request (struct CheckPaymentRequestContext *cprc)
  * @return #GNUNET_OK on success, #GNUNET_SYSERR on failure
  */
 static int
-parse_contract_terms (struct CheckPaymentRequestContext *cprc)
+check_fulfillment_url (struct CheckPaymentRequestContext *cprc)
 {
-  struct GNUNET_JSON_Specification spec[] = {
-    GNUNET_JSON_spec_string ("fulfillment_url",
-                             &cprc->fulfillment_url),
-    GNUNET_JSON_spec_end ()
-  };
-
-  if (GNUNET_OK !=
-      GNUNET_JSON_parse (cprc->contract_terms,
-                         spec,
-                         NULL, NULL))
+  if (NULL == cprc->fulfillment_url)
   {
     GNUNET_break (0);
     cprc->ret
@@ -276,18 +396,6 @@ parse_contract_terms (struct CheckPaymentRequestContext *cprc)
                                     "Merchant database error (contract terms corrupted)");
     return GNUNET_SYSERR;
   }
-  if (GNUNET_OK !=
-      TALER_JSON_hash (cprc->contract_terms,
-                       &cprc->h_contract_terms))
-  {
-    GNUNET_break (0);
-    cprc->ret
-      = TALER_MHD_reply_with_error (cprc->sc.con,
-                                    MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                    TALER_EC_CHECK_PAYMENT_FAILED_COMPUTE_PROPOSAL_HASH,
-                                    "Failed to hash proposal");
-    return GNUNET_SYSERR;
-  }
   return GNUNET_OK;
 }
 
@@ -304,17 +412,11 @@ check_order_and_request_payment (struct CheckPaymentRequestContext *cprc)
 {
   enum GNUNET_DB_QueryStatus qs;
 
-  if (NULL != cprc->contract_terms)
-  {
-    /* This should never happen. */
-    GNUNET_break (0);
-    json_decref (cprc->contract_terms);
-    cprc->contract_terms = NULL;
-  }
-  qs = db->find_order (db->cls,
-                       &cprc->contract_terms,
-                       cprc->order_id,
-                       &cprc->mi->pubkey);
+  qs = db->find_order_info (db->cls,
+                            cprc->order_id,
+                            &cprc->mi->pubkey,
+                            &order_info_cb,
+                            cprc);
   if (0 > qs)
   {
     /* single, read-only SQL statements should never cause
@@ -336,7 +438,7 @@ check_order_and_request_payment (struct CheckPaymentRequestContext *cprc)
   }
 
   if (GNUNET_OK !=
-      parse_contract_terms (cprc))
+      check_fulfillment_url (cprc))
     return cprc->ret;
   /* Offer was not picked up yet, but we ensured that it exists */
   return send_pay_request (cprc);
@@ -367,16 +469,19 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
   struct CheckPaymentRequestContext *cprc = *connection_cls;
   enum GNUNET_DB_QueryStatus qs;
   MHD_RESULT ret;
+  int fresh_lookup;
 
   if (NULL == cprc)
   {
     const char *long_poll_timeout_s;
 
     /* First time here, parse request and check order is known */
-    cprc = GNUNET_new (struct CheckPaymentRequestContext);
+    cprc = TMH_long_poll_record_alloc (
+      sizeof (struct CheckPaymentRequestContext));
     cprc->hc.cc = &cprc_cleanup;
     cprc->ret = GNUNET_SYSERR;
     cprc->sc.con = connection;
+    cprc->sc.hc = &cprc->hc;
     cprc->mi = mi;
     *connection_cls = cprc;
 
@@ -395,20 +500,6 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
     cprc->contract_url = MHD_lookup_connection_value (connection,
                                                       MHD_GET_ARGUMENT_KIND,
                                                       "contract_url");
-    if (NULL == cprc->contract_url)
-    {
-      cprc->final_contract_url = TALER_url_absolute_mhd (connection,
-                                                         "/public/proposal",
-                                                         "instance", mi->id,
-                                                         "order_id",
-                                                         cprc->order_id,
-                                                         NULL);
-      GNUNET_assert (NULL != cprc->final_contract_url);
-    }
-    else
-    {
-      cprc->final_contract_url = GNUNET_strdup (cprc->contract_url);
-    }
     cprc->session_id = MHD_lookup_connection_value (connection,
                                                     MHD_GET_ARGUMENT_KIND,
                                                     "session_id");
@@ -443,16 +534,38 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
                 GNUNET_STRINGS_absolute_time_to_string (
                   cprc->sc.long_poll_timeout));
   }
-  if (NULL != cprc->contract_terms)
+  if ( (GNUNET_YES != cprc->have_lookup_result) &&
+       (GNUNET_YES != cprc->have_info) )
   {
-    json_decref (cprc->contract_terms);
-    cprc->contract_terms = NULL;
+    struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+    /* fetch what we need to know about the contract (but not the
+       contract terms themselves) without blocking the event loop */
+    ah = db->find_contract_info_async (db->cls,
+                                       cprc->order_id,
+                                       &mi->pubkey,
+                                       &contract_info_cb,
+                                       cprc);
+    if (NULL == ah)
+    {
+      GNUNET_break (0);
+      return TALER_MHD_reply_with_error (connection,
+                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                         TALER_EC_CHECK_PAYMENT_DB_FETCH_CONTRACT_TERMS_ERROR,
+                                         "db error fetching contract terms");
+    }
+    TMH_db_suspend (&cprc->ds,
+                    connection,
+                    ah);
+    return MHD_YES;
   }
+  /* consume result; contract terms never change once they exist, so
+     a long-poll resumption only looks them up if they were missing
+     (or dropped while waiting); the paid status is checked below */
+  fresh_lookup = cprc->have_lookup_result;
+  cprc->have_lookup_result = GNUNET_NO;
+  qs = cprc->lookup_qs;
   db->preflight (db->cls);
-  qs = db->find_contract_terms (db->cls,
-                                &cprc->contract_terms,
-                                cprc->order_id,
-                                &mi->pubkey);
   if (0 > qs)
   {
     /* single, read-only SQL statements should never cause
@@ -471,16 +584,15 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
     /* Check that we're at least aware of the order */
     return check_order_and_request_payment (cprc);
   }
-  GNUNET_assert (NULL != cprc->contract_terms);
+  GNUNET_assert (GNUNET_YES == cprc->have_info);
 
   if (GNUNET_OK !=
-      parse_contract_terms (cprc))
+      check_fulfillment_url (cprc))
     return cprc->ret;
   GNUNET_log (GNUNET_ERROR_TYPE_INFO,
               "Checkig payment status for order `%s' with contract %s\n",
               cprc->order_id,
               GNUNET_h2s (&cprc->h_contract_terms));
-  GNUNET_assert (NULL != cprc->contract_terms);
 
   /* Check if the order has been paid for. */
   if (NULL != cprc->session_id)
@@ -523,12 +635,37 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
   else
   {
     /* Check if paid regardless of session. */
-    json_t *xcontract_terms = NULL;
+    struct TMH_PaymentStatus *ps = cprc->sc.ps;
 
-    qs = db->find_paid_contract_terms_from_hash (db->cls,
-                                                 &xcontract_terms,
-                                                 &cprc->h_contract_terms,
-                                                 &mi->pubkey);
+    if ( (NULL != ps) &&
+         (GNUNET_YES == ps->paid_known) )
+    {
+      /* another request resumed by the same event already checked */
+      qs = (GNUNET_YES == ps->paid)
+           ? GNUNET_DB_STATUS_SUCCESS_ONE_RESULT
+           : GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+    }
+    else
+    {
+      /* the lookup in this invocation already told us, otherwise
+         the contract may have been paid while we were waiting */
+      if (GNUNET_YES != fresh_lookup)
+        qs = db->find_contract_info_from_hash (db->cls,
+                                               &cprc->h_contract_terms,
+                                               &mi->pubkey,
+                                               &paid_info_cb,
+                                               cprc);
+      if (0 < qs)
+        qs = (GNUNET_YES == cprc->paid)
+             ? GNUNET_DB_STATUS_SUCCESS_ONE_RESULT
+             : GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+      if ( (0 <= qs) &&
+           (NULL != ps) )
+      {
+        ps->paid_known = GNUNET_YES;
+        ps->paid = (0 < qs) ? GNUNET_YES : GNUNET_NO;
+      }
+    }
     if (0 > qs)
     {
       /* Always report on hard error as well to enable diagnostics */
@@ -547,20 +684,35 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
       return send_pay_request (cprc);
     }
     GNUNET_break (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs);
-    GNUNET_assert (NULL != xcontract_terms);
-    json_decref (xcontract_terms);
   }
 
   /* Accumulate refunds, if any. */
-  for (unsigned int i = 0; i<MAX_RETRIES; i++)
+  if ( (NULL != cprc->sc.ps) &&
+       (GNUNET_YES == cprc->sc.ps->refunds_known) )
   {
-    qs = db->get_refunds_from_contract_terms_hash (db->cls,
-                                                   &mi->pubkey,
-                                                   &cprc->h_contract_terms,
-                                                   &process_refunds_cb,
-                                                   cprc);
-    if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
-      break;
+    cprc->refunded = cprc->sc.ps->refunded;
+    cprc->refund_amount = cprc->sc.ps->refund_amount;
+    qs = GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+  }
+  else
+  {
+    for (unsigned int i = 0; i<MAX_RETRIES; i++)
+    {
+      qs = db->get_refunds_from_contract_terms_hash (db->cls,
+                                                     &mi->pubkey,
+                                                     &cprc->h_contract_terms,
+                                                     &process_refunds_cb,
+                                                     cprc);
+      if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
+        break;
+    }
+    if ( (0 <= qs) &&
+         (NULL != cprc->sc.ps) )
+    {
+      cprc->sc.ps->refunds_known = GNUNET_YES;
+      cprc->sc.ps->refunded = cprc->refunded;
+      cprc->sc.ps->refund_amount = cprc->refund_amount;
+    }
   }
   if (0 > qs)
   {
@@ -572,20 +724,44 @@ MH_handler_check_payment (struct TMH_RequestHandler *rh,
                                        TALER_EC_PAY_DB_FETCH_TRANSACTION_ERROR,
                                        "Merchant database error");
   }
-  if (cprc->refunded)
-    return TALER_MHD_reply_json_pack (connection,
-                                      MHD_HTTP_OK,
-                                      "{s:O, s:b, s:b, s:o}",
-                                      "contract_terms", cprc->contract_terms,
-                                      "paid", 1,
-                                      "refunded", cprc->refunded,
-                                      "refund_amount",
-                                      TALER_JSON_from_amount (
-                                        &cprc->refund_amount));
-  return TALER_MHD_reply_json_pack (connection,
-                                    MHD_HTTP_OK,
-                                    "{s:O, s:b, s:b }",
-                                    "contract_terms", cprc->contract_terms,
-                                    "paid", 1,
-                                    "refunded", 0);
+  /* Only now that the payment is complete do we need the
+     contract terms themselves */
+  {
+    json_t *contract_terms = NULL;
+
+    qs = db->find_contract_terms_from_hash (db->cls,
+                                            &contract_terms,
+                                            &cprc->h_contract_terms,
+                                            &mi->pubkey);
+    if (0 >= qs)
+    {
+      /* single, read-only SQL statements should never cause
+         serialization problems */
+      GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
+      /* Always report on hard error as well to enable diagnostics */
+      GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
+      return TALER_MHD_reply_with_error (connection,
+                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                         TALER_EC_CHECK_PAYMENT_DB_FETCH_CONTRACT_TERMS_ERROR,
+                                         "db error fetching contract terms");
+    }
+    if (cprc->refunded)
+      ret = TALER_MHD_reply_json_pack (connection,
+                                       MHD_HTTP_OK,
+                                       "{s:o, s:b, s:b, s:o}",
+                                       "contract_terms", contract_terms,
+                                       "paid", 1,
+                                       "refunded", cprc->refunded,
+                                       "refund_amount",
+                                       TALER_JSON_from_amount (
+                                         &cprc->refund_amount));
+    else
+      ret = TALER_MHD_reply_json_pack (connection,
+                                       MHD_HTTP_OK,
+                                       "{s:o, s:b, s:b }",
+                                       "contract_terms", contract_terms,
+                                       "paid", 1,
+                                       "refunded", 0);
+  }
+  return ret;
 }
@@ -24,6 +24,12 @@
 #include <taler/taler_json_lib.h>
 #include "taler-merchant-httpd.h"
 
+/**
+ * How many rows do we fetch from the database at once
+ * when streaming a /history response?
+ */
+#define HISTORY_CHUNK_SIZE 64
+
 
 /**
  * Closure for #pd_cb.
@@ -46,21 +52,18 @@ struct ProcessContractClosure
 
 
 /**
- * Function called with information about a transaction.
+ * Build the /history entry for a contract.
  *
- * @param cls closure of type `struct ProcessContractClosure`
  * @param order_id transaction's order ID.
- * @param row_id serial numer of the transaction in the table,
- * used as index by the frontend to skip previous results.
+ * @param row_id serial numer of the transaction in the table
+ * @param contract_terms the contract terms
+ * @return NULL if @a contract_terms are not well-formed
  */
-static void
-pd_cb (void *cls,
-       const char *order_id,
-       uint64_t row_id,
-       const json_t *contract_terms)
+static json_t *
+make_entry (const char *order_id,
+            uint64_t row_id,
+            const json_t *contract_terms)
 {
-  struct ProcessContractClosure *pcc = cls;
-  json_t *entry;
   json_t *amount;
   json_t *timestamp;
   json_t *instance;
@@ -78,23 +81,49 @@ pd_cb (void *cls,
                          "summary", &summary))
   {
     GNUNET_break (0);
-    pcc->failure = GNUNET_SYSERR;
-    return;
+    return NULL;
   }
 
   /* summary is optional, but we need something, so we use
      the order ID if it is not given. */
   if (NULL == summary)
-    summary = json_string (order_id);
-
-  if (NULL == (entry =
-                 json_pack ("{s:I, s:s, s:O, s:O, s:O, s:O}",
-                            "row_id", row_id,
-                            "order_id", order_id,
-                            "amount", amount,
-                            "timestamp", timestamp,
-                            "instance", instance,
-                            "summary", summary)))
+    return json_pack ("{s:I, s:s, s:O, s:O, s:O, s:s}",
+                      "row_id", row_id,
+                      "order_id", order_id,
+                      "amount", amount,
+                      "timestamp", timestamp,
+                      "instance", instance,
+                      "summary", order_id);
+  return json_pack ("{s:I, s:s, s:O, s:O, s:O, s:O}",
+                    "row_id", row_id,
+                    "order_id", order_id,
+                    "amount", amount,
+                    "timestamp", timestamp,
+                    "instance", instance,
+                    "summary", summary);
+}
+
+
+/**
+ * Function called with information about a transaction.
+ *
+ * @param cls closure of type `struct ProcessContractClosure`
+ * @param order_id transaction's order ID.
+ * @param row_id serial numer of the transaction in the table,
+ * used as index by the frontend to skip previous results.
+ */
+static void
+pd_cb (void *cls,
+       const char *order_id,
+       uint64_t row_id,
+       const json_t *contract_terms)
+{
+  struct ProcessContractClosure *pcc = cls;
+  json_t *entry;
+
+  if (NULL == (entry = make_entry (order_id,
+                                   row_id,
+                                   contract_terms)))
   {
     GNUNET_break (0);
     pcc->failure = GNUNET_SYSERR;
@@ -106,12 +135,431 @@ pd_cb (void *cls,
   {
     GNUNET_break (0);
     pcc->failure = GNUNET_SYSERR;
-    json_decref (entry);
     return;
   }
 }
 
 
+/**
+ * Phases of streaming a /history response.
+ */
+enum StreamPhase
+{
+  /**
+   * Still fetching rows from the database.
+   */
+  SP_ROWS,
+
+  /**
+   * All rows were emitted, we still need to close the JSON.
+   */
+  SP_TRAILER,
+
+  /**
+   * Everything was emitted.
+   */
+  SP_DONE
+};
+
+
+/**
+ * State of a /history response that is streamed to the client.
+ * Rows are fetched from the database in chunks of at most
+ * #HISTORY_CHUNK_SIZE rows, and each chunk is only fetched after
+ * the previous one was handed to MHD, so memory use is bounded by
+ * the chunk size and not by the number of rows requested.
+ */
+struct HistoryStream
+{
+
+  /**
+   * Serialized JSON not yet handed to MHD.
+   */
+  char *buf;
+
+  /**
+   * Number of bytes in @e buf that are valid.
+   */
+  size_t buf_len;
+
+  /**
+   * Offset of the first byte in @e buf not yet handed to MHD.
+   */
+  size_t buf_off;
+
+  /**
+   * Allocated size of @e buf.
+   */
+  size_t buf_size;
+
+  /**
+   * Instance the history is for.
+   */
+  struct TALER_MerchantPublicKeyP merchant_pub;
+
+  /**
+   * Date argument of the request.
+   */
+  struct GNUNET_TIME_Absolute date;
+
+  /**
+   * Only return rows with a serial id above this value.
+   */
+  uint64_t min_row;
+
+  /**
+   * Only return rows with a serial id below this value.
+   */
+  uint64_t max_row;
+
+  /**
+   * Number of rows still to be returned.
+   */
+  uint64_t remaining;
+
+  /**
+   * Number of rows returned in the current chunk.
+   */
+  uint64_t chunk_rows;
+
+  /**
+   * Return rows older than @e date?
+   */
+  int past;
+
+  /**
+   * Return rows in ascending order?
+   */
+  unsigned int ascending;
+
+  /**
+   * Have we emitted an entry yet (do we need a separator)?
+   */
+  int have_entries;
+
+  /**
+   * Set to #GNUNET_SYSERR if a contract was not well-formed.
+   */
+  int failure;
+
+  /**
+   * Where are we?
+   */
+  enum StreamPhase phase;
+};
+
+
+/**
+ * Context for a /history request, used so that the request
+ * keeps its admission control slot until it is completed.
+ */
+struct HistoryContext
+{
+  /**
+   * Must be first for #handle_mhd_completion_callback.
+   */
+  struct TM_HandlerContext hc;
+};
+
+
+/**
+ * Clean up a `struct HistoryContext`.
+ *
+ * @param hc the `struct HistoryContext` to free
+ */
+static void
+history_context_cleanup (struct TM_HandlerContext *hc)
+{
+  GNUNET_free (hc);
+}
+
+
+/**
+ * Append @a len bytes at @a data to the buffer of @a hs.
+ *
+ * @param hs stream to append to
+ * @param data data to append
+ * @param len number of bytes in @a data
+ */
+static void
+stream_append (struct HistoryStream *hs,
+               const char *data,
+               size_t len)
+{
+  if (hs->buf_len + len > hs->buf_size)
+  {
+    size_t nsize = GNUNET_MAX (2 * hs->buf_size,
+                               hs->buf_len + len);
+
+    hs->buf = GNUNET_realloc (hs->buf,
+                              nsize);
+    hs->buf_size = nsize;
+  }
+  memcpy (&hs->buf[hs->buf_len],
+          data,
+          len);
+  hs->buf_len += len;
+}
+
+
+/**
+ * Function called with information about a transaction while
+ * streaming.  Serializes the entry into the buffer of the stream.
+ *
+ * @param cls closure of type `struct HistoryStream`
+ * @param order_id transaction's order ID.
+ * @param row_id serial numer of the transaction in the table
+ * @param contract_terms the contract terms
+ */
+static void
+stream_cb (void *cls,
+           const char *order_id,
+           uint64_t row_id,
+           const json_t *contract_terms)
+{
+  struct HistoryStream *hs = cls;
+  json_t *entry;
+  char *str;
+
+  hs->chunk_rows++;
+  if (GNUNET_YES == hs->ascending)
+    hs->min_row = row_id;
+  else
+    hs->max_row = row_id;
+  if (NULL == (entry = make_entry (order_id,
+                                   row_id,
+                                   contract_terms)))
+  {
+    hs->failure = GNUNET_SYSERR;
+    return;
+  }
+  str = json_dumps (entry,
+                    JSON_COMPACT);
+  json_decref (entry);
+  if (NULL == str)
+  {
+    GNUNET_break (0);
+    hs->failure = GNUNET_SYSERR;
+    return;
+  }
+  if (GNUNET_YES == hs->have_entries)
+    stream_append (hs,
+                   ",",
+                   1);
+  hs->have_entries = GNUNET_YES;
+  stream_append (hs,
+                 str,
+                 strlen (str));
+  free (str);
+}
+
+
+/**
+ * Fetch the next chunk of rows of @a hs into its buffer.
+ *
+ * @param hs stream to advance
+ * @return #GNUNET_OK on success
+ */
+static int
+stream_fetch (struct HistoryStream *hs)
+{
+  enum GNUNET_DB_QueryStatus qs;
+  uint64_t nrows = GNUNET_MIN (hs->remaining,
+                               HISTORY_CHUNK_SIZE);
+
+  hs->chunk_rows = 0;
+  qs = db->find_contract_terms_by_date_and_row_range (db->cls,
+                                                      hs->date,
+                                                      &hs->merchant_pub,
+                                                      hs->min_row,
+                                                      hs->max_row,
+                                                      nrows,
+                                                      hs->past,
+                                                      hs->ascending,
+                                                      &stream_cb,
+                                                      hs);
+  if ( (0 > qs) ||
+       (GNUNET_SYSERR == hs->failure) )
+  {
+    /* single, read-only SQL statements should never cause
+       serialization problems */
+    GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
+    /* Always report on hard error as well to enable diagnostics */
+    GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
+    return GNUNET_SYSERR;
+  }
+  hs->remaining -= hs->chunk_rows;
+  if ( (0 == hs->remaining) ||
+       (hs->chunk_rows < nrows) )
+  {
+    stream_append (hs,
+                   "]}",
+                   2);
+    hs->phase = SP_TRAILER;
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Hand the next part of a streamed /history response to MHD.
+ *
+ * @param cls a `struct HistoryStream`
+ * @param pos position in the response
+ * @param buf where to copy the data
+ * @param max maximum number of bytes to copy to @a buf
+ * @return number of bytes written to @a buf
+ */
+static ssize_t
+stream_reader (void *cls,
+               uint64_t pos,
+               char *buf,
+               size_t max)
+{
+  struct HistoryStream *hs = cls;
+  size_t len;
+
+  (void) pos;
+  while (hs->buf_off == hs->buf_len)
+  {
+    hs->buf_off = 0;
+    hs->buf_len = 0;
+    switch (hs->phase)
+    {
+    case SP_ROWS:
+      if (GNUNET_OK != stream_fetch (hs))
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+      break;
+    case SP_TRAILER:
+      hs->phase = SP_DONE;
+      return MHD_CONTENT_READER_END_OF_STREAM;
+    case SP_DONE:
+      return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+  }
+  len = GNUNET_MIN (max,
+                    hs->buf_len - hs->buf_off);
+  memcpy (buf,
+          &hs->buf[hs->buf_off],
+          len);
+  hs->buf_off += len;
+  return len;
+}
+
+
+/**
+ * Free a `struct HistoryStream`.
+ *
+ * @param cls the `struct HistoryStream`
+ */
+static void
+stream_free (void *cls)
+{
+  struct HistoryStream *hs = cls;
+
+  GNUNET_free_non_null (hs->buf);
+  GNUNET_free (hs);
+}
+
+
+/**
+ * Stream the history of instance @a mi to the client.  The first
+ * chunk is fetched before we reply, so that database errors at
+ * that point still result in a proper error response.
+ *
+ * @param connection the MHD connection to handle
+ * @param[in,out] connection_cls the connection's closure
+ * @param mi merchant backend instance
+ * @param date date argument of the request
+ * @param start start argument of the request
+ * @param delta delta argument of the request
+ * @param ascending ordering requested by the client
+ * @return MHD result code
+ */
+static MHD_RESULT
+stream_history (struct MHD_Connection *connection,
+                void **connection_cls,
+                const struct MerchantInstance *mi,
+                struct GNUNET_TIME_Absolute date,
+                unsigned long long start,
+                long long delta,
+                unsigned int ascending)
+{
+  struct HistoryStream *hs;
+  struct HistoryContext *hctx;
+  struct MHD_Response *resp;
+  MHD_RESULT ret;
+
+  hs = GNUNET_new (struct HistoryStream);
+  hs->merchant_pub = mi->pubkey;
+  hs->date = date;
+  hs->past = (delta < 0) ? GNUNET_YES : GNUNET_NO;
+  hs->ascending = ascending;
+  hs->remaining = llabs (delta);
+  hs->phase = SP_ROWS;
+  /* The original query returns the |delta| rows closest to either
+     end of the range (depending on the ordering), and we page
+     through that range from that end. */
+  if (GNUNET_YES == hs->past)
+  {
+    hs->min_row = 0;
+    hs->max_row = start;
+  }
+  else
+  {
+    hs->min_row = start;
+    hs->max_row = INT64_MAX;
+  }
+  stream_append (hs,
+                 "{\"history\":[",
+                 strlen ("{\"history\":["));
+  if ( (0 == hs->remaining) ||
+       (GNUNET_OK != stream_fetch (hs)) )
+  {
+    if (0 == hs->remaining)
+    {
+      stream_append (hs,
+                     "]}",
+                     2);
+      hs->phase = SP_TRAILER;
+    }
+    else
+    {
+      stream_free (hs);
+      return TALER_MHD_reply_with_error (connection,
+                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                         TALER_EC_HISTORY_DB_FETCH_ERROR,
+                                         "db error to get history");
+    }
+  }
+  resp = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN,
+                                            16 * 1024,
+                                            &stream_reader,
+                                            hs,
+                                            &stream_free);
+  if (NULL == resp)
+  {
+    GNUNET_break (0);
+    stream_free (hs);
+    return MHD_NO;
+  }
+  TALER_MHD_add_global_headers (resp);
+  GNUNET_break (MHD_YES ==
+                MHD_add_response_header (resp,
+                                         MHD_HTTP_HEADER_CONTENT_TYPE,
+                                         "application/json"));
+  ret = MHD_queue_response (connection,
+                            MHD_HTTP_OK,
+                            resp);
+  MHD_destroy_response (resp);
+  /* hold on to our admission slot until the response was sent */
+  hctx = GNUNET_new (struct HistoryContext);
+  hctx->hc.cc = &history_context_cleanup;
+  *connection_cls = hctx;
+  return ret;
+}
+
+
 /**
  * Manage a /history request. Query the db and returns transactions
  * younger than the date given as parameter
@@ -239,10 +687,13 @@ MH_handler_history (struct TMH_RequestHandler *rh,
     if (1 != sscanf (str,
                      "%lld",
                      &delta))
+    {
+      json_decref (response);
       return TALER_MHD_reply_with_error (connection,
                                          MHD_HTTP_BAD_REQUEST,
                                          TALER_EC_PARAMETER_MALFORMED,
                                          "delta");
+    }
   }
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
               "Querying history back to %s, start: %llu, delta: %lld\n",
@@ -250,9 +701,6 @@ MH_handler_history (struct TMH_RequestHandler *rh,
               start,
               delta);
 
-  pcc.response = response;
-  pcc.failure = GNUNET_NO;
-
   str = MHD_lookup_connection_value (connection,
                                      MHD_GET_ARGUMENT_KIND,
                                      "ordering");
@@ -260,36 +708,14 @@ MH_handler_history (struct TMH_RequestHandler *rh,
        (0 == strcmp ("ascending",
                      str)) )
     ascending = GNUNET_YES;
-
-  qs = db->find_contract_terms_by_date_and_range (db->cls,
-                                                  date,
-                                                  &mi->pubkey,
-                                                  start,
-                                                  llabs (delta),
-                                                  (delta < 0) ? GNUNET_YES :
-                                                  GNUNET_NO,
-                                                  ascending,
-                                                  &pd_cb,
-                                                  &pcc);
-  if ( (0 > qs) ||
-       (GNUNET_SYSERR == pcc.failure) )
-  {
-    /* single, read-only SQL statements should never cause
-       serialization problems */
-    GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
-    /* Always report on hard error as well to enable diagnostics */
-    GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
-    json_decref (response);
-    return TALER_MHD_reply_with_error (connection,
-                                       MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                       TALER_EC_HISTORY_DB_FETCH_ERROR,
-                                       "db error to get history");
-  }
-  ret = TALER_MHD_reply_json_pack (connection,
-                                   MHD_HTTP_OK,
-                                   "{ s:o }",
-                                   "history",
-                                   response /* consumes 'response' */);
+  json_decref (response);
+  ret = stream_history (connection,
+                        connection_cls,
+                        mi,
+                        date,
+                        start,
+                        delta,
+                        ascending);
   LOG_INFO ("/history, http code: %d\n",
             MHD_HTTP_OK);
   return ret;
@@ -0,0 +1,819 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_metrics.c
+ * @brief request metrics and the /metrics handler
+ * @author Christian Grothoff
+ *
+ * All metrics are plain counters updated from the scheduler's
+ * (single) thread, so recording needs neither locks nor atomics.
+ */
+#include "platform.h"
+#include <stdarg.h>
+#include <taler/taler_mhd_lib.h>
+#include "taler-merchant-httpd_admission.h"
+#include "taler-merchant-httpd_arena.h"
+#include "taler-merchant-httpd_metrics.h"
+
+
+/**
+ * Number of finite buckets of our latency histograms.
+ */
+#define NUM_BUCKETS 14
+
+/**
+ * Upper bounds of the finite buckets of our latency histograms,
+ * in microseconds.
+ */
+static const uint64_t bucket_bounds[NUM_BUCKETS] = {
+  1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+  1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+
+/**
+ * A latency histogram.
+ */
+struct Histogram
+{
+
+  /**
+   * Number of observations per bucket (not cumulative); the last
+   * bucket counts observations above the largest bound.
+   */
+  unsigned long long buckets[NUM_BUCKETS + 1];
+
+  /**
+   * Sum of all observations, in microseconds.
+   */
+  unsigned long long sum_us;
+
+  /**
+   * Number of observations.
+   */
+  unsigned long long count;
+
+};
+
+
+/**
+ * Metrics about requests for one endpoint and instance.  Each
+ * instance has an array of these in its `metrics`, indexed by
+ * the @e metrics_id of the handler.
+ */
+struct TMH_EndpointMetrics
+{
+
+  /**
+   * Latency of the requests.
+   */
+  struct Histogram latency;
+
+  /**
+   * Number of requests by class of the HTTP status code
+   * (index 0 is used if the status is unknown).
+   */
+  unsigned long long status[6];
+
+};
+
+
+/**
+ * Metrics about requests to the exchange for one operation.
+ */
+struct ExchangeMetrics
+{
+
+  /**
+   * Latency of the requests.
+   */
+  struct Histogram latency;
+
+  /**
+   * Number of requests by class of the HTTP status code
+   * (index 0 is used for network failures).
+   */
+  unsigned long long status[6];
+
+};
+
+
+/**
+ * Buffer we build the reply in.
+ */
+struct MetricsBuffer
+{
+
+  /**
+   * The data.
+   */
+  char *buf;
+
+  /**
+   * Number of bytes used in @e buf.
+   */
+  size_t len;
+
+  /**
+   * Number of bytes allocated for @e buf.
+   */
+  size_t size;
+
+};
+
+
+/**
+ * All handlers we keep metrics for, indexed by their @e metrics_id.
+ */
+static struct TMH_RequestHandler **endpoints;
+
+/**
+ * Which of the #endpoints are public?
+ */
+static int *endpoint_public;
+
+/**
+ * Length of the #endpoints array.
+ */
+static unsigned int num_endpoints;
+
+/**
+ * Metrics about requests to the exchange.
+ */
+static struct ExchangeMetrics exchange_metrics[TMH_METRICS_EX_MAX];
+
+/**
+ * Names of the exchange operations, for the labels.
+ */
+static const char *exchange_op_names[TMH_METRICS_EX_MAX] = {
+  [TMH_METRICS_EX_DEPOSIT] = "deposit",
+  [TMH_METRICS_EX_DEPOSITS_GET] = "deposits_get",
+  [TMH_METRICS_EX_TRANSFERS_GET] = "transfers_get"
+};
+
+/**
+ * Names of the admission control classes, for the labels.
+ */
+static const char *ac_names[TMH_AC_MAX] = {
+  [TMH_AC_PAY] = "pay",
+  [TMH_AC_WALLET] = "wallet",
+  [TMH_AC_POLL] = "poll",
+  [TMH_AC_BACKOFFICE] = "backoffice",
+  [TMH_AC_SCAN] = "scan"
+};
+
+
+/**
+ * Add an observation of @a duration to @a h.
+ *
+ * @param[in,out] h histogram to update
+ * @param duration the observation
+ */
+static void
+histogram_add (struct Histogram *h,
+               struct GNUNET_TIME_Relative duration)
+{
+  unsigned int i;
+
+  for (i = 0; i<NUM_BUCKETS; i++)
+    if (duration.rel_value_us <= bucket_bounds[i])
+      break;
+  h->buckets[i]++;
+  h->sum_us += duration.rel_value_us;
+  h->count++;
+}
+
+
+/**
+ * Register the handlers of @a rhs.
+ *
+ * @param rhs handlers, terminated by a NULL URL
+ * @param is_public #GNUNET_YES if the handlers are public
+ */
+static void
+add_endpoints (struct TMH_RequestHandler *rhs,
+               int is_public)
+{
+  for (unsigned int i = 0; NULL != rhs[i].url; i++)
+  {
+    unsigned int n = num_endpoints;
+
+    rhs[i].metrics_id = num_endpoints;
+    GNUNET_array_append (endpoint_public,
+                         n,
+                         is_public);
+    GNUNET_array_append (endpoints,
+                         num_endpoints,
+                         &rhs[i]);
+  }
+}
+
+
+void
+TMH_METRICS_init (struct TMH_RequestHandler *handlers,
+                  struct TMH_RequestHandler *public_handlers)
+{
+  add_endpoints (handlers,
+                 GNUNET_NO);
+  add_endpoints (public_handlers,
+                 GNUNET_YES);
+}
+
+
+void
+TMH_METRICS_done (void)
+{
+  unsigned int n = num_endpoints;
+
+  GNUNET_array_grow (endpoints,
+                     num_endpoints,
+                     0);
+  GNUNET_array_grow (endpoint_public,
+                     n,
+                     0);
+}
+
+
+/**
+ * Map an HTTP status code to the index of its class.
+ *
+ * @param http_status the status code
+ * @return 1-5 for the classes, 0 if @a http_status is invalid
+ */
+static unsigned int
+status_class (unsigned int http_status)
+{
+  unsigned int sc = http_status / 100;
+
+  return ( (sc >= 1) && (sc <= 5) ) ? sc : 0;
+}
+
+
+void
+TMH_METRICS_record_request (const struct TMH_RequestHandler *rh,
+                            struct MerchantInstance *mi,
+                            struct MHD_Connection *connection,
+                            struct GNUNET_TIME_Absolute start)
+{
+  struct TMH_EndpointMetrics *em;
+  unsigned int http_status = 0;
+
+  if ( (NULL == mi) ||
+       (rh->metrics_id >= num_endpoints) ||
+       (endpoints[rh->metrics_id] != rh) )
+    return; /* not one of our endpoints (404 handler) */
+  if (NULL == mi->metrics)
+    mi->metrics = GNUNET_new_array (num_endpoints,
+                                    struct TMH_EndpointMetrics);
+  em = &mi->metrics[rh->metrics_id];
+#if MHD_VERSION >= 0x00097000
+  {
+    const union MHD_ConnectionInfo *ci;
+
+    ci = MHD_get_connection_info (connection,
+                                  MHD_CONNECTION_INFO_HTTP_STATUS);
+    if (NULL != ci)
+      http_status = ci->http_status;
+  }
+#else
+  (void) connection;
+#endif
+  em->status[status_class (http_status)]++;
+  histogram_add (&em->latency,
+                 GNUNET_TIME_absolute_get_duration (start));
+}
+
+
+void
+TMH_METRICS_record_exchange (enum TMH_METRICS_ExchangeOperation op,
+                             struct GNUNET_TIME_Absolute start,
+                             unsigned int http_status)
+{
+  struct ExchangeMetrics *xm = &exchange_metrics[op];
+
+  xm->status[status_class (http_status)]++;
+  histogram_add (&xm->latency,
+                 GNUNET_TIME_absolute_get_duration (start));
+}
+
+
+void
+TMH_METRICS_free_instance (struct MerchantInstance *mi)
+{
+  GNUNET_free_non_null (mi->metrics);
+  mi->metrics = NULL;
+}
+
+
+/**
+ * Append formatted text to @a mb.
+ *
+ * @param[in,out] mb buffer to append to
+ * @param format format string
+ * @param ... arguments for @a format
+ */
+static void
+mb_printf (struct MetricsBuffer *mb,
+           const char *format,
+           ...)
+{
+  va_list ap;
+  int n;
+
+  while (1)
+  {
+    va_start (ap,
+              format);
+    n = vsnprintf (&mb->buf[mb->len],
+                   mb->size - mb->len,
+                   format,
+                   ap);
+    va_end (ap);
+    GNUNET_assert (n >= 0);
+    if (mb->len + n < mb->size)
+      break;
+    GNUNET_array_grow (mb->buf,
+                       mb->size,
+                       GNUNET_MAX (2 * mb->size,
+                                   mb->len + n + 1));
+  }
+  mb->len += n;
+}
+
+
+/**
+ * Append the metric header ("HELP" and "TYPE" lines) to @a mb.
+ *
+ * @param[in,out] mb buffer to append to
+ * @param name name of the metric
+ * @param type Prometheus type of the metric
+ * @param help description of the metric
+ */
+static void
+mb_header (struct MetricsBuffer *mb,
+           const char *name,
+           const char *type,
+           const char *help)
+{
+  mb_printf (mb,
+             "# HELP %s %s\n# TYPE %s %s\n",
+             name,
+             help,
+             name,
+             type);
+}
+
+
+/**
+ * Append histogram @a h to @a mb.
+ *
+ * @param[in,out] mb buffer to append to
+ * @param name name of the metric
+ * @param labels labels of the series, without braces
+ * @param h the histogram
+ */
+static void
+mb_histogram (struct MetricsBuffer *mb,
+              const char *name,
+              const char *labels,
+              const struct Histogram *h)
+{
+  unsigned long long cumulative = 0;
+
+  for (unsigned int i = 0; i<NUM_BUCKETS; i++)
+  {
+    cumulative += h->buckets[i];
+    mb_printf (mb,
+               "%s_bucket{%s,le=\"%llu.%06llu\"} %llu\n",
+               name,
+               labels,
+               (unsigned long long) (bucket_bounds[i] / 1000000),
+               (unsigned long long) (bucket_bounds[i] % 1000000),
+               cumulative);
+  }
+  mb_printf (mb,
+             "%s_bucket{%s,le=\"+Inf\"} %llu\n"
+             "%s_sum{%s} %llu.%06llu\n"
+             "%s_count{%s} %llu\n",
+             name,
+             labels,
+             h->count,
+             name,
+             labels,
+             h->sum_us / 1000000,
+             h->sum_us % 1000000,
+             name,
+             labels,
+             h->count);
+}
+
+
+/**
+ * Labels of the status classes.
+ */
+static const char *status_labels[6] = {
+  "unknown", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+
+/**
+ * Append the request counters of instance @a value to @a cls.
+ *
+ * @param cls a `struct MetricsBuffer`
+ * @param key unused
+ * @param value a `struct MerchantInstance`
+ * @return #GNUNET_OK (continue to iterate)
+ */
+static int
+add_instance_counters (void *cls,
+                       const struct GNUNET_HashCode *key,
+                       void *value)
+{
+  struct MetricsBuffer *mb = cls;
+  struct MerchantInstance *mi = value;
+
+  (void) key;
+  if (NULL == mi->metrics)
+    return GNUNET_OK;
+  for (unsigned int i = 0; i<num_endpoints; i++)
+  {
+    const struct TMH_EndpointMetrics *em = &mi->metrics[i];
+
+    for (unsigned int j = 0; j<6; j++)
+    {
+      if (0 == em->status[j])
+        continue;
+      mb_printf (mb,
+                 "taler_merchant_requests_total{endpoint=\"%s\",method=\"%s\",public=\"%s\",instance=\"%s\",code=\"%s\"} %llu\n",
+                 endpoints[i]->url,
+                 (NULL != endpoints[i]->method)
+                 ? endpoints[i]->method
+                 : "*",
+                 endpoint_public[i] ? "true" : "false",
+                 mi->id,
+                 status_labels[j],
+                 em->status[j]);
+    }
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Append the request latencies of instance @a value to @a cls.
+ *
+ * @param cls a `struct MetricsBuffer`
+ * @param key unused
+ * @param value a `struct MerchantInstance`
+ * @return #GNUNET_OK (continue to iterate)
+ */
+static int
+add_instance_latencies (void *cls,
+                        const struct GNUNET_HashCode *key,
+                        void *value)
+{
+  struct MetricsBuffer *mb = cls;
+  struct MerchantInstance *mi = value;
+
+  (void) key;
+  if (NULL == mi->metrics)
+    return GNUNET_OK;
+  for (unsigned int i = 0; i<num_endpoints; i++)
+  {
+    const struct TMH_EndpointMetrics *em = &mi->metrics[i];
+    char *labels;
+
+    if (0 == em->latency.count)
+      continue;
+    GNUNET_asprintf (&labels,
+                     "endpoint=\"%s\",method=\"%s\",public=\"%s\",instance=\"%s\"",
+                     endpoints[i]->url,
+                     (NULL != endpoints[i]->method)
+                     ? endpoints[i]->method
+                     : "*",
+                     endpoint_public[i] ? "true" : "false",
+                     mi->id);
+    mb_histogram (mb,
+                  "taler_merchant_request_duration_seconds",
+                  labels,
+                  &em->latency);
+    GNUNET_free (labels);
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Closure for #add_statement.
+ */
+struct StatementContext
+{
+  /**
+   * Buffer to append to.
+   */
+  struct MetricsBuffer *mb;
+
+  /**
+   * Which part of the statistics do we append?  0 for the
+   * totals, 1 for the maxima.
+   */
+  int max;
+};
+
+
+/**
+ * Append the statistics of a prepared statement to @a cls.
+ *
+ * @param cls a `struct StatementContext`
+ * @param name name of the prepared statement
+ * @param calls number of times the statement was executed
+ * @param total total time spent executing the statement
+ * @param max longest execution of the statement
+ */
+static void
+add_statement (void *cls,
+               const char *name,
+               unsigned long long calls,
+               struct GNUNET_TIME_Relative total,
+               struct GNUNET_TIME_Relative max)
+{
+  struct StatementContext *sc = cls;
+
+  if (sc->max)
+  {
+    mb_printf (sc->mb,
+               "taler_merchant_db_statement_max_duration_seconds{statement=\"%s\"} %llu.%06llu\n",
+               name,
+               (unsigned long long) (max.rel_value_us / 1000000),
+               (unsigned long long) (max.rel_value_us % 1000000));
+    return;
+  }
+  mb_printf (sc->mb,
+             "taler_merchant_db_statement_duration_seconds_sum{statement=\"%s\"} %llu.%06llu\n"
+             "taler_merchant_db_statement_duration_seconds_count{statement=\"%s\"} %llu\n",
+             name,
+             (unsigned long long) (total.rel_value_us / 1000000),
+             (unsigned long long) (total.rel_value_us % 1000000),
+             name,
+             calls);
+}
+
+
+/**
+ * Append everything we know to @a mb.
+ *
+ * @param[in,out] mb buffer to append to
+ */
+static void
+build_metrics (struct MetricsBuffer *mb)
+{
+  mb_header (mb,
+             "taler_merchant_requests_total",
+             "counter",
+             "Requests answered, by endpoint, instance and status class.");
+  GNUNET_CONTAINER_multihashmap_iterate (by_id_map,
+                                         &add_instance_counters,
+                                         mb);
+  mb_header (mb,
+             "taler_merchant_request_duration_seconds",
+             "histogram",
+             "Time from receiving a request until it was answered.");
+  GNUNET_CONTAINER_multihashmap_iterate (by_id_map,
+                                         &add_instance_latencies,
+                                         mb);
+
+  mb_header (mb,
+             "taler_merchant_exchange_requests_total",
+             "counter",
+             "Requests to exchanges, by operation and status class.");
+  for (unsigned int i = 0; i<TMH_METRICS_EX_MAX; i++)
+    for (unsigned int j = 0; j<6; j++)
+      if (0 != exchange_metrics[i].status[j])
+        mb_printf (mb,
+                   "taler_merchant_exchange_requests_total{operation=\"%s\",code=\"%s\"} %llu\n",
+                   exchange_op_names[i],
+                   (0 == j) ? "failure" : status_labels[j],
+                   exchange_metrics[i].status[j]);
+  mb_header (mb,
+             "taler_merchant_exchange_request_duration_seconds",
+             "histogram",
+             "Latency of requests to exchanges, by operation.");
+  for (unsigned int i = 0; i<TMH_METRICS_EX_MAX; i++)
+  {
+    char labels[64];
+
+    GNUNET_snprintf (labels,
+                     sizeof (labels),
+                     "operation=\"%s\"",
+                     exchange_op_names[i]);
+    mb_histogram (mb,
+                  "taler_merchant_exchange_request_duration_seconds",
+                  labels,
+                  &exchange_metrics[i].latency);
+  }
+
+  {
+    struct StatementContext sc = {
+      .mb = mb
+    };
+
+    mb_header (mb,
+               "taler_merchant_db_statement_duration_seconds",
+               "summary",
+               "Time spent executing prepared statements.");
+    db->iterate_statement_statistics (db->cls,
+                                      &add_statement,
+                                      &sc);
+    sc.max = 1;
+    mb_header (mb,
+               "taler_merchant_db_statement_max_duration_seconds",
+               "gauge",
+               "Longest execution of prepared statements.");
+    db->iterate_statement_statistics (db->cls,
+                                      &add_statement,
+                                      &sc);
+  }
+  {
+    struct TALER_MERCHANTDB_PoolStatistics ps;
+
+    db->get_pool_statistics (db->cls,
+                             &ps);
+    mb_header (mb,
+               "taler_merchant_db_pool_queries_total",
+               "counter",
+               "Asynchronous database operations started.");
+    mb_printf (mb,
+               "taler_merchant_db_pool_queries_total %llu\n",
+               ps.queries);
+    mb_header (mb,
+               "taler_merchant_db_pool_wait_seconds_total",
+               "counter",
+               "Time asynchronous operations waited for a connection.");
+    mb_printf (mb,
+               "taler_merchant_db_pool_wait_seconds_total %llu.%06llu\n",
+               (unsigned long long) (ps.total_wait.rel_value_us / 1000000),
+               (unsigned long long) (ps.total_wait.rel_value_us % 1000000));
+    mb_header (mb,
+               "taler_merchant_db_pool_queued",
+               "gauge",
+               "Asynchronous operations waiting for a connection.");
+    mb_printf (mb,
+               "taler_merchant_db_pool_queued %u\n",
+               ps.queue_length);
+    mb_header (mb,
+               "taler_merchant_db_pool_busy",
+               "gauge",
+               "Pool connections executing an operation.");
+    mb_printf (mb,
+               "taler_merchant_db_pool_busy %u\n",
+               ps.busy);
+  }
+
+  mb_header (mb,
+             "taler_merchant_long_poll_waiting",
+             "gauge",
+             "Requests long-polling for a payment or refund.");
+  mb_printf (mb,
+             "taler_merchant_long_poll_waiting %u\n",
+             (NULL != payment_trigger_map)
+             ? GNUNET_CONTAINER_multihashmap_size (payment_trigger_map)
+             : 0);
+  {
+    struct TMH_SlabStatistics ss;
+
+    TMH_long_poll_get_statistics (&ss);
+    mb_header (mb,
+               "taler_merchant_long_poll_records",
+               "gauge",
+               "Contexts of long-polling requests in use.");
+    mb_printf (mb,
+               "taler_merchant_long_poll_records %u\n",
+               ss.in_use);
+    mb_header (mb,
+               "taler_merchant_long_poll_record_size_bytes",
+               "gauge",
+               "Size of the context of a long-polling request.");
+    mb_printf (mb,
+               "taler_merchant_long_poll_record_size_bytes %llu\n",
+               (unsigned long long) ss.record_size);
+    mb_header (mb,
+               "taler_merchant_long_poll_memory_bytes",
+               "gauge",
+               "Memory held for the contexts of long-polling requests.");
+    mb_printf (mb,
+               "taler_merchant_long_poll_memory_bytes %llu\n",
+               ss.bytes);
+  }
+
+  {
+    struct TMH_AdmissionStatistics as;
+
+    TMH_ADMISSION_get_statistics (&as);
+    mb_header (mb,
+               "taler_merchant_admission_active",
+               "gauge",
+               "Requests being processed, by admission class.");
+    for (unsigned int i = TMH_AC_NONE + 1; i<TMH_AC_MAX; i++)
+      mb_printf (mb,
+                 "taler_merchant_admission_active{class=\"%s\"} %u\n",
+                 ac_names[i],
+                 as.active[i]);
+    mb_header (mb,
+               "taler_merchant_admission_queued",
+               "gauge",
+               "Requests waiting for admission, by admission class.");
+    for (unsigned int i = TMH_AC_NONE + 1; i<TMH_AC_MAX; i++)
+      mb_printf (mb,
+                 "taler_merchant_admission_queued{class=\"%s\"} %u\n",
+                 ac_names[i],
+                 as.queued[i]);
+    mb_header (mb,
+               "taler_merchant_admission_shed_total",
+               "counter",
+               "Requests rejected because we were overloaded.");
+    for (unsigned int i = TMH_AC_NONE + 1; i<TMH_AC_MAX; i++)
+      mb_printf (mb,
+                 "taler_merchant_admission_shed_total{class=\"%s\"} %llu\n",
+                 ac_names[i],
+                 as.shed[i]);
+  }
+  {
+    struct TMH_ArenaStatistics ars;
+
+    TMH_arena_get_statistics (&ars);
+    mb_header (mb,
+               "taler_merchant_arena_bytes_total",
+               "counter",
+               "Bytes allocated from request arenas.");
+    mb_printf (mb,
+               "taler_merchant_arena_bytes_total %llu\n",
+               ars.bytes);
+    mb_header (mb,
+               "taler_merchant_arena_blocks_total",
+               "counter",
+               "Blocks request arenas obtained from malloc().");
+    mb_printf (mb,
+               "taler_merchant_arena_blocks_total %llu\n",
+               ars.blocks);
+  }
+}
+
+
+MHD_RESULT
+TMH_METRICS_handler (struct TMH_RequestHandler *rh,
+                     struct MHD_Connection *connection,
+                     void **connection_cls,
+                     const char *upload_data,
+                     size_t *upload_data_size,
+                     struct MerchantInstance *mi)
+{
+  struct MetricsBuffer mb = { 0 };
+  struct MHD_Response *resp;
+  MHD_RESULT ret;
+
+  (void) connection_cls;
+  (void) upload_data;
+  (void) upload_data_size;
+  (void) mi;
+  GNUNET_array_grow (mb.buf,
+                     mb.size,
+                     16 * 1024);
+  build_metrics (&mb);
+  resp = MHD_create_response_from_buffer (mb.len,
+                                          mb.buf,
+                                          MHD_RESPMEM_MUST_COPY);
+  GNUNET_array_grow (mb.buf,
+                     mb.size,
+                     0);
+  if (NULL == resp)
+  {
+    GNUNET_break (0);
+    return MHD_NO;
+  }
+  TALER_MHD_add_global_headers (resp);
+  GNUNET_break (MHD_YES ==
+                MHD_add_response_header (resp,
+                                         MHD_HTTP_HEADER_CONTENT_TYPE,
+                                         rh->mime_type));
+  ret = MHD_queue_response (connection,
+                            rh->response_code,
+                            resp);
+  MHD_destroy_response (resp);
+  return ret;
+}
+
+
+/* end of taler-merchant-httpd_metrics.c */
@@ -0,0 +1,137 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_metrics.h
+ * @brief request metrics and the /metrics handler
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_METRICS_H
+#define TALER_MERCHANT_HTTPD_METRICS_H
+
+#include "taler-merchant-httpd.h"
+
+
+/**
+ * Requests to the exchange we keep latency metrics for.
+ */
+enum TMH_METRICS_ExchangeOperation
+{
+
+  /**
+   * /deposit, see #TALER_EXCHANGE_deposit().
+   */
+  TMH_METRICS_EX_DEPOSIT = 0,
+
+  /**
+   * /deposits, see #TALER_EXCHANGE_deposits_get().
+   */
+  TMH_METRICS_EX_DEPOSITS_GET,
+
+  /**
+   * /transfers, see #TALER_EXCHANGE_transfers_get().
+   */
+  TMH_METRICS_EX_TRANSFERS_GET,
+
+  /**
+   * Number of operations, must be last.
+   */
+  TMH_METRICS_EX_MAX
+};
+
+
+/**
+ * Prepare keeping metrics for the requests served by
+ * @a handlers and @a public_handlers.  Assigns the
+ * @e metrics_id of all handlers.
+ *
+ * @param handlers handlers for non-public URLs, terminated by a NULL URL
+ * @param public_handlers handlers for public URLs, terminated by a NULL URL
+ */
+void
+TMH_METRICS_init (struct TMH_RequestHandler *handlers,
+                  struct TMH_RequestHandler *public_handlers);
+
+
+/**
+ * Release all metrics.
+ */
+void
+TMH_METRICS_done (void);
+
+
+/**
+ * A request for @a rh and instance @a mi that started at @a start
+ * was answered on @a connection.
+ *
+ * @param rh handler of the request
+ * @param mi instance of the request
+ * @param connection connection the request was answered on
+ * @param start time when we received the request
+ */
+void
+TMH_METRICS_record_request (const struct TMH_RequestHandler *rh,
+                            struct MerchantInstance *mi,
+                            struct MHD_Connection *connection,
+                            struct GNUNET_TIME_Absolute start);
+
+
+/**
+ * A request to the exchange for @a op that was started at @a start
+ * completed with @a http_status.
+ *
+ * @param op the request
+ * @param start when the request was started
+ * @param http_status HTTP status returned by the exchange, 0 on
+ *        network failure
+ */
+void
+TMH_METRICS_record_exchange (enum TMH_METRICS_ExchangeOperation op,
+                             struct GNUNET_TIME_Absolute start,
+                             unsigned int http_status);
+
+
+/**
+ * Release the metrics we keep for instance @a mi.
+ *
+ * @param mi instance that is going away
+ */
+void
+TMH_METRICS_free_instance (struct MerchantInstance *mi);
+
+
+/**
+ * Handle a request for /metrics by returning our metrics in the
+ * Prometheus text format.  Metrics are kept per process, so with
+ * multiple workers each worker reports its own requests.
+ *
+ * @param rh context of the handler
+ * @param connection the MHD connection to handle
+ * @param[in,out] connection_cls the connection's closure (can be updated)
+ * @param upload_data upload data
+ * @param[in,out] upload_data_size number of bytes (left) in @a upload_data
+ * @param mi merchant backend instance, never NULL
+ * @return MHD result code
+ */
+MHD_RESULT
+TMH_METRICS_handler (struct TMH_RequestHandler *rh,
+                     struct MHD_Connection *connection,
+                     void **connection_cls,
+                     const char *upload_data,
+                     size_t *upload_data_size,
+                     struct MerchantInstance *mi);
+
+
+#endif
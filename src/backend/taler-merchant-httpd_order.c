@@ -593,53 +593,7 @@ proposal_put (struct MHD_Connection *connection,
                                          "db error: could not check for existing order"
                                          " due to repeated soft transaction failure");
     }
-
-    {
-      /* Hard error could be constraint violation,
-         check if order already exists */
-      json_t *contract_terms = NULL;
-
-      db->preflight (db->cls);
-      qs = db->find_order (db->cls,
-                           &contract_terms,
-                           order_id,
-                           &mi->pubkey);
-      if (0 < qs)
-      {
-        /* Yep, indeed uniqueness constraint violation */
-        int rv;
-        char *msg;
-
-        GNUNET_JSON_parse_free (spec);
-        GNUNET_asprintf (&msg,
-                         "order ID `%s' already exists",
-                         order_id);
-        {
-          /* Log plenty of details for the admin */
-          char *js;
-
-          js = json_dumps (contract_terms,
-                           JSON_COMPACT);
-          GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
-                      _ ("Order ID `%s' already exists with proposal `%s'\n"),
-                      order_id,
-                      js);
-          free (js);
-        }
-        json_decref (contract_terms);
-
-        /* contract_terms may be private, only expose
-         * duplicate order_id to the network */
-        rv = TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_BAD_REQUEST, /* or conflict? */
-                                         TALER_EC_PROPOSAL_STORE_DB_ERROR_ALREADY_EXISTS,
-                                         msg);
-        GNUNET_free (msg);
-        return rv;
-      }
-    }
-
-    /* Other hard transaction error (disk full, etc.) */
+    /* Hard transaction error (disk full, etc.) */
     GNUNET_JSON_parse_free (spec);
     return TALER_MHD_reply_with_error
              (connection,
@@ -648,6 +602,29 @@ proposal_put (struct MHD_Connection *connection,
              "db error: could not store this proposal's data into db");
   }
 
+  if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+  {
+    /* An order (or claimed contract) with this ID already exists */
+    int rv;
+    char *msg;
+
+    GNUNET_JSON_parse_free (spec);
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                _ ("Order ID `%s' already exists\n"),
+                order_id);
+    GNUNET_asprintf (&msg,
+                     "order ID `%s' already exists",
+                     order_id);
+    /* contract_terms may be private, only expose
+     * duplicate order_id to the network */
+    rv = TALER_MHD_reply_with_error (connection,
+                                     MHD_HTTP_BAD_REQUEST, /* or conflict? */
+                                     TALER_EC_PROPOSAL_STORE_DB_ERROR_ALREADY_EXISTS,
+                                     msg);
+    GNUNET_free (msg);
+    return rv;
+  }
+
   /* DB transaction succeeded, generate positive response */
   {
     MHD_RESULT ret;
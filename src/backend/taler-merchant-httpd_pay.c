@@ -31,8 +31,10 @@
 #include <taler/taler_json_lib.h>
 #include <taler/taler_exchange_service.h>
 #include "taler-merchant-httpd.h"
+#include "taler-merchant-httpd_arena.h"
 #include "taler-merchant-httpd_auditors.h"
 #include "taler-merchant-httpd_exchanges.h"
+#include "taler-merchant-httpd_metrics.h"
 #include "taler-merchant-httpd_refund.h"
 
 
@@ -69,6 +71,11 @@ struct DepositConfirmation
    */
   struct TALER_EXCHANGE_DepositHandle *dh;
 
+  /**
+   * When did we start the deposit operation @e dh?
+   */
+  struct GNUNET_TIME_Absolute dh_start;
+
   /**
    * URL of the exchange that issued this coin.
    */
@@ -115,6 +122,18 @@ struct DepositConfirmation
    */
   struct TALER_CoinSpendSignatureP coin_sig;
 
+  /**
+   * Public key the exchange signed the deposit confirmation
+   * with, valid if @e exchange_reply is set.
+   */
+  struct TALER_ExchangePublicKeyP exchange_pub;
+
+  /**
+   * Reply of the exchange confirming the deposit, set while the
+   * deposit still has to be stored in our database.
+   */
+  json_t *exchange_reply;
+
   /**
    * Offset of this coin into the `dc` array of all coins in the
    * @e pc.
@@ -603,9 +622,13 @@ pay_context_cleanup (struct TM_HandlerContext *hc)
       GNUNET_CRYPTO_rsa_signature_free (dc->ub_sig.rsa_signature);
       dc->ub_sig.rsa_signature = NULL;
     }
-    GNUNET_free_non_null (dc->exchange_url);
+    if (NULL != dc->exchange_reply)
+    {
+      json_decref (dc->exchange_reply);
+      dc->exchange_reply = NULL;
+    }
   }
-  GNUNET_free_non_null (pc->dc);
+  /* pc->dc and the strings are released with the arena of the request */
   if (NULL != pc->fo)
   {
     TMH_EXCHANGES_find_exchange_cancel (pc->fo);
@@ -621,9 +644,6 @@ pay_context_cleanup (struct TM_HandlerContext *hc)
     json_decref (pc->contract_terms);
     pc->contract_terms = NULL;
   }
-  GNUNET_free_non_null (pc->order_id);
-  GNUNET_free_non_null (pc->session_id);
-  GNUNET_free_non_null (pc->fulfillment_url);
   GNUNET_CONTAINER_DLL_remove (pc_head,
                                pc_tail,
                                pc);
@@ -632,23 +652,24 @@ pay_context_cleanup (struct TM_HandlerContext *hc)
 
 
 /**
- * Check whether the amount paid is sufficient to cover
- * the contract.
+ * Compute the amount the coins of @a pc contribute and the amount
+ * needed to cover the contract (considering the fees).
  *
  * @param pc payment context to check
- * @return #GNUNET_OK if the payment is sufficient, #GNUNET_SYSERR if it is
- *         insufficient
+ * @param[out] acc_amount set to the sum of the contributions of the coins
+ * @param[out] total_needed set to the amount needed for the contract
+ * @return #GNUNET_OK on success, #GNUNET_SYSERR if the fees are
+ *         unacceptable (and we resumed @a pc with an error)
  */
 static int
-check_payment_sufficient (struct PayContext *pc)
+compute_total_needed (struct PayContext *pc,
+                      struct TALER_Amount *acc_amount,
+                      struct TALER_Amount *total_needed)
 {
   struct TALER_Amount acc_fee;
-  struct TALER_Amount acc_amount;
-  struct TALER_Amount final_amount;
   struct TALER_Amount wire_fee_delta;
   struct TALER_Amount wire_fee_customer_contribution;
   struct TALER_Amount total_wire_fee;
-  struct TALER_Amount total_needed;
 
   if (0 == pc->coins_cnt)
   {
@@ -662,7 +683,7 @@ check_payment_sufficient (struct PayContext *pc)
 
   acc_fee = pc->dc[0].deposit_fee;
   total_wire_fee = pc->dc[0].wire_fee;
-  acc_amount = pc->dc[0].amount_with_fee;
+  *acc_amount = pc->dc[0].amount_with_fee;
 
   /**
    * This loops calculates what are the deposit fee / total
@@ -678,9 +699,9 @@ check_payment_sufficient (struct PayContext *pc)
                             &dc->deposit_fee,
                             &acc_fee)) ||
          (0 >
-          TALER_amount_add (&acc_amount,
+          TALER_amount_add (acc_amount,
                             &dc->amount_with_fee,
-                            &acc_amount)) )
+                            acc_amount)) )
     {
       GNUNET_break (0);
       /* Overflow in these amounts? Very strange. */
@@ -743,7 +764,7 @@ check_payment_sufficient (struct PayContext *pc)
 
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
               "Amount received from wallet: %s\n",
-              TALER_amount2s (&acc_amount));
+              TALER_amount2s (acc_amount));
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
               "Deposit fee for all coins: %s\n",
               TALER_amount2s (&acc_fee));
@@ -756,9 +777,6 @@ check_payment_sufficient (struct PayContext *pc)
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
               "Deposit fee limit for merchant: %s\n",
               TALER_amount2s (&pc->max_fee));
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Total refunded amount: %s\n",
-              TALER_amount2s (&pc->total_refunded));
 
   /* Now compare exchange wire fee compared to
    * what we are willing to pay */
@@ -826,7 +844,7 @@ check_payment_sufficient (struct PayContext *pc)
                                           &pc->max_fee));
     /* add that to the total */
     if (0 >
-        TALER_amount_add (&total_needed,
+        TALER_amount_add (total_needed,
                           &excess_fee,
                           &pc->amount))
     {
@@ -842,8 +860,28 @@ check_payment_sufficient (struct PayContext *pc)
   {
     /* Fees are fully covered by the merchant, all we require
        is that the total payment is not below the contract's amount */
-    total_needed = pc->amount;
+    *total_needed = pc->amount;
   }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Check whether the amount paid is still sufficient to cover
+ * the contract after deducting the refunds in @a pc.
+ *
+ * @param pc payment context to check
+ * @param acc_amount sum of the contributions of the coins
+ * @param total_needed amount needed for the contract
+ * @return #GNUNET_OK if the payment is sufficient, #GNUNET_SYSERR if it is
+ *         insufficient (and we resumed @a pc with an error)
+ */
+static int
+check_refunds_sufficient (struct PayContext *pc,
+                          const struct TALER_Amount *acc_amount,
+                          const struct TALER_Amount *total_needed)
+{
+  struct TALER_Amount final_amount;
 
   /* Do not count refunds towards the payment */
   GNUNET_log (GNUNET_ERROR_TYPE_INFO,
@@ -851,7 +889,7 @@ check_payment_sufficient (struct PayContext *pc)
               TALER_amount2s (&pc->total_refunded));
   if (0 >
       TALER_amount_subtract (&final_amount,
-                             &acc_amount,
+                             acc_amount,
                              &pc->total_refunded))
   {
     GNUNET_break (0);
@@ -863,18 +901,18 @@ check_payment_sufficient (struct PayContext *pc)
   }
 
   if (-1 == TALER_amount_cmp (&final_amount,
-                              &total_needed))
+                              total_needed))
   {
     /* acc_amount < total_needed */
-    if (-1 < TALER_amount_cmp (&acc_amount,
-                               &total_needed))
+    if (-1 < TALER_amount_cmp (acc_amount,
+                               total_needed))
     {
       resume_pay_with_error (pc,
                              MHD_HTTP_PAYMENT_REQUIRED,
                              TALER_EC_PAY_REFUNDED,
                              "contract not paid up due to refunds");
     }
-    else if (-1 < TALER_amount_cmp (&acc_amount,
+    else if (-1 < TALER_amount_cmp (acc_amount,
                                     &pc->amount))
     {
       GNUNET_break_op (0);
@@ -894,9 +932,32 @@ check_payment_sufficient (struct PayContext *pc)
     }
     return GNUNET_SYSERR;
   }
+  return GNUNET_OK;
+}
 
 
-  return GNUNET_OK;
+/**
+ * Check whether the amount paid is sufficient to cover
+ * the contract.
+ *
+ * @param pc payment context to check
+ * @return #GNUNET_OK if the payment is sufficient, #GNUNET_SYSERR if it is
+ *         insufficient
+ */
+static int
+check_payment_sufficient (struct PayContext *pc)
+{
+  struct TALER_Amount acc_amount;
+  struct TALER_Amount total_needed;
+
+  if (GNUNET_OK !=
+      compute_total_needed (pc,
+                            &acc_amount,
+                            &total_needed))
+    return GNUNET_SYSERR;
+  return check_refunds_sufficient (pc,
+                                   &acc_amount,
+                                   &total_needed);
 }
 
 
@@ -921,6 +982,62 @@ static void
 begin_transaction (struct PayContext *pc);
 
 
+/**
+ * Store all deposits of @a pc that the exchange confirmed, but that
+ * are not yet in our database, in one batch.
+ *
+ * @param pc payment context
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+store_confirmed_deposits (struct PayContext *pc)
+{
+  struct TALER_MERCHANTDB_Batch *batch;
+  enum GNUNET_DB_QueryStatus qs;
+
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Storing successful payment for h_contract_terms `%s' and merchant `%s'\n",
+              GNUNET_h2s (&pc->h_contract_terms),
+              TALER_B2S (&pc->mi->pubkey));
+  batch = db->batch_start (db->cls);
+  for (unsigned int i = 0; i<pc->coins_cnt; i++)
+  {
+    struct DepositConfirmation *dc = &pc->dc[i];
+
+    if (NULL == dc->exchange_reply)
+      continue;
+    db->batch_store_deposit (db->cls,
+                             batch,
+                             &pc->h_contract_terms,
+                             &pc->mi->pubkey,
+                             &dc->coin_pub,
+                             dc->exchange_url,
+                             &dc->amount_with_fee,
+                             &dc->deposit_fee,
+                             &dc->refund_fee,
+                             &dc->wire_fee,
+                             &dc->exchange_pub,
+                             dc->exchange_reply);
+  }
+  qs = db->batch_commit_TR (db->cls,
+                            batch);
+  if (0 > qs)
+    return qs;
+  for (unsigned int i = 0; i<pc->coins_cnt; i++)
+  {
+    struct DepositConfirmation *dc = &pc->dc[i];
+
+    if (NULL == dc->exchange_reply)
+      continue;
+    json_decref (dc->exchange_reply);
+    dc->exchange_reply = NULL;
+    dc->found_in_db = GNUNET_YES;
+    pc->pending--;
+  }
+  return qs;
+}
+
+
 /**
  * Callback to handle a deposit permission's response.
  *
@@ -944,6 +1061,9 @@ deposit_cb (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   dc->dh = NULL;
+  TMH_METRICS_record_exchange (TMH_METRICS_EX_DEPOSIT,
+                               dc->dh_start,
+                               hr->http_status);
   GNUNET_assert (GNUNET_YES == pc->suspended);
   pc->pending_at_ce--;
   if (MHD_HTTP_OK != hr->http_status)
@@ -954,6 +1074,11 @@ deposit_cb (void *cls,
                 (int) hr->ec);
     /* Transaction failed; stop all other ongoing deposits */
     abort_deposit (pc);
+    /* but remember those the exchange already confirmed */
+    if (0 > store_confirmed_deposits (pc))
+      GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                  "Failed to store confirmed deposits for h_contract_terms `%s'\n",
+                  GNUNET_h2s (&pc->h_contract_terms));
 
     if (5 == hr->http_status / 100)
     {
@@ -1028,29 +1153,17 @@ deposit_cb (void *cls,
     }
     return;
   }
-  /* store result to DB */
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Storing successful payment for h_contract_terms `%s' and merchant `%s'\n",
-              GNUNET_h2s (&pc->h_contract_terms),
-              TALER_B2S (&pc->mi->pubkey));
+  /* remember the confirmation, and store the confirmations of all
+     coins of the exchange together once they are all in */
+  dc->exchange_pub = *sign_key;
+  dc->exchange_reply = json_incref ((json_t *) hr->reply);
+  if (0 != pc->pending_at_ce)
+    return; /* still more to do with current exchange */
   /* NOTE: not run in any transaction block, simply as a
      transaction by itself! */
-  db->preflight (db->cls);
-  qs = db->store_deposit (db->cls,
-                          &pc->h_contract_terms,
-                          &pc->mi->pubkey,
-                          &dc->coin_pub,
-                          dc->exchange_url,
-                          &dc->amount_with_fee,
-                          &dc->deposit_fee,
-                          &dc->refund_fee,
-                          &dc->wire_fee,
-                          sign_key,
-                          hr->reply);
+  qs = store_confirmed_deposits (pc);
   if (0 > qs)
   {
-    /* Special report if retries insufficient */
-    abort_deposit (pc);
     if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
     {
       begin_transaction (pc);
@@ -1065,11 +1178,6 @@ deposit_cb (void *cls,
                            "Merchant database error");
     return;
   }
-  dc->found_in_db = GNUNET_YES;
-  pc->pending--;
-
-  if (0 != pc->pending_at_ce)
-    return; /* still more to do with current exchange */
   find_next_exchange (pc);
 }
 
@@ -1218,6 +1326,7 @@ process_pay_with_exchange (void *cls,
                 (unsigned long long) pc->wire_transfer_deadline.abs_value_us,
                 (unsigned long long) pc->refund_deadline.abs_value_us);
     db->preflight (db->cls);
+    dc->dh_start = GNUNET_TIME_absolute_get ();
     dc->dh = TALER_EXCHANGE_deposit (mh,
                                      &dc->amount_with_fee,
                                      pc->wire_transfer_deadline,
@@ -1467,15 +1576,18 @@ parse_pay (struct MHD_Connection *connection,
     session_id = json_string_value (json_object_get (root,
                                                      "session_id"));
     if (NULL != session_id)
-      pc->session_id = GNUNET_strdup (session_id);
+      pc->session_id = TMH_arena_strdup (TMH_handler_arena (&pc->hc),
+                                         session_id);
   }
   GNUNET_assert (NULL == pc->order_id);
-  pc->order_id = GNUNET_strdup (order_id);
+  pc->order_id = TMH_arena_strdup (TMH_handler_arena (&pc->hc),
+                                   order_id);
   GNUNET_assert (NULL == pc->contract_terms);
-  qs = db->find_contract_terms (db->cls,
-                                &pc->contract_terms,
-                                order_id,
-                                &merchant_pub);
+  qs = db->find_contract_terms_with_hash (db->cls,
+                                          &pc->contract_terms,
+                                          &pc->h_contract_terms,
+                                          order_id,
+                                          &merchant_pub);
   if (0 > qs)
   {
     GNUNET_JSON_parse_free (spec);
@@ -1506,21 +1618,6 @@ parse_pay (struct MHD_Connection *connection,
       : GNUNET_SYSERR;
   }
 
-  if (GNUNET_OK !=
-      TALER_JSON_hash (pc->contract_terms,
-                       &pc->h_contract_terms))
-  {
-    GNUNET_break (0);
-    GNUNET_JSON_parse_free (spec);
-    return
-      (MHD_YES ==
-       TALER_MHD_reply_with_error (connection,
-                                   MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                   TALER_EC_PAY_FAILED_COMPUTE_PROPOSAL_HASH,
-                                   "Failed to hash proposal"))
-      ? GNUNET_NO
-      : GNUNET_SYSERR;
-  }
   GNUNET_log (GNUNET_ERROR_TYPE_INFO,
               "Handling /pay for order `%s' with contract hash `%s'\n",
               order_id,
@@ -1577,7 +1674,8 @@ parse_pay (struct MHD_Connection *connection,
       return res;
     }
 
-    pc->fulfillment_url = GNUNET_strdup (fulfillment_url);
+    pc->fulfillment_url = TMH_arena_strdup (TMH_handler_arena (&pc->hc),
+                                            fulfillment_url);
     if (pc->wire_transfer_deadline.abs_value_us <
         pc->refund_deadline.abs_value_us)
     {
@@ -1691,8 +1789,9 @@ parse_pay (struct MHD_Connection *connection,
                                        "coins");
   }
   /* note: 1 coin = 1 deposit confirmation expected */
-  pc->dc = GNUNET_new_array (pc->coins_cnt,
-                             struct DepositConfirmation);
+  pc->dc = TMH_arena_new_array (TMH_handler_arena (&pc->hc),
+                                pc->coins_cnt,
+                                struct DepositConfirmation);
 
   /* This loop populates the array 'dc' in 'pc' */
   {
@@ -1727,7 +1826,8 @@ parse_pay (struct MHD_Connection *connection,
         GNUNET_break_op (0);
         return res;
       }
-      dc->exchange_url = GNUNET_strdup (exchange_url);
+      dc->exchange_url = TMH_arena_strdup (TMH_handler_arena (&pc->hc),
+                                           exchange_url);
       dc->index = coins_index;
       dc->pc = pc;
     }
@@ -1782,6 +1882,91 @@ check_coin_refunded (void *cls,
 }
 
 
+/**
+ * Conclude the payment once all coins of @a pc are in the
+ * database (and thus their fees known to us): we compute the
+ * amount needed here, and let the database check the refunds,
+ * mark the contract as paid and store the session information
+ * in a single round trip.
+ *
+ * @param pc payment context to conclude
+ * @return #GNUNET_OK if @a pc was resumed with a response,
+ *         #GNUNET_NO to fall back to the full transaction
+ */
+static int
+conclude_payment (struct PayContext *pc)
+{
+  struct TALER_Amount acc_amount;
+  struct TALER_Amount total_needed;
+  struct TALER_CoinSpendPublicKeyP *coin_pubs;
+  enum TALER_MERCHANTDB_PayCommitStatus pcs;
+  enum GNUNET_DB_QueryStatus qs;
+
+  if (GNUNET_OK !=
+      compute_total_needed (pc,
+                            &acc_amount,
+                            &total_needed))
+    return GNUNET_OK;
+  coin_pubs = GNUNET_new_array (pc->coins_cnt,
+                                struct TALER_CoinSpendPublicKeyP);
+  for (unsigned int i = 0; i<pc->coins_cnt; i++)
+    coin_pubs[i] = pc->dc[i].coin_pub;
+  db->preflight (db->cls);
+  qs = db->pay_commit (db->cls,
+                       &pc->h_contract_terms,
+                       &pc->mi->pubkey,
+                       pc->order_id,
+                       pc->session_id,
+                       pc->fulfillment_url,
+                       pc->coins_cnt,
+                       coin_pubs,
+                       &acc_amount,
+                       &total_needed,
+                       &pcs,
+                       &pc->total_refunded);
+  GNUNET_free (coin_pubs);
+  if (GNUNET_DB_STATUS_HARD_ERROR == qs)
+  {
+    GNUNET_break (0);
+    resume_pay_with_error (pc,
+                           MHD_HTTP_INTERNAL_SERVER_ERROR,
+                           TALER_EC_PAY_DB_STORE_PAYMENTS_ERROR,
+                           "Merchant database error: could not mark proposal as 'paid'");
+    return GNUNET_OK;
+  }
+  if (0 >= qs)
+    return GNUNET_NO; /* soft error, retry the slow way */
+  switch (pcs)
+  {
+  case TALER_MERCHANTDB_PCS_PAID:
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Contract `%s' was fully paid\n",
+                GNUNET_h2s (&pc->h_contract_terms));
+    TMH_long_poll_resume (pc->order_id,
+                          &pc->mi->pubkey,
+                          NULL);
+    generate_success_response (pc);
+    return GNUNET_OK;
+  case TALER_MERCHANTDB_PCS_REFUNDED:
+    if (GNUNET_OK !=
+        check_refunds_sufficient (pc,
+                                  &acc_amount,
+                                  &total_needed))
+      return GNUNET_OK;
+    /* database and we disagree, do it the slow way */
+    GNUNET_break (0);
+    return GNUNET_NO;
+  case TALER_MERCHANTDB_PCS_UNKNOWN_COINS:
+    /* should be impossible as we stored them, but the slow
+       way will sort it out */
+    GNUNET_break (0);
+    return GNUNET_NO;
+  }
+  GNUNET_break (0);
+  return GNUNET_NO;
+}
+
+
 /**
  * Begin of the DB transaction.  If required (from
  * soft/serialization errors), the transaction can be
@@ -1806,6 +1991,12 @@ begin_transaction (struct PayContext *pc)
   }
   GNUNET_assert (GNUNET_YES == pc->suspended);
 
+  /* All coins are in the database: one round trip suffices */
+  if ( (PC_MODE_PAY == pc->mode) &&
+       (0 == pc->pending) &&
+       (GNUNET_OK == conclude_payment (pc)) )
+    return;
+
   /* Init. some price accumulators.  */
   GNUNET_break (GNUNET_OK ==
                 TALER_amount_get_zero (pc->amount.currency,
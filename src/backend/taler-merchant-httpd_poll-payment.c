@@ -47,20 +47,21 @@ struct PollPaymentRequestContext
   struct TM_HandlerContext hc;
 
   /**
-   * Entry in the #resume_timeout_heap for this check payment, if we are
+   * Entry in the #resume_timeout_wheel for this check payment, if we are
    * suspended.
    */
   struct TMH_SuspendedConnection sc;
 
   /**
-   * Which merchant instance is this for?
+   * Suspension while we wait for the database to return the
+   * contract terms.
    */
-  struct MerchantInstance *mi;
+  struct TMH_DbSuspension ds;
 
   /**
-   * URL where the final contract can be found for this payment.
+   * Which merchant instance is this for?
    */
-  char *final_contract_url;
+  struct MerchantInstance *mi;
 
   /**
    * order ID for the payment
@@ -73,10 +74,9 @@ struct PollPaymentRequestContext
   const char *contract_url;
 
   /**
-   * fulfillment URL of the contract (valid as long as
-   * @e contract_terms is valid).
+   * fulfillment URL of the contract, NULL if not (yet) known.
    */
-  const char *fulfillment_url;
+  char *fulfillment_url;
 
   /**
    * session of the client
@@ -84,14 +84,7 @@ struct PollPaymentRequestContext
   const char *session_id;
 
   /**
-   * Contract terms of the payment we are checking. NULL when they
-   * are not (yet) known.
-   */
-  json_t *contract_terms;
-
-  /**
-   * Hash of @e contract_terms, set only once @e contract_terms
-   * is available.
+   * Hash of the contract terms, as given by the client.
    */
   struct GNUNET_HashCode h_contract_terms;
 
@@ -125,6 +118,29 @@ struct PollPaymentRequestContext
    */
   int ret;
 
+  /**
+   * Status of the (asynchronous) contract terms lookup.
+   */
+  enum GNUNET_DB_QueryStatus lookup_qs;
+
+  /**
+   * Set to #GNUNET_YES once we checked the result of the contract
+   * terms lookup.
+   */
+  int contract_checked;
+
+  /**
+   * Set to #GNUNET_YES if we dropped the fulfillment URL while
+   * long-polling and need to look it up again.
+   */
+  int refetch_contract;
+
+  /**
+   * Set to #GNUNET_YES if the last lookup of the contract
+   * told us that it is paid.
+   */
+  int paid;
+
 };
 
 
@@ -139,10 +155,74 @@ pprc_cleanup (struct TM_HandlerContext *hc)
   struct PollPaymentRequestContext *pprc
     = (struct PollPaymentRequestContext *) hc;
 
-  if (NULL != pprc->contract_terms)
-    json_decref (pprc->contract_terms);
-  GNUNET_free_non_null (pprc->final_contract_url);
-  GNUNET_free (pprc);
+  TMH_db_cancel (&pprc->ds);
+  TMH_long_poll_release (&pprc->sc);
+  GNUNET_free_non_null (pprc->fulfillment_url);
+  TMH_long_poll_record_free (pprc);
+}
+
+
+/**
+ * Remember what we need to know about the contract in @a pprc.
+ *
+ * @param pprc context to update
+ * @param ci information about the contract, NULL if not found
+ */
+static void
+set_contract_info (struct PollPaymentRequestContext *pprc,
+                   const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  GNUNET_free_non_null (pprc->fulfillment_url);
+  pprc->fulfillment_url = NULL;
+  pprc->paid = GNUNET_NO;
+  if (NULL == ci)
+    return;
+  if ('\0' != ci->fulfillment_url[0])
+    pprc->fulfillment_url = GNUNET_strdup (ci->fulfillment_url);
+  pprc->paid = ci->paid;
+}
+
+
+/**
+ * Function called with the result of looking up the contract
+ * terms.  Stores the result and resumes the handler.
+ *
+ * @param cls a `struct PollPaymentRequestContext`
+ * @param qs transaction status
+ * @param ci information about the contract, if found
+ */
+static void
+contract_info_cb (void *cls,
+                  enum GNUNET_DB_QueryStatus qs,
+                  const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  struct PollPaymentRequestContext *pprc = cls;
+
+  pprc->lookup_qs = qs;
+  set_contract_info (pprc,
+                     ci);
+  TMH_db_resume (&pprc->ds);
+}
+
+
+/**
+ * Function called with the result of checking whether the
+ * contract was paid.
+ *
+ * @param cls a `struct PollPaymentRequestContext`
+ * @param qs transaction status
+ * @param ci information about the contract, if found
+ */
+static void
+paid_info_cb (void *cls,
+              enum GNUNET_DB_QueryStatus qs,
+              const struct TALER_MERCHANTDB_ContractInfo *ci)
+{
+  struct PollPaymentRequestContext *pprc = cls;
+
+  (void) qs;
+  set_contract_info (pprc,
+                     ci);
 }
 
 
@@ -190,6 +270,15 @@ process_refunds_cb (void *cls,
 static void
 suspend_pprc (struct PollPaymentRequestContext *pprc)
 {
+  if ( (GNUNET_YES == TMH_long_poll_compact) &&
+       (NULL != pprc->fulfillment_url) )
+  {
+    /* the fulfillment URL is only needed after we are woken up
+       if we have a session */
+    GNUNET_free (pprc->fulfillment_url);
+    pprc->fulfillment_url = NULL;
+    pprc->refetch_contract = (NULL != pprc->session_id);
+  }
   TMH_compute_pay_key (pprc->order_id,
                        &pprc->mi->pubkey,
                        &pprc->sc.key);
@@ -215,6 +304,8 @@ send_pay_request (struct PollPaymentRequestContext *pprc)
   MHD_RESULT ret;
   char *already_paid_order_id = NULL;
   char *taler_pay_uri;
+  char *final_contract_url = NULL;
+  const char *contract_url;
   struct GNUNET_TIME_Relative remaining;
 
   remaining = GNUNET_TIME_absolute_get_remaining (pprc->sc.long_poll_timeout);
@@ -257,20 +348,68 @@ send_pay_request (struct PollPaymentRequestContext *pprc)
                                           pprc->order_id,
                                           pprc->session_id,
                                           pprc->mi->id);
+  contract_url = pprc->contract_url;
+  if (NULL == contract_url)
+  {
+    final_contract_url = TALER_url_absolute_mhd (pprc->sc.con,
+                                                 "/public/proposal",
+                                                 "instance", pprc->mi->id,
+                                                 "order_id", pprc->order_id,
+                                                 NULL);
+    GNUNET_assert (NULL != final_contract_url);
+    contract_url = final_contract_url;
+  }
   ret = TALER_MHD_reply_json_pack (pprc->sc.con,
                                    MHD_HTTP_OK,
                                    "{s:s, s:s, s:b, s:s?}",
                                    "taler_pay_uri", taler_pay_uri,
-                                   "contract_url", pprc->final_contract_url,
+                                   "contract_url", contract_url,
                                    "paid", 0,
                                    "already_paid_order_id",
                                    already_paid_order_id);
+  GNUNET_free_non_null (final_contract_url);
   GNUNET_free (taler_pay_uri);
   GNUNET_free_non_null (already_paid_order_id);
   return ret;
 }
 
 
+/**
+ * Look up what we need to know about the contract of @a pprc (but
+ * not the contract terms themselves), suspending the connection
+ * until the lookup is done.
+ *
+ * @param pprc request to look up the contract terms for
+ * @return MHD result code
+ */
+static MHD_RESULT
+lookup_contract_terms (struct PollPaymentRequestContext *pprc)
+{
+  struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+  /* obtain contract terms, indirectly checking that the client's contract
+     terms hash is actually valid and known. */
+  pprc->contract_checked = GNUNET_NO;
+  ah = db->find_contract_info_from_hash_async (db->cls,
+                                               &pprc->h_contract_terms,
+                                               &pprc->mi->pubkey,
+                                               &contract_info_cb,
+                                               pprc);
+  if (NULL == ah)
+  {
+    GNUNET_break (0);
+    return TALER_MHD_reply_with_error (pprc->sc.con,
+                                       MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                       TALER_EC_PAY_DB_FETCH_TRANSACTION_ERROR,
+                                       "Merchant database error");
+  }
+  TMH_db_suspend (&pprc->ds,
+                  pprc->sc.con,
+                  ah);
+  return MHD_YES;
+}
+
+
 /**
  * Manages a /public/poll-payment call, checking the status
  * of a payment and, if necessary, constructing the URL
@@ -295,6 +434,7 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
   struct PollPaymentRequestContext *pprc = *connection_cls;
   enum GNUNET_DB_QueryStatus qs;
   MHD_RESULT ret;
+  int fresh_lookup = GNUNET_NO;
 
   if (NULL == pprc)
   {
@@ -303,10 +443,12 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
     const char *cts;
     const char *min_refund;
 
-    pprc = GNUNET_new (struct PollPaymentRequestContext);
+    pprc = TMH_long_poll_record_alloc (
+      sizeof (struct PollPaymentRequestContext));
     pprc->hc.cc = &pprc_cleanup;
     pprc->ret = GNUNET_SYSERR;
     pprc->sc.con = connection;
+    pprc->sc.hc = &pprc->hc;
     pprc->mi = mi;
     *connection_cls = pprc;
 
@@ -395,31 +537,25 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
     pprc->contract_url = MHD_lookup_connection_value (connection,
                                                       MHD_GET_ARGUMENT_KIND,
                                                       "contract_url");
-    if (NULL == pprc->contract_url)
-    {
-      pprc->final_contract_url = TALER_url_absolute_mhd (connection,
-                                                         "/public/proposal",
-                                                         "instance", mi->id,
-                                                         "order_id",
-                                                         pprc->order_id,
-                                                         NULL);
-      GNUNET_assert (NULL != pprc->final_contract_url);
-    }
-    else
-    {
-      pprc->final_contract_url = GNUNET_strdup (pprc->contract_url);
-    }
     pprc->session_id = MHD_lookup_connection_value (connection,
                                                     MHD_GET_ARGUMENT_KIND,
                                                     "session_id");
+    return lookup_contract_terms (pprc);
+  } /* end of first-time initialization / sanity checks */
 
-    /* obtain contract terms, indirectly checking that the client's contract
-       terms hash is actually valid and known. */
-    db->preflight (db->cls);
-    qs = db->find_contract_terms_from_hash (db->cls,
-                                            &pprc->contract_terms,
-                                            &pprc->h_contract_terms,
-                                            &mi->pubkey);
+  if (GNUNET_YES == pprc->refetch_contract)
+  {
+    /* woken up after dropping the fulfillment URL, we need it
+       again */
+    pprc->refetch_contract = GNUNET_NO;
+    return lookup_contract_terms (pprc);
+  }
+
+  if (GNUNET_YES != pprc->contract_checked)
+  {
+    /* contract terms lookup completed, check result */
+    pprc->contract_checked = GNUNET_YES;
+    qs = pprc->lookup_qs;
     if (0 > qs)
     {
       /* Always report on hard error as well to enable diagnostics */
@@ -437,27 +573,16 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
                                          "Given order_id doesn't map to any proposal");
     }
     GNUNET_break (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs);
-
+    if (NULL == pprc->fulfillment_url)
     {
-      struct GNUNET_JSON_Specification spec[] = {
-        GNUNET_JSON_spec_string ("fulfillment_url",
-                                 &pprc->fulfillment_url),
-        GNUNET_JSON_spec_end ()
-      };
-
-      if (GNUNET_OK !=
-          GNUNET_JSON_parse (pprc->contract_terms,
-                             spec,
-                             NULL, NULL))
-      {
-        GNUNET_break (0);
-        return TALER_MHD_reply_with_error (connection,
-                                           MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                           TALER_EC_CHECK_PAYMENT_DB_FETCH_CONTRACT_TERMS_ERROR,
-                                           "Merchant database error (contract terms corrupted)");
-      }
+      GNUNET_break (0);
+      return TALER_MHD_reply_with_error (connection,
+                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                         TALER_EC_CHECK_PAYMENT_DB_FETCH_CONTRACT_TERMS_ERROR,
+                                         "Merchant database error (contract terms corrupted)");
     }
-  } /* end of first-time initialization / sanity checks */
+    fresh_lookup = GNUNET_YES;
+  } /* end of contract terms check */
 
   db->preflight (db->cls);
 
@@ -498,12 +623,38 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
   else
   {
     /* Check if paid regardless of session. */
-    json_t *xcontract_terms = NULL;
+    struct TMH_PaymentStatus *ps = pprc->sc.ps;
 
-    qs = db->find_paid_contract_terms_from_hash (db->cls,
-                                                 &xcontract_terms,
-                                                 &pprc->h_contract_terms,
-                                                 &mi->pubkey);
+    if ( (NULL != ps) &&
+         (GNUNET_YES == ps->paid_known) )
+    {
+      /* another request resumed by the same event already checked */
+      qs = (GNUNET_YES == ps->paid)
+           ? GNUNET_DB_STATUS_SUCCESS_ONE_RESULT
+           : GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+    }
+    else
+    {
+      /* the lookup in this invocation already told us, otherwise
+         the contract may have been paid while we were waiting */
+      qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
+      if (GNUNET_YES != fresh_lookup)
+        qs = db->find_contract_info_from_hash (db->cls,
+                                               &pprc->h_contract_terms,
+                                               &mi->pubkey,
+                                               &paid_info_cb,
+                                               pprc);
+      if (0 < qs)
+        qs = (GNUNET_YES == pprc->paid)
+             ? GNUNET_DB_STATUS_SUCCESS_ONE_RESULT
+             : GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+      if ( (0 <= qs) &&
+           (NULL != ps) )
+      {
+        ps->paid_known = GNUNET_YES;
+        ps->paid = (0 < qs) ? GNUNET_YES : GNUNET_NO;
+      }
+    }
     if (0 > qs)
     {
       /* Always report on hard error as well to enable diagnostics */
@@ -518,21 +669,36 @@ MH_handler_poll_payment (struct TMH_RequestHandler *rh,
       return send_pay_request (pprc);
     }
     GNUNET_break (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs);
-    GNUNET_assert (NULL != xcontract_terms);
-    json_decref (xcontract_terms);
   }
 
   /* Accumulate refunds, if any. */
-  for (unsigned int i = 0; i<MAX_RETRIES; i++)
+  if ( (NULL != pprc->sc.ps) &&
+       (GNUNET_YES == pprc->sc.ps->refunds_known) )
+  {
+    pprc->refunded = pprc->sc.ps->refunded;
+    pprc->refund_amount = pprc->sc.ps->refund_amount;
+    qs = GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+  }
+  else
   {
-    pprc->refunded = GNUNET_NO;
-    qs = db->get_refunds_from_contract_terms_hash (db->cls,
-                                                   &mi->pubkey,
-                                                   &pprc->h_contract_terms,
-                                                   &process_refunds_cb,
-                                                   pprc);
-    if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
-      break;
+    for (unsigned int i = 0; i<MAX_RETRIES; i++)
+    {
+      pprc->refunded = GNUNET_NO;
+      qs = db->get_refunds_from_contract_terms_hash (db->cls,
+                                                     &mi->pubkey,
+                                                     &pprc->h_contract_terms,
+                                                     &process_refunds_cb,
+                                                     pprc);
+      if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
+        break;
+    }
+    if ( (0 <= qs) &&
+         (NULL != pprc->sc.ps) )
+    {
+      pprc->sc.ps->refunds_known = GNUNET_YES;
+      pprc->sc.ps->refunded = pprc->refunded;
+      pprc->sc.ps->refund_amount = pprc->refund_amount;
+    }
   }
   if (0 > qs)
   {
@@ -37,6 +37,299 @@
  */
 #define MAX_RETRIES 3
 
+/**
+ * Start of the body of a reply to a claim, followed by the
+ * contract terms.
+ */
+#define BODY_PREFIX "{\"contract_terms\":"
+
+/**
+ * Space we reserve after the contract terms for the signature
+ * (103 characters in Crockford base32) and its JSON framing.
+ */
+#define BODY_SUFFIX_SIZE 128
+
+/**
+ * Data structure we keep for a /proposal request.
+ */
+struct ProposalContext
+{
+  /**
+   * Must be first for #handle_mhd_completion_callback.
+   */
+  struct TM_HandlerContext hc;
+
+  /**
+   * Suspension while we wait for the database to return the
+   * contract terms.
+   */
+  struct TMH_DbSuspension ds;
+
+  /**
+   * Body of our reply, #BODY_PREFIX followed by the contract terms
+   * as stored in the database, with #BODY_SUFFIX_SIZE bytes to spare.
+   * NULL if the contract terms are not (yet) known.
+   */
+  char *body;
+
+  /**
+   * Number of bytes used in @e body.
+   */
+  size_t body_len;
+
+  /**
+   * Nonce the contract terms were claimed with.
+   */
+  char *nonce;
+
+  /**
+   * Hash of the contract terms.
+   */
+  struct GNUNET_HashCode h_contract_terms;
+
+  /**
+   * Our signature over @e h_contract_terms, valid if @e have_sig
+   * is #GNUNET_YES.
+   */
+  struct GNUNET_CRYPTO_EddsaSignature merchant_sig;
+
+  /**
+   * Did the database have @e merchant_sig for us?
+   */
+  int have_sig;
+
+  /**
+   * Status of the contract terms lookup.
+   */
+  enum GNUNET_DB_QueryStatus qs;
+
+};
+
+
+/**
+ * Clean up the state of a /proposal request.
+ *
+ * @param hc must be a `struct ProposalContext *`
+ */
+static void
+proposal_context_cleanup (struct TM_HandlerContext *hc)
+{
+  struct ProposalContext *pc = (struct ProposalContext *) hc;
+
+  TMH_db_cancel (&pc->ds);
+  GNUNET_free_non_null (pc->body);
+  GNUNET_free_non_null (pc->nonce);
+  GNUNET_free (pc);
+}
+
+
+/**
+ * Remember the claimed contract @a cc in @a pc, copying the
+ * contract terms right into the body of our reply.
+ *
+ * @param pc context to update
+ * @param cc the claimed contract
+ */
+static void
+set_claimed_contract (struct ProposalContext *pc,
+                      const struct TALER_MERCHANTDB_ClaimedContract *cc)
+{
+  pc->body_len = strlen (BODY_PREFIX) + cc->contract_terms_size;
+  pc->body = GNUNET_malloc (pc->body_len + BODY_SUFFIX_SIZE);
+  memcpy (pc->body,
+          BODY_PREFIX,
+          strlen (BODY_PREFIX));
+  memcpy (&pc->body[strlen (BODY_PREFIX)],
+          cc->contract_terms,
+          cc->contract_terms_size);
+  pc->nonce = GNUNET_strdup (cc->nonce);
+  pc->h_contract_terms = cc->h_contract_terms;
+  pc->have_sig = cc->have_sig;
+  pc->merchant_sig = cc->merchant_sig;
+}
+
+
+/**
+ * Function called with the result of looking up the claimed
+ * contract terms.  Stores the result and resumes the handler.
+ *
+ * @param cls a `struct ProposalContext`
+ * @param qs transaction status
+ * @param cc the claimed contract, if found
+ */
+static void
+claimed_contract_cb (void *cls,
+                     enum GNUNET_DB_QueryStatus qs,
+                     const struct TALER_MERCHANTDB_ClaimedContract *cc)
+{
+  struct ProposalContext *pc = cls;
+
+  pc->qs = qs;
+  if (NULL != cc)
+    set_claimed_contract (pc,
+                          cc);
+  TMH_db_resume (&pc->ds);
+}
+
+
+/**
+ * Claim the order @a order_id with @a nonce: turn it into contract
+ * terms, sign them and store them together with their hash and our
+ * signature, so that later lookups can be answered without
+ * processing the contract terms again.
+ *
+ * @param pc request context, updated with the claimed contract
+ * @param connection the MHD connection to handle
+ * @param order_id the order to claim
+ * @param nonce nonce of the wallet
+ * @param mi merchant backend instance
+ * @return #GNUNET_OK on success (@a pc is updated),
+ *         #GNUNET_NO if a reply was queued successfully,
+ *         #GNUNET_SYSERR if queueing a reply failed
+ */
+static enum GNUNET_GenericReturnValue
+claim_order (struct ProposalContext *pc,
+             struct MHD_Connection *connection,
+             const char *order_id,
+             const char *nonce,
+             struct MerchantInstance *mi)
+{
+  struct GNUNET_TIME_Absolute timestamp;
+  struct GNUNET_JSON_Specification spec[] = {
+    GNUNET_JSON_spec_absolute_time ("timestamp", &timestamp),
+    GNUNET_JSON_spec_end ()
+  };
+  struct TALER_MERCHANTDB_ClaimedContract cc = {
+    .nonce = nonce,
+    .have_sig = GNUNET_YES
+  };
+  enum GNUNET_GenericReturnValue res;
+  enum GNUNET_DB_QueryStatus qs;
+  json_t *contract_terms;
+  char *canonical;
+
+  db->preflight (db->cls);
+  qs = db->find_order (db->cls,
+                       &contract_terms,
+                       order_id,
+                       &mi->pubkey);
+  if (0 > qs)
+  {
+    /* single, read-only SQL statements should never cause
+       serialization problems */
+    GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
+    /* Always report on hard error as well to enable diagnostics */
+    GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
+    return (MHD_YES ==
+            TALER_MHD_reply_with_error (connection,
+                                        MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                        TALER_EC_PROPOSAL_LOOKUP_DB_ERROR,
+                                        "An error occurred while retrieving proposal data from db"))
+           ? GNUNET_NO
+           : GNUNET_SYSERR;
+  }
+  if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+  {
+    return (MHD_YES ==
+            TALER_MHD_reply_with_error (connection,
+                                        MHD_HTTP_NOT_FOUND,
+                                        TALER_EC_PROPOSAL_LOOKUP_NOT_FOUND,
+                                        "unknown order id"))
+           ? GNUNET_NO
+           : GNUNET_SYSERR;
+  }
+  GNUNET_assert (NULL != contract_terms);
+  json_object_set_new (contract_terms,
+                       "nonce",
+                       json_string (nonce));
+
+  /* extract fields we need to sign separately */
+  res = TALER_MHD_parse_json_data (connection,
+                                   contract_terms,
+                                   spec);
+  if (GNUNET_OK != res)
+  {
+    json_decref (contract_terms);
+    if (GNUNET_NO == res)
+      return GNUNET_NO;
+    return (MHD_YES ==
+            TALER_MHD_reply_with_error (connection,
+                                        MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                        TALER_EC_PROPOSAL_ORDER_PARSE_ERROR,
+                                        "Impossible to parse the order"))
+           ? GNUNET_NO
+           : GNUNET_SYSERR;
+  }
+
+  /* canonicalize and hash only once, like TALER_JSON_hash() (which
+     includes the terminating 0-byte in the hash) */
+  canonical = json_dumps (contract_terms,
+                          JSON_COMPACT | JSON_SORT_KEYS);
+  json_decref (contract_terms);
+  if (NULL == canonical)
+  {
+    GNUNET_break (0);
+    return (MHD_YES ==
+            TALER_MHD_reply_with_error (connection,
+                                        MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                        TALER_EC_INTERNAL_LOGIC_ERROR,
+                                        "Could not hash order"))
+           ? GNUNET_NO
+           : GNUNET_SYSERR;
+  }
+  cc.contract_terms = canonical;
+  cc.contract_terms_size = strlen (canonical);
+  GNUNET_CRYPTO_hash (canonical,
+                      cc.contract_terms_size + 1,
+                      &cc.h_contract_terms);
+
+  /* create proposal signature */
+  {
+    struct TALER_ProposalDataPS pdps = {
+      .purpose.purpose = htonl (TALER_SIGNATURE_MERCHANT_CONTRACT),
+      .purpose.size = htonl (sizeof (pdps)),
+      .hash = cc.h_contract_terms
+    };
+
+    GNUNET_CRYPTO_eddsa_sign (&mi->privkey.eddsa_priv,
+                              &pdps,
+                              &cc.merchant_sig);
+  }
+
+  for (unsigned int i = 0; i<MAX_RETRIES; i++)
+  {
+    db->preflight (db->cls);
+    qs = db->insert_claimed_contract (db->cls,
+                                      order_id,
+                                      &mi->pubkey,
+                                      timestamp,
+                                      &cc);
+    if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
+      break;
+  }
+  if (0 > qs)
+  {
+    free (canonical);
+    /* Special report if retries insufficient */
+    GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
+    /* Always report on hard error as well to enable diagnostics */
+    GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
+    return (MHD_YES ==
+            TALER_MHD_reply_with_error (connection,
+                                        MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                        TALER_EC_PROPOSAL_STORE_DB_ERROR,
+                                        "db error: could not store this proposal's data into db"))
+           ? GNUNET_NO
+           : GNUNET_SYSERR;
+  }
+  /* The order itself is no longer needed, taler-merchant-gc deletes it */
+  set_claimed_contract (pc,
+                        &cc);
+  free (canonical);
+  return GNUNET_OK;
+}
+
+
 /**
  * Manage a GET /proposal request. Query the db and returns the
  * proposal's data related to the transaction id given as the URL's
@@ -60,12 +353,15 @@ MH_handler_proposal_lookup (struct TMH_RequestHandler *rh,
                             size_t *upload_data_size,
                             struct MerchantInstance *mi)
 {
+  struct ProposalContext *pc = *connection_cls;
   const char *order_id;
   const char *nonce;
   enum GNUNET_DB_QueryStatus qs;
-  json_t *contract_terms;
-  struct GNUNET_CRYPTO_EddsaSignature merchant_sig;
-  const char *stored_nonce;
+  struct MHD_Response *resp;
+  MHD_RESULT ret;
+  char *end;
+  size_t body_len;
+  int comp;
 
   order_id = MHD_lookup_connection_value (connection,
                                           MHD_GET_ARGUMENT_KIND,
@@ -83,11 +379,33 @@ MH_handler_proposal_lookup (struct TMH_RequestHandler *rh,
                                        MHD_HTTP_BAD_REQUEST,
                                        TALER_EC_PARAMETER_MISSING,
                                        "nonce");
-  db->preflight (db->cls);
-  qs = db->find_contract_terms (db->cls,
-                                &contract_terms,
-                                order_id,
-                                &mi->pubkey);
+  if (NULL == pc)
+  {
+    struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+    /* fetch contract terms without blocking the event loop */
+    pc = GNUNET_new (struct ProposalContext);
+    pc->hc.cc = &proposal_context_cleanup;
+    *connection_cls = pc;
+    ah = db->find_claimed_contract_async (db->cls,
+                                          order_id,
+                                          &mi->pubkey,
+                                          &claimed_contract_cb,
+                                          pc);
+    if (NULL == ah)
+    {
+      GNUNET_break (0);
+      return TALER_MHD_reply_with_error (connection,
+                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                         TALER_EC_PROPOSAL_LOOKUP_DB_ERROR,
+                                         "An error occurred while retrieving proposal data from db");
+    }
+    TMH_db_suspend (&pc->ds,
+                    connection,
+                    ah);
+    return MHD_YES;
+  }
+  qs = pc->qs;
   if (0 > qs)
   {
     /* single, read-only SQL statements should never cause
@@ -102,78 +420,23 @@ MH_handler_proposal_lookup (struct TMH_RequestHandler *rh,
   }
   if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
   {
-    struct GNUNET_TIME_Absolute timestamp;
-    struct GNUNET_JSON_Specification spec[] = {
-      GNUNET_JSON_spec_absolute_time ("timestamp", &timestamp),
-      GNUNET_JSON_spec_end ()
-    };
-    enum GNUNET_GenericReturnValue res;
-
-    db->preflight (db->cls);
-    qs = db->find_order (db->cls,
-                         &contract_terms,
+    switch (claim_order (pc,
+                         connection,
                          order_id,
-                         &mi->pubkey);
-    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
-    {
-      return TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_NOT_FOUND,
-                                         TALER_EC_PROPOSAL_LOOKUP_NOT_FOUND,
-                                         "unknown order id");
-    }
-    GNUNET_assert (NULL != contract_terms);
-    json_object_set_new (contract_terms,
-                         "nonce",
-                         json_string (nonce));
-
-    /* extract fields we need to sign separately */
-    res = TALER_MHD_parse_json_data (connection,
-                                     contract_terms,
-                                     spec);
-    if (GNUNET_NO == res)
+                         nonce,
+                         mi))
     {
+    case GNUNET_OK:
+      break;
+    case GNUNET_NO:
       return MHD_YES;
+    case GNUNET_SYSERR:
+      return MHD_NO;
     }
-    if (GNUNET_SYSERR == res)
-    {
-      return TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                         TALER_EC_PROPOSAL_ORDER_PARSE_ERROR,
-                                         "Impossible to parse the order");
-    }
-
-    for (unsigned int i = 0; i<MAX_RETRIES; i++)
-    {
-      db->preflight (db->cls);
-      qs = db->insert_contract_terms (db->cls,
-                                      order_id,
-                                      &mi->pubkey,
-                                      timestamp,
-                                      contract_terms);
-      if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
-        break;
-    }
-    if (0 > qs)
-    {
-      /* Special report if retries insufficient */
-      GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
-      /* Always report on hard error as well to enable diagnostics */
-      GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
-      return TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                         TALER_EC_PROPOSAL_STORE_DB_ERROR,
-                                         "db error: could not store this proposal's data into db");
-    }
-    // FIXME: now we can delete (merchant_pub, order_id) from the merchant_orders table
   }
+  GNUNET_assert (NULL != pc->body);
 
-  GNUNET_assert (NULL != contract_terms);
-
-  stored_nonce
-    = json_string_value (json_object_get (contract_terms,
-                                          "nonce"));
-
-  if (NULL == stored_nonce)
+  if ('\0' == pc->nonce[0])
   {
     GNUNET_break (0);
     return TALER_MHD_reply_with_error (connection,
@@ -182,7 +445,7 @@ MH_handler_proposal_lookup (struct TMH_RequestHandler *rh,
                                        "existing proposal has no nonce");
   }
 
-  if (0 != strcmp (stored_nonce,
+  if (0 != strcmp (pc->nonce,
                    nonce))
   {
     return TALER_MHD_reply_with_error (connection,
@@ -191,37 +454,67 @@ MH_handler_proposal_lookup (struct TMH_RequestHandler *rh,
                                        "mismatched nonce");
   }
 
-
-  /* create proposal signature */
+  if (GNUNET_YES != pc->have_sig)
   {
+    /* claimed before we stored signatures, but at least the hash
+       is known */
     struct TALER_ProposalDataPS pdps = {
       .purpose.purpose = htonl (TALER_SIGNATURE_MERCHANT_CONTRACT),
-      .purpose.size = htonl (sizeof (pdps))
+      .purpose.size = htonl (sizeof (pdps)),
+      .hash = pc->h_contract_terms
     };
 
-    if (GNUNET_OK !=
-        TALER_JSON_hash (contract_terms,
-                         &pdps.hash))
-    {
-      GNUNET_break (0);
-      return TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                         TALER_EC_INTERNAL_LOGIC_ERROR,
-                                         "Could not hash order");
-    }
-
     GNUNET_CRYPTO_eddsa_sign (&mi->privkey.eddsa_priv,
                               &pdps,
-                              &merchant_sig);
+                              &pc->merchant_sig);
+  }
+
+  /* complete the body in place and hand it over to MHD */
+  end = &pc->body[pc->body_len];
+  memcpy (end,
+          ",\"sig\":\"",
+          strlen (",\"sig\":\""));
+  end += strlen (",\"sig\":\"");
+  end = GNUNET_STRINGS_data_to_string (&pc->merchant_sig,
+                                       sizeof (pc->merchant_sig),
+                                       end,
+                                       &pc->body[pc->body_len
+                                                 + BODY_SUFFIX_SIZE] - end);
+  GNUNET_assert (NULL != end);
+  memcpy (end,
+          "\"}",
+          2);
+  end += 2;
+  body_len = end - pc->body;
+  /* compress like TALER_MHD_reply_json() would */
+  comp = MHD_NO;
+  if (MHD_YES == TALER_MHD_can_compress (connection))
+    comp = TALER_MHD_body_compress ((void **) &pc->body,
+                                    &body_len);
+  resp = MHD_create_response_from_buffer (body_len,
+                                          pc->body,
+                                          MHD_RESPMEM_MUST_FREE);
+  if (NULL == resp)
+  {
+    GNUNET_break (0);
+    return MHD_NO;
   }
-  return TALER_MHD_reply_json_pack (connection,
-                                    MHD_HTTP_OK,
-                                    "{ s:o, s:o }",
-                                    "contract_terms",
-                                    contract_terms,
-                                    "sig",
-                                    GNUNET_JSON_from_data_auto (
-                                      &merchant_sig));
+  pc->body = NULL;
+  TALER_MHD_add_global_headers (resp);
+  GNUNET_break (MHD_YES ==
+                MHD_add_response_header (resp,
+                                         MHD_HTTP_HEADER_CONTENT_TYPE,
+                                         "application/json"));
+  if (MHD_YES == comp)
+    GNUNET_break (MHD_YES ==
+                  MHD_add_response_header (resp,
+                                           MHD_HTTP_HEADER_CONTENT_ENCODING,
+                                           "deflate"));
+  ret = MHD_queue_response (connection,
+                            MHD_HTTP_OK,
+                            resp);
+  MHD_destroy_response (resp);
+  return ret;
 }
 
 
@@ -152,10 +152,11 @@ process_refund (struct MHD_Connection *connection,
 
   db->preflight (db->cls);
   /* Convert order id to h_contract_terms */
-  qs = db->find_contract_terms (db->cls,
-                                &contract_terms,
-                                order_id,
-                                &mi->pubkey);
+  qs = db->find_contract_terms_with_hash (db->cls,
+                                          &contract_terms,
+                                          &h_contract_terms,
+                                          order_id,
+                                          &mi->pubkey);
   if (0 > qs)
   {
     /* single, read-only SQL statements should never cause
@@ -179,17 +180,6 @@ process_refund (struct MHD_Connection *connection,
                                        "order_id not found in database");
   }
 
-  if (GNUNET_OK !=
-      TALER_JSON_hash (contract_terms,
-                       &h_contract_terms))
-  {
-    GNUNET_break (0);
-    json_decref (contract_terms);
-    return TALER_MHD_reply_with_error (connection,
-                                       MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                       TALER_EC_INTERNAL_LOGIC_ERROR,
-                                       "Could not hash contract terms");
-  }
   json_decref (contract_terms);
   for (unsigned int i = 0; i<MAX_RETRIES; i++)
   {
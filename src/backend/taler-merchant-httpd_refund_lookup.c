@@ -449,6 +449,7 @@ MH_handler_refund_lookup (struct TMH_RequestHandler *rh,
   struct ProcessRefundData *prd;
   const char *order_id;
   json_t *contract_terms;
+  struct GNUNET_HashCode h_contract_terms;
   enum GNUNET_DB_QueryStatus qs;
 
   prd = *connection_cls;
@@ -469,10 +470,11 @@ MH_handler_refund_lookup (struct TMH_RequestHandler *rh,
     /* Convert order id to h_contract_terms */
     contract_terms = NULL;
     db->preflight (db->cls);
-    qs = db->find_contract_terms (db->cls,
-                                  &contract_terms,
-                                  order_id,
-                                  &mi->pubkey);
+    qs = db->find_contract_terms_with_hash (db->cls,
+                                            &contract_terms,
+                                            &h_contract_terms,
+                                            order_id,
+                                            &mi->pubkey);
     if (0 > qs)
     {
       /* single, read-only SQL statements should never cause
@@ -497,20 +499,9 @@ MH_handler_refund_lookup (struct TMH_RequestHandler *rh,
                                          "order_id not found in database");
     }
 
-    prd = GNUNET_new (struct ProcessRefundData);
-    if (GNUNET_OK !=
-        TALER_JSON_hash (contract_terms,
-                         &prd->h_contract_terms))
-    {
-      GNUNET_break (0);
-      json_decref (contract_terms);
-      GNUNET_free (prd);
-      return TALER_MHD_reply_with_error (connection,
-                                         MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                         TALER_EC_INTERNAL_LOGIC_ERROR,
-                                         "Could not hash contract terms");
-    }
     json_decref (contract_terms);
+    prd = GNUNET_new (struct ProcessRefundData);
+    prd->h_contract_terms = h_contract_terms;
     prd->hc.cc = &cleanup_prd;
     prd->merchant = mi;
     prd->ec = TALER_EC_NONE;
@@ -0,0 +1,284 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_router.c
+ * @brief map request URLs and methods to request handlers using
+ *        a character trie over the (lower-cased) path
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <ctype.h>
+#include "taler-merchant-httpd_router.h"
+
+
+/**
+ * Prefix of URLs for public handlers.
+ */
+#define PUBLIC_PREFIX "/public/"
+
+/**
+ * Prefix of URLs for a specific instance.
+ */
+#define INSTANCE_PREFIX "/instances/"
+
+
+/**
+ * Node in the trie.  Children are kept in a singly linked
+ * list, as URLs only use a small alphabet and nodes rarely
+ * have more than a handful of children.
+ */
+struct RouteNode
+{
+
+  /**
+   * First child of this node.
+   */
+  struct RouteNode *child;
+
+  /**
+   * Next sibling of this node.
+   */
+  struct RouteNode *sibling;
+
+  /**
+   * Non-public handlers for the path ending at this node.
+   */
+  struct TMH_RequestHandler **handlers;
+
+  /**
+   * Public handlers for the path ending at this node.
+   */
+  struct TMH_RequestHandler **public_handlers;
+
+  /**
+   * Length of the @e handlers array.
+   */
+  unsigned int num_handlers;
+
+  /**
+   * Length of the @e public_handlers array.
+   */
+  unsigned int num_public_handlers;
+
+  /**
+   * Character (lower case) leading to this node from its parent.
+   */
+  char c;
+
+};
+
+
+/**
+ * Routing table.
+ */
+struct TMH_Router
+{
+
+  /**
+   * Root of the trie, matches the empty path.
+   */
+  struct RouteNode root;
+
+};
+
+
+/**
+ * Find the child of @a n reached via character @a c.
+ *
+ * @param n node to search
+ * @param c lower-case character to look for
+ * @return NULL if there is no such child
+ */
+static struct RouteNode *
+find_child (const struct RouteNode *n,
+            char c)
+{
+  for (struct RouteNode *pos = n->child; NULL != pos; pos = pos->sibling)
+    if (c == pos->c)
+      return pos;
+  return NULL;
+}
+
+
+struct TMH_Router *
+TMH_router_create (void)
+{
+  return GNUNET_new (struct TMH_Router);
+}
+
+
+void
+TMH_router_add (struct TMH_Router *r,
+                int is_public,
+                struct TMH_RequestHandler *handlers)
+{
+  for (unsigned int i = 0; NULL != handlers[i].url; i++)
+  {
+    struct TMH_RequestHandler *rh = &handlers[i];
+    struct RouteNode *n = &r->root;
+
+    for (const char *pos = rh->url; '\0' != *pos; pos++)
+    {
+      char c = (char) tolower ((unsigned char) *pos);
+      struct RouteNode *next;
+
+      next = find_child (n,
+                         c);
+      if (NULL == next)
+      {
+        next = GNUNET_new (struct RouteNode);
+        next->c = c;
+        next->sibling = n->child;
+        n->child = next;
+      }
+      n = next;
+    }
+    if (GNUNET_YES == is_public)
+      GNUNET_array_append (n->public_handlers,
+                           n->num_public_handlers,
+                           rh);
+    else
+      GNUNET_array_append (n->handlers,
+                           n->num_handlers,
+                           rh);
+  }
+}
+
+
+/**
+ * Find a handler for @a method in @a handlers.
+ *
+ * @param handlers array of handlers to search
+ * @param num_handlers length of @a handlers
+ * @param method method to look for
+ * @return NULL if no handler matches @a method
+ */
+static struct TMH_RequestHandler *
+find_method (struct TMH_RequestHandler **handlers,
+             unsigned int num_handlers,
+             const char *method)
+{
+  for (unsigned int i = 0; i<num_handlers; i++)
+    if ( (NULL == handlers[i]->method) ||
+         (0 == strcasecmp (method,
+                           handlers[i]->method)) )
+      return handlers[i];
+  return NULL;
+}
+
+
+enum TMH_RouteStatus
+TMH_router_resolve (const struct TMH_Router *r,
+                    const char *url,
+                    const char *method,
+                    struct TMH_Route *route)
+{
+  const struct RouteNode *n = &r->root;
+  const char *path = url;
+  unsigned int num_handlers;
+
+  memset (route,
+          0,
+          sizeof (*route));
+  if (0 == strncmp (path,
+                    PUBLIC_PREFIX,
+                    strlen (PUBLIC_PREFIX)))
+  {
+    route->is_public = GNUNET_YES;
+    path += strlen (PUBLIC_PREFIX) - 1;
+  }
+  else
+  {
+    route->is_public = GNUNET_NO;
+  }
+  if (0 == strncmp (path,
+                    INSTANCE_PREFIX,
+                    strlen (INSTANCE_PREFIX)))
+  {
+    const char *istart = path + strlen (INSTANCE_PREFIX);
+    const char *slash = strchr (istart,
+                                '/');
+
+    if (NULL == slash)
+      return TMH_ROUTE_MALFORMED;
+    route->instance_id = istart;
+    route->instance_id_len = slash - istart;
+    path = slash;
+  }
+  route->path = path;
+  for (const char *pos = path; '\0' != *pos; pos++)
+  {
+    n = find_child (n,
+                    (char) tolower ((unsigned char) *pos));
+    if (NULL == n)
+      return TMH_ROUTE_NOT_FOUND;
+  }
+  num_handlers = n->num_public_handlers;
+  if (GNUNET_YES != route->is_public)
+    num_handlers += n->num_handlers;
+  if (0 == num_handlers)
+    return TMH_ROUTE_NOT_FOUND;
+  if (0 == strcasecmp (method,
+                       MHD_HTTP_METHOD_OPTIONS))
+    return TMH_ROUTE_PREFLIGHT;
+  if (GNUNET_YES != route->is_public)
+    route->rh = find_method (n->handlers,
+                             n->num_handlers,
+                             method);
+  if (NULL == route->rh)
+    route->rh = find_method (n->public_handlers,
+                             n->num_public_handlers,
+                             method);
+  if (NULL == route->rh)
+    return TMH_ROUTE_METHOD_NOT_ALLOWED;
+  return TMH_ROUTE_FOUND;
+}
+
+
+/**
+ * Free the children of @a n and the handler arrays of @a n.
+ *
+ * @param n node to clean up
+ */
+static void
+free_node (struct RouteNode *n)
+{
+  struct RouteNode *pos;
+
+  while (NULL != (pos = n->child))
+  {
+    n->child = pos->sibling;
+    free_node (pos);
+    GNUNET_free (pos);
+  }
+  GNUNET_array_grow (n->handlers,
+                     n->num_handlers,
+                     0);
+  GNUNET_array_grow (n->public_handlers,
+                     n->num_public_handlers,
+                     0);
+}
+
+
+void
+TMH_router_destroy (struct TMH_Router *r)
+{
+  free_node (&r->root);
+  GNUNET_free (r);
+}
+
+
+/* end of taler-merchant-httpd_router.c */
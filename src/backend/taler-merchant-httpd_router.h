@@ -0,0 +1,159 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_router.h
+ * @brief map request URLs and methods to request handlers
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_ROUTER_H
+#define TALER_MERCHANT_HTTPD_ROUTER_H
+
+#include "taler-merchant-httpd.h"
+
+
+/**
+ * Routing table, built once at startup.
+ */
+struct TMH_Router;
+
+
+/**
+ * Outcome of resolving a request.
+ */
+enum TMH_RouteStatus
+{
+
+  /**
+   * A handler was found.
+   */
+  TMH_ROUTE_FOUND,
+
+  /**
+   * The path is known and the method is OPTIONS,
+   * the caller should answer with a CORS preflight.
+   */
+  TMH_ROUTE_PREFLIGHT,
+
+  /**
+   * The path is known, but not for this method.
+   */
+  TMH_ROUTE_METHOD_NOT_ALLOWED,
+
+  /**
+   * The path is not known.
+   */
+  TMH_ROUTE_NOT_FOUND,
+
+  /**
+   * The URL is malformed (i.e. "/instances/" without a path
+   * after the instance identifier), the instance fields of
+   * the route are not set.
+   */
+  TMH_ROUTE_MALFORMED
+};
+
+
+/**
+ * Result of resolving a request.  Points into the URL and
+ * the routing table, so nothing needs to be freed.
+ */
+struct TMH_Route
+{
+
+  /**
+   * Handler for the request, set if the status is #TMH_ROUTE_FOUND.
+   */
+  struct TMH_RequestHandler *rh;
+
+  /**
+   * Instance identifier from the URL, NOT 0-terminated;
+   * NULL if the request is for the default instance.
+   */
+  const char *instance_id;
+
+  /**
+   * Number of bytes in @e instance_id.
+   */
+  size_t instance_id_len;
+
+  /**
+   * Path of the request after the "/public" and "/instances/$ID"
+   * prefixes were removed.
+   */
+  const char *path;
+
+  /**
+   * #GNUNET_YES if the URL started with "/public/".
+   */
+  int is_public;
+
+};
+
+
+/**
+ * Create an empty routing table.
+ *
+ * @return new routing table
+ */
+struct TMH_Router *
+TMH_router_create (void);
+
+
+/**
+ * Add handlers to the routing table.  Public handlers are
+ * reachable with and without the "/public" prefix, the others
+ * only without.  When several handlers match a path and method,
+ * non-public handlers win, and otherwise the one added first.
+ *
+ * @param r routing table to extend
+ * @param is_public #GNUNET_YES if @a handlers are public
+ * @param handlers array of handlers terminated by an entry with
+ *        a NULL URL, must remain valid for the lifetime of @a r
+ */
+void
+TMH_router_add (struct TMH_Router *r,
+                int is_public,
+                struct TMH_RequestHandler *handlers);
+
+
+/**
+ * Resolve a request.  Runs in time linear in the length of the
+ * @a url and does not allocate memory.  URL paths and methods
+ * are matched case-insensitively.
+ *
+ * @param r routing table to use
+ * @param url URL that was requested
+ * @param method HTTP method of the request
+ * @param[out] route set to the result
+ * @return status of the lookup
+ */
+enum TMH_RouteStatus
+TMH_router_resolve (const struct TMH_Router *r,
+                    const char *url,
+                    const char *method,
+                    struct TMH_Route *route);
+
+
+/**
+ * Free a routing table.
+ *
+ * @param r routing table to free
+ */
+void
+TMH_router_destroy (struct TMH_Router *r);
+
+
+#endif
@@ -0,0 +1,205 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_slab.c
+ * @brief allocator for many records of the same (small) size
+ * @author Christian Grothoff
+ *
+ * Records are carved out of chunks of #SLAB_CHUNK_SIZE bytes.  Free
+ * records are kept in a list threaded through the records themselves,
+ * so allocation and release are O(1) and there is no per-record
+ * overhead beyond rounding the size up to #SLAB_ALIGNMENT.
+ */
+#include "platform.h"
+#include "taler-merchant-httpd_slab.h"
+
+
+/**
+ * Alignment of all records.
+ */
+#define SLAB_ALIGNMENT 16
+
+/**
+ * Size of the chunks we obtain from malloc().
+ */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Round @a n up to a multiple of #SLAB_ALIGNMENT.
+ */
+#define SLAB_ROUND(n) \
+  (((n) + SLAB_ALIGNMENT - 1) & ~((size_t) SLAB_ALIGNMENT - 1))
+
+
+/**
+ * Header of a chunk.  The records follow the header (at offset
+ * #SLAB_ROUND of its size).
+ */
+struct SlabChunk
+{
+  /**
+   * Next chunk of the slab.
+   */
+  struct SlabChunk *next;
+};
+
+
+/**
+ * A free record.
+ */
+struct FreeRecord
+{
+  /**
+   * Next free record.
+   */
+  struct FreeRecord *next;
+};
+
+
+/**
+ * A slab of records.
+ */
+struct TMH_Slab
+{
+
+  /**
+   * Chunks of the slab.
+   */
+  struct SlabChunk *chunks;
+
+  /**
+   * Free records.
+   */
+  struct FreeRecord *free_list;
+
+  /**
+   * Number of records per chunk.
+   */
+  unsigned int records_per_chunk;
+
+  /**
+   * Our statistics.
+   */
+  struct TMH_SlabStatistics stats;
+
+};
+
+
+struct TMH_Slab *
+TMH_slab_create (size_t record_size)
+{
+  struct TMH_Slab *slab;
+  size_t rs;
+
+  rs = SLAB_ROUND (GNUNET_MAX (record_size,
+                               sizeof (struct FreeRecord)));
+  GNUNET_assert (rs <= SLAB_CHUNK_SIZE
+                 - SLAB_ROUND (sizeof (struct SlabChunk)));
+  slab = GNUNET_new (struct TMH_Slab);
+  slab->stats.record_size = rs;
+  slab->stats.bytes = sizeof (*slab);
+  slab->records_per_chunk
+    = (SLAB_CHUNK_SIZE - SLAB_ROUND (sizeof (struct SlabChunk))) / rs;
+  return slab;
+}
+
+
+/**
+ * Add a chunk to @a slab and put its records into the free list.
+ *
+ * @param slab slab to grow
+ */
+static void
+grow (struct TMH_Slab *slab)
+{
+  struct SlabChunk *chunk;
+  char *base;
+
+  chunk = GNUNET_malloc_large (SLAB_CHUNK_SIZE);
+  GNUNET_assert (NULL != chunk);
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->stats.chunks++;
+  slab->stats.bytes += SLAB_CHUNK_SIZE;
+  base = ((char *) chunk) + SLAB_ROUND (sizeof (struct SlabChunk));
+  /* push in reverse, so that we hand out records in address order */
+  for (unsigned int i = slab->records_per_chunk; i>0; i--)
+  {
+    struct FreeRecord *fr
+      = (struct FreeRecord *) &base[(i - 1) * slab->stats.record_size];
+
+    fr->next = slab->free_list;
+    slab->free_list = fr;
+  }
+}
+
+
+void *
+TMH_slab_alloc (struct TMH_Slab *slab)
+{
+  struct FreeRecord *fr;
+
+  if (NULL == slab->free_list)
+    grow (slab);
+  fr = slab->free_list;
+  slab->free_list = fr->next;
+  memset (fr,
+          0,
+          slab->stats.record_size);
+  slab->stats.in_use++;
+  slab->stats.peak = GNUNET_MAX (slab->stats.peak,
+                                 slab->stats.in_use);
+  return fr;
+}
+
+
+void
+TMH_slab_free (struct TMH_Slab *slab,
+               void *record)
+{
+  struct FreeRecord *fr = record;
+
+  GNUNET_assert (0 < slab->stats.in_use);
+  slab->stats.in_use--;
+  fr->next = slab->free_list;
+  slab->free_list = fr;
+}
+
+
+void
+TMH_slab_get_statistics (const struct TMH_Slab *slab,
+                         struct TMH_SlabStatistics *stats)
+{
+  *stats = slab->stats;
+}
+
+
+void
+TMH_slab_destroy (struct TMH_Slab *slab)
+{
+  struct SlabChunk *chunk;
+
+  GNUNET_break (0 == slab->stats.in_use);
+  while (NULL != (chunk = slab->chunks))
+  {
+    slab->chunks = chunk->next;
+    GNUNET_free (chunk);
+  }
+  GNUNET_free (slab);
+}
+
+
+/* end of taler-merchant-httpd_slab.c */
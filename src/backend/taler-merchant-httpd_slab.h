@@ -0,0 +1,123 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_slab.h
+ * @brief allocator for many records of the same (small) size,
+ *        used for the contexts of long-polling requests
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_SLAB_H
+#define TALER_MERCHANT_HTTPD_SLAB_H
+
+#include <gnunet/gnunet_util_lib.h>
+
+
+/**
+ * A slab of records.
+ */
+struct TMH_Slab;
+
+
+/**
+ * Statistics about a slab.
+ */
+struct TMH_SlabStatistics
+{
+
+  /**
+   * Size of a record (including padding).
+   */
+  size_t record_size;
+
+  /**
+   * Number of records currently allocated.
+   */
+  unsigned int in_use;
+
+  /**
+   * Largest number of records allocated at the same time.
+   */
+  unsigned int peak;
+
+  /**
+   * Number of chunks obtained from malloc().
+   */
+  unsigned int chunks;
+
+  /**
+   * Number of bytes obtained from malloc(), including the
+   * slab itself.
+   */
+  unsigned long long bytes;
+
+};
+
+
+/**
+ * Create a slab for records of @a record_size bytes.  Memory is
+ * obtained from malloc() in chunks of many records and only
+ * returned when the slab is destroyed, so the memory used is
+ * bounded by the largest number of records in use at any time.
+ *
+ * @param record_size size of the records
+ * @return the slab
+ */
+struct TMH_Slab *
+TMH_slab_create (size_t record_size);
+
+
+/**
+ * Allocate a record from @a slab.
+ *
+ * @param slab slab to allocate from
+ * @return zero-initialized record
+ */
+void *
+TMH_slab_alloc (struct TMH_Slab *slab);
+
+
+/**
+ * Return @a record to @a slab.
+ *
+ * @param slab slab @a record was allocated from
+ * @param record record to free
+ */
+void
+TMH_slab_free (struct TMH_Slab *slab,
+               void *record);
+
+
+/**
+ * Obtain statistics about @a slab.
+ *
+ * @param slab a slab
+ * @param[out] stats set to the current statistics
+ */
+void
+TMH_slab_get_statistics (const struct TMH_Slab *slab,
+                         struct TMH_SlabStatistics *stats);
+
+
+/**
+ * Destroy @a slab, all records must have been freed.
+ *
+ * @param slab slab to destroy
+ */
+void
+TMH_slab_destroy (struct TMH_Slab *slab);
+
+
+#endif
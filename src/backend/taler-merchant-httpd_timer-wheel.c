@@ -0,0 +1,320 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_timer-wheel.c
+ * @brief hierarchical timer wheel with O(1) insertion and removal
+ * @author Christian Grothoff
+ *
+ * Time is divided into ticks of the resolution of the wheel.  Entries
+ * expiring within the next #L0_SIZE ticks are kept in the slot of
+ * their tick in the first level.  Entries expiring later are kept in
+ * the second level, where each slot covers #L0_SIZE ticks, or in the
+ * overflow list.  Whenever the first level wraps around, the entries
+ * of the next slot of the second level are moved into the first
+ * level; whenever the second level wraps around, the overflow list
+ * is redistributed.
+ */
+#include "platform.h"
+#include "taler-merchant-httpd_timer-wheel.h"
+
+
+/**
+ * log2 of the number of slots in the first level.
+ */
+#define L0_BITS 8
+
+/**
+ * Number of slots in the first level.
+ */
+#define L0_SIZE (1LLU << L0_BITS)
+
+/**
+ * log2 of the number of slots in the second level.
+ */
+#define L1_BITS 6
+
+/**
+ * Number of slots in the second level.
+ */
+#define L1_SIZE (1LLU << L1_BITS)
+
+
+/**
+ * A slot of a timer wheel.
+ */
+struct TMH_TimerWheelSlot
+{
+
+  /**
+   * Head of the entries in this slot.
+   */
+  struct TMH_TimerWheelEntry *head;
+
+  /**
+   * Tail of the entries in this slot.
+   */
+  struct TMH_TimerWheelEntry *tail;
+
+};
+
+
+/**
+ * A timer wheel.
+ */
+struct TMH_TimerWheel
+{
+
+  /**
+   * First level, one slot per tick.
+   */
+  struct TMH_TimerWheelSlot l0[L0_SIZE];
+
+  /**
+   * Second level, one slot per #L0_SIZE ticks.
+   */
+  struct TMH_TimerWheelSlot l1[L1_SIZE];
+
+  /**
+   * Entries expiring after the range covered by the second level.
+   */
+  struct TMH_TimerWheelSlot overflow;
+
+  /**
+   * Length of a tick in microseconds.
+   */
+  uint64_t resolution_us;
+
+  /**
+   * Next tick to process.
+   */
+  uint64_t base;
+
+  /**
+   * Number of entries in the wheel.
+   */
+  unsigned int size;
+
+};
+
+
+/**
+ * Put @a e into the slot of @a tw matching its expiration tick.
+ *
+ * @param tw the wheel
+ * @param e entry to place, not in any slot
+ */
+static void
+place (struct TMH_TimerWheel *tw,
+       struct TMH_TimerWheelEntry *e)
+{
+  struct TMH_TimerWheelSlot *slot;
+
+  if (e->expires <= tw->base)
+    slot = &tw->l0[tw->base & (L0_SIZE - 1)];
+  else if (e->expires - tw->base < L0_SIZE)
+    slot = &tw->l0[e->expires & (L0_SIZE - 1)];
+  else if (e->expires - tw->base < L0_SIZE * L1_SIZE)
+    slot = &tw->l1[(e->expires >> L0_BITS) & (L1_SIZE - 1)];
+  else
+    slot = &tw->overflow;
+  e->slot = slot;
+  GNUNET_CONTAINER_DLL_insert (slot->head,
+                               slot->tail,
+                               e);
+}
+
+
+/**
+ * Redistribute the entries of @a slot.
+ *
+ * @param tw the wheel
+ * @param slot slot to empty
+ */
+static void
+cascade (struct TMH_TimerWheel *tw,
+         struct TMH_TimerWheelSlot *slot)
+{
+  struct TMH_TimerWheelEntry *e = slot->head;
+
+  slot->head = NULL;
+  slot->tail = NULL;
+  while (NULL != e)
+  {
+    struct TMH_TimerWheelEntry *next = e->next;
+
+    e->next = NULL;
+    e->prev = NULL;
+    place (tw,
+           e);
+    e = next;
+  }
+}
+
+
+struct TMH_TimerWheel *
+TMH_timer_wheel_create (struct GNUNET_TIME_Relative resolution,
+                        struct GNUNET_TIME_Absolute now)
+{
+  struct TMH_TimerWheel *tw;
+
+  GNUNET_assert (0 != resolution.rel_value_us);
+  tw = GNUNET_new (struct TMH_TimerWheel);
+  tw->resolution_us = resolution.rel_value_us;
+  tw->base = now.abs_value_us / tw->resolution_us + 1;
+  return tw;
+}
+
+
+void
+TMH_timer_wheel_insert (struct TMH_TimerWheel *tw,
+                        struct TMH_TimerWheelEntry *e,
+                        struct GNUNET_TIME_Absolute deadline,
+                        void *entry_cls)
+{
+  GNUNET_assert (NULL == e->slot);
+  e->cls = entry_cls;
+  /* round up, so that we never expire early */
+  e->expires = deadline.abs_value_us / tw->resolution_us
+               + ((0 == deadline.abs_value_us % tw->resolution_us) ? 0 : 1);
+  e->next = NULL;
+  e->prev = NULL;
+  place (tw,
+         e);
+  tw->size++;
+}
+
+
+void
+TMH_timer_wheel_remove (struct TMH_TimerWheel *tw,
+                        struct TMH_TimerWheelEntry *e)
+{
+  if (NULL == e->slot)
+    return;
+  GNUNET_CONTAINER_DLL_remove (e->slot->head,
+                               e->slot->tail,
+                               e);
+  e->slot = NULL;
+  tw->size--;
+}
+
+
+unsigned int
+TMH_timer_wheel_advance (struct TMH_TimerWheel *tw,
+                         struct GNUNET_TIME_Absolute now,
+                         TMH_TimerWheelCallback cb,
+                         void *cb_cls)
+{
+  uint64_t now_tick = now.abs_value_us / tw->resolution_us;
+  unsigned int expired = 0;
+
+  while ( (0 != tw->size) &&
+          (tw->base <= now_tick) )
+  {
+    struct TMH_TimerWheelSlot *slot = &tw->l0[tw->base & (L0_SIZE - 1)];
+    struct TMH_TimerWheelEntry *e;
+
+    if (0 == (tw->base & (L0_SIZE - 1)))
+    {
+      uint64_t l1 = (tw->base >> L0_BITS) & (L1_SIZE - 1);
+
+      if (0 == l1)
+        cascade (tw,
+                 &tw->overflow);
+      cascade (tw,
+               &tw->l1[l1]);
+    }
+    /* the callback may add entries expiring right away to this slot */
+    while (NULL != (e = slot->head))
+    {
+      TMH_timer_wheel_remove (tw,
+                              e);
+      expired++;
+      cb (cb_cls,
+          e->cls);
+    }
+    tw->base++;
+  }
+  /* nothing left to expire, skip the remaining (empty) ticks */
+  if (tw->base <= now_tick)
+    tw->base = now_tick + 1;
+  return expired;
+}
+
+
+/**
+ * Remove all entries from @a slot, calling @a cb on each.
+ *
+ * @param tw the wheel
+ * @param slot slot to clear
+ * @param cb function to call
+ * @param cb_cls closure for @a cb
+ */
+static void
+clear_slot (struct TMH_TimerWheel *tw,
+            struct TMH_TimerWheelSlot *slot,
+            TMH_TimerWheelCallback cb,
+            void *cb_cls)
+{
+  struct TMH_TimerWheelEntry *e;
+
+  while (NULL != (e = slot->head))
+  {
+    TMH_timer_wheel_remove (tw,
+                            e);
+    cb (cb_cls,
+        e->cls);
+  }
+}
+
+
+void
+TMH_timer_wheel_clear (struct TMH_TimerWheel *tw,
+                       TMH_TimerWheelCallback cb,
+                       void *cb_cls)
+{
+  for (unsigned int i = 0; i<L0_SIZE; i++)
+    clear_slot (tw,
+                &tw->l0[i],
+                cb,
+                cb_cls);
+  for (unsigned int i = 0; i<L1_SIZE; i++)
+    clear_slot (tw,
+                &tw->l1[i],
+                cb,
+                cb_cls);
+  clear_slot (tw,
+              &tw->overflow,
+              cb,
+              cb_cls);
+}
+
+
+unsigned int
+TMH_timer_wheel_size (const struct TMH_TimerWheel *tw)
+{
+  return tw->size;
+}
+
+
+void
+TMH_timer_wheel_destroy (struct TMH_TimerWheel *tw)
+{
+  GNUNET_break (0 == tw->size);
+  GNUNET_free (tw);
+}
+
+
+/* end of taler-merchant-httpd_timer-wheel.c */
@@ -0,0 +1,176 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Affero General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backend/taler-merchant-httpd_timer-wheel.h
+ * @brief hierarchical timer wheel with O(1) insertion and removal,
+ *        used for the timeouts of long-polling requests
+ * @author Christian Grothoff
+ */
+#ifndef TALER_MERCHANT_HTTPD_TIMER_WHEEL_H
+#define TALER_MERCHANT_HTTPD_TIMER_WHEEL_H
+
+#include <gnunet/gnunet_util_lib.h>
+
+
+/**
+ * A timer wheel.
+ */
+struct TMH_TimerWheel;
+
+
+/**
+ * A slot of a timer wheel (internal).
+ */
+struct TMH_TimerWheelSlot;
+
+
+/**
+ * Entry in a timer wheel.  Typically embedded into the
+ * struct of the object that has the timeout.
+ */
+struct TMH_TimerWheelEntry
+{
+
+  /**
+   * Kept in a DLL per slot.
+   */
+  struct TMH_TimerWheelEntry *next;
+
+  /**
+   * Kept in a DLL per slot.
+   */
+  struct TMH_TimerWheelEntry *prev;
+
+  /**
+   * Slot we are in, NULL if not in a wheel.
+   */
+  struct TMH_TimerWheelSlot *slot;
+
+  /**
+   * Closure given to #TMH_timer_wheel_insert().
+   */
+  void *cls;
+
+  /**
+   * Tick at which the entry expires.
+   */
+  uint64_t expires;
+
+};
+
+
+/**
+ * Function called for an entry that expired.  The entry has
+ * already been removed from the wheel.
+ *
+ * @param cls closure
+ * @param entry_cls closure of the entry
+ */
+typedef void
+(*TMH_TimerWheelCallback)(void *cls,
+                          void *entry_cls);
+
+
+/**
+ * Create a timer wheel.  Entries expire with a granularity of
+ * @a resolution, and never before their deadline.
+ *
+ * @param resolution granularity of the wheel
+ * @param now current time
+ * @return the wheel
+ */
+struct TMH_TimerWheel *
+TMH_timer_wheel_create (struct GNUNET_TIME_Relative resolution,
+                        struct GNUNET_TIME_Absolute now);
+
+
+/**
+ * Add @a e to @a tw to expire at @a deadline.  If @a tw is empty
+ * and was not advanced for a while, it should be advanced to the
+ * current time first, so that it does not have to catch up later.
+ *
+ * @param tw wheel to add to
+ * @param[out] e entry to initialize and add, must not be in a wheel
+ * @param deadline when should the entry expire
+ * @param entry_cls closure for the entry
+ */
+void
+TMH_timer_wheel_insert (struct TMH_TimerWheel *tw,
+                        struct TMH_TimerWheelEntry *e,
+                        struct GNUNET_TIME_Absolute deadline,
+                        void *entry_cls);
+
+
+/**
+ * Remove @a e from @a tw.  Does nothing if @a e is not in a wheel.
+ *
+ * @param tw wheel to remove from
+ * @param e entry to remove
+ */
+void
+TMH_timer_wheel_remove (struct TMH_TimerWheel *tw,
+                        struct TMH_TimerWheelEntry *e);
+
+
+/**
+ * Expire all entries of @a tw with a deadline of up to @a now.
+ *
+ * @param tw wheel to advance
+ * @param now current time
+ * @param cb function to call for each expired entry
+ * @param cb_cls closure for @a cb
+ * @return number of entries that expired
+ */
+unsigned int
+TMH_timer_wheel_advance (struct TMH_TimerWheel *tw,
+                         struct GNUNET_TIME_Absolute now,
+                         TMH_TimerWheelCallback cb,
+                         void *cb_cls);
+
+
+/**
+ * Remove all entries from @a tw, regardless of their deadline.
+ *
+ * @param tw wheel to clear
+ * @param cb function to call for each entry
+ * @param cb_cls closure for @a cb
+ */
+void
+TMH_timer_wheel_clear (struct TMH_TimerWheel *tw,
+                       TMH_TimerWheelCallback cb,
+                       void *cb_cls);
+
+
+/**
+ * Get the number of entries in @a tw.
+ *
+ * @param tw a wheel
+ * @return number of entries
+ */
+unsigned int
+TMH_timer_wheel_size (const struct TMH_TimerWheel *tw);
+
+
+/**
+ * Destroy @a tw, which must be empty.
+ *
+ * @param tw wheel to destroy
+ */
+void
+TMH_timer_wheel_destroy (struct TMH_TimerWheel *tw);
+
+
+#endif
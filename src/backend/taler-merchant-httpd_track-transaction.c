@@ -24,10 +24,12 @@
 #include <taler/taler_signatures.h>
 #include <taler/taler_json_lib.h>
 #include "taler-merchant-httpd.h"
+#include "taler-merchant-httpd_arena.h"
 #include "taler_merchant_service.h"
 #include "taler-merchant-httpd_mhd.h"
 #include "taler-merchant-httpd_auditors.h"
 #include "taler-merchant-httpd_exchanges.h"
+#include "taler-merchant-httpd_metrics.h"
 #include "taler-merchant-httpd_track-transaction.h"
 
 
@@ -182,6 +184,11 @@ struct TrackCoinContext
    */
   struct TALER_EXCHANGE_DepositGetHandle *dwh;
 
+  /**
+   * When did we start the request @e dwh?
+   */
+  struct GNUNET_TIME_Absolute dwh_start;
+
   /**
    * Wire transfer identifier for this coin.
    */
@@ -226,6 +233,12 @@ struct TrackTransactionContext
    */
   struct MHD_Connection *connection;
 
+  /**
+   * Suspended connection while we long-poll for the wire transfer
+   * of the contract to become known.
+   */
+  struct TMH_SuspendedConnection sc;
+
   /**
    * Kept in a DLL.
    */
@@ -263,6 +276,11 @@ struct TrackTransactionContext
    */
   struct TALER_EXCHANGE_TransfersGetHandle *wdh;
 
+  /**
+   * When did we start the request @e wdh?
+   */
+  struct GNUNET_TIME_Absolute wdh_start;
+
   /**
    * Response to return upon resume.
    */
@@ -318,22 +336,40 @@ struct TrackTransactionContext
    */
   struct MerchantInstance *mi;
 
+  /**
+   * Reply of the exchange saying that the wire transfer is still
+   * pending, returned once the long-poll timeout expires.  NULL if
+   * we are not long-polling.
+   */
+  json_t *accepted_reply;
+
   /**
    * Set to negative values in #coin_cb() if we encounter
    * a database problem.
    */
   enum GNUNET_DB_QueryStatus qs;
 
+  /**
+   * #GNUNET_YES if we were resumed to start long-polling.
+   */
+  int park;
+
+  /**
+   * #GNUNET_YES if we are (or were) suspended long-polling.
+   */
+  int parked;
+
 };
 
 
 /**
- * Free the @a tctx.
+ * Forget about the coins of @a tctx, cancelling pending requests
+ * to the exchange.
  *
- * @param tctx data to free
+ * @param tctx operation to clean up
  */
 static void
-free_tctx (struct TrackTransactionContext *tctx)
+clear_coins (struct TrackTransactionContext *tctx)
 {
   struct TrackCoinContext *tcc;
 
@@ -347,13 +383,20 @@ free_tctx (struct TrackTransactionContext *tctx)
       TALER_EXCHANGE_deposits_get_cancel (tcc->dwh);
       tcc->dwh = NULL;
     }
-    if (NULL != tcc->exchange_url)
-    {
-      GNUNET_free (tcc->exchange_url);
-      tcc->exchange_url = NULL;
-    }
-    GNUNET_free (tcc);
+    /* tcc itself is released with the arena of the request */
   }
+}
+
+
+/**
+ * Free the @a tctx.
+ *
+ * @param tctx data to free
+ */
+static void
+free_tctx (struct TrackTransactionContext *tctx)
+{
+  clear_coins (tctx);
   if (NULL != tctx->wdh)
   {
     TALER_EXCHANGE_transfers_get_cancel (tctx->wdh);
@@ -369,6 +412,12 @@ free_tctx (struct TrackTransactionContext *tctx)
     GNUNET_SCHEDULER_cancel (tctx->timeout_task);
     tctx->timeout_task = NULL;
   }
+  TMH_long_poll_release (&tctx->sc);
+  if (NULL != tctx->accepted_reply)
+  {
+    json_decref (tctx->accepted_reply);
+    tctx->accepted_reply = NULL;
+  }
   GNUNET_free (tctx);
 }
 
@@ -416,6 +465,37 @@ resume_track_transaction_with_response (struct TrackTransactionContext *tctx,
 }
 
 
+/**
+ * The exchange has not yet executed the wire transfer for one of
+ * the coins, but the client is willing to wait.  Remember the
+ * exchange's @a reply and resume the connection, so that the
+ * handler can suspend it again to long-poll for the wire transfer.
+ *
+ * @param tctx transaction tracking context
+ * @param reply reply of the exchange, returned if the long-poll times out
+ */
+static void
+park_track_transaction (struct TrackTransactionContext *tctx,
+                        const json_t *reply)
+{
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Wire transfer still pending, long-polling /track/transaction\n");
+  if (NULL != tctx->timeout_task)
+  {
+    GNUNET_SCHEDULER_cancel (tctx->timeout_task);
+    tctx->timeout_task = NULL;
+  }
+  if (NULL != tctx->accepted_reply)
+    json_decref (tctx->accepted_reply);
+  tctx->accepted_reply = json_incref ((json_t *) reply);
+  tctx->eh = NULL;
+  tctx->current_exchange = NULL;
+  tctx->park = GNUNET_YES;
+  MHD_resume_connection (tctx->connection);
+  TMH_trigger_daemon (); /* we resumed, kick MHD */
+}
+
+
 /**
  * This function is called to trace the wire transfers for
  * all of the coins of the transaction of the @a tctx.  Once
@@ -461,6 +541,9 @@ wire_deposits_cb (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   tctx->wdh = NULL;
+  TMH_METRICS_record_exchange (TMH_METRICS_EX_TRANSFERS_GET,
+                               tctx->wdh_start,
+                               hr->http_status);
   if (MHD_HTTP_OK != hr->http_status)
   {
     GNUNET_break_op (0);
@@ -539,6 +622,11 @@ wire_deposits_cb (void *cls,
       }
     }
   }
+  /* wake up clients long-polling on /track/transaction for the
+     contracts of this wire transfer */
+  TMH_long_poll_resume_transfers (details,
+                                  details_length,
+                                  &tctx->mi->pubkey);
   /* Continue tracing (will also handle case that we are done) */
   trace_coins (tctx);
 }
@@ -608,10 +696,20 @@ wtid_cb (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   tcc->dwh = NULL;
+  TMH_METRICS_record_exchange (TMH_METRICS_EX_DEPOSITS_GET,
+                               tcc->dwh_start,
+                               hr->http_status);
   if (MHD_HTTP_OK != hr->http_status)
   {
     if (MHD_HTTP_ACCEPTED == hr->http_status)
     {
+      if (0 != GNUNET_TIME_absolute_get_remaining (
+            tctx->sc.long_poll_timeout).rel_value_us)
+      {
+        park_track_transaction (tctx,
+                                hr->reply);
+        return;
+      }
       resume_track_transaction_with_response (
         tcc->tctx,
         MHD_HTTP_ACCEPTED,
@@ -685,6 +783,7 @@ wtid_cb (void *cls,
     return;
   }
 
+  tctx->wdh_start = GNUNET_TIME_absolute_get ();
   tctx->wdh = TALER_EXCHANGE_transfers_get (tctx->eh,
                                             wtid,
                                             &wire_deposits_cb,
@@ -851,6 +950,7 @@ trace_coins (struct TrackTransactionContext *tctx)
     }
     /* we are not done requesting WTIDs from the current
        exchange; do the next one */
+    tcc->dwh_start = GNUNET_TIME_absolute_get ();
     tcc->dwh = TALER_EXCHANGE_deposits_get (tctx->eh,
                                             &tctx->mi->privkey,
                                             &tctx->h_wire,
@@ -999,10 +1099,12 @@ coin_cb (void *cls,
   struct TrackTransactionContext *tctx = cls;
   struct TrackCoinContext *tcc;
 
-  tcc = GNUNET_new (struct TrackCoinContext);
+  tcc = TMH_arena_new (TMH_handler_arena (&tctx->hc),
+                       struct TrackCoinContext);
   tcc->tctx = tctx;
   tcc->coin_pub = *coin_pub;
-  tcc->exchange_url = GNUNET_strdup (exchange_url);
+  tcc->exchange_url = TMH_arena_strdup (TMH_handler_arena (&tctx->hc),
+                                        exchange_url);
   tcc->amount_with_fee = *amount_with_fee;
   tcc->deposit_fee = *deposit_fee;
   GNUNET_CONTAINER_DLL_insert (tctx->tcc_head,
@@ -1081,6 +1183,7 @@ MH_handler_track_transaction (struct TMH_RequestHandler *rh,
 {
   struct TrackTransactionContext *tctx;
   const char *order_id;
+  const char *long_poll_timeout_s;
   enum GNUNET_DB_QueryStatus qs;
   struct json_t *contract_terms;
 
@@ -1089,7 +1192,35 @@ MH_handler_track_transaction (struct TMH_RequestHandler *rh,
     tctx = GNUNET_new (struct TrackTransactionContext);
     tctx->hc.cc = &track_transaction_cleanup;
     tctx->connection = connection;
+    tctx->sc.con = connection;
+    tctx->sc.hc = &tctx->hc;
     *connection_cls = tctx;
+    long_poll_timeout_s = MHD_lookup_connection_value (connection,
+                                                       MHD_GET_ARGUMENT_KIND,
+                                                       "timeout");
+    if (NULL != long_poll_timeout_s)
+    {
+      unsigned int timeout;
+
+      if (1 != sscanf (long_poll_timeout_s,
+                       "%u",
+                       &timeout))
+      {
+        GNUNET_break_op (0);
+        return TALER_MHD_reply_with_error (connection,
+                                           MHD_HTTP_BAD_REQUEST,
+                                           TALER_EC_PARAMETER_MALFORMED,
+                                           "timeout must be non-negative number");
+      }
+      tctx->sc.long_poll_timeout
+        = GNUNET_TIME_relative_to_absolute (GNUNET_TIME_relative_multiply (
+                                              GNUNET_TIME_UNIT_SECONDS,
+                                              timeout));
+    }
+    else
+    {
+      tctx->sc.long_poll_timeout = GNUNET_TIME_UNIT_ZERO_ABS;
+    }
   }
   else
   {
@@ -1121,6 +1252,33 @@ MH_handler_track_transaction (struct TMH_RequestHandler *rh,
                 ret ? "OK" : "FAILED");
     return ret;
   }
+  if (GNUNET_YES == tctx->park)
+  {
+    /* wire transfer still pending, wait for it to become known */
+    tctx->park = GNUNET_NO;
+    tctx->parked = GNUNET_YES;
+    TMH_compute_transfer_key (&tctx->h_contract_terms,
+                              &tctx->mi->pubkey,
+                              &tctx->sc.key);
+    TMH_long_poll_suspend (&tctx->sc,
+                           NULL);
+    return MHD_YES;
+  }
+  if (GNUNET_YES == tctx->parked)
+  {
+    tctx->parked = GNUNET_NO;
+    TMH_long_poll_release (&tctx->sc);
+    if (0 == GNUNET_TIME_absolute_get_remaining (
+          tctx->sc.long_poll_timeout).rel_value_us)
+    {
+      /* long-poll timed out, report what the exchange told us */
+      return TALER_MHD_reply_json (connection,
+                                   tctx->accepted_reply,
+                                   MHD_HTTP_ACCEPTED);
+    }
+    /* (some of) the wire transfers became known, start over */
+    clear_coins (tctx);
+  }
   if ( (NULL != tctx->fo) ||
        (NULL != tctx->eh) )
   {
@@ -1148,10 +1306,11 @@ MH_handler_track_transaction (struct TMH_RequestHandler *rh,
      the contract term's hashcode so as to retrieve all the
      coins which have been deposited for it. */
   db->preflight (db->cls);
-  qs = db->find_contract_terms (db->cls,
-                                &contract_terms,
-                                order_id,
-                                &tctx->mi->pubkey);
+  qs = db->find_contract_terms_with_hash (db->cls,
+                                          &contract_terms,
+                                          &tctx->h_contract_terms,
+                                          order_id,
+                                          &tctx->mi->pubkey);
   if (0 > qs)
   {
     GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
@@ -1166,17 +1325,6 @@ MH_handler_track_transaction (struct TMH_RequestHandler *rh,
                                        TALER_EC_PROPOSAL_LOOKUP_NOT_FOUND,
                                        "Given order_id doesn't map to any proposal");
 
-  if (GNUNET_OK !=
-      TALER_JSON_hash (contract_terms,
-                       &tctx->h_contract_terms))
-  {
-    json_decref (contract_terms);
-    return TALER_MHD_reply_with_error (connection,
-                                       MHD_HTTP_INTERNAL_SERVER_ERROR,
-                                       TALER_EC_INTERNAL_LOGIC_ERROR,
-                                       "Failed to hash contract terms");
-  }
-
   {
     struct GNUNET_JSON_Specification spec[] = {
       GNUNET_JSON_spec_absolute_time ("refund_deadline",
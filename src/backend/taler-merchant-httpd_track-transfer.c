@@ -27,6 +27,7 @@
 #include "taler-merchant-httpd_mhd.h"
 #include "taler-merchant-httpd_auditors.h"
 #include "taler-merchant-httpd_exchanges.h"
+#include "taler-merchant-httpd_metrics.h"
 #include "taler-merchant-httpd_track-transfer.h"
 
 
@@ -62,6 +63,11 @@ struct TrackTransferContext
    */
   struct TALER_EXCHANGE_TransfersGetHandle *wdh;
 
+  /**
+   * When did we start the request @e wdh?
+   */
+  struct GNUNET_TIME_Absolute wdh_start;
+
   /**
    * For which merchant instance is this tracking request?
    */
@@ -100,10 +106,10 @@ struct TrackTransferContext
   char *wire_method;
 
   /**
-   * Pointer to the detail that we are currently
+   * Details of the wire transfer that we are
    * checking in #check_transfer().
    */
-  const struct TALER_TrackTransferDetails *current_detail;
+  const struct TALER_TrackTransferDetails *details;
 
   /**
    * Argument for the /wire/transfers request.
@@ -120,11 +126,6 @@ struct TrackTransferContext
    */
   json_t *deposits_response;
 
-  /**
-   * Which transaction detail are we currently looking at?
-   */
-  unsigned int current_offset;
-
   /**
    * Response code to return.
    */
@@ -156,6 +157,35 @@ struct Entry
    */
   struct TALER_Amount deposit_fee;
 
+  /**
+   * Order ID of the contract, NULL until looked up.
+   */
+  char *order_id;
+
+};
+
+
+/**
+ * Closure for #collect_entry().
+ */
+struct EntryArray
+{
+
+  /**
+   * Keys of the entries (hashes of the contracts).
+   */
+  struct GNUNET_HashCode *h_contract_terms;
+
+  /**
+   * The entries.
+   */
+  struct Entry **entries;
+
+  /**
+   * Number of entries collected so far.
+   */
+  unsigned int off;
+
 };
 
 
@@ -210,71 +240,127 @@ hashmap_free (void *cls,
               const struct GNUNET_HashCode *key,
               void *value)
 {
-  struct TALER_Entry *entry = value;
+  struct Entry *entry = value;
 
   (void) cls;
   (void) key;
+  GNUNET_free_non_null (entry->order_id);
   GNUNET_free (entry);
   return GNUNET_YES;
 }
 
 
 /**
- * Builds JSON response containing the summed-up amounts
- * from individual deposits.
+ * Add an entry of the hashmap to the `struct EntryArray`.
  *
- * @param cls closure
+ * @param cls a `struct EntryArray`
  * @param key map's current key
- * @param map's current value
- * @return #GNUNET_YES if iteration is to be continued,
- *         #GNUNET_NO otherwise.
+ * @param value a `struct Entry`
+ * @return #GNUNET_YES (continue to iterate)
  */
 static int
-build_deposits_response (void *cls,
-                         const struct GNUNET_HashCode *key,
-                         void *value)
+collect_entry (void *cls,
+               const struct GNUNET_HashCode *key,
+               void *value)
 {
-  struct TrackTransferContext *rctx = cls;
-  struct Entry *entry = value;
-  json_t *element;
-  json_t *contract_terms;
-  json_t *order_id;
+  struct EntryArray *ea = cls;
 
-  db->preflight (db->cls);
-  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
-      db->find_contract_terms_from_hash (db->cls,
-                                         &contract_terms,
-                                         key,
-                                         &rctx->mi->pubkey))
-  {
-    GNUNET_break_op (0);
-    return GNUNET_NO;
-  }
+  ea->h_contract_terms[ea->off] = *key;
+  ea->entries[ea->off] = value;
+  ea->off++;
+  return GNUNET_YES;
+}
+
+
+/**
+ * Remember the order ID of a contract in its entry.
+ *
+ * @param cls array of `struct Entry *`
+ * @param offset offset of the entry in the array
+ * @param order_id order ID of the contract
+ */
+static void
+set_order_id (void *cls,
+              unsigned int offset,
+              const char *order_id)
+{
+  struct Entry **entries = cls;
+
+  GNUNET_free_non_null (entries[offset]->order_id);
+  entries[offset]->order_id = GNUNET_strdup (order_id);
+}
+
+
+/**
+ * Builds JSON response containing the summed-up amounts
+ * from individual deposits.  The order IDs of all contracts
+ * in @a map are looked up with a single statement.
+ *
+ * @param rctx context with the array to append the response to
+ * @param map maps hashes of contracts to `struct Entry`
+ * @return #GNUNET_OK on success
+ */
+static int
+build_deposits_response (struct TrackTransferContext *rctx,
+                         struct GNUNET_CONTAINER_MultiHashMap *map)
+{
+  unsigned int n = GNUNET_CONTAINER_multihashmap_size (map);
+  struct EntryArray ea = {
+    .h_contract_terms = GNUNET_new_array (GNUNET_MAX (1, n),
+                                          struct GNUNET_HashCode),
+    .entries = GNUNET_new_array (GNUNET_MAX (1, n),
+                                 struct Entry *)
+  };
+  enum GNUNET_DB_QueryStatus qs;
+  int ret = GNUNET_OK;
 
-  order_id = json_object_get (contract_terms,
-                              "order_id");
-  if (NULL == order_id)
+  GNUNET_CONTAINER_multihashmap_iterate (map,
+                                         &collect_entry,
+                                         &ea);
+  db->preflight (db->cls);
+  qs = db->find_order_ids_by_hashes (db->cls,
+                                     &rctx->mi->pubkey,
+                                     n,
+                                     ea.h_contract_terms,
+                                     &set_order_id,
+                                     ea.entries);
+  if (0 > qs)
   {
-    GNUNET_break_op (0);
-    json_decref (contract_terms);
-    return GNUNET_NO;
+    GNUNET_break (0);
+    ret = GNUNET_SYSERR;
+    goto cleanup;
   }
-  element = json_pack ("{s:O, s:o, s:o}",
-                       "order_id", order_id,
-                       "deposit_value", TALER_JSON_from_amount (
-                         &entry->deposit_value),
-                       "deposit_fee", TALER_JSON_from_amount (
-                         &entry->deposit_fee));
-  json_decref (contract_terms);
-  if (NULL == element)
+  for (unsigned int i = 0; i<n; i++)
   {
-    GNUNET_break_op (0);
-    return GNUNET_NO;
+    struct Entry *entry = ea.entries[i];
+    json_t *element;
+
+    if (NULL == entry->order_id)
+    {
+      GNUNET_break_op (0);
+      ret = GNUNET_SYSERR;
+      goto cleanup;
+    }
+    element = json_pack ("{s:s, s:o, s:o}",
+                         "order_id", entry->order_id,
+                         "deposit_value", TALER_JSON_from_amount (
+                           &entry->deposit_value),
+                         "deposit_fee", TALER_JSON_from_amount (
+                           &entry->deposit_fee));
+    if (NULL == element)
+    {
+      GNUNET_break_op (0);
+      ret = GNUNET_SYSERR;
+      goto cleanup;
+    }
+    GNUNET_break (0 ==
+                  json_array_append_new (rctx->deposits_response,
+                                         element));
   }
-  GNUNET_break (0 ==
-                json_array_append_new (rctx->deposits_response,
-                                       element));
-  return GNUNET_YES;
+cleanup:
+  GNUNET_free (ea.h_contract_terms);
+  GNUNET_free (ea.entries);
+  return ret;
 }
 
 
@@ -365,11 +451,14 @@ transform_response (const json_t *result,
   }
   rctx->deposits_response = json_array ();
 
-  if (GNUNET_SYSERR ==
-      GNUNET_CONTAINER_multihashmap_iterate (map,
-                                             &build_deposits_response,
-                                             rctx))
+  if (GNUNET_OK !=
+      build_deposits_response (rctx,
+                               map))
+  {
+    json_decref (rctx->deposits_response);
+    rctx->deposits_response = NULL;
     goto cleanup;
+  }
 
   result_mod = json_copy ((struct json_t *) result);
   json_object_del (result_mod,
@@ -436,18 +525,17 @@ track_transfer_cleanup (struct TM_HandlerContext *hc)
  * knew about this coin.
  *
  * @param cls closure with our `struct TrackTransferContext *`
- * @param transaction_id of the contract
- * @param coin_pub public key of the coin
- * @param exchange_url URL of the exchange that issued @a coin_pub
+ * @param offset offset of the coin in the details of the transfer
+ * @param exchange_url URL of the exchange that issued the coin
  * @param amount_with_fee amount the exchange will transfer for this coin
  * @param deposit_fee fee the exchange will charge for this coin
  * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee the exchange charges
  * @param exchange_proof proof from exchange that coin was accepted
  */
 static void
 check_transfer (void *cls,
-                const struct GNUNET_HashCode *h_contract_terms,
-                const struct TALER_CoinSpendPublicKeyP *coin_pub,
+                unsigned int offset,
                 const char *exchange_url,
                 const struct TALER_Amount *amount_with_fee,
                 const struct TALER_Amount *deposit_fee,
@@ -456,10 +544,10 @@ check_transfer (void *cls,
                 const json_t *exchange_proof)
 {
   struct TrackTransferContext *rctx = cls;
-  const struct TALER_TrackTransferDetails *ttd = rctx->current_detail;
+  const struct TALER_TrackTransferDetails *ttd = &rctx->details[offset];
 
   if (GNUNET_SYSERR == rctx->check_transfer_result)
-    return; /* already had a serious issue; odd that we're called more than once as well... */
+    return; /* already reported the first conflict */
   if ( (0 != TALER_amount_cmp (amount_with_fee,
                                &ttd->coin_value)) ||
        (0 != TALER_amount_cmp (deposit_fee,
@@ -476,9 +564,9 @@ check_transfer (void *cls,
           "code", (json_int_t) TALER_EC_TRACK_TRANSFER_CONFLICTING_REPORTS,
           "hint", "disagreement about deposit valuation",
           "exchange_deposit_proof", exchange_proof,
-          "conflict_offset", (json_int_t) rctx->current_offset,
+          "conflict_offset", (json_int_t) offset,
           "exchange_transfer_proof", rctx->original_response,
-          "coin_pub", GNUNET_JSON_from_data_auto (coin_pub),
+          "coin_pub", GNUNET_JSON_from_data_auto (&ttd->coin_pub),
           "h_contract_terms", GNUNET_JSON_from_data_auto (
             &ttd->h_contract_terms),
           "amount_with_fee", TALER_JSON_from_amount (amount_with_fee),
@@ -606,6 +694,9 @@ wire_transfer_cb (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   rctx->wdh = NULL;
+  TMH_METRICS_record_exchange (TMH_METRICS_EX_TRANSFERS_GET,
+                               rctx->wdh_start,
+                               hr->http_status);
   GNUNET_log (GNUNET_ERROR_TYPE_INFO,
               "Got response code %u from exchange for /track/transfer\n",
               hr->http_status);
@@ -666,23 +757,38 @@ wire_transfer_cb (void *cls,
    * exchange paid us for it, we must have received it _beforehands_!
    *
    * details_length is how many (Taler coin) deposits have been
-   * aggregated into _this_ wire transfer.
-   *///
-  for (unsigned int i = 0; i<details_length; i++)
+   * aggregated into _this_ wire transfer; we check them all
+   * with a single statement.
+   */
   {
-    rctx->current_offset = i;
-    rctx->current_detail = &details[i];
-    /* Set the coin as "never seen" before. */
+    struct GNUNET_HashCode *h_contract_terms;
+    struct TALER_CoinSpendPublicKeyP *coin_pubs;
+
+    h_contract_terms = GNUNET_new_array (GNUNET_MAX (1, details_length),
+                                         struct GNUNET_HashCode);
+    coin_pubs = GNUNET_new_array (GNUNET_MAX (1, details_length),
+                                  struct TALER_CoinSpendPublicKeyP);
+    for (unsigned int i = 0; i<details_length; i++)
+    {
+      h_contract_terms[i] = details[i].h_contract_terms;
+      coin_pubs[i] = details[i].coin_pub;
+    }
+    rctx->details = details;
+    /* Set the coins as "never seen" before. */
     rctx->check_transfer_result = GNUNET_NO;
     db->preflight (db->cls);
-    qs = db->find_payments_by_hash_and_coin (db->cls,
-                                             &details[i].h_contract_terms,
-                                             &rctx->mi->pubkey,
-                                             &details[i].coin_pub,
-                                             &check_transfer,
-                                             rctx);
+    qs = db->find_payments_by_coins (db->cls,
+                                     &rctx->mi->pubkey,
+                                     details_length,
+                                     h_contract_terms,
+                                     coin_pubs,
+                                     &check_transfer,
+                                     rctx);
+    rctx->details = NULL;
     if (0 > qs)
     {
+      GNUNET_free (h_contract_terms);
+      GNUNET_free (coin_pubs);
       /* single, read-only SQL statements should never cause
          serialization problems */
       GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
@@ -699,19 +805,27 @@ wire_transfer_cb (void *cls,
                                   "failed to obtain deposit data from local database"));
       return;
     }
-    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+    if (GNUNET_SYSERR == rctx->check_transfer_result)
     {
-      /* The exchange says we made this deposit, but WE do not
-         recall making it (corrupted / unreliable database?)!
-         Well, let's say thanks and accept the money! */
-      GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
-                  "Failed to find payment data in DB\n");
-      rctx->check_transfer_result = GNUNET_OK;
+      GNUNET_free (h_contract_terms);
+      GNUNET_free (coin_pubs);
+      /* #check_transfer() failed, report conflict! */
+      GNUNET_break_op (0);
+      GNUNET_assert (NULL != rctx->response);
+      resume_track_transfer_with_response
+        (rctx,
+        MHD_HTTP_FAILED_DEPENDENCY,
+        rctx->response);
+      rctx->response = NULL;
+      return;
     }
-    if (GNUNET_NO == rctx->check_transfer_result)
+    if ( (0 < qs) &&
+         (GNUNET_NO == rctx->check_transfer_result) )
     {
-      /* Internal error: how can we have called #check_transfer()
-         but still have no result? */
+      GNUNET_free (h_contract_terms);
+      GNUNET_free (coin_pubs);
+      /* Internal error: how can we have found coins without
+         calling #check_transfer()? */
       GNUNET_break (0);
       resume_track_transfer_with_response
         (rctx,
@@ -725,48 +839,54 @@ wire_transfer_cb (void *cls,
                                   "file", __FILE__));
       return;
     }
-    if (GNUNET_SYSERR == rctx->check_transfer_result)
+    if ((unsigned int) qs < details_length)
     {
-      /* #check_transfer() failed, report conflict! */
-      GNUNET_break_op (0);
-      GNUNET_assert (NULL != rctx->response);
-      resume_track_transfer_with_response
-        (rctx,
-        MHD_HTTP_FAILED_DEPENDENCY,
-        rctx->response);
-      rctx->response = NULL;
-      return;
+      /* The exchange says we made these deposits, but WE do not
+         recall making them (corrupted / unreliable database?)!
+         Well, let's say thanks and accept the money! */
+      GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                  "Failed to find payment data in DB for %u of %u coins\n",
+                  details_length - (unsigned int) qs,
+                  details_length);
     }
-    /* Response is consistent with the /deposit we made,
+
+    /* Response is consistent with the /deposits we made,
        remember it for future reference */
-    for (unsigned int r = 0; r<MAX_RETRIES; r++)
+    for (unsigned int i = 0; i<MAX_RETRIES; i++)
     {
       db->preflight (db->cls);
-      qs = db->store_coin_to_transfer (db->cls,
-                                       &details[i].h_contract_terms,
-                                       &details[i].coin_pub,
-                                       &rctx->wtid);
+      qs = db->store_coins_to_transfer (db->cls,
+                                        &rctx->wtid,
+                                        details_length,
+                                        h_contract_terms,
+                                        coin_pubs);
       if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
         break;
     }
-    if (0 > qs)
-    {
-      /* Special report if retries insufficient */
-      GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
-      /* Always report on hard error as well to enable diagnostics */
-      GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
-      resume_track_transfer_with_response
-        (rctx,
-        MHD_HTTP_INTERNAL_SERVER_ERROR,
-        TALER_MHD_make_json_pack ("{s:I, s:s}",
-                                  "code",
-                                  (json_int_t)
-                                  TALER_EC_TRACK_TRANSFER_DB_STORE_COIN_ERROR,
-                                  "details",
-                                  "failed to store response from exchange to local database"));
-      return;
-    }
+    GNUNET_free (h_contract_terms);
+    GNUNET_free (coin_pubs);
+  }
+  if (0 > qs)
+  {
+    /* Special report if retries insufficient */
+    GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR != qs);
+    /* Always report on hard error as well to enable diagnostics */
+    GNUNET_break (GNUNET_DB_STATUS_HARD_ERROR == qs);
+    resume_track_transfer_with_response
+      (rctx,
+      MHD_HTTP_INTERNAL_SERVER_ERROR,
+      TALER_MHD_make_json_pack ("{s:I, s:s}",
+                                "code",
+                                (json_int_t)
+                                TALER_EC_TRACK_TRANSFER_DB_STORE_COIN_ERROR,
+                                "details",
+                                "failed to store response from exchange to local database"));
+    return;
   }
+  /* wake up clients long-polling on /track/transaction */
+  TMH_long_poll_resume_transfers (details,
+                                  details_length,
+                                  &rctx->mi->pubkey);
   rctx->original_response = NULL;
 
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
@@ -830,6 +950,7 @@ process_track_transfer_with_exchange (void *cls,
     return;
   }
   rctx->eh = eh;
+  rctx->wdh_start = GNUNET_TIME_absolute_get ();
   rctx->wdh = TALER_EXCHANGE_transfers_get (eh,
                                             &rctx->wtid,
                                             &wire_transfer_cb,
@@ -23,6 +23,30 @@ BEGIN;
 -- Unlike the other SQL files, it SHOULD be updated to reflect the
 -- latest requirements for dropping tables.
 
+-- Drops for 0007.sql
+
+DROP FUNCTION IF EXISTS merchant_order_ids_insert CASCADE;
+DROP TABLE IF EXISTS merchant_order_ids CASCADE;
+
+-- Drops for 0006.sql
+
+DROP FUNCTION IF EXISTS merchant_orders_pay_deadline CASCADE;
+
+-- Drops for 0005.sql
+
+DROP SCHEMA IF EXISTS merchant_archive CASCADE;
+DROP FUNCTION IF EXISTS merchant_archive_partitions;
+DROP FUNCTION IF EXISTS merchant_create_partitions;
+
+-- Drops for 0003.sql
+
+DROP FUNCTION IF EXISTS merchant_contract_hot_columns CASCADE;
+DROP FUNCTION IF EXISTS merchant_json_time;
+
+-- Drops for 0002.sql
+
+DROP FUNCTION IF EXISTS merchant_do_pay;
+
 -- Drops for 0001.sql
 
 DROP TABLE IF EXISTS merchant_transfers CASCADE;
@@ -0,0 +1,149 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0002', NULL, NULL);
+
+
+-- Final bookkeeping of a /pay request, in one round trip.
+--
+-- Checks that all of the coins given in in_coin_pubs (the
+-- concatenation of their 32-byte public keys) were deposited for
+-- the contract, sums up the refunds granted on those coins and,
+-- if in_paid minus the refunds still covers in_needed, marks the
+-- contract as paid and (if in_session_id and in_fulfillment_url
+-- are not empty) remembers the order for the session.
+--
+-- out_status is
+--   0 if the contract is now paid,
+--   1 if the refunds ate into the payment (nothing was changed),
+--   2 if some coin (or the contract) is unknown (nothing was changed).
+-- out_refunded is the total refunded on the coins.
+--
+-- The function is called as a single statement in autocommit mode,
+-- so it runs at the default isolation level READ COMMITTED, not in
+-- a SERIALIZABLE transaction like the other statements of the
+-- plugin: each statement in here sees what was committed before it
+-- started.  This is still safe, as the first statement locks the row
+-- of the contract FOR UPDATE: concurrent calls for the same contract
+-- wait for the lock and then see the deposits and the paid flag
+-- committed by the call that held it, so they run one after the
+-- other.  Deposits are never removed, and a refund committed after
+-- we summed up the refunds is simply ordered after the payment.
+CREATE OR REPLACE FUNCTION merchant_do_pay
+  (IN in_merchant_pub BYTEA
+  ,IN in_h_contract_terms BYTEA
+  ,IN in_order_id VARCHAR
+  ,IN in_session_id VARCHAR
+  ,IN in_fulfillment_url VARCHAR
+  ,IN in_coin_pubs BYTEA
+  ,IN in_paid_val INT8
+  ,IN in_paid_frac INT4
+  ,IN in_needed_val INT8
+  ,IN in_needed_frac INT4
+  ,IN in_now INT8
+  ,OUT out_status INT4
+  ,OUT out_refunded_val INT8
+  ,OUT out_refunded_frac INT4)
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  coin_cnt INT4;
+  known_cnt INT4;
+  refunded NUMERIC;
+BEGIN
+  out_refunded_val = 0;
+  out_refunded_frac = 0;
+  coin_cnt = LENGTH(in_coin_pubs) / 32;
+
+  PERFORM 1
+    FROM merchant_contract_terms
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     FOR UPDATE;
+  IF NOT FOUND
+  THEN
+    out_status = 2;
+    RETURN;
+  END IF;
+
+  SELECT COUNT(*)
+    INTO known_cnt
+    FROM merchant_deposits
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     AND coin_pub IN
+       (SELECT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32)
+          FROM generate_series(0, coin_cnt - 1) AS i);
+  -- in_coin_pubs may list a coin more than once
+  IF known_cnt <
+     (SELECT COUNT(DISTINCT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32))
+        FROM generate_series(0, coin_cnt - 1) AS i)
+  THEN
+    out_status = 2;
+    RETURN;
+  END IF;
+
+  -- amounts are value plus fraction in units of 10^-8
+  SELECT COALESCE(SUM(refund_amount_val::NUMERIC * 100000000
+                      + refund_amount_frac), 0)
+    INTO refunded
+    FROM merchant_refunds
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     AND coin_pub IN
+       (SELECT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32)
+          FROM generate_series(0, coin_cnt - 1) AS i);
+  out_refunded_val = DIV(refunded, 100000000);
+  out_refunded_frac = MOD(refunded, 100000000);
+
+  IF in_paid_val::NUMERIC * 100000000 + in_paid_frac - refunded
+     < in_needed_val::NUMERIC * 100000000 + in_needed_frac
+  THEN
+    out_status = 1;
+    RETURN;
+  END IF;
+
+  UPDATE merchant_contract_terms
+     SET paid=TRUE
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub;
+
+  IF (in_session_id <> '') AND (in_fulfillment_url <> '')
+  THEN
+    INSERT INTO merchant_session_info
+      (session_id
+      ,fulfillment_url
+      ,order_id
+      ,merchant_pub
+      ,timestamp)
+    VALUES
+      (in_session_id
+      ,in_fulfillment_url
+      ,in_order_id
+      ,in_merchant_pub
+      ,in_now)
+    ON CONFLICT DO NOTHING;
+  END IF;
+
+  out_status = 0;
+END $$;
+
+-- Complete transaction
+COMMIT;
@@ -0,0 +1,123 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0003', NULL, NULL);
+
+
+-- Fields of orders and contract terms that are read frequently
+-- (e.g. by every /check-payment and /public/poll-payment) are
+-- kept in their own columns, so that such lookups neither ship
+-- nor parse the whole JSON document.  The contract_terms column
+-- itself stays BYTEA: its exact bytes are what the wallet got and
+-- what was hashed and signed.
+--
+-- The columns are maintained by a trigger; the amount is stored
+-- in the currency of the backend like all other amounts.
+
+ALTER TABLE merchant_orders
+  ADD COLUMN fulfillment_url VARCHAR NOT NULL DEFAULT ''
+ ,ADD COLUMN summary VARCHAR NOT NULL DEFAULT ''
+ ,ADD COLUMN amount_val INT8 NOT NULL DEFAULT 0
+ ,ADD COLUMN amount_frac INT4 NOT NULL DEFAULT 0
+ ,ADD COLUMN refund_deadline INT8 NOT NULL DEFAULT 0;
+
+ALTER TABLE merchant_contract_terms
+  ADD COLUMN fulfillment_url VARCHAR NOT NULL DEFAULT ''
+ ,ADD COLUMN summary VARCHAR NOT NULL DEFAULT ''
+ ,ADD COLUMN amount_val INT8 NOT NULL DEFAULT 0
+ ,ADD COLUMN amount_frac INT4 NOT NULL DEFAULT 0
+ ,ADD COLUMN refund_deadline INT8 NOT NULL DEFAULT 0;
+
+
+-- Convert a timestamp in the JSON encoding of libgnunetjson to
+-- microseconds, as stored by libgnunetpq.  Accepts both the
+-- {"t_ms": N} and the "/Date(N)/" encodings; "never" becomes
+-- INT8_MAX.  Returns 0 if in_t is NULL or malformed.
+CREATE OR REPLACE FUNCTION merchant_json_time (
+  IN in_t JSONB)
+RETURNS INT8
+LANGUAGE plpgsql
+IMMUTABLE
+AS $$
+DECLARE
+  t TEXT;
+BEGIN
+  IF in_t IS NULL
+  THEN
+    RETURN 0;
+  END IF;
+  IF jsonb_typeof (in_t) = 'object'
+  THEN
+    t = in_t->>'t_ms';
+    IF t = 'never'
+    THEN
+      RETURN 9223372036854775807;
+    END IF;
+    RETURN COALESCE (substring (t FROM '^[0-9]+$')::INT8 * 1000, 0);
+  END IF;
+  t = in_t #>> '{}';
+  IF t = '/never/'
+  THEN
+    RETURN 9223372036854775807;
+  END IF;
+  RETURN COALESCE (substring (t FROM '^/Date\(([0-9]+)\)/$')::INT8 * 1000000,
+                   0);
+END $$;
+
+
+-- Trigger function filling the frequently read columns from
+-- NEW.contract_terms.
+CREATE OR REPLACE FUNCTION merchant_contract_hot_columns ()
+RETURNS TRIGGER
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  ct JSONB;
+  amount NUMERIC;
+BEGIN
+  ct = convert_from (NEW.contract_terms, 'UTF8')::JSONB;
+  NEW.fulfillment_url = COALESCE (ct->>'fulfillment_url', '');
+  NEW.summary = COALESCE (ct->>'summary', '');
+  amount = COALESCE (substring (ct->>'amount' FROM ':([0-9.]+)$')::NUMERIC,
+                     0);
+  NEW.amount_val = trunc (amount);
+  NEW.amount_frac = (amount - trunc (amount)) * 100000000;
+  NEW.refund_deadline = merchant_json_time (ct->'refund_deadline');
+  RETURN NEW;
+END $$;
+
+CREATE TRIGGER merchant_orders_hot_columns
+  BEFORE INSERT OR UPDATE OF contract_terms
+  ON merchant_orders
+  FOR EACH ROW EXECUTE PROCEDURE merchant_contract_hot_columns ();
+
+CREATE TRIGGER merchant_contract_terms_hot_columns
+  BEFORE INSERT OR UPDATE OF contract_terms
+  ON merchant_contract_terms
+  FOR EACH ROW EXECUTE PROCEDURE merchant_contract_hot_columns ();
+
+-- Fill the columns for existing rows.
+UPDATE merchant_orders
+  SET contract_terms=contract_terms;
+UPDATE merchant_contract_terms
+  SET contract_terms=contract_terms;
+
+-- Complete transaction
+COMMIT;
@@ -0,0 +1,47 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0004', NULL, NULL);
+
+
+-- Contract terms are claimed once but looked up on every retry
+-- of the claim.  We keep what is needed to answer such a lookup
+-- next to the contract terms, so that it does not have to parse,
+-- hash or sign them again: the nonce the contract was claimed
+-- with and the merchant's signature over h_contract_terms.
+--
+-- The contract_terms of claimed contracts are stored in their
+-- canonical form (compact, keys sorted), which is exactly what
+-- h_contract_terms was computed over.
+--
+-- The signature is NULL for contracts claimed before this patch.
+
+ALTER TABLE merchant_contract_terms
+  ADD COLUMN nonce VARCHAR NOT NULL DEFAULT ''
+ ,ADD COLUMN merchant_sig BYTEA DEFAULT NULL
+    CHECK (LENGTH(merchant_sig)=64);
+
+-- Fill the nonce for existing rows.
+UPDATE merchant_contract_terms
+  SET nonce=COALESCE (convert_from (contract_terms, 'UTF8')::JSONB->>'nonce',
+                      '');
+
+-- Complete transaction
+COMMIT;
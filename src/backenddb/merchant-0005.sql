@@ -0,0 +1,547 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0005', NULL, NULL);
+
+
+-- merchant_contract_terms, merchant_deposits, merchant_refunds,
+-- merchant_refund_proofs and merchant_transfers are partitioned by
+-- month, using the timestamp of the contract as the partition key.
+-- Tables other than merchant_contract_terms carry the timestamp of
+-- their contract in contract_timestamp.  The timestamp is part of
+-- the contract terms and thus of h_contract_terms, so adding it to
+-- the unique keys does not weaken them.
+--
+-- Old months can be detached and moved to the merchant_archive
+-- schema with merchant_archive_partitions() (see
+-- taler-merchant-archive), from where they can be dumped and
+-- dropped; future months are created by merchant_create_partitions().
+-- Rows that fall outside of all monthly partitions (like transfers
+-- of coins for contracts we do not know) end up in the *_default
+-- partitions, which are never archived.
+--
+-- Requires PostgreSQL 12 or later (foreign keys referencing
+-- partitioned tables).  The migration copies the existing rows of
+-- these tables once.
+
+CREATE SCHEMA IF NOT EXISTS merchant_archive;
+
+-- Keep the sequences, they are re-attached to the new tables below.
+ALTER SEQUENCE merchant_contract_terms_row_id_seq
+  OWNED BY NONE;
+ALTER SEQUENCE merchant_refunds_rtransaction_id_seq
+  OWNED BY NONE;
+ALTER SEQUENCE merchant_refund_proofs_rtransaction_id_seq
+  OWNED BY NONE;
+
+DROP INDEX IF EXISTS merchant_transfers_by_coin;
+DROP INDEX IF EXISTS merchant_transfers_by_wtid;
+
+ALTER TABLE merchant_refund_proofs
+  RENAME TO merchant_refund_proofs_old;
+ALTER TABLE merchant_refunds
+  RENAME TO merchant_refunds_old;
+ALTER TABLE merchant_transfers
+  RENAME TO merchant_transfers_old;
+ALTER TABLE merchant_deposits
+  RENAME TO merchant_deposits_old;
+ALTER TABLE merchant_contract_terms
+  RENAME TO merchant_contract_terms_old;
+
+
+CREATE TABLE merchant_contract_terms
+  (order_id VARCHAR NOT NULL
+  ,merchant_pub BYTEA NOT NULL CHECK (LENGTH(merchant_pub)=32)
+  ,contract_terms BYTEA NOT NULL
+  ,h_contract_terms BYTEA NOT NULL CHECK (LENGTH(h_contract_terms)=64)
+  ,timestamp INT8 NOT NULL
+  ,row_id INT8 NOT NULL DEFAULT nextval ('merchant_contract_terms_row_id_seq')
+  ,paid BOOLEAN DEFAULT FALSE NOT NULL
+  ,fulfillment_url VARCHAR NOT NULL DEFAULT ''
+  ,summary VARCHAR NOT NULL DEFAULT ''
+  ,amount_val INT8 NOT NULL DEFAULT 0
+  ,amount_frac INT4 NOT NULL DEFAULT 0
+  ,refund_deadline INT8 NOT NULL DEFAULT 0
+  ,nonce VARCHAR NOT NULL DEFAULT ''
+  ,merchant_sig BYTEA DEFAULT NULL CHECK (LENGTH(merchant_sig)=64)
+  ,PRIMARY KEY (order_id, merchant_pub, timestamp)
+  ,UNIQUE (h_contract_terms, merchant_pub, timestamp)
+  ) PARTITION BY RANGE (timestamp);
+CREATE INDEX merchant_contract_terms_by_row_id
+  ON merchant_contract_terms
+  (row_id);
+ALTER SEQUENCE merchant_contract_terms_row_id_seq
+  OWNED BY merchant_contract_terms.row_id;
+
+CREATE TABLE merchant_deposits
+  (h_contract_terms BYTEA NOT NULL
+  ,merchant_pub BYTEA NOT NULL CHECK (LENGTH(merchant_pub)=32)
+  ,coin_pub BYTEA NOT NULL CHECK (LENGTH(coin_pub)=32)
+  ,exchange_url VARCHAR NOT NULL
+  ,amount_with_fee_val INT8 NOT NULL
+  ,amount_with_fee_frac INT4 NOT NULL
+  ,deposit_fee_val INT8 NOT NULL
+  ,deposit_fee_frac INT4 NOT NULL
+  ,refund_fee_val INT8 NOT NULL
+  ,refund_fee_frac INT4 NOT NULL
+  ,wire_fee_val INT8 NOT NULL
+  ,wire_fee_frac INT4 NOT NULL
+  ,signkey_pub BYTEA NOT NULL CHECK (LENGTH(signkey_pub)=32)
+  ,exchange_proof BYTEA NOT NULL
+  ,contract_timestamp INT8 NOT NULL
+  ,PRIMARY KEY (h_contract_terms, coin_pub, contract_timestamp)
+  ,FOREIGN KEY (h_contract_terms, merchant_pub, contract_timestamp)
+   REFERENCES merchant_contract_terms (h_contract_terms, merchant_pub, timestamp)
+  ) PARTITION BY RANGE (contract_timestamp);
+
+-- Note that h_contract_terms + coin_pub may actually be unknown to
+-- us, hence contract_timestamp is 0 if we do not know the contract.
+CREATE TABLE merchant_transfers
+  (h_contract_terms BYTEA NOT NULL
+  ,coin_pub BYTEA NOT NULL CHECK (LENGTH(coin_pub)=32)
+  ,wtid BYTEA NOT NULL CHECK (LENGTH(wtid)=32)
+  ,contract_timestamp INT8 NOT NULL
+  ,PRIMARY KEY (h_contract_terms, coin_pub, contract_timestamp)
+  ) PARTITION BY RANGE (contract_timestamp);
+CREATE INDEX merchant_transfers_by_wtid
+  ON merchant_transfers
+  (wtid);
+
+CREATE TABLE merchant_refunds
+  (rtransaction_id INT8 NOT NULL
+     DEFAULT nextval ('merchant_refunds_rtransaction_id_seq')
+  ,merchant_pub BYTEA NOT NULL
+  ,h_contract_terms BYTEA NOT NULL
+  ,coin_pub BYTEA NOT NULL
+  ,reason VARCHAR NOT NULL
+  ,refund_amount_val INT8 NOT NULL
+  ,refund_amount_frac INT4 NOT NULL
+  ,contract_timestamp INT8 NOT NULL
+  ,FOREIGN KEY (h_contract_terms, coin_pub, contract_timestamp)
+   REFERENCES merchant_deposits (h_contract_terms, coin_pub, contract_timestamp)
+  ,FOREIGN KEY (h_contract_terms, merchant_pub, contract_timestamp)
+   REFERENCES merchant_contract_terms (h_contract_terms, merchant_pub, timestamp)
+  ,PRIMARY KEY (h_contract_terms, merchant_pub, coin_pub, rtransaction_id,
+                contract_timestamp)
+  ) PARTITION BY RANGE (contract_timestamp);
+ALTER SEQUENCE merchant_refunds_rtransaction_id_seq
+  OWNED BY merchant_refunds.rtransaction_id;
+
+CREATE TABLE merchant_refund_proofs
+  (rtransaction_id INT8 NOT NULL
+     DEFAULT nextval ('merchant_refund_proofs_rtransaction_id_seq')
+  ,merchant_pub BYTEA NOT NULL CHECK (LENGTH(merchant_pub)=32)
+  ,h_contract_terms BYTEA NOT NULL CHECK (LENGTH(h_contract_terms)=64)
+  ,coin_pub BYTEA NOT NULL CHECK (LENGTH(coin_pub)=32)
+  ,exchange_sig BYTEA NOT NULL CHECK (LENGTH(exchange_sig)=64)
+  ,exchange_pub BYTEA NOT NULL CHECK (LENGTH(exchange_pub)=32)
+  ,contract_timestamp INT8 NOT NULL
+  ,FOREIGN KEY (h_contract_terms, merchant_pub, coin_pub, rtransaction_id,
+                contract_timestamp)
+   REFERENCES merchant_refunds (h_contract_terms, merchant_pub, coin_pub,
+                                rtransaction_id, contract_timestamp)
+  ,PRIMARY KEY (h_contract_terms, merchant_pub, coin_pub, rtransaction_id,
+                contract_timestamp)
+  ) PARTITION BY RANGE (contract_timestamp);
+ALTER SEQUENCE merchant_refund_proofs_rtransaction_id_seq
+  OWNED BY merchant_refund_proofs.rtransaction_id;
+
+
+-- Create the monthly partitions of all partitioned tables for the
+-- months from in_start to in_end (both timestamps in microseconds,
+-- months in UTC), unless they exist already.  Returns the number
+-- of partitions created.  A month for which rows already ended up
+-- in a default partition is skipped with a warning.
+CREATE OR REPLACE FUNCTION merchant_create_partitions (
+  IN in_start INT8
+ ,IN in_end INT8)
+RETURNS INT4
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  month TIMESTAMP;
+  lo INT8;
+  hi INT8;
+  t TEXT;
+  p TEXT;
+  created INT4 = 0;
+BEGIN
+  month = date_trunc ('month', to_timestamp (in_start / 1000000.0)
+                               AT TIME ZONE 'UTC');
+  WHILE month < to_timestamp (in_end / 1000000.0) AT TIME ZONE 'UTC'
+  LOOP
+    lo = (EXTRACT (EPOCH FROM month) * 1000000)::INT8;
+    hi = (EXTRACT (EPOCH FROM month + INTERVAL '1 month') * 1000000)::INT8;
+    FOREACH t IN ARRAY ARRAY['merchant_contract_terms'
+                            ,'merchant_deposits'
+                            ,'merchant_transfers'
+                            ,'merchant_refunds'
+                            ,'merchant_refund_proofs']
+    LOOP
+      p = t || '_' || to_char (month, 'YYYYMM');
+      CONTINUE WHEN to_regclass (p) IS NOT NULL;
+      BEGIN
+        EXECUTE format ('CREATE TABLE %I PARTITION OF %I'
+                        ' FOR VALUES FROM (%s) TO (%s)',
+                        p, t, lo, hi);
+      EXCEPTION WHEN check_violation THEN
+        RAISE WARNING 'rows for % are in the default partition of %, not creating %',
+          to_char (month, 'YYYY-MM'), t, p;
+        CONTINUE;
+      END;
+      IF t = 'merchant_contract_terms'
+      THEN
+        EXECUTE format ('CREATE TRIGGER merchant_contract_terms_hot_columns'
+                        ' BEFORE INSERT OR UPDATE OF contract_terms ON %I'
+                        ' FOR EACH ROW EXECUTE PROCEDURE'
+                        ' merchant_contract_hot_columns ()',
+                        p);
+      END IF;
+      created = created + 1;
+    END LOOP;
+    month = month + INTERVAL '1 month';
+  END LOOP;
+  RETURN created;
+END $$;
+
+
+-- Detach the monthly partitions of all partitioned tables that only
+-- hold rows with a (contract) timestamp before in_before and move
+-- them to the merchant_archive schema.  Returns the number of
+-- partitions archived.
+CREATE OR REPLACE FUNCTION merchant_archive_partitions (
+  IN in_before INT8)
+RETURNS INT4
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  suffix TEXT;
+  t TEXT;
+  p TEXT;
+  fk RECORD;
+  archived INT4 = 0;
+BEGIN
+  FOR suffix IN
+    SELECT substring (c.relname FROM '_([0-9]{6})$')
+      FROM pg_inherits i
+      JOIN pg_class c
+        ON (c.oid = i.inhrelid)
+     WHERE i.inhparent = 'merchant_contract_terms'::regclass
+       AND c.relname ~ '_[0-9]{6}$'
+     ORDER BY 1
+  LOOP
+    EXIT WHEN (EXTRACT (EPOCH FROM to_date (suffix, 'YYYYMM')
+                                   + INTERVAL '1 month')
+               * 1000000)::INT8 > in_before;
+    -- referencing tables first, so that no foreign key is violated
+    FOREACH t IN ARRAY ARRAY['merchant_refund_proofs'
+                            ,'merchant_refunds'
+                            ,'merchant_transfers'
+                            ,'merchant_deposits'
+                            ,'merchant_contract_terms']
+    LOOP
+      p = t || '_' || suffix;
+      CONTINUE WHEN to_regclass (p) IS NULL;
+      EXECUTE format ('ALTER TABLE %I DETACH PARTITION %I',
+                      t, p);
+      -- the foreign keys were kept when detaching, but now refer
+      -- to rows that are about to go as well
+      FOR fk IN
+        SELECT conname
+          FROM pg_constraint
+         WHERE conrelid = p::regclass
+           AND contype = 'f'
+      LOOP
+        EXECUTE format ('ALTER TABLE %I DROP CONSTRAINT %I',
+                        p, fk.conname);
+      END LOOP;
+      EXECUTE format ('ALTER TABLE %I SET SCHEMA merchant_archive',
+                      p);
+      archived = archived + 1;
+    END LOOP;
+  END LOOP;
+  RETURN archived;
+END $$;
+
+
+CREATE TABLE merchant_contract_terms_default
+  PARTITION OF merchant_contract_terms DEFAULT;
+CREATE TRIGGER merchant_contract_terms_hot_columns
+  BEFORE INSERT OR UPDATE OF contract_terms
+  ON merchant_contract_terms_default
+  FOR EACH ROW EXECUTE PROCEDURE merchant_contract_hot_columns ();
+CREATE TABLE merchant_deposits_default
+  PARTITION OF merchant_deposits DEFAULT;
+CREATE TABLE merchant_transfers_default
+  PARTITION OF merchant_transfers DEFAULT;
+CREATE TABLE merchant_refunds_default
+  PARTITION OF merchant_refunds DEFAULT;
+CREATE TABLE merchant_refund_proofs_default
+  PARTITION OF merchant_refund_proofs DEFAULT;
+
+-- Partitions for the existing contracts and the next three months.
+SELECT merchant_create_partitions (
+  COALESCE ((SELECT MIN(timestamp) FROM merchant_contract_terms_old),
+            (EXTRACT (EPOCH FROM CURRENT_TIMESTAMP) * 1000000)::INT8)
+ ,((EXTRACT (EPOCH FROM CURRENT_TIMESTAMP + INTERVAL '3 months'))
+   * 1000000)::INT8);
+
+
+INSERT INTO merchant_contract_terms
+  (order_id
+  ,merchant_pub
+  ,contract_terms
+  ,h_contract_terms
+  ,timestamp
+  ,row_id
+  ,paid
+  ,fulfillment_url
+  ,summary
+  ,amount_val
+  ,amount_frac
+  ,refund_deadline
+  ,nonce
+  ,merchant_sig)
+  SELECT
+    order_id
+   ,merchant_pub
+   ,contract_terms
+   ,h_contract_terms
+   ,timestamp
+   ,row_id
+   ,paid
+   ,fulfillment_url
+   ,summary
+   ,amount_val
+   ,amount_frac
+   ,refund_deadline
+   ,nonce
+   ,merchant_sig
+  FROM merchant_contract_terms_old;
+
+INSERT INTO merchant_deposits
+  (h_contract_terms
+  ,merchant_pub
+  ,coin_pub
+  ,exchange_url
+  ,amount_with_fee_val
+  ,amount_with_fee_frac
+  ,deposit_fee_val
+  ,deposit_fee_frac
+  ,refund_fee_val
+  ,refund_fee_frac
+  ,wire_fee_val
+  ,wire_fee_frac
+  ,signkey_pub
+  ,exchange_proof
+  ,contract_timestamp)
+  SELECT
+    d.h_contract_terms
+   ,d.merchant_pub
+   ,d.coin_pub
+   ,d.exchange_url
+   ,d.amount_with_fee_val
+   ,d.amount_with_fee_frac
+   ,d.deposit_fee_val
+   ,d.deposit_fee_frac
+   ,d.refund_fee_val
+   ,d.refund_fee_frac
+   ,d.wire_fee_val
+   ,d.wire_fee_frac
+   ,d.signkey_pub
+   ,d.exchange_proof
+   ,c.timestamp
+  FROM merchant_deposits_old d
+  JOIN merchant_contract_terms_old c
+    USING (h_contract_terms, merchant_pub);
+
+INSERT INTO merchant_transfers
+  (h_contract_terms
+  ,coin_pub
+  ,wtid
+  ,contract_timestamp)
+  SELECT
+    t.h_contract_terms
+   ,t.coin_pub
+   ,t.wtid
+   ,COALESCE ((SELECT c.timestamp
+                 FROM merchant_contract_terms_old c
+                WHERE c.h_contract_terms=t.h_contract_terms
+                LIMIT 1), 0)
+  FROM merchant_transfers_old t;
+
+INSERT INTO merchant_refunds
+  (rtransaction_id
+  ,merchant_pub
+  ,h_contract_terms
+  ,coin_pub
+  ,reason
+  ,refund_amount_val
+  ,refund_amount_frac
+  ,contract_timestamp)
+  SELECT
+    r.rtransaction_id
+   ,r.merchant_pub
+   ,r.h_contract_terms
+   ,r.coin_pub
+   ,r.reason
+   ,r.refund_amount_val
+   ,r.refund_amount_frac
+   ,c.timestamp
+  FROM merchant_refunds_old r
+  JOIN merchant_contract_terms_old c
+    USING (h_contract_terms, merchant_pub);
+
+INSERT INTO merchant_refund_proofs
+  (rtransaction_id
+  ,merchant_pub
+  ,h_contract_terms
+  ,coin_pub
+  ,exchange_sig
+  ,exchange_pub
+  ,contract_timestamp)
+  SELECT
+    p.rtransaction_id
+   ,p.merchant_pub
+   ,p.h_contract_terms
+   ,p.coin_pub
+   ,p.exchange_sig
+   ,p.exchange_pub
+   ,c.timestamp
+  FROM merchant_refund_proofs_old p
+  JOIN merchant_contract_terms_old c
+    USING (h_contract_terms, merchant_pub);
+
+DROP TABLE merchant_refund_proofs_old;
+DROP TABLE merchant_refunds_old;
+DROP TABLE merchant_transfers_old;
+DROP TABLE merchant_deposits_old;
+DROP TABLE merchant_contract_terms_old;
+
+
+-- Same as in merchant-0002.sql, but looks up the timestamp of the
+-- contract first, so that the lookups of deposits and refunds
+-- only visit the partitions of the contract's month.
+CREATE OR REPLACE FUNCTION merchant_do_pay
+  (IN in_merchant_pub BYTEA
+  ,IN in_h_contract_terms BYTEA
+  ,IN in_order_id VARCHAR
+  ,IN in_session_id VARCHAR
+  ,IN in_fulfillment_url VARCHAR
+  ,IN in_coin_pubs BYTEA
+  ,IN in_paid_val INT8
+  ,IN in_paid_frac INT4
+  ,IN in_needed_val INT8
+  ,IN in_needed_frac INT4
+  ,IN in_now INT8
+  ,OUT out_status INT4
+  ,OUT out_refunded_val INT8
+  ,OUT out_refunded_frac INT4)
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  coin_cnt INT4;
+  known_cnt INT4;
+  refunded NUMERIC;
+  ts INT8;
+BEGIN
+  out_refunded_val = 0;
+  out_refunded_frac = 0;
+  coin_cnt = LENGTH(in_coin_pubs) / 32;
+
+  SELECT timestamp
+    INTO ts
+    FROM merchant_contract_terms
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     FOR UPDATE;
+  IF NOT FOUND
+  THEN
+    out_status = 2;
+    RETURN;
+  END IF;
+
+  SELECT COUNT(*)
+    INTO known_cnt
+    FROM merchant_deposits
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     AND contract_timestamp=ts
+     AND coin_pub IN
+       (SELECT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32)
+          FROM generate_series(0, coin_cnt - 1) AS i);
+  -- in_coin_pubs may list a coin more than once
+  IF known_cnt <
+     (SELECT COUNT(DISTINCT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32))
+        FROM generate_series(0, coin_cnt - 1) AS i)
+  THEN
+    out_status = 2;
+    RETURN;
+  END IF;
+
+  -- amounts are value plus fraction in units of 10^-8
+  SELECT COALESCE(SUM(refund_amount_val::NUMERIC * 100000000
+                      + refund_amount_frac), 0)
+    INTO refunded
+    FROM merchant_refunds
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     AND contract_timestamp=ts
+     AND coin_pub IN
+       (SELECT SUBSTRING(in_coin_pubs FROM 32 * i + 1 FOR 32)
+          FROM generate_series(0, coin_cnt - 1) AS i);
+  out_refunded_val = DIV(refunded, 100000000);
+  out_refunded_frac = MOD(refunded, 100000000);
+
+  IF in_paid_val::NUMERIC * 100000000 + in_paid_frac - refunded
+     < in_needed_val::NUMERIC * 100000000 + in_needed_frac
+  THEN
+    out_status = 1;
+    RETURN;
+  END IF;
+
+  UPDATE merchant_contract_terms
+     SET paid=TRUE
+   WHERE h_contract_terms=in_h_contract_terms
+     AND merchant_pub=in_merchant_pub
+     AND timestamp=ts;
+
+  IF (in_session_id <> '') AND (in_fulfillment_url <> '')
+  THEN
+    INSERT INTO merchant_session_info
+      (session_id
+      ,fulfillment_url
+      ,order_id
+      ,merchant_pub
+      ,timestamp)
+    VALUES
+      (in_session_id
+      ,in_fulfillment_url
+      ,in_order_id
+      ,in_merchant_pub
+      ,in_now)
+    ON CONFLICT DO NOTHING;
+  END IF;
+
+  out_status = 0;
+END $$;
+
+-- Complete transaction
+COMMIT;
@@ -0,0 +1,68 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0006', NULL, NULL);
+
+
+-- Orders are only read until they are claimed (afterwards the
+-- contract terms are used) or until their pay_deadline has passed,
+-- but nothing ever deleted them.  taler-merchant-gc deletes such
+-- rows in small batches; to find expired orders without parsing
+-- every order, the pay_deadline gets its own column.
+
+ALTER TABLE merchant_orders
+  ADD COLUMN pay_deadline INT8 NOT NULL DEFAULT 9223372036854775807;
+
+-- Trigger function filling pay_deadline from NEW.contract_terms.
+-- Orders without (valid) pay_deadline never expire.
+CREATE OR REPLACE FUNCTION merchant_orders_pay_deadline ()
+RETURNS TRIGGER
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  pd INT8;
+BEGIN
+  pd = merchant_json_time (convert_from (NEW.contract_terms, 'UTF8')::JSONB
+                             ->'pay_deadline');
+  IF pd = 0
+  THEN
+    pd = 9223372036854775807;
+  END IF;
+  NEW.pay_deadline = pd;
+  RETURN NEW;
+END $$;
+
+CREATE TRIGGER merchant_orders_pay_deadline
+  BEFORE INSERT OR UPDATE OF contract_terms
+  ON merchant_orders
+  FOR EACH ROW EXECUTE PROCEDURE merchant_orders_pay_deadline ();
+
+-- Fill the column for existing rows.
+UPDATE merchant_orders
+  SET contract_terms=contract_terms;
+
+CREATE INDEX IF NOT EXISTS merchant_orders_by_pay_deadline
+  ON merchant_orders (pay_deadline);
+
+CREATE INDEX IF NOT EXISTS merchant_session_info_by_timestamp
+  ON merchant_session_info (timestamp);
+
+-- Complete transaction
+COMMIT;
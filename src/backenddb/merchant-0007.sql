@@ -0,0 +1,149 @@
+--
+-- This file is part of TALER
+-- Copyright (C) 2020 Taler Systems SA
+--
+-- TALER is free software; you can redistribute it and/or modify it under the
+-- terms of the GNU General Public License as published by the Free Software
+-- Foundation; either version 3, or (at your option) any later version.
+--
+-- TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+-- WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+-- A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License along with
+-- TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+--
+
+-- Everything in one big transaction
+BEGIN;
+
+-- Check patch versioning is in place.
+SELECT _v.register_patch('merchant-0007', NULL, NULL);
+
+
+-- Since merchant-0005.sql the primary key of merchant_contract_terms
+-- includes the timestamp (the partition key), so it no longer keeps
+-- an order ID from being claimed twice, and archived contracts are
+-- not visible to the check of insert_order at all.  Order IDs of
+-- contracts are thus also kept in merchant_order_ids, which is not
+-- partitioned and never archived.
+
+CREATE TABLE IF NOT EXISTS merchant_order_ids
+  (order_id VARCHAR NOT NULL
+  ,merchant_pub BYTEA NOT NULL CHECK (LENGTH(merchant_pub)=32)
+  ,PRIMARY KEY (order_id, merchant_pub)
+  );
+
+INSERT INTO merchant_order_ids
+  (order_id
+  ,merchant_pub)
+  SELECT order_id
+        ,merchant_pub
+    FROM merchant_contract_terms
+  ON CONFLICT DO NOTHING;
+
+DO $$
+DECLARE
+  p TEXT;
+BEGIN
+  FOR p IN
+    SELECT tablename
+      FROM pg_tables
+     WHERE schemaname = 'merchant_archive'
+       AND tablename ~ '^merchant_contract_terms_[0-9]{6}$'
+  LOOP
+    EXECUTE format ('INSERT INTO merchant_order_ids'
+                    ' (order_id, merchant_pub)'
+                    ' SELECT order_id, merchant_pub'
+                    '   FROM merchant_archive.%I'
+                    ' ON CONFLICT DO NOTHING',
+                    p);
+  END LOOP;
+END $$;
+
+-- Trigger function recording the order ID of NEW; fails with a
+-- unique violation if the order ID was used before, which aborts
+-- the insertion of the contract terms.
+CREATE OR REPLACE FUNCTION merchant_order_ids_insert ()
+RETURNS TRIGGER
+LANGUAGE plpgsql
+AS $$
+BEGIN
+  INSERT INTO merchant_order_ids
+    (order_id
+    ,merchant_pub)
+  VALUES
+    (NEW.order_id
+    ,NEW.merchant_pub);
+  RETURN NULL;
+END $$;
+
+-- AFTER triggers on a partitioned table are inherited by all of its
+-- (future) partitions, and dropped from partitions that get detached.
+CREATE TRIGGER merchant_contract_terms_order_id
+  AFTER INSERT ON merchant_contract_terms
+  FOR EACH ROW EXECUTE PROCEDURE merchant_order_ids_insert ();
+
+
+-- Same as in merchant-0005.sql, but fails if rows for a month are
+-- already in a default partition instead of skipping the month with
+-- a warning: those rows would never be archived, so this needs the
+-- attention of the operator.  Also tolerates concurrent invocations
+-- (as done by several workers of taler-merchant-httpd starting up).
+CREATE OR REPLACE FUNCTION merchant_create_partitions (
+  IN in_start INT8
+ ,IN in_end INT8)
+RETURNS INT4
+LANGUAGE plpgsql
+AS $$
+DECLARE
+  month TIMESTAMP;
+  lo INT8;
+  hi INT8;
+  t TEXT;
+  p TEXT;
+  created INT4 = 0;
+BEGIN
+  month = date_trunc ('month', to_timestamp (in_start / 1000000.0)
+                               AT TIME ZONE 'UTC');
+  WHILE month < to_timestamp (in_end / 1000000.0) AT TIME ZONE 'UTC'
+  LOOP
+    lo = (EXTRACT (EPOCH FROM month) * 1000000)::INT8;
+    hi = (EXTRACT (EPOCH FROM month + INTERVAL '1 month') * 1000000)::INT8;
+    FOREACH t IN ARRAY ARRAY['merchant_contract_terms'
+                            ,'merchant_deposits'
+                            ,'merchant_transfers'
+                            ,'merchant_refunds'
+                            ,'merchant_refund_proofs']
+    LOOP
+      p = t || '_' || to_char (month, 'YYYYMM');
+      CONTINUE WHEN to_regclass (p) IS NOT NULL;
+      BEGIN
+        EXECUTE format ('CREATE TABLE %I PARTITION OF %I'
+                        ' FOR VALUES FROM (%s) TO (%s)',
+                        p, t, lo, hi);
+      EXCEPTION
+        WHEN duplicate_table OR unique_violation THEN
+          CONTINUE;
+        WHEN check_violation THEN
+          RAISE EXCEPTION 'rows for % are in the default partition of %, cannot create %',
+            to_char (month, 'YYYY-MM'), t, p
+            USING HINT = 'Move these rows out of the default partition, then create the partition.';
+      END;
+      IF t = 'merchant_contract_terms'
+      THEN
+        EXECUTE format ('CREATE TRIGGER merchant_contract_terms_hot_columns'
+                        ' BEFORE INSERT OR UPDATE OF contract_terms ON %I'
+                        ' FOR EACH ROW EXECUTE PROCEDURE'
+                        ' merchant_contract_hot_columns ()',
+                        p);
+      END IF;
+      created = created + 1;
+    END LOOP;
+    month = month + INTERVAL '1 month';
+  END LOOP;
+  RETURN created;
+END $$;
+
+-- Complete transaction
+COMMIT;
@@ -0,0 +1,438 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Lesser General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backenddb/perf_merchantdb_transfers.c
+ * @brief measure the cost of reconciling a large aggregated wire
+ *        transfer, checking and storing the coins one by one
+ *        compared to the bulk lookup and insert
+ * @author Christian Grothoff
+ *
+ * We store the deposits of two sets of #NUM_COINS coins, spread over
+ * #NUM_CONTRACTS contracts, and then do what /track/transfer does for
+ * a wire transfer aggregating them: once per coin for the first set
+ * and in bulk for the second.  Uses the database of
+ * test-merchantdb-postgres, which is dropped afterwards.
+ */
+#include "platform.h"
+#include <taler/taler_util.h>
+#include <taler/taler_json_lib.h>
+#include "taler_merchantdb_lib.h"
+#include <jansson.h>
+
+/**
+ * Number of coins aggregated into a wire transfer.
+ */
+#define NUM_COINS 10000
+
+/**
+ * Number of contracts the coins were deposited for.
+ */
+#define NUM_CONTRACTS 100
+
+/**
+ * Currency we use for the coins.
+ */
+#define CURRENCY "EUR"
+
+/**
+ * URL we use for the exchange.
+ */
+#define EXCHANGE_URL "http://localhost:8888/"
+
+#define RND_BLK(ptr)                                                    \
+  GNUNET_CRYPTO_random_block (GNUNET_CRYPTO_QUALITY_WEAK, ptr, sizeof (*ptr))
+
+
+/**
+ * Coins of one variant of the measurement.
+ */
+struct CoinSet
+{
+  /**
+   * Contracts the coins were deposited for.
+   */
+  struct GNUNET_HashCode h_contract_terms[NUM_COINS];
+
+  /**
+   * The coins.
+   */
+  struct TALER_CoinSpendPublicKeyP coin_pubs[NUM_COINS];
+
+  /**
+   * Wire transfer aggregating the coins.
+   */
+  struct TALER_WireTransferIdentifierRawP wtid;
+};
+
+
+/**
+ * Return value from main().
+ */
+static int result;
+
+/**
+ * Handle to the plugin we are measuring.
+ */
+static struct TALER_MERCHANTDB_Plugin *plugin;
+
+/**
+ * Merchant public key.
+ */
+static struct TALER_MerchantPublicKeyP merchant_pub;
+
+/**
+ * Hashes of our contracts.
+ */
+static struct GNUNET_HashCode h_contracts[NUM_CONTRACTS];
+
+/**
+ * Coins checked one by one.
+ */
+static struct CoinSet per_coin;
+
+/**
+ * Coins checked in bulk.
+ */
+static struct CoinSet bulk;
+
+/**
+ * Number of coins found in the database.
+ */
+static unsigned int found;
+
+
+/**
+ * Print the result of one phase.
+ *
+ * @param name name of the phase
+ * @param start when the phase started
+ * @param n number of operations in the phase
+ */
+static void
+report (const char *name,
+        struct GNUNET_TIME_Absolute start,
+        unsigned int n)
+{
+  struct GNUNET_TIME_Relative d = GNUNET_TIME_absolute_get_duration (start);
+
+  fprintf (stdout,
+           "%-28s %10llu ms %8llu ns/op\n",
+           name,
+           (unsigned long long) (d.rel_value_us / 1000LLU),
+           (unsigned long long) (d.rel_value_us * 1000LLU / n));
+}
+
+
+/**
+ * Count a coin found by the per-coin lookup.
+ *
+ * @param cls NULL
+ * @param h_contract_terms proposal data's hashcode
+ * @param coin_pub public key of the coin
+ * @param exchange_url URL of the exchange that issued the coin
+ * @param amount_with_fee amount the exchange will deposit for this coin
+ * @param deposit_fee fee the exchange will charge for this coin
+ * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee the exchange charges
+ * @param exchange_proof proof from exchange that coin was accepted
+ */
+static void
+count_coin (void *cls,
+            const struct GNUNET_HashCode *h_contract_terms,
+            const struct TALER_CoinSpendPublicKeyP *coin_pub,
+            const char *exchange_url,
+            const struct TALER_Amount *amount_with_fee,
+            const struct TALER_Amount *deposit_fee,
+            const struct TALER_Amount *refund_fee,
+            const struct TALER_Amount *wire_fee,
+            const json_t *exchange_proof)
+{
+  (void) cls;
+  found++;
+}
+
+
+/**
+ * Count a coin found by the bulk lookup.
+ *
+ * @param cls NULL
+ * @param offset offset of the coin in the arrays given to the lookup
+ * @param exchange_url URL of the exchange that issued the coin
+ * @param amount_with_fee amount the exchange will deposit for this coin
+ * @param deposit_fee fee the exchange will charge for this coin
+ * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee the exchange charges
+ * @param exchange_proof proof from exchange that coin was accepted
+ */
+static void
+count_coin_at (void *cls,
+               unsigned int offset,
+               const char *exchange_url,
+               const struct TALER_Amount *amount_with_fee,
+               const struct TALER_Amount *deposit_fee,
+               const struct TALER_Amount *refund_fee,
+               const struct TALER_Amount *wire_fee,
+               const json_t *exchange_proof)
+{
+  (void) cls;
+  GNUNET_assert (offset < NUM_COINS);
+  found++;
+}
+
+
+/**
+ * Create the contracts and store the deposits of the coins of
+ * both sets.
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+setup (void)
+{
+  struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
+  struct TALER_Amount amount_with_fee;
+  struct TALER_Amount fee;
+  struct TALER_ExchangePublicKeyP signkey_pub;
+  struct TALER_MERCHANTDB_Batch *batch;
+  json_t *deposit_proof;
+
+  (void) GNUNET_TIME_round_abs (&now);
+  RND_BLK (&merchant_pub);
+  RND_BLK (&signkey_pub);
+  for (unsigned int i = 0; i<NUM_CONTRACTS; i++)
+  {
+    json_t *contract_terms;
+    char order_id[32];
+
+    GNUNET_snprintf (order_id,
+                     sizeof (order_id),
+                     "perf-%u",
+                     i);
+    contract_terms = json_pack ("{s:s}",
+                                "order_id", order_id);
+    GNUNET_assert (NULL != contract_terms);
+    GNUNET_assert (GNUNET_OK ==
+                   TALER_JSON_hash (contract_terms,
+                                    &h_contracts[i]));
+    if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->insert_contract_terms (plugin->cls,
+                                       order_id,
+                                       &merchant_pub,
+                                       now,
+                                       contract_terms))
+    {
+      GNUNET_break (0);
+      json_decref (contract_terms);
+      return GNUNET_SYSERR;
+    }
+    json_decref (contract_terms);
+  }
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_string_to_amount (CURRENCY ":1",
+                                         &amount_with_fee));
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_string_to_amount (CURRENCY ":0.01",
+                                         &fee));
+  deposit_proof = json_pack ("{s:s}",
+                             "x-taler-bank", "perf deposit");
+  GNUNET_assert (NULL != deposit_proof);
+  batch = plugin->batch_start (plugin->cls);
+  for (unsigned int i = 0; i<NUM_COINS; i++)
+  {
+    struct CoinSet *sets[] = { &per_coin, &bulk };
+
+    for (unsigned int j = 0; j<2; j++)
+    {
+      struct CoinSet *cs = sets[j];
+
+      cs->h_contract_terms[i] = h_contracts[i % NUM_CONTRACTS];
+      RND_BLK (&cs->coin_pubs[i]);
+      plugin->batch_store_deposit (plugin->cls,
+                                   batch,
+                                   &cs->h_contract_terms[i],
+                                   &merchant_pub,
+                                   &cs->coin_pubs[i],
+                                   EXCHANGE_URL,
+                                   &amount_with_fee,
+                                   &fee,
+                                   &fee,
+                                   &fee,
+                                   &signkey_pub,
+                                   deposit_proof);
+    }
+  }
+  json_decref (deposit_proof);
+  RND_BLK (&per_coin.wtid);
+  RND_BLK (&bulk.wtid);
+  if (0 > plugin->batch_commit_TR (plugin->cls,
+                                   batch))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Check and store the coins of #per_coin one by one, like
+ * /track/transfer used to.
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+measure_per_coin (void)
+{
+  struct GNUNET_TIME_Absolute start;
+
+  found = 0;
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_COINS; i++)
+    if (0 > plugin->find_payments_by_hash_and_coin (
+          plugin->cls,
+          &per_coin.h_contract_terms[i],
+          &merchant_pub,
+          &per_coin.coin_pubs[i],
+          &count_coin,
+          NULL))
+      return GNUNET_SYSERR;
+  report ("per coin: lookup",
+          start,
+          NUM_COINS);
+  GNUNET_break (NUM_COINS == found);
+  start = GNUNET_TIME_absolute_get ();
+  for (unsigned int i = 0; i<NUM_COINS; i++)
+    if (0 > plugin->store_coin_to_transfer (plugin->cls,
+                                            &per_coin.h_contract_terms[i],
+                                            &per_coin.coin_pubs[i],
+                                            &per_coin.wtid))
+      return GNUNET_SYSERR;
+  report ("per coin: insert",
+          start,
+          NUM_COINS);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Check and store the coins of #bulk with one statement each.
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+measure_bulk (void)
+{
+  struct GNUNET_TIME_Absolute start;
+
+  found = 0;
+  start = GNUNET_TIME_absolute_get ();
+  if (0 > plugin->find_payments_by_coins (plugin->cls,
+                                          &merchant_pub,
+                                          NUM_COINS,
+                                          bulk.h_contract_terms,
+                                          bulk.coin_pubs,
+                                          &count_coin_at,
+                                          NULL))
+    return GNUNET_SYSERR;
+  report ("bulk: lookup",
+          start,
+          NUM_COINS);
+  GNUNET_break (NUM_COINS == found);
+  start = GNUNET_TIME_absolute_get ();
+  if (0 > plugin->store_coins_to_transfer (plugin->cls,
+                                           &bulk.wtid,
+                                           NUM_COINS,
+                                           bulk.h_contract_terms,
+                                           bulk.coin_pubs))
+    return GNUNET_SYSERR;
+  report ("bulk: insert",
+          start,
+          NUM_COINS);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Run the measurements.
+ *
+ * @param cls closure with config
+ */
+static void
+run (void *cls)
+{
+  struct GNUNET_CONFIGURATION_Handle *cfg = cls;
+
+  if (NULL == (plugin = TALER_MERCHANTDB_plugin_load (cfg)))
+  {
+    result = 77;
+    return;
+  }
+  if (GNUNET_OK != plugin->drop_tables (plugin->cls))
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "Dropping tables failed\n");
+    TALER_MERCHANTDB_plugin_unload (plugin);
+    result = 77;
+    return;
+  }
+  TALER_MERCHANTDB_plugin_unload (plugin);
+  if (NULL == (plugin = TALER_MERCHANTDB_plugin_load (cfg)))
+  {
+    result = 77;
+    return;
+  }
+  if ( (GNUNET_OK != setup ()) ||
+       (GNUNET_OK != measure_per_coin ()) ||
+       (GNUNET_OK != measure_bulk ()) )
+  {
+    GNUNET_break (0);
+    result = 1;
+  }
+  GNUNET_break (GNUNET_OK ==
+                plugin->drop_tables (plugin->cls));
+  TALER_MERCHANTDB_plugin_unload (plugin);
+  plugin = NULL;
+}
+
+
+int
+main (int argc,
+      char *const argv[])
+{
+  struct GNUNET_CONFIGURATION_Handle *cfg;
+
+  (void) argc;
+  (void) argv;
+  GNUNET_log_setup ("perf-merchantdb-transfers",
+                    "WARNING",
+                    NULL);
+  cfg = GNUNET_CONFIGURATION_create ();
+  if (GNUNET_OK !=
+      GNUNET_CONFIGURATION_parse (cfg,
+                                  "test-merchantdb-postgres.conf"))
+  {
+    GNUNET_break (0);
+    GNUNET_CONFIGURATION_destroy (cfg);
+    return 2;
+  }
+  GNUNET_SCHEDULER_run (&run,
+                        cfg);
+  GNUNET_CONFIGURATION_destroy (cfg);
+  return result;
+}
+
+
+/* end of perf_merchantdb_transfers.c */
@@ -0,0 +1,2228 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Lesser General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backenddb/pg_async.c
+ * @brief non-blocking execution of prepared statements on dedicated
+ *        libpq connections, driven by the GNUnet scheduler
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <poll.h>
+#include "pg_async.h"
+
+
+/**
+ * How long do we wait for a connection to be established (and
+ * its statements to be prepared)?
+ */
+#define CONNECT_TIMEOUT GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_SECONDS, 10)
+
+/**
+ * Maximum delay between attempts to reconnect.
+ */
+#define CONNECT_RETRY_MAX GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_SECONDS, 30)
+
+/**
+ * How long may the execution of a batch take?
+ */
+#define BATCH_TIMEOUT GNUNET_TIME_relative_multiply ( \
+    GNUNET_TIME_UNIT_SECONDS, 30)
+
+
+/**
+ * A prepared statement with serialized parameters.
+ */
+struct PGA_Statement
+{
+
+  /**
+   * Name of the prepared statement.
+   */
+  char *name;
+
+  /**
+   * Serialized parameter values (pointing into the same allocation
+   * as this array), NULL after the statement was sent.
+   */
+  char **values;
+
+  /**
+   * Lengths of the @e values.
+   */
+  int *lengths;
+
+  /**
+   * Formats of the @e values.
+   */
+  int *formats;
+
+  /**
+   * Number of parameters.
+   */
+  unsigned int nparams;
+
+};
+
+
+/**
+ * A query waiting for (or undergoing) execution.
+ */
+struct PGA_Query
+{
+
+  /**
+   * Kept in a DLL.
+   */
+  struct PGA_Query *next;
+
+  /**
+   * Kept in a DLL.
+   */
+  struct PGA_Query *prev;
+
+  /**
+   * Context the query belongs to.
+   */
+  struct PGA_Context *ctx;
+
+  /**
+   * Connection executing the query, NULL while it is waiting.
+   */
+  struct PGA_Connection *conn;
+
+  /**
+   * When was the query queued?
+   */
+  struct GNUNET_TIME_Absolute queued;
+
+  /**
+   * Position of the query in the order of #PGA_query() calls.
+   */
+  uint64_t serial;
+
+  /**
+   * Function to call with the result, NULL if the query was
+   * cancelled while being executed.
+   */
+  PGA_ResultCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * The statement to execute.
+   */
+  struct PGA_Statement st;
+
+  /**
+   * First result we got for the query, NULL if none yet.
+   */
+  PGresult *result;
+
+};
+
+
+/**
+ * Statements to be executed together in one transaction.
+ */
+struct PGA_Batch
+{
+
+  /**
+   * Context the batch belongs to.
+   */
+  struct PGA_Context *ctx;
+
+  /**
+   * The statements, array of length @e num_stmts.
+   */
+  struct PGA_Statement *stmts;
+
+  /**
+   * Number of statements in the batch.
+   */
+  unsigned int num_stmts;
+
+  /**
+   * Allocated length of @e stmts.
+   */
+  unsigned int max_stmts;
+
+};
+
+
+/**
+ * State of a connection used for asynchronous queries.
+ */
+enum ConnectionState
+{
+
+  /**
+   * Not connected, possibly waiting to reconnect.
+   */
+  CS_DOWN = 0,
+
+  /**
+   * Waiting for PQconnectPoll() to establish the connection.
+   */
+  CS_CONNECTING,
+
+  /**
+   * Connected, preparing the statements one after the other.
+   */
+  CS_PREPARING,
+
+  /**
+   * Ready to run queries.
+   */
+  CS_READY
+};
+
+
+/**
+ * Connection used for asynchronous queries.
+ */
+struct PGA_Connection
+{
+
+  /**
+   * Context this connection belongs to.
+   */
+  struct PGA_Context *ctx;
+
+  /**
+   * Postgres connection, NULL if we are not connected.
+   */
+  PGconn *conn;
+
+  /**
+   * Socket of @e conn.
+   */
+  struct GNUNET_NETWORK_Handle *sock;
+
+  /**
+   * Task waiting for @e sock to become readable.
+   */
+  struct GNUNET_SCHEDULER_Task *read_task;
+
+  /**
+   * Task waiting for @e sock to become writable.
+   */
+  struct GNUNET_SCHEDULER_Task *write_task;
+
+  /**
+   * Query currently executed on this connection, NULL if idle.
+   */
+  struct PGA_Query *active;
+
+  /**
+   * Task to reconnect after a failed attempt.
+   */
+  struct GNUNET_SCHEDULER_Task *retry_task;
+
+  /**
+   * When do we give up on the current attempt to connect?
+   */
+  struct GNUNET_TIME_Absolute connect_deadline;
+
+  /**
+   * How long to wait before the next attempt to connect.
+   */
+  struct GNUNET_TIME_Relative retry_delay;
+
+  /**
+   * Earliest time of the next attempt to connect the connection
+   * for batches, which has no @e retry_task.
+   */
+  struct GNUNET_TIME_Absolute retry_after;
+
+  /**
+   * Offset of the next statement to prepare while in
+   * state #CS_PREPARING.
+   */
+  unsigned int prep_off;
+
+  /**
+   * State of @e conn.
+   */
+  enum ConnectionState state;
+
+};
+
+
+/**
+ * Connection listening for notifications on a channel.
+ */
+struct PGA_Listener
+{
+
+  /**
+   * Context this listener belongs to.
+   */
+  struct PGA_Context *ctx;
+
+  /**
+   * Channel we LISTEN on.
+   */
+  char *channel;
+
+  /**
+   * Function to call with notifications.
+   */
+  PGA_NotifyCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * Postgres connection, NULL if we are not connected.
+   */
+  PGconn *conn;
+
+  /**
+   * Socket of @e conn.
+   */
+  struct GNUNET_NETWORK_Handle *sock;
+
+  /**
+   * Task waiting for @e sock to become readable.
+   */
+  struct GNUNET_SCHEDULER_Task *read_task;
+
+  /**
+   * Task waiting for @e sock to become writable.
+   */
+  struct GNUNET_SCHEDULER_Task *write_task;
+
+  /**
+   * Task to (re)connect.
+   */
+  struct GNUNET_SCHEDULER_Task *retry_task;
+
+  /**
+   * When do we give up on the current attempt to connect
+   * (and LISTEN)?
+   */
+  struct GNUNET_TIME_Absolute connect_deadline;
+
+  /**
+   * How long to wait before the next attempt to reconnect.
+   */
+  struct GNUNET_TIME_Relative retry_delay;
+
+  /**
+   * State of @e conn, #CS_PREPARING while our LISTEN is
+   * being executed.
+   */
+  enum ConnectionState state;
+
+  /**
+   * #GNUNET_YES if we were connected before, so that notifications
+   * may have been lost when we (re)connect.
+   */
+  int was_connected;
+
+};
+
+
+/**
+ * Handle for a pool of asynchronous database connections.  Queries
+ * are queued and executed in FIFO order on the first idle connection.
+ */
+struct PGA_Context
+{
+
+  /**
+   * libpq connection string.
+   */
+  char *conninfo;
+
+  /**
+   * Prepared statements to set up on each connection.
+   */
+  struct GNUNET_PQ_PreparedStatement *ps;
+
+  /**
+   * Head of queries waiting for a connection.
+   */
+  struct PGA_Query *q_head;
+
+  /**
+   * Tail of queries waiting for a connection.
+   */
+  struct PGA_Query *q_tail;
+
+  /**
+   * Our connections, array of length @e num_conns.
+   */
+  struct PGA_Connection *conns;
+
+  /**
+   * Statistics about the use of the pool.
+   */
+  struct PGA_Statistics stats;
+
+  /**
+   * Length of the @e conns array.
+   */
+  unsigned int num_conns;
+
+  /**
+   * Number of active listeners.
+   */
+  unsigned int num_listeners;
+
+  /**
+   * Task to start queries queued by the application.  We never
+   * start queries (and thus possibly call back) from within
+   * #PGA_query() itself.
+   */
+  struct GNUNET_SCHEDULER_Task *run_task;
+
+  /**
+   * Serial number to give to the next query.
+   */
+  uint64_t next_serial;
+
+  /**
+   * Connection used (synchronously, with bounded waits) for
+   * batches, not part of the pool.
+   */
+  struct PGA_Connection batch_conn;
+
+};
+
+
+/**
+ * Serialize @a params for the prepared statement @a name into @a st.
+ * The values are copied, so @a params do not need to remain valid.
+ *
+ * @param[out] st statement to initialize
+ * @param name name of the prepared statement
+ * @param params parameters for the statement
+ * @return #GNUNET_OK on success, #GNUNET_SYSERR if @a params
+ *         could not be serialized
+ */
+static int
+statement_init (struct PGA_Statement *st,
+                const char *name,
+                const struct GNUNET_PQ_QueryParam *params)
+{
+  unsigned int len;
+  unsigned int off;
+  unsigned int soff;
+  size_t total;
+  char *pos;
+
+  len = 0;
+  for (unsigned int i = 0; 0 != params[i].num_params; i++)
+    len += params[i].num_params;
+  {
+    void *scratch[len + 1];
+    void *param_values[len + 1];
+    int param_lengths[len + 1];
+    int param_formats[len + 1];
+
+    off = 0;
+    soff = 0;
+    for (unsigned int i = 0; 0 != params[i].num_params; i++)
+    {
+      const struct GNUNET_PQ_QueryParam *x = &params[i];
+      int ret;
+
+      ret = x->conv (x->conv_cls,
+                     x->data,
+                     x->size,
+                     &param_values[off],
+                     &param_lengths[off],
+                     &param_formats[off],
+                     x->num_params,
+                     &scratch[soff],
+                     len - soff);
+      if (ret < 0)
+      {
+        for (unsigned int j = 0; j < soff; j++)
+          GNUNET_free (scratch[j]);
+        return GNUNET_SYSERR;
+      }
+      soff += ret;
+      off += x->num_params;
+    }
+    /* copy the values, as the application's data (and our
+       scratch space) may be gone by the time we send the query */
+    total = len * (sizeof (char *) + 2 * sizeof (int));
+    for (unsigned int i = 0; i<len; i++)
+      if (NULL != param_values[i])
+        total += param_lengths[i];
+    st->values = GNUNET_malloc (total + 1);
+    st->lengths = (int *) &st->values[len];
+    st->formats = &st->lengths[len];
+    pos = (char *) &st->formats[len];
+    for (unsigned int i = 0; i<len; i++)
+    {
+      st->lengths[i] = param_lengths[i];
+      st->formats[i] = param_formats[i];
+      if (NULL == param_values[i])
+        continue; /* SQL NULL */
+      GNUNET_memcpy (pos,
+                     param_values[i],
+                     param_lengths[i]);
+      st->values[i] = pos;
+      pos += param_lengths[i];
+    }
+    for (unsigned int j = 0; j < soff; j++)
+      GNUNET_free (scratch[j]);
+  }
+  st->name = GNUNET_strdup (name);
+  st->nparams = len;
+  return GNUNET_OK;
+}
+
+
+/**
+ * Send @a st to the server (without waiting for the result).
+ *
+ * @param conn connection to send on
+ * @param st statement to send
+ * @return #GNUNET_OK on success
+ */
+static int
+statement_send (PGconn *conn,
+                const struct PGA_Statement *st)
+{
+  if (1 != PQsendQueryPrepared (conn,
+                                st->name,
+                                st->nparams,
+                                (const char *const *) st->values,
+                                st->lengths,
+                                st->formats,
+                                1))
+    return GNUNET_SYSERR;
+  return GNUNET_OK;
+}
+
+
+/**
+ * Release the resources of @a st.
+ *
+ * @param st statement to release
+ */
+static void
+statement_release (struct PGA_Statement *st)
+{
+  GNUNET_free_non_null (st->values);
+  st->values = NULL;
+  GNUNET_free (st->name);
+}
+
+
+/**
+ * Release all resources associated with @a q.
+ *
+ * @param[in] q query to free
+ */
+static void
+query_free (struct PGA_Query *q)
+{
+  if (NULL != q->result)
+    PQclear (q->result);
+  statement_release (&q->st);
+  GNUNET_free (q);
+}
+
+
+/**
+ * Close the database connection of @a c (if any).
+ *
+ * @param c connection to close
+ */
+static void
+connection_close (struct PGA_Connection *c)
+{
+  if (NULL != c->read_task)
+  {
+    GNUNET_SCHEDULER_cancel (c->read_task);
+    c->read_task = NULL;
+  }
+  if (NULL != c->write_task)
+  {
+    GNUNET_SCHEDULER_cancel (c->write_task);
+    c->write_task = NULL;
+  }
+  if (NULL != c->sock)
+  {
+    GNUNET_NETWORK_socket_free_memory_only_ (c->sock);
+    c->sock = NULL;
+  }
+  if (NULL != c->retry_task)
+  {
+    GNUNET_SCHEDULER_cancel (c->retry_task);
+    c->retry_task = NULL;
+  }
+  if (NULL != c->conn)
+  {
+    PQfinish (c->conn);
+    c->conn = NULL;
+  }
+  c->state = CS_DOWN;
+}
+
+
+/**
+ * Start the next waiting query on @a c, if @a c is idle.
+ *
+ * @param c connection to use
+ */
+static void
+connection_run_next (struct PGA_Connection *c);
+
+
+/**
+ * Check if none of the connections of @a ctx is (being) connected,
+ * i.e. if the database is unreachable.
+ *
+ * @param ctx context to check
+ * @return #GNUNET_YES if all connections are down
+ */
+static int
+pool_down (const struct PGA_Context *ctx)
+{
+  for (unsigned int i = 0; i<ctx->num_conns; i++)
+    if (CS_DOWN != ctx->conns[i].state)
+      return GNUNET_NO;
+  return GNUNET_YES;
+}
+
+
+/**
+ * Fail all queries that are waiting for a connection right now.
+ * Queries queued (or cancelled) by the callbacks are handled
+ * correctly: we only ever take the head of the live queue.
+ *
+ * @param ctx context whose queries to fail
+ */
+static void
+fail_waiting (struct PGA_Context *ctx)
+{
+  uint64_t cutoff = ctx->next_serial;
+  struct PGA_Query *q;
+
+  while ( (NULL != (q = ctx->q_head)) &&
+          (q->serial < cutoff) )
+  {
+    GNUNET_CONTAINER_DLL_remove (ctx->q_head,
+                                 ctx->q_tail,
+                                 q);
+    ctx->stats.queue_length--;
+    q->cb (q->cb_cls,
+           NULL);
+    query_free (q);
+  }
+}
+
+
+/**
+ * Start connecting @a c to the database.
+ *
+ * @param c connection to open
+ */
+static void
+connection_start (struct PGA_Connection *c);
+
+
+/**
+ * Task to reconnect @a c after a failed attempt.
+ *
+ * @param cls a `struct PGA_Connection`
+ */
+static void
+connection_retry (void *cls)
+{
+  struct PGA_Connection *c = cls;
+
+  c->retry_task = NULL;
+  if (NULL != c->ctx->q_head)
+    connection_start (c);
+}
+
+
+/**
+ * The attempt to connect @a c failed, try again later.  If no
+ * connection of the pool is (being) established, the queries
+ * waiting right now fail instead of waiting for the database
+ * to come back.
+ *
+ * @param c connection that failed
+ */
+static void
+connection_backoff (struct PGA_Connection *c)
+{
+  GNUNET_log_from (GNUNET_ERROR_TYPE_ERROR,
+                   "pq-async",
+                   "Database connection to '%s' failed: %s\n",
+                   c->ctx->conninfo,
+                   (NULL != c->conn)
+                   ? PQerrorMessage (c->conn)
+                   : "");
+  connection_close (c);
+  c->retry_delay = GNUNET_TIME_relative_min (
+    GNUNET_TIME_STD_BACKOFF (c->retry_delay),
+    CONNECT_RETRY_MAX);
+  c->retry_task = GNUNET_SCHEDULER_add_delayed (c->retry_delay,
+                                                &connection_retry,
+                                                c);
+  if (GNUNET_YES == pool_down (c->ctx))
+    fail_waiting (c->ctx);
+}
+
+
+/**
+ * Wait until the socket of @a c (which is being set up) becomes
+ * readable (or writable), but no longer than the connect deadline.
+ *
+ * @param c connection being set up
+ * @param want_write #GNUNET_YES to wait for the socket to become writable
+ * @param cb function to call
+ */
+static void
+setup_wait (struct PGA_Connection *c,
+            int want_write,
+            GNUNET_SCHEDULER_TaskCallback cb)
+{
+  struct GNUNET_TIME_Relative timeout
+    = GNUNET_TIME_absolute_get_remaining (c->connect_deadline);
+
+  if (GNUNET_YES == want_write)
+    c->write_task = GNUNET_SCHEDULER_add_write_net (timeout,
+                                                    c->sock,
+                                                    cb,
+                                                    c);
+  else
+    c->read_task = GNUNET_SCHEDULER_add_read_net (timeout,
+                                                  c->sock,
+                                                  cb,
+                                                  c);
+}
+
+
+/**
+ * What to do next while setting up a connection.
+ */
+enum SetupStatus
+{
+
+  /**
+   * Wait for the socket to become readable, then call
+   * connection_setup_step().
+   */
+  SETUP_WAIT_READ,
+
+  /**
+   * Wait for the socket to become writable, then call
+   * connection_setup_step().
+   */
+  SETUP_WAIT_WRITE,
+
+  /**
+   * The connection is ready.
+   */
+  SETUP_READY,
+
+  /**
+   * Setting up the connection failed.
+   */
+  SETUP_FAILED
+};
+
+
+/**
+ * Send the next statement to prepare on @a c, or mark @a c as
+ * ready if all statements are prepared.
+ *
+ * @param c connection being set up
+ * @return what to do next
+ */
+static enum SetupStatus
+prepare_next (struct PGA_Connection *c);
+
+
+/**
+ * Flush the PREPARE of @a c and process its result.
+ *
+ * @param c connection being set up
+ * @return what to do next
+ */
+static enum SetupStatus
+prepare_continue (struct PGA_Connection *c)
+{
+  switch (PQflush (c->conn))
+  {
+  case 0:
+    break;
+  case 1:
+    return SETUP_WAIT_WRITE;
+  default:
+    return SETUP_FAILED;
+  }
+  if (1 != PQconsumeInput (c->conn))
+    return SETUP_FAILED;
+  while (0 == PQisBusy (c->conn))
+  {
+    const struct GNUNET_PQ_PreparedStatement *ps
+      = &c->ctx->ps[c->prep_off];
+    PGresult *res;
+
+    res = PQgetResult (c->conn);
+    if (NULL == res)
+    {
+      c->prep_off++;
+      return prepare_next (c);
+    }
+    if (PGRES_COMMAND_OK != PQresultStatus (res))
+    {
+      GNUNET_log_from (GNUNET_ERROR_TYPE_ERROR,
+                       "pq-async",
+                       "PQprepare (`%s' as `%s') failed with error: %s\n",
+                       ps->sql,
+                       ps->name,
+                       PQerrorMessage (c->conn));
+      PQclear (res);
+      return SETUP_FAILED;
+    }
+    PQclear (res);
+  }
+  return SETUP_WAIT_READ;
+}
+
+
+static enum SetupStatus
+prepare_next (struct PGA_Connection *c)
+{
+  const struct GNUNET_PQ_PreparedStatement *ps = &c->ctx->ps[c->prep_off];
+
+  if (NULL == ps->name)
+  {
+    c->state = CS_READY;
+    return SETUP_READY;
+  }
+  if (1 != PQsendPrepare (c->conn,
+                          ps->name,
+                          ps->sql,
+                          ps->num_arguments,
+                          NULL))
+    return SETUP_FAILED;
+  return prepare_continue (c);
+}
+
+
+/**
+ * Continue establishing the connection of @a c, as directed by
+ * the result @a pst of PQconnectPoll().
+ *
+ * @param c connection being set up
+ * @param pst what libpq wants us to do next
+ * @return what to do next
+ */
+static enum SetupStatus
+connection_poll (struct PGA_Connection *c,
+                 PostgresPollingStatusType pst)
+{
+  switch (pst)
+  {
+  case PGRES_POLLING_READING:
+  case PGRES_POLLING_WRITING:
+    /* the socket may change while libpq tries different addresses */
+    if (NULL != c->sock)
+      GNUNET_NETWORK_socket_free_memory_only_ (c->sock);
+    c->sock = GNUNET_NETWORK_socket_box_native (PQsocket (c->conn));
+    if (NULL == c->sock)
+    {
+      GNUNET_break (0);
+      return SETUP_FAILED;
+    }
+    return (PGRES_POLLING_WRITING == pst)
+           ? SETUP_WAIT_WRITE
+           : SETUP_WAIT_READ;
+  case PGRES_POLLING_OK:
+    if (0 != PQsetnonblocking (c->conn,
+                               1))
+    {
+      GNUNET_break (0);
+      return SETUP_FAILED;
+    }
+    c->state = CS_PREPARING;
+    c->prep_off = 0;
+    return prepare_next (c);
+  default:
+    return SETUP_FAILED;
+  }
+}
+
+
+/**
+ * The socket of @a c (being set up) is ready, continue setting
+ * up the connection as far as possible without blocking.
+ *
+ * @param c connection being set up
+ * @return what to do next
+ */
+static enum SetupStatus
+connection_setup_step (struct PGA_Connection *c)
+{
+  switch (c->state)
+  {
+  case CS_CONNECTING:
+    return connection_poll (c,
+                            PQconnectPoll (c->conn));
+  case CS_PREPARING:
+    return prepare_continue (c);
+  default:
+    GNUNET_break (0);
+    return SETUP_FAILED;
+  }
+}
+
+
+/**
+ * Start connecting @a c to the database, closing its current
+ * connection (if any).  The connection is then set up by calling
+ * connection_setup_step() whenever its socket is ready, as told
+ * by the result.
+ *
+ * @param c connection to open
+ * @return what to do next
+ */
+static enum SetupStatus
+connection_begin (struct PGA_Connection *c)
+{
+  connection_close (c);
+  c->conn = PQconnectStart (c->ctx->conninfo);
+  if ( (NULL == c->conn) ||
+       (CONNECTION_BAD == PQstatus (c->conn)) )
+    return SETUP_FAILED;
+  c->state = CS_CONNECTING;
+  c->connect_deadline = GNUNET_TIME_relative_to_absolute (CONNECT_TIMEOUT);
+  /* as if PQconnectPoll() had returned PGRES_POLLING_WRITING */
+  return connection_poll (c,
+                          PGRES_POLLING_WRITING);
+}
+
+
+/**
+ * The socket of @a c (being set up) is ready, continue.
+ *
+ * @param cls a `struct PGA_Connection`
+ */
+static void
+connection_setup_cb (void *cls);
+
+
+/**
+ * Act on @a ss while setting up the pool connection @a c.
+ *
+ * @param c connection being set up
+ * @param ss what to do next
+ */
+static void
+connection_setup_continue (struct PGA_Connection *c,
+                           enum SetupStatus ss)
+{
+  switch (ss)
+  {
+  case SETUP_WAIT_READ:
+  case SETUP_WAIT_WRITE:
+    setup_wait (c,
+                (SETUP_WAIT_WRITE == ss) ? GNUNET_YES : GNUNET_NO,
+                &connection_setup_cb);
+    return;
+  case SETUP_READY:
+    c->retry_delay = GNUNET_TIME_UNIT_ZERO;
+    connection_run_next (c);
+    return;
+  case SETUP_FAILED:
+    connection_backoff (c);
+    return;
+  }
+}
+
+
+static void
+connection_setup_cb (void *cls)
+{
+  struct PGA_Connection *c = cls;
+
+  c->read_task = NULL;
+  c->write_task = NULL;
+  if (0 == GNUNET_TIME_absolute_get_remaining (
+        c->connect_deadline).rel_value_us)
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                     "pq-async",
+                     "Timeout setting up database connection\n");
+    connection_backoff (c);
+    return;
+  }
+  connection_setup_continue (c,
+                             connection_setup_step (c));
+}
+
+
+static void
+connection_start (struct PGA_Connection *c)
+{
+  connection_setup_continue (c,
+                             connection_begin (c));
+}
+
+
+/**
+ * Finish the active query of @a c, passing @a result to the
+ * application (if the query was not cancelled), then continue
+ * with the next query.
+ *
+ * @param c connection with the active query
+ * @param result result to return, NULL on failure
+ */
+static void
+connection_finish (struct PGA_Connection *c,
+                   PGresult *result)
+{
+  struct PGA_Query *q = c->active;
+
+  c->active = NULL;
+  if (NULL != q->cb)
+    q->cb (q->cb_cls,
+           result);
+  query_free (q);
+  connection_run_next (c);
+}
+
+
+/**
+ * The connection @a c broke, fail its active query and
+ * reconnect for the next one.
+ *
+ * @param c connection that failed
+ */
+static void
+connection_fail (struct PGA_Connection *c)
+{
+  GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                   "pq-async",
+                   "Asynchronous database connection failed: %s\n",
+                   PQerrorMessage (c->conn));
+  connection_close (c);
+  if (NULL != c->active)
+    connection_finish (c,
+                       NULL);
+}
+
+
+/**
+ * Our socket is readable, process whatever Postgres sent us.
+ *
+ * @param cls a `struct PGA_Connection`
+ */
+static void
+connection_read_cb (void *cls)
+{
+  struct PGA_Connection *c = cls;
+
+  c->read_task = NULL;
+  if (1 != PQconsumeInput (c->conn))
+  {
+    connection_fail (c);
+    return;
+  }
+  while (0 == PQisBusy (c->conn))
+  {
+    PGresult *res;
+
+    res = PQgetResult (c->conn);
+    if (NULL == res)
+    {
+      connection_finish (c,
+                         c->active->result);
+      return;
+    }
+    if (NULL == c->active->result)
+      c->active->result = res;
+    else
+      PQclear (res); /* we only care about the first result */
+  }
+  c->read_task
+    = GNUNET_SCHEDULER_add_read_net (GNUNET_TIME_UNIT_FOREVER_REL,
+                                     c->sock,
+                                     &connection_read_cb,
+                                     c);
+}
+
+
+/**
+ * Flush data libpq could not yet send to the server.
+ *
+ * @param cls a `struct PGA_Connection`
+ */
+static void
+connection_write_cb (void *cls)
+{
+  struct PGA_Connection *c = cls;
+
+  c->write_task = NULL;
+  switch (PQflush (c->conn))
+  {
+  case 0:
+    break;
+  case 1:
+    c->write_task
+      = GNUNET_SCHEDULER_add_write_net (GNUNET_TIME_UNIT_FOREVER_REL,
+                                        c->sock,
+                                        &connection_write_cb,
+                                        c);
+    break;
+  default:
+    connection_fail (c);
+    break;
+  }
+}
+
+
+static void
+connection_run_next (struct PGA_Connection *c)
+{
+  struct PGA_Context *ctx = c->ctx;
+  struct PGA_Query *q;
+  struct GNUNET_TIME_Relative wait;
+
+  if (NULL != c->active)
+    return;
+  if (NULL == ctx->q_head)
+    return;
+  switch (c->state)
+  {
+  case CS_DOWN:
+    if (NULL == c->retry_task)
+    {
+      connection_start (c);
+      return;
+    }
+    /* waiting to reconnect; unless another connection may serve
+       the queue soon, do not keep the queries waiting */
+    if (GNUNET_YES == pool_down (ctx))
+      fail_waiting (ctx);
+    return;
+  case CS_CONNECTING:
+  case CS_PREPARING:
+    /* we run the query once we are ready */
+    return;
+  case CS_READY:
+    break;
+  }
+  q = ctx->q_head;
+  GNUNET_CONTAINER_DLL_remove (ctx->q_head,
+                               ctx->q_tail,
+                               q);
+  ctx->stats.queue_length--;
+  ctx->stats.queries++;
+  wait = GNUNET_TIME_absolute_get_duration (q->queued);
+  ctx->stats.total_wait = GNUNET_TIME_relative_add (ctx->stats.total_wait,
+                                                    wait);
+  ctx->stats.max_wait = GNUNET_TIME_relative_max (ctx->stats.max_wait,
+                                                  wait);
+  c->active = q;
+  q->conn = c;
+  if (GNUNET_OK !=
+      statement_send (c->conn,
+                      &q->st))
+  {
+    connection_fail (c);
+    return;
+  }
+  GNUNET_free_non_null (q->st.values);
+  q->st.values = NULL;
+  connection_write_cb (c);
+  if ( (NULL != c->conn) &&
+       (NULL == c->read_task) )
+    c->read_task
+      = GNUNET_SCHEDULER_add_read_net (GNUNET_TIME_UNIT_FOREVER_REL,
+                                       c->sock,
+                                       &connection_read_cb,
+                                       c);
+}
+
+
+/**
+ * Task to start queries queued by the application.
+ *
+ * @param cls a `struct PGA_Context`
+ */
+static void
+run_queued (void *cls)
+{
+  struct PGA_Context *ctx = cls;
+
+  ctx->run_task = NULL;
+  for (unsigned int i = 0; i<ctx->num_conns; i++)
+  {
+    if (NULL == ctx->q_head)
+      break;
+    connection_run_next (&ctx->conns[i]);
+  }
+}
+
+
+struct PGA_Context *
+PGA_connect (const char *conninfo,
+             unsigned int pool_size,
+             const struct GNUNET_PQ_PreparedStatement *ps)
+{
+  struct PGA_Context *ctx;
+  unsigned int plen;
+
+  for (plen = 0; NULL != ps[plen].name; plen++)
+    ;
+  ctx = GNUNET_new (struct PGA_Context);
+  ctx->conninfo = GNUNET_strdup (conninfo);
+  ctx->ps = GNUNET_new_array (plen + 1,
+                              struct GNUNET_PQ_PreparedStatement);
+  GNUNET_memcpy (ctx->ps,
+                 ps,
+                 sizeof (struct GNUNET_PQ_PreparedStatement) * plen);
+  if (0 == pool_size)
+    pool_size = 1;
+  ctx->num_conns = pool_size;
+  ctx->stats.size = pool_size;
+  ctx->conns = GNUNET_new_array (pool_size,
+                                 struct PGA_Connection);
+  for (unsigned int i = 0; i<pool_size; i++)
+    ctx->conns[i].ctx = ctx;
+  ctx->batch_conn.ctx = ctx;
+  return ctx;
+}
+
+
+struct PGA_Query *
+PGA_query (struct PGA_Context *ctx,
+           const char *name,
+           const struct GNUNET_PQ_QueryParam *params,
+           PGA_ResultCallback cb,
+           void *cb_cls)
+{
+  struct PGA_Query *q;
+
+  q = GNUNET_new (struct PGA_Query);
+  if (GNUNET_OK !=
+      statement_init (&q->st,
+                      name,
+                      params))
+  {
+    GNUNET_free (q);
+    return NULL;
+  }
+  q->ctx = ctx;
+  q->queued = GNUNET_TIME_absolute_get ();
+  q->serial = ctx->next_serial++;
+  q->cb = cb;
+  q->cb_cls = cb_cls;
+  GNUNET_CONTAINER_DLL_insert_tail (ctx->q_head,
+                                    ctx->q_tail,
+                                    q);
+  ctx->stats.queue_length++;
+  ctx->stats.max_queue_length = GNUNET_MAX (ctx->stats.max_queue_length,
+                                            ctx->stats.queue_length);
+  if (NULL == ctx->run_task)
+    ctx->run_task = GNUNET_SCHEDULER_add_now (&run_queued,
+                                              ctx);
+  return q;
+}
+
+
+void
+PGA_query_cancel (struct PGA_Query *q)
+{
+  struct PGA_Context *ctx = q->ctx;
+
+  if (NULL != q->conn)
+  {
+    /* already sent, discard the result when it arrives */
+    q->cb = NULL;
+    return;
+  }
+  GNUNET_CONTAINER_DLL_remove (ctx->q_head,
+                               ctx->q_tail,
+                               q);
+  ctx->stats.queue_length--;
+  query_free (q);
+}
+
+
+/**
+ * Close the database connection of @a l (if any).
+ *
+ * @param l listener to close
+ */
+static void
+listener_close (struct PGA_Listener *l)
+{
+  if (NULL != l->read_task)
+  {
+    GNUNET_SCHEDULER_cancel (l->read_task);
+    l->read_task = NULL;
+  }
+  if (NULL != l->write_task)
+  {
+    GNUNET_SCHEDULER_cancel (l->write_task);
+    l->write_task = NULL;
+  }
+  if (NULL != l->sock)
+  {
+    GNUNET_NETWORK_socket_free_memory_only_ (l->sock);
+    l->sock = NULL;
+  }
+  if (NULL != l->conn)
+  {
+    PQfinish (l->conn);
+    l->conn = NULL;
+  }
+  l->state = CS_DOWN;
+}
+
+
+/**
+ * (Re)connect @a l to the database and LISTEN.
+ *
+ * @param cls a `struct PGA_Listener`
+ */
+static void
+listener_connect (void *cls);
+
+
+/**
+ * The connection of @a l broke (or could not be established),
+ * try again later.
+ *
+ * @param l listener that failed
+ */
+static void
+listener_fail (struct PGA_Listener *l)
+{
+  GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                   "pq-async",
+                   "Listening on `%s' failed: %s\n",
+                   l->channel,
+                   (NULL != l->conn)
+                   ? PQerrorMessage (l->conn)
+                   : "");
+  listener_close (l);
+  l->retry_delay = GNUNET_TIME_relative_min (
+    GNUNET_TIME_STD_BACKOFF (l->retry_delay),
+    CONNECT_RETRY_MAX);
+  l->retry_task = GNUNET_SCHEDULER_add_delayed (l->retry_delay,
+                                                &listener_connect,
+                                                l);
+}
+
+
+/**
+ * Our socket is readable, process the result of our LISTEN and
+ * pass notifications to the application.
+ *
+ * @param cls a `struct PGA_Listener`
+ */
+static void
+listener_read_cb (void *cls);
+
+
+/**
+ * Wait for @a l to become readable; until the connect deadline
+ * while we are not yet listening.
+ *
+ * @param l listener to wait for
+ */
+static void
+listener_wait_read (struct PGA_Listener *l)
+{
+  l->read_task
+    = GNUNET_SCHEDULER_add_read_net ((CS_READY == l->state)
+                                     ? GNUNET_TIME_UNIT_FOREVER_REL
+                                     : GNUNET_TIME_absolute_get_remaining (
+                                       l->connect_deadline),
+                                     l->sock,
+                                     &listener_read_cb,
+                                     l);
+}
+
+
+/**
+ * Flush data libpq could not yet send to the server.
+ *
+ * @param cls a `struct PGA_Listener`
+ */
+static void
+listener_write_cb (void *cls)
+{
+  struct PGA_Listener *l = cls;
+
+  l->write_task = NULL;
+  switch (PQflush (l->conn))
+  {
+  case 0:
+    break;
+  case 1:
+    l->write_task
+      = GNUNET_SCHEDULER_add_write_net (GNUNET_TIME_absolute_get_remaining (
+                                          l->connect_deadline),
+                                        l->sock,
+                                        &listener_write_cb,
+                                        l);
+    break;
+  default:
+    listener_fail (l);
+    break;
+  }
+}
+
+
+/**
+ * We are connected, send the LISTEN for our channel.  Its result
+ * is processed by #listener_read_cb().
+ *
+ * @param l listener to set up
+ */
+static void
+listener_send_listen (struct PGA_Listener *l)
+{
+  char *ident;
+  char *sql;
+  int ret;
+
+  if (0 != PQsetnonblocking (l->conn,
+                             1))
+  {
+    GNUNET_break (0);
+    listener_fail (l);
+    return;
+  }
+  ident = PQescapeIdentifier (l->conn,
+                              l->channel,
+                              strlen (l->channel));
+  if (NULL == ident)
+  {
+    listener_fail (l);
+    return;
+  }
+  GNUNET_asprintf (&sql,
+                   "LISTEN %s",
+                   ident);
+  PQfreemem (ident);
+  ret = PQsendQuery (l->conn,
+                     sql);
+  GNUNET_free (sql);
+  if (1 != ret)
+  {
+    listener_fail (l);
+    return;
+  }
+  l->state = CS_PREPARING;
+  listener_write_cb (l);
+  if (NULL != l->conn)
+    listener_wait_read (l);
+}
+
+
+/**
+ * The socket of @a l (being connected) is ready, continue.
+ *
+ * @param cls a `struct PGA_Listener`
+ */
+static void
+listener_connect_cb (void *cls);
+
+
+/**
+ * Continue establishing the connection of @a l, as directed by
+ * the result @a pst of PQconnectPoll().
+ *
+ * @param l listener being connected
+ * @param pst what libpq wants us to do next
+ */
+static void
+listener_poll (struct PGA_Listener *l,
+               PostgresPollingStatusType pst)
+{
+  struct GNUNET_TIME_Relative timeout;
+
+  switch (pst)
+  {
+  case PGRES_POLLING_READING:
+  case PGRES_POLLING_WRITING:
+    /* the socket may change while libpq tries different addresses */
+    if (NULL != l->sock)
+      GNUNET_NETWORK_socket_free_memory_only_ (l->sock);
+    l->sock = GNUNET_NETWORK_socket_box_native (PQsocket (l->conn));
+    if (NULL == l->sock)
+    {
+      GNUNET_break (0);
+      listener_fail (l);
+      return;
+    }
+    timeout = GNUNET_TIME_absolute_get_remaining (l->connect_deadline);
+    if (PGRES_POLLING_WRITING == pst)
+      l->write_task = GNUNET_SCHEDULER_add_write_net (timeout,
+                                                      l->sock,
+                                                      &listener_connect_cb,
+                                                      l);
+    else
+      l->read_task = GNUNET_SCHEDULER_add_read_net (timeout,
+                                                    l->sock,
+                                                    &listener_connect_cb,
+                                                    l);
+    return;
+  case PGRES_POLLING_OK:
+    listener_send_listen (l);
+    return;
+  default:
+    listener_fail (l);
+    return;
+  }
+}
+
+
+static void
+listener_connect_cb (void *cls)
+{
+  struct PGA_Listener *l = cls;
+
+  l->read_task = NULL;
+  l->write_task = NULL;
+  if (0 == GNUNET_TIME_absolute_get_remaining (
+        l->connect_deadline).rel_value_us)
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                     "pq-async",
+                     "Timeout connecting to listen on `%s'\n",
+                     l->channel);
+    listener_fail (l);
+    return;
+  }
+  listener_poll (l,
+                 PQconnectPoll (l->conn));
+}
+
+
+/**
+ * The LISTEN of @a l completed, pass on that notifications may
+ * have been lost while we were not listening.
+ *
+ * @param l listener that is now ready
+ */
+static void
+listener_ready (struct PGA_Listener *l)
+{
+  l->state = CS_READY;
+  l->retry_delay = GNUNET_TIME_UNIT_ZERO;
+  if (GNUNET_YES == l->was_connected)
+    l->cb (l->cb_cls,
+           NULL);
+  l->was_connected = GNUNET_YES;
+}
+
+
+static void
+listener_read_cb (void *cls)
+{
+  struct PGA_Listener *l = cls;
+  PGnotify *n;
+
+  l->read_task = NULL;
+  if ( (CS_READY != l->state) &&
+       (0 == GNUNET_TIME_absolute_get_remaining (
+          l->connect_deadline).rel_value_us) )
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                     "pq-async",
+                     "Timeout waiting for LISTEN on `%s'\n",
+                     l->channel);
+    listener_fail (l);
+    return;
+  }
+  if (1 != PQconsumeInput (l->conn))
+  {
+    listener_fail (l);
+    return;
+  }
+  while ( (CS_READY != l->state) &&
+          (0 == PQisBusy (l->conn)) )
+  {
+    PGresult *res;
+
+    res = PQgetResult (l->conn);
+    if (NULL == res)
+    {
+      listener_ready (l);
+      break;
+    }
+    if (PGRES_COMMAND_OK != PQresultStatus (res))
+    {
+      PQclear (res);
+      listener_fail (l);
+      return;
+    }
+    PQclear (res);
+  }
+  while (NULL != (n = PQnotifies (l->conn)))
+  {
+    l->cb (l->cb_cls,
+           n->extra);
+    PQfreemem (n);
+  }
+  listener_wait_read (l);
+}
+
+
+static void
+listener_connect (void *cls)
+{
+  struct PGA_Listener *l = cls;
+
+  l->retry_task = NULL;
+  l->conn = PQconnectStart (l->ctx->conninfo);
+  if ( (NULL == l->conn) ||
+       (CONNECTION_BAD == PQstatus (l->conn)) )
+  {
+    listener_fail (l);
+    return;
+  }
+  l->state = CS_CONNECTING;
+  l->connect_deadline = GNUNET_TIME_relative_to_absolute (CONNECT_TIMEOUT);
+  listener_poll (l,
+                 PGRES_POLLING_WRITING);
+}
+
+
+struct PGA_Listener *
+PGA_listen (struct PGA_Context *ctx,
+            const char *channel,
+            PGA_NotifyCallback cb,
+            void *cb_cls)
+{
+  struct PGA_Listener *l;
+
+  l = GNUNET_new (struct PGA_Listener);
+  l->ctx = ctx;
+  l->channel = GNUNET_strdup (channel);
+  l->cb = cb;
+  l->cb_cls = cb_cls;
+  l->retry_task = GNUNET_SCHEDULER_add_now (&listener_connect,
+                                            l);
+  ctx->num_listeners++;
+  return l;
+}
+
+
+void
+PGA_listen_cancel (struct PGA_Listener *l)
+{
+  listener_close (l);
+  if (NULL != l->retry_task)
+  {
+    GNUNET_SCHEDULER_cancel (l->retry_task);
+    l->retry_task = NULL;
+  }
+  l->ctx->num_listeners--;
+  GNUNET_free (l->channel);
+  GNUNET_free (l);
+}
+
+
+enum GNUNET_DB_QueryStatus
+PGA_result_to_qs (PGresult *result,
+                  const char *name)
+{
+  ExecStatusType est;
+  const char *sqlstate;
+  int rows;
+
+  if (NULL == result)
+    return GNUNET_DB_STATUS_HARD_ERROR;
+  est = PQresultStatus (result);
+  if ( (PGRES_COMMAND_OK != est) &&
+       (PGRES_TUPLES_OK != est) )
+  {
+    sqlstate = PQresultErrorField (result,
+                                   PG_DIAG_SQLSTATE);
+    if (NULL == sqlstate)
+    {
+      GNUNET_break (0);
+      return GNUNET_DB_STATUS_HARD_ERROR;
+    }
+    if ( (0 == strcmp (sqlstate,
+                       "40001")) || /* serialization failure */
+         (0 == strcmp (sqlstate,
+                       "40P01")) ) /* deadlock detected */
+    {
+      GNUNET_log_from (GNUNET_ERROR_TYPE_INFO,
+                       "pq-async",
+                       "Query `%s' failed with result: %s/%s\n",
+                       name,
+                       sqlstate,
+                       PQresultErrorField (result,
+                                           PG_DIAG_MESSAGE_PRIMARY));
+      return GNUNET_DB_STATUS_SOFT_ERROR;
+    }
+    GNUNET_log_from (GNUNET_ERROR_TYPE_ERROR,
+                     "pq-async",
+                     "Query `%s' failed with result: %s/%s\n",
+                     name,
+                     sqlstate,
+                     PQresultErrorField (result,
+                                         PG_DIAG_MESSAGE_PRIMARY));
+    return GNUNET_DB_STATUS_HARD_ERROR;
+  }
+  if (PGRES_COMMAND_OK == est)
+    return GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+  rows = PQntuples (result);
+  return (enum GNUNET_DB_QueryStatus) rows;
+}
+
+
+struct PGA_Batch *
+PGA_batch_create (struct PGA_Context *ctx)
+{
+  struct PGA_Batch *b;
+
+  b = GNUNET_new (struct PGA_Batch);
+  b->ctx = ctx;
+  return b;
+}
+
+
+int
+PGA_batch_add (struct PGA_Batch *b,
+               const char *name,
+               const struct GNUNET_PQ_QueryParam *params)
+{
+  if (b->num_stmts == b->max_stmts)
+    GNUNET_array_grow (b->stmts,
+                       b->max_stmts,
+                       GNUNET_MAX (4,
+                                   2 * b->max_stmts));
+  if (GNUNET_OK !=
+      statement_init (&b->stmts[b->num_stmts],
+                      name,
+                      params))
+    return GNUNET_SYSERR;
+  b->num_stmts++;
+  return GNUNET_OK;
+}
+
+
+/**
+ * SQL to start the transaction of a batch.
+ */
+#define BATCH_BEGIN "START TRANSACTION ISOLATION LEVEL SERIALIZABLE"
+
+
+/**
+ * Wait until @a fd becomes ready for @a events, but no longer than
+ * until @a deadline.
+ *
+ * @param fd socket to wait for
+ * @param events events to wait for, see poll()
+ * @param deadline when to give up
+ * @param[out] revents set to the events that occurred
+ * @return #GNUNET_OK if @a fd is ready, #GNUNET_NO on timeout,
+ *         #GNUNET_SYSERR on failure
+ */
+static int
+wait_socket (int fd,
+             short events,
+             struct GNUNET_TIME_Absolute deadline,
+             short *revents)
+{
+  for (;;)
+  {
+    struct GNUNET_TIME_Relative rem
+      = GNUNET_TIME_absolute_get_remaining (deadline);
+    struct pollfd pfd = {
+      .fd = fd,
+      .events = events
+    };
+    int ret;
+
+    if (0 == rem.rel_value_us)
+      return GNUNET_NO;
+    ret = poll (&pfd,
+                1,
+                (int) GNUNET_MIN ((rem.rel_value_us + 999) / 1000,
+                                  (uint64_t) INT_MAX));
+    if (0 > ret)
+    {
+      if (EINTR == errno)
+        continue;
+      return GNUNET_SYSERR;
+    }
+    if (0 == ret)
+      continue; /* check the deadline again */
+    *revents = pfd.revents;
+    return GNUNET_OK;
+  }
+}
+
+
+/**
+ * Connect the connection for batches @a c to the database and
+ * prepare all statements.  This is done like for the connections
+ * of the pool, except that we wait for the socket ourselves (as
+ * batches are executed synchronously), for at most #CONNECT_TIMEOUT.
+ * After a failure, we do not try again for a while, failing
+ * batches right away instead.
+ *
+ * @param c connection for batches
+ * @return #GNUNET_OK on success
+ */
+static int
+batch_connect (struct PGA_Connection *c)
+{
+  enum SetupStatus ss;
+
+  if (0 != GNUNET_TIME_absolute_get_remaining (c->retry_after).rel_value_us)
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_DEBUG,
+                     "pq-async",
+                     "Not yet reconnecting for batch\n");
+    return GNUNET_SYSERR;
+  }
+  ss = connection_begin (c);
+  while ( (SETUP_WAIT_READ == ss) ||
+          (SETUP_WAIT_WRITE == ss) )
+  {
+    short revents;
+    int ret;
+
+    ret = wait_socket (PQsocket (c->conn),
+                       (SETUP_WAIT_WRITE == ss) ? POLLOUT : POLLIN,
+                       c->connect_deadline,
+                       &revents);
+    if (GNUNET_OK != ret)
+    {
+      if (GNUNET_NO == ret)
+        GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                         "pq-async",
+                         "Timeout setting up database connection\n");
+      ss = SETUP_FAILED;
+      break;
+    }
+    ss = connection_setup_step (c);
+  }
+  if (SETUP_READY == ss)
+  {
+    c->retry_delay = GNUNET_TIME_UNIT_ZERO;
+    return GNUNET_OK;
+  }
+  GNUNET_log_from (GNUNET_ERROR_TYPE_ERROR,
+                   "pq-async",
+                   "Database connection to '%s' failed: %s\n",
+                   c->ctx->conninfo,
+                   (NULL != c->conn)
+                   ? PQerrorMessage (c->conn)
+                   : "");
+  connection_close (c);
+  c->retry_delay = GNUNET_TIME_relative_min (
+    GNUNET_TIME_STD_BACKOFF (c->retry_delay),
+    CONNECT_RETRY_MAX);
+  c->retry_after = GNUNET_TIME_relative_to_absolute (c->retry_delay);
+  return GNUNET_SYSERR;
+}
+
+
+/**
+ * Flush what libpq could not yet send on @a conn, then wait until
+ * input arrives, but no longer than until @a deadline, and consume
+ * it.
+ *
+ * @param conn connection of a batch
+ * @param deadline when to give up on the batch
+ * @return #GNUNET_OK if input was consumed, #GNUNET_NO on timeout,
+ *         #GNUNET_SYSERR if the connection failed
+ */
+static int
+batch_wait (PGconn *conn,
+            struct GNUNET_TIME_Absolute deadline)
+{
+  for (;;)
+  {
+    short events = POLLIN;
+    short revents;
+    int ret;
+
+    switch (PQflush (conn))
+    {
+    case 0:
+      break;
+    case 1:
+      events |= POLLOUT;
+      break;
+    default:
+      return GNUNET_SYSERR;
+    }
+    ret = wait_socket (PQsocket (conn),
+                       events,
+                       deadline,
+                       &revents);
+    if (GNUNET_OK != ret)
+    {
+      if (GNUNET_NO == ret)
+        GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                         "pq-async",
+                         "Timeout executing batch\n");
+      return ret;
+    }
+    if (0 == (revents & (POLLIN | POLLERR | POLLHUP)))
+      continue; /* only writable, flush more */
+    if (1 != PQconsumeInput (conn))
+      return GNUNET_SYSERR;
+    return GNUNET_OK;
+  }
+}
+
+
+/**
+ * SQL to start the transaction of a batch.
+ */
+#define BATCH_BEGIN "START TRANSACTION ISOLATION LEVEL SERIALIZABLE"
+
+
+#if HAVE_PQ_PIPELINE
+
+/**
+ * Run the statements of @a b on @a c in pipeline mode: everything
+ * is sent at once, and then we collect the results.  The COMMIT is
+ * sent after a sync point: if a statement fails, the server skips
+ * the rest of the first segment, and the COMMIT then rolls back.
+ *
+ * @param b batch to run
+ * @param c connection to use, must be connected
+ * @return status of the batch, see #PGA_batch_execute()
+ */
+static enum GNUNET_DB_QueryStatus
+batch_run (const struct PGA_Batch *b,
+           struct PGA_Connection *c)
+{
+  PGconn *conn = c->conn;
+  struct GNUNET_TIME_Absolute deadline
+    = GNUNET_TIME_relative_to_absolute (BATCH_TIMEOUT);
+  enum GNUNET_DB_QueryStatus qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
+  unsigned int idx = 0;
+  unsigned int syncs = 0;
+  int ok;
+
+  ok = (1 == PQenterPipelineMode (conn)) &&
+       (1 == PQsendQueryParams (conn,
+                                BATCH_BEGIN,
+                                0, NULL, NULL, NULL, NULL,
+                                1));
+  for (unsigned int i = 0; ok && (i<b->num_stmts); i++)
+    ok = (GNUNET_OK ==
+          statement_send (conn,
+                          &b->stmts[i]));
+  ok = ok &&
+       (1 == PQpipelineSync (conn)) &&
+       (1 == PQsendQueryParams (conn,
+                                "COMMIT",
+                                0, NULL, NULL, NULL, NULL,
+                                1)) &&
+       (1 == PQpipelineSync (conn));
+  while (ok && (syncs < 2))
+  {
+    if (GNUNET_OK !=
+        batch_wait (conn,
+                    deadline))
+    {
+      ok = 0;
+      continue;
+    }
+    while ( (syncs < 2) &&
+            (0 == PQisBusy (conn)) )
+    {
+      PGresult *res;
+
+      res = PQgetResult (conn);
+      if (NULL == res)
+        continue; /* end of the results of a command */
+      switch (PQresultStatus (res))
+      {
+      case PGRES_PIPELINE_SYNC:
+        syncs++;
+        break;
+      case PGRES_PIPELINE_ABORTED:
+        /* skipped after an earlier failure */
+        idx++;
+        break;
+      default:
+        if (0 <= qs)
+        {
+          enum GNUNET_DB_QueryStatus sqs;
+
+          sqs = PGA_result_to_qs (res,
+                                  (0 == idx)
+                                  ? "BEGIN"
+                                  : (idx <= b->num_stmts)
+                                  ? b->stmts[idx - 1].name
+                                  : "COMMIT");
+          if (0 > sqs)
+            qs = sqs;
+        }
+        idx++;
+        break;
+      }
+      PQclear (res);
+    }
+  }
+  if (! ok)
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                     "pq-async",
+                     "Database connection failed during batch: %s\n",
+                     PQerrorMessage (conn));
+    connection_close (c);
+    return GNUNET_DB_STATUS_HARD_ERROR;
+  }
+  GNUNET_break (1 == PQexitPipelineMode (conn));
+  return qs;
+}
+
+
+#else
+
+
+/**
+ * Wait for the results of the command sent last on @a conn and
+ * convert the first one.
+ *
+ * @param conn connection of a batch
+ * @param deadline when to give up on the batch
+ * @param name name of the command, for logging
+ * @param[in,out] ok set to 0 if the connection failed
+ * @return status of the command
+ */
+static enum GNUNET_DB_QueryStatus
+batch_result (PGconn *conn,
+              struct GNUNET_TIME_Absolute deadline,
+              const char *name,
+              int *ok)
+{
+  enum GNUNET_DB_QueryStatus qs;
+  PGresult *first = NULL;
+
+  for (;;)
+  {
+    PGresult *res;
+
+    if (0 != PQisBusy (conn))
+    {
+      if (GNUNET_OK !=
+          batch_wait (conn,
+                      deadline))
+      {
+        *ok = 0;
+        break;
+      }
+      continue;
+    }
+    res = PQgetResult (conn);
+    if (NULL == res)
+      break;
+    if (NULL == first)
+      first = res;
+    else
+      PQclear (res); /* we only care about the first result */
+  }
+  qs = (*ok)
+       ? PGA_result_to_qs (first,
+                           name)
+       : GNUNET_DB_STATUS_HARD_ERROR;
+  if (NULL != first)
+    PQclear (first);
+  return qs;
+}
+
+
+/**
+ * Run the statements of @a b on @a c one after the other, as our
+ * libpq does not support pipeline mode.
+ *
+ * @param b batch to run
+ * @param c connection to use, must be connected
+ * @return status of the batch, see #PGA_batch_execute()
+ */
+static enum GNUNET_DB_QueryStatus
+batch_run (const struct PGA_Batch *b,
+           struct PGA_Connection *c)
+{
+  PGconn *conn = c->conn;
+  struct GNUNET_TIME_Absolute deadline
+    = GNUNET_TIME_relative_to_absolute (BATCH_TIMEOUT);
+  enum GNUNET_DB_QueryStatus qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
+  enum GNUNET_DB_QueryStatus sqs;
+  int ok;
+
+  ok = (1 == PQsendQueryParams (conn,
+                                BATCH_BEGIN,
+                                0, NULL, NULL, NULL, NULL,
+                                1));
+  if (ok)
+  {
+    sqs = batch_result (conn,
+                        deadline,
+                        "BEGIN",
+                        &ok);
+    if (0 > sqs)
+      qs = sqs;
+  }
+  for (unsigned int i = 0; ok && (0 <= qs) && (i<b->num_stmts); i++)
+  {
+    ok = (GNUNET_OK ==
+          statement_send (conn,
+                          &b->stmts[i]));
+    if (! ok)
+      break;
+    sqs = batch_result (conn,
+                        deadline,
+                        b->stmts[i].name,
+                        &ok);
+    if (0 > sqs)
+      qs = sqs;
+  }
+  if (ok)
+    ok = (1 == PQsendQueryParams (conn,
+                                  (0 <= qs) ? "COMMIT" : "ROLLBACK",
+                                  0, NULL, NULL, NULL, NULL,
+                                  1));
+  if (ok)
+  {
+    sqs = batch_result (conn,
+                        deadline,
+                        (0 <= qs) ? "COMMIT" : "ROLLBACK",
+                        &ok);
+    if ( (0 <= qs) &&
+         (0 > sqs) )
+      qs = sqs;
+  }
+  if (! ok)
+  {
+    GNUNET_log_from (GNUNET_ERROR_TYPE_WARNING,
+                     "pq-async",
+                     "Database connection failed during batch: %s\n",
+                     PQerrorMessage (conn));
+    connection_close (c);
+    return GNUNET_DB_STATUS_HARD_ERROR;
+  }
+  return qs;
+}
+
+
+#endif
+
+
+enum GNUNET_DB_QueryStatus
+PGA_batch_execute (struct PGA_Batch *b)
+{
+  struct PGA_Connection *c = &b->ctx->batch_conn;
+
+  if (0 == b->num_stmts)
+    return GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+  if ( (NULL == c->conn) ||
+       (CONNECTION_OK != PQstatus (c->conn)) )
+  {
+    if (GNUNET_OK != batch_connect (c))
+      return GNUNET_DB_STATUS_HARD_ERROR;
+  }
+  return batch_run (b,
+                    c);
+}
+
+
+void
+PGA_batch_destroy (struct PGA_Batch *b)
+{
+  for (unsigned int i = 0; i<b->num_stmts; i++)
+    statement_release (&b->stmts[i]);
+  GNUNET_array_grow (b->stmts,
+                     b->max_stmts,
+                     0);
+  GNUNET_free (b);
+}
+
+
+void
+PGA_get_statistics (const struct PGA_Context *ctx,
+                    struct PGA_Statistics *stats)
+{
+  *stats = ctx->stats;
+  stats->busy = 0;
+  for (unsigned int i = 0; i<ctx->num_conns; i++)
+    if (NULL != ctx->conns[i].active)
+      stats->busy++;
+}
+
+
+void
+PGA_disconnect (struct PGA_Context *ctx)
+{
+  struct PGA_Query *q;
+
+  GNUNET_break (0 == ctx->num_listeners);
+  if (NULL != ctx->run_task)
+  {
+    GNUNET_SCHEDULER_cancel (ctx->run_task);
+    ctx->run_task = NULL;
+  }
+  while (NULL != (q = ctx->q_head))
+  {
+    GNUNET_break (0); /* application should have cancelled */
+    GNUNET_CONTAINER_DLL_remove (ctx->q_head,
+                                 ctx->q_tail,
+                                 q);
+    query_free (q);
+  }
+  for (unsigned int i = 0; i<ctx->num_conns; i++)
+  {
+    struct PGA_Connection *c = &ctx->conns[i];
+
+    if (NULL != c->active)
+    {
+      GNUNET_break (NULL == c->active->cb);
+      query_free (c->active);
+      c->active = NULL;
+    }
+    connection_close (c);
+  }
+  connection_close (&ctx->batch_conn);
+  GNUNET_free (ctx->conns);
+  GNUNET_free (ctx->ps);
+  GNUNET_free (ctx->conninfo);
+  GNUNET_free (ctx);
+}
+
+
+/* end of pg_async.c */
@@ -0,0 +1,298 @@
+/*
+  This file is part of TALER
+  (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU Lesser General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file backenddb/pg_async.h
+ * @brief non-blocking execution of prepared statements on dedicated
+ *        libpq connections, driven by the GNUnet scheduler
+ * @author Christian Grothoff
+ */
+#ifndef PG_ASYNC_H
+#define PG_ASYNC_H
+
+#include <libpq-fe.h>
+#include <gnunet/gnunet_util_lib.h>
+#include <gnunet/gnunet_pq_lib.h>
+
+
+/**
+ * Handle for a pool of asynchronous database connections.
+ */
+struct PGA_Context;
+
+
+/**
+ * Statistics about the use of a connection pool.
+ */
+struct PGA_Statistics
+{
+
+  /**
+   * Number of queries that were started.
+   */
+  unsigned long long queries;
+
+  /**
+   * Total time queries spent waiting for an idle connection.
+   */
+  struct GNUNET_TIME_Relative total_wait;
+
+  /**
+   * Longest time a query spent waiting for an idle connection.
+   */
+  struct GNUNET_TIME_Relative max_wait;
+
+  /**
+   * Number of queries currently waiting for a connection.
+   */
+  unsigned int queue_length;
+
+  /**
+   * Largest value @e queue_length ever had.
+   */
+  unsigned int max_queue_length;
+
+  /**
+   * Number of connections currently executing a query.
+   */
+  unsigned int busy;
+
+  /**
+   * Number of connections in the pool.
+   */
+  unsigned int size;
+
+};
+
+
+/**
+ * Handle for a query that was queued for asynchronous execution.
+ */
+struct PGA_Query;
+
+
+/**
+ * Function called with the result of an asynchronous query.
+ *
+ * @param cls closure
+ * @param result result returned by Postgres, NULL if we failed to
+ *        run the query (i.e. because the connection broke); only
+ *        valid for the duration of the call
+ */
+typedef void
+(*PGA_ResultCallback)(void *cls,
+                      PGresult *result);
+
+
+/**
+ * Handle for a connection listening for notifications.
+ */
+struct PGA_Listener;
+
+
+/**
+ * Function called with a notification received on a channel.
+ * Must not call #PGA_listen_cancel() on the listener.
+ *
+ * @param cls closure
+ * @param payload payload of the notification, NULL if the
+ *        connection was re-established and notifications
+ *        may have been lost in the meantime
+ */
+typedef void
+(*PGA_NotifyCallback)(void *cls,
+                      const char *payload);
+
+
+/**
+ * Create a context for asynchronous queries.  Connections to the
+ * database are only established once they are needed, so this is
+ * cheap for programs that never use the asynchronous API.
+ *
+ * @param conninfo libpq connection string
+ * @param pool_size maximum number of connections to use
+ * @param ps array of prepared statements to prepare on each of
+ *        our connections, terminated by #GNUNET_PQ_PREPARED_STATEMENT_END;
+ *        the array is copied, but the strings it points to must remain
+ *        valid until #PGA_disconnect()
+ * @return NULL on error
+ */
+struct PGA_Context *
+PGA_connect (const char *conninfo,
+             unsigned int pool_size,
+             const struct GNUNET_PQ_PreparedStatement *ps);
+
+
+/**
+ * Queue prepared statement @a name for execution with @a params.
+ * The parameters are serialized immediately, so they do not need to
+ * remain valid after this call returns.
+ *
+ * @param ctx context to run the query in
+ * @param name name of the prepared statement
+ * @param params parameters for the statement
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return NULL on error (i.e. failure to serialize @a params)
+ */
+struct PGA_Query *
+PGA_query (struct PGA_Context *ctx,
+           const char *name,
+           const struct GNUNET_PQ_QueryParam *params,
+           PGA_ResultCallback cb,
+           void *cb_cls);
+
+
+/**
+ * Cancel query @a q.  The callback will not be invoked.  If the
+ * query was already sent to the database, its result is discarded.
+ *
+ * @param q query to cancel
+ */
+void
+PGA_query_cancel (struct PGA_Query *q);
+
+
+/**
+ * Convert the status of @a result into a database status code,
+ * following the same rules as GNUNET_PQ_eval_result().  On success,
+ * returns the number of rows returned by a query (or 0 for
+ * statements that do not return rows).
+ *
+ * @param result result to inspect, NULL is a hard error
+ * @param name name of the statement (for logging)
+ * @return status code
+ */
+enum GNUNET_DB_QueryStatus
+PGA_result_to_qs (PGresult *result,
+                  const char *name);
+
+
+/**
+ * Statements to be executed together in one transaction.
+ */
+struct PGA_Batch;
+
+
+/**
+ * Create an (empty) batch of statements.  Batches are executed
+ * synchronously on a connection of their own, so that the caller
+ * can use the outcome like that of a GNUnet PQ transaction.
+ *
+ * @param ctx context to run the batch in
+ * @return the batch
+ */
+struct PGA_Batch *
+PGA_batch_create (struct PGA_Context *ctx);
+
+
+/**
+ * Add prepared statement @a name with @a params to @a b.  The
+ * parameters are serialized immediately.  The result of the
+ * statement is only checked for errors.
+ *
+ * @param b batch to add to
+ * @param name name of the prepared statement
+ * @param params parameters for the statement
+ * @return #GNUNET_OK on success, #GNUNET_SYSERR if @a params
+ *         could not be serialized
+ */
+int
+PGA_batch_add (struct PGA_Batch *b,
+               const char *name,
+               const struct GNUNET_PQ_QueryParam *params);
+
+
+/**
+ * Execute all statements of @a b in one (serializable) transaction.
+ * With libpq 14 or later, the statements are pipelined, so that the
+ * whole batch takes about one round trip to the database.  The batch
+ * remains valid, so it can be executed again after a soft error.
+ * Blocks for at most a few seconds to connect, and for a bounded
+ * time to execute the batch, otherwise the batch fails with a hard
+ * error.
+ *
+ * The number of rows affected by the statements is not reported,
+ * so callers should only check if the result is negative.
+ *
+ * @param b batch to execute
+ * @return #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT if the transaction
+ *         committed, #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if @a b
+ *         is empty, otherwise the error of the first failed statement
+ *         (or #GNUNET_DB_STATUS_HARD_ERROR if the connection failed
+ *         or timed out)
+ */
+enum GNUNET_DB_QueryStatus
+PGA_batch_execute (struct PGA_Batch *b);
+
+
+/**
+ * Release the resources of @a b.
+ *
+ * @param b batch to destroy
+ */
+void
+PGA_batch_destroy (struct PGA_Batch *b);
+
+
+/**
+ * Start listening for notifications on @a channel.  The listener
+ * uses its own connection (not one from the pool), which is
+ * re-established automatically if it breaks.
+ *
+ * @param ctx context to use the connection parameters of
+ * @param channel name of the channel to LISTEN on
+ * @param cb function to call for each notification
+ * @param cb_cls closure for @a cb
+ * @return handle to stop listening
+ */
+struct PGA_Listener *
+PGA_listen (struct PGA_Context *ctx,
+            const char *channel,
+            PGA_NotifyCallback cb,
+            void *cb_cls);
+
+
+/**
+ * Stop listening and close the connection of @a l.
+ *
+ * @param l listener to stop
+ */
+void
+PGA_listen_cancel (struct PGA_Listener *l);
+
+
+/**
+ * Obtain statistics about the connection pool of @a ctx.
+ *
+ * @param ctx context to inspect
+ * @param[out] stats set to the current statistics
+ */
+void
+PGA_get_statistics (const struct PGA_Context *ctx,
+                    struct PGA_Statistics *stats);
+
+
+/**
+ * Close all connections of @a ctx and cancel all pending queries.
+ * All listeners must have been cancelled before.
+ *
+ * @param ctx context to destroy
+ */
+void
+PGA_disconnect (struct PGA_Context *ctx);
+
+
+#endif
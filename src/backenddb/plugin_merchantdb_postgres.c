@@ -27,12 +27,40 @@
 #include <taler/taler_pq_lib.h>
 #include <taler/taler_json_lib.h>
 #include "taler_merchantdb_plugin.h"
+#include "pg_async.h"
+
+/**
+ * Channel used to notify other processes about payments and refunds.
+ */
+#define PAYMENT_EVENT_CHANNEL "taler_merchant_payment_events"
 
 /**
  * How often do we re-try if we run into a DB serialization error?
  */
 #define MAX_RETRIES 3
 
+/**
+ * Name under which the statistics account the execution of a
+ * batch (see #postgres_batch_commit_TR()), which runs all of its
+ * statements in a single round trip.
+ */
+#define BATCH_STATEMENT_NAME "batch_commit"
+
+/**
+ * SQL expression for the timestamp of the contract with hash
+ * @a h (of the instance @a pub), used to restrict lookups in the
+ * tables partitioned by contract timestamp to the partition
+ * of the contract's month.
+ *
+ * @param h parameter with the hash of the contract terms
+ * @param pub parameter with the merchant's public key
+ */
+#define CONTRACT_TIMESTAMP(h,pub) \
+  "(SELECT timestamp" \
+  "   FROM merchant_contract_terms" \
+  "  WHERE h_contract_terms=" h \
+  "    AND merchant_pub=" pub ")"
+
 
 /**
  * Wrapper macro to add the currency from the plugin's state
@@ -67,6 +95,35 @@
     field,pg->currency,amountp)
 
 
+/**
+ * Latency statistics we keep for a prepared statement.
+ */
+struct StatementStatistics
+{
+
+  /**
+   * Name of the statement.
+   */
+  const char *name;
+
+  /**
+   * Number of times the statement was executed.
+   */
+  unsigned long long calls;
+
+  /**
+   * Total time spent executing the statement.
+   */
+  struct GNUNET_TIME_Relative total;
+
+  /**
+   * Longest execution of the statement.
+   */
+  struct GNUNET_TIME_Relative max;
+
+};
+
+
 /**
  * Type of the "cls" argument given to each of the functions in
  * our API.
@@ -99,709 +156,653 @@ struct PostgresClosure
    */
   const char *transaction_name;
 
+  /**
+   * Connection(s) for asynchronous queries.
+   */
+  struct PGA_Context *async;
+
+  /**
+   * Latency statistics of our prepared statements, sorted
+   * by statement name.
+   */
+  struct StatementStatistics *stmt_stats;
+
+  /**
+   * Length of the @e stmt_stats array.
+   */
+  unsigned int num_stmt_stats;
+
+  /**
+   * Head of payment event notifications being sent.
+   */
+  struct PaymentNotification *pn_head;
+
+  /**
+   * Tail of payment event notifications being sent.
+   */
+  struct PaymentNotification *pn_tail;
+
+  /**
+   * Listener for payment events, NULL if we do not listen.
+   */
+  struct PGA_Listener *listener;
+
+  /**
+   * Function to call with payment events from other processes.
+   */
+  TALER_MERCHANTDB_PaymentEventCallback event_cb;
+
+  /**
+   * Closure for @e event_cb.
+   */
+  void *event_cb_cls;
+
+  /**
+   * Random identifier of this process, prefixed to the payload of our
+   * notifications so that we can ignore our own.
+   */
+  char origin[17];
+
 };
 
 
 /**
- * Drop merchant tables
- *
- * @param cls closure our `struct Plugin`
- * @return #GNUNET_OK upon success; #GNUNET_SYSERR upon failure
+ * Notification of a payment event being sent.
  */
-static int
-postgres_drop_tables (void *cls)
+struct PaymentNotification
 {
-  struct PostgresClosure *pg = cls;
-  char *load_path;
 
-  GNUNET_asprintf (&load_path,
-                   "%s%s",
-                   pg->sql_dir,
-                   "drop");
-  GNUNET_PQ_run_sql (pg->conn,
-                     load_path);
-  GNUNET_free (load_path);
-  return GNUNET_OK;
-}
+  /**
+   * Kept in a DLL.
+   */
+  struct PaymentNotification *next;
+
+  /**
+   * Kept in a DLL.
+   */
+  struct PaymentNotification *prev;
+
+  /**
+   * Plugin state.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * The underlying query.
+   */
+  struct PGA_Query *q;
+
+  /**
+   * When was the notification started?
+   */
+  struct GNUNET_TIME_Absolute start;
+
+};
 
 
 /**
- * Check that the database connection is still up.
- *
- * @param pg connection to check
+ * Handle for an asynchronous database operation.
  */
-static void
-check_connection (struct PostgresClosure *pg)
+struct TALER_MERCHANTDB_AsyncHandle
 {
-  GNUNET_PQ_reconnect_if_down (pg->conn);
-}
+
+  /**
+   * Plugin state.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * The underlying query.
+   */
+  struct PGA_Query *q;
+
+  /**
+   * Name of the prepared statement (for logging).
+   */
+  const char *stmt;
+
+  /**
+   * When was the operation started?
+   */
+  struct GNUNET_TIME_Absolute start;
+
+  /**
+   * Function to call with the result (contract info lookups).
+   */
+  TALER_MERCHANTDB_ContractInfoCallback info_cb;
+
+  /**
+   * Function to call with the result (claimed contract lookups).
+   */
+  TALER_MERCHANTDB_ClaimedContractCallback claimed_cb;
+
+  /**
+   * Closure for @e info_cb or @e claimed_cb.
+   */
+  void *cb_cls;
+
+};
 
 
 /**
- * Do a pre-flight check that we are not in an uncommitted transaction.
- * If we are, try to commit the previous transaction and output a warning.
- * Does not return anything, as we will continue regardless of the outcome.
+ * Statements to be executed together.
+ */
+struct TALER_MERCHANTDB_Batch
+{
+
+  /**
+   * The underlying batch.
+   */
+  struct PGA_Batch *b;
+
+  /**
+   * #GNUNET_YES if adding a statement failed.
+   */
+  int failed;
+
+};
+
+
+/**
+ * Compare two `struct StatementStatistics` by name, for qsort()
+ * and bsearch().
  *
- * @param cls the `struct PostgresClosure` with the plugin-specific state
+ * @param a first statistics
+ * @param b second statistics
+ * @return result of strcmp() on the names
  */
-static void
-postgres_preflight (void *cls)
+static int
+cmp_statement_statistics (const void *a,
+                          const void *b)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_ExecuteStatement es[] = {
-    GNUNET_PQ_make_execute ("COMMIT"),
-    GNUNET_PQ_EXECUTE_STATEMENT_END
-  };
+  const struct StatementStatistics *sa = a;
+  const struct StatementStatistics *sb = b;
 
-  if (NULL == pg->transaction_name)
-    return; /* all good */
-  if (GNUNET_OK ==
-      GNUNET_PQ_exec_statements (pg->conn,
-                                 es))
-  {
-    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
-                "BUG: Preflight check committed transaction `%s'!\n",
-                pg->transaction_name);
-  }
-  else
-  {
-    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
-                "BUG: Preflight check failed to commit transaction `%s'!\n",
-                pg->transaction_name);
-  }
-  pg->transaction_name = NULL;
+  return strcmp (sa->name,
+                 sb->name);
 }
 
 
 /**
- * Start a transaction.
+ * Account the execution of statement @a name that started at @a start.
  *
- * @param cls the `struct PostgresClosure` with the plugin-specific state
- * @param name unique name identifying the transaction (for debugging),
- *             must point to a constant
- * @return #GNUNET_OK on success
+ * @param pg plugin state
+ * @param name name of the prepared statement
+ * @param start when the execution started
  */
-static int
-postgres_start (void *cls,
-                const char *name)
+static void
+record_statement (struct PostgresClosure *pg,
+                  const char *name,
+                  struct GNUNET_TIME_Absolute start)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_ExecuteStatement es[] = {
-    GNUNET_PQ_make_execute ("START TRANSACTION ISOLATION LEVEL SERIALIZABLE"),
-    GNUNET_PQ_EXECUTE_STATEMENT_END
+  struct StatementStatistics key = {
+    .name = name
   };
-
-  check_connection (pg);
-  postgres_preflight (pg);
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Starting merchant DB transaction\n");
-  if (GNUNET_OK !=
-      GNUNET_PQ_exec_statements (pg->conn,
-                                 es))
+  struct StatementStatistics *ss;
+  struct GNUNET_TIME_Relative duration;
+
+  ss = bsearch (&key,
+                pg->stmt_stats,
+                pg->num_stmt_stats,
+                sizeof (struct StatementStatistics),
+                &cmp_statement_statistics);
+  if (NULL == ss)
   {
-    TALER_LOG_ERROR ("Failed to start transaction\n");
     GNUNET_break (0);
-    return GNUNET_SYSERR;
+    return;
   }
-  pg->transaction_name = name;
-  return GNUNET_OK;
+  duration = GNUNET_TIME_absolute_get_duration (start);
+  ss->calls++;
+  ss->total = GNUNET_TIME_relative_add (ss->total,
+                                        duration);
+  ss->max = GNUNET_TIME_relative_max (ss->max,
+                                      duration);
 }
 
 
 /**
- * Roll back the current transaction of a database connection.
+ * Like #GNUNET_PQ_eval_prepared_non_select(), but also
+ * accounts the latency of the statement.
  *
- * @param cls the `struct PostgresClosure` with the plugin-specific state
- * @return #GNUNET_OK on success
+ * @param pg plugin state
+ * @param statement_name name of the statement
+ * @param params parameters to the statement
+ * @return status code from the database
  */
-static void
-postgres_rollback (void *cls)
+static enum GNUNET_DB_QueryStatus
+eval_prepared_non_select (struct PostgresClosure *pg,
+                          const char *statement_name,
+                          const struct GNUNET_PQ_QueryParam *params)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_ExecuteStatement es[] = {
-    GNUNET_PQ_make_execute ("ROLLBACK"),
-    GNUNET_PQ_EXECUTE_STATEMENT_END
-  };
+  struct GNUNET_TIME_Absolute start = GNUNET_TIME_absolute_get ();
+  enum GNUNET_DB_QueryStatus qs;
 
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Rolling back merchant DB transaction\n");
-  GNUNET_break (GNUNET_OK ==
-                GNUNET_PQ_exec_statements (pg->conn,
-                                           es));
-  pg->transaction_name = NULL;
+  qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
+                                           statement_name,
+                                           params);
+  record_statement (pg,
+                    statement_name,
+                    start);
+  return qs;
 }
 
 
 /**
- * Commit the current transaction of a database connection.
+ * Like #GNUNET_PQ_eval_prepared_multi_select(), but also
+ * accounts the latency of the statement.
  *
- * @param cls the `struct PostgresClosure` with the plugin-specific state
- * @return transaction status code
+ * @param pg plugin state
+ * @param statement_name name of the statement
+ * @param params parameters to the statement
+ * @param rh function to call with the result set
+ * @param rh_cls closure for @a rh
+ * @return status code from the database
  */
 static enum GNUNET_DB_QueryStatus
-postgres_commit (void *cls)
+eval_prepared_multi_select (struct PostgresClosure *pg,
+                            const char *statement_name,
+                            const struct GNUNET_PQ_QueryParam *params,
+                            GNUNET_PQ_PostgresResultHandler rh,
+                            void *rh_cls)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_end
-  };
+  struct GNUNET_TIME_Absolute start = GNUNET_TIME_absolute_get ();
+  enum GNUNET_DB_QueryStatus qs;
 
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Committing merchant DB transaction\n");
-  pg->transaction_name = NULL;
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "end_transaction",
-                                             params);
+  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
+                                             statement_name,
+                                             params,
+                                             rh,
+                                             rh_cls);
+  record_statement (pg,
+                    statement_name,
+                    start);
+  return qs;
 }
 
 
 /**
- * Retrieve proposal data given its proposal data's hashcode
+ * Like #GNUNET_PQ_eval_prepared_singleton_select(), but also
+ * accounts the latency of the statement.
  *
- * @param cls closure
- * @param contract_terms where to store the retrieved proposal data
- * @param h_contract_terms proposal data's hashcode that will be used to
- * perform the lookup
- * @return transaction status
+ * @param pg plugin state
+ * @param statement_name name of the statement
+ * @param params parameters to the statement
+ * @param[in,out] rs result specification to use for storing the result
+ * @return status code from the database
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_contract_terms_from_hash (void *cls,
-                                        json_t **contract_terms,
-                                        const struct
-                                        GNUNET_HashCode *h_contract_terms,
-                                        const struct
-                                        TALER_MerchantPublicKeyP *merchant_pub)
+eval_prepared_singleton_select (struct PostgresClosure *pg,
+                                const char *statement_name,
+                                const struct GNUNET_PQ_QueryParam *params,
+                                struct GNUNET_PQ_ResultSpec *rs)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_end
-  };
-  struct GNUNET_PQ_ResultSpec rs[] = {
-    TALER_PQ_result_spec_json ("contract_terms",
-                               contract_terms),
-    GNUNET_PQ_result_spec_end
-  };
+  struct GNUNET_TIME_Absolute start = GNUNET_TIME_absolute_get ();
+  enum GNUNET_DB_QueryStatus qs;
 
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "find_contract_terms_from_hash",
-                                                   params,
-                                                   rs);
+  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
+                                                 statement_name,
+                                                 params,
+                                                 rs);
+  record_statement (pg,
+                    statement_name,
+                    start);
+  return qs;
 }
 
 
 /**
- * Retrieve proposal data given its proposal data's hashcode
+ * Drop merchant tables
  *
- * @param cls closure
- * @param contract_terms where to store the retrieved proposal data
- * @param h_contract_terms proposal data's hashcode that will be used to
- * perform the lookup
- * @return transaction status
+ * @param cls closure our `struct Plugin`
+ * @return #GNUNET_OK upon success; #GNUNET_SYSERR upon failure
  */
-static enum GNUNET_DB_QueryStatus
-postgres_find_paid_contract_terms_from_hash (void *cls,
-                                             json_t **contract_terms,
-                                             const struct
-                                             GNUNET_HashCode *h_contract_terms,
-                                             const struct
-                                             TALER_MerchantPublicKeyP *
-                                             merchant_pub)
+static int
+postgres_drop_tables (void *cls)
 {
   struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_end
-  };
-  struct GNUNET_PQ_ResultSpec rs[] = {
-    TALER_PQ_result_spec_json ("contract_terms",
-                               contract_terms),
-    GNUNET_PQ_result_spec_end
-  };
+  char *load_path;
 
-  /* no preflight check here, runs in its own transaction from
-     caller (in /pay case) */
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "find_paid_contract_terms_from_hash",
-                                                   params,
-                                                   rs);
+  GNUNET_asprintf (&load_path,
+                   "%s%s",
+                   pg->sql_dir,
+                   "drop");
+  GNUNET_PQ_run_sql (pg->conn,
+                     load_path);
+  GNUNET_free (load_path);
+  return GNUNET_OK;
 }
 
 
 /**
- * Retrieve proposal data given its order id.  Ignores if the
- * proposal has been paid or not.
+ * Check that the database connection is still up.
+ *
+ * @param pg connection to check
+ */
+static void
+check_connection (struct PostgresClosure *pg)
+{
+  GNUNET_PQ_reconnect_if_down (pg->conn);
+}
+
+
+/**
+ * Make sure the tables partitioned by (contract) timestamp have
+ * partitions for all months from now until @a end.
  *
  * @param cls closure
- * @param[out] contract_terms where to store the retrieved contract terms
- * @param order id order id used to perform the lookup
+ * @param end create partitions up to this time
+ * @param[out] created set to the number of partitions created
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_contract_terms (void *cls,
-                              json_t **contract_terms,
-                              const char *order_id,
-                              const struct
-                              TALER_MerchantPublicKeyP *merchant_pub)
+postgres_create_partitions (void *cls,
+                            struct GNUNET_TIME_Absolute end,
+                            unsigned int *created)
 {
   struct PostgresClosure *pg = cls;
+  struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
+  uint32_t cnt32;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (order_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&now),
+    GNUNET_PQ_query_param_absolute_time (&end),
     GNUNET_PQ_query_param_end
   };
   struct GNUNET_PQ_ResultSpec rs[] = {
-    TALER_PQ_result_spec_json ("contract_terms",
-                               contract_terms),
+    GNUNET_PQ_result_spec_uint32 ("created",
+                                  &cnt32),
     GNUNET_PQ_result_spec_end
   };
+  enum GNUNET_DB_QueryStatus qs;
 
-  *contract_terms = NULL;
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Finding contract term, order_id: '%s', merchant_pub: '%s'.\n",
-              order_id,
-              TALER_B2S (merchant_pub));
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "find_contract_terms",
-                                                   params,
-                                                   rs);
+  qs = eval_prepared_singleton_select (pg,
+                                       "create_partitions",
+                                       params,
+                                       rs);
+  *created = (0 < qs) ? cnt32 : 0;
+  return qs;
 }
 
 
 /**
- * Retrieve order given its order id and the instance's merchant public key.
+ * Detach the monthly partitions of the tables partitioned by
+ * (contract) timestamp that only hold data from before @a before
+ * and move them to the "merchant_archive" schema.
  *
  * @param cls closure
- * @param[out] contract_terms where to store the retrieved contract terms
- * @param order id order id used to perform the lookup
- * @param merchant_pub merchant public key that identifies the instance
+ * @param before archive partitions with data from before this time
+ * @param[out] archived set to the number of partitions archived
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_order (void *cls,
-                     json_t **contract_terms,
-                     const char *order_id,
-                     const struct TALER_MerchantPublicKeyP *merchant_pub)
+postgres_archive_partitions (void *cls,
+                             struct GNUNET_TIME_Absolute before,
+                             unsigned int *archived)
 {
   struct PostgresClosure *pg = cls;
+  uint32_t cnt32;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (order_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&before),
     GNUNET_PQ_query_param_end
   };
   struct GNUNET_PQ_ResultSpec rs[] = {
-    TALER_PQ_result_spec_json ("contract_terms",
-                               contract_terms),
+    GNUNET_PQ_result_spec_uint32 ("archived",
+                                  &cnt32),
     GNUNET_PQ_result_spec_end
   };
+  enum GNUNET_DB_QueryStatus qs;
 
-  *contract_terms = NULL;
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Finding contract term, order_id: '%s', merchant_pub: '%s'.\n",
-              order_id,
-              TALER_B2S (merchant_pub));
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "find_order",
-                                                   params,
-                                                   rs);
+  qs = eval_prepared_singleton_select (pg,
+                                       "archive_partitions",
+                                       params,
+                                       rs);
+  *archived = (0 < qs) ? cnt32 : 0;
+  return qs;
 }
 
 
 /**
- * Insert proposal data and its hashcode into db
+ * Delete up to @a limit orders that were claimed or whose pay
+ * deadline is before @a expired_before.
  *
  * @param cls closure
- * @param order_id identificator of the proposal being stored
- * @param merchant_pub merchant's public key
- * @param timestamp timestamp of this proposal data
- * @param contract_terms proposal data to store
- * @return transaction status
+ * @param expired_before delete unclaimed orders with a pay deadline
+ *        before this time
+ * @param limit maximum number of orders to delete
+ * @return transaction status, number of orders deleted on success
  */
 static enum GNUNET_DB_QueryStatus
-postgres_insert_contract_terms (void *cls,
-                                const char *order_id,
-                                const struct
-                                TALER_MerchantPublicKeyP *merchant_pub,
-                                struct GNUNET_TIME_Absolute timestamp,
-                                const json_t *contract_terms)
+postgres_gc_orders (void *cls,
+                    struct GNUNET_TIME_Absolute expired_before,
+                    uint32_t limit)
 {
   struct PostgresClosure *pg = cls;
-  struct GNUNET_HashCode h_contract_terms;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (order_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_absolute_time (&timestamp),
-    TALER_PQ_query_param_json (contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (&h_contract_terms),
+  struct GNUNET_PQ_QueryParam params_claimed[] = {
+    GNUNET_PQ_query_param_uint32 (&limit),
     GNUNET_PQ_query_param_end
   };
+  enum GNUNET_DB_QueryStatus qs;
+  enum GNUNET_DB_QueryStatus qs2;
+  uint32_t left;
 
-  if (GNUNET_OK !=
-      TALER_JSON_hash (contract_terms,
-                       &h_contract_terms))
+  check_connection (pg);
+  qs = eval_prepared_non_select (pg,
+                                 "gc_claimed_orders",
+                                 params_claimed);
+  if ( (0 > qs) ||
+       (limit <= (uint32_t) qs) )
+    return qs;
+  left = limit - (uint32_t) qs;
   {
-    GNUNET_break (0);
-    return GNUNET_SYSERR;
+    struct GNUNET_PQ_QueryParam params_expired[] = {
+      GNUNET_PQ_query_param_absolute_time (&expired_before),
+      GNUNET_PQ_query_param_uint32 (&left),
+      GNUNET_PQ_query_param_end
+    };
+
+    qs2 = eval_prepared_non_select (pg,
+                                    "gc_expired_orders",
+                                    params_expired);
   }
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "inserting contract terms: order_id: %s, merchant_pub: %s, h_contract_terms: %s.\n",
-              order_id,
-              TALER_B2S (merchant_pub),
-              GNUNET_h2s (&h_contract_terms));
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_contract_terms",
-                                             params);
+  if (0 > qs2)
+    return qs2;
+  return qs + qs2;
 }
 
 
 /**
- * Insert order into the DB.
+ * Delete up to @a limit session-to-order mappings created
+ * before @a older_than.
  *
  * @param cls closure
- * @param order_id identificator of the proposal being stored
- * @param merchant_pub merchant's public key
- * @param timestamp timestamp of this proposal data
- * @param contract_terms proposal data to store
- * @return transaction status
+ * @param older_than delete sessions recorded before this time
+ * @param limit maximum number of sessions to delete
+ * @return transaction status, number of sessions deleted on success
  */
 static enum GNUNET_DB_QueryStatus
-postgres_insert_order (void *cls,
-                       const char *order_id,
-                       const struct TALER_MerchantPublicKeyP *merchant_pub,
-                       struct GNUNET_TIME_Absolute timestamp,
-                       const json_t *contract_terms)
+postgres_gc_sessions (void *cls,
+                      struct GNUNET_TIME_Absolute older_than,
+                      uint32_t limit)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (order_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_absolute_time (&timestamp),
-    TALER_PQ_query_param_json (contract_terms),
+    GNUNET_PQ_query_param_absolute_time (&older_than),
+    GNUNET_PQ_query_param_uint32 (&limit),
     GNUNET_PQ_query_param_end
   };
 
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "inserting order: order_id: %s, merchant_pub: %s.\n",
-              order_id,
-              TALER_B2S (merchant_pub));
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_order",
-                                             params);
+  return eval_prepared_non_select (pg,
+                                   "gc_sessions",
+                                   params);
 }
 
 
 /**
- * Mark contract terms as paid.  Needed by /history as only paid
- * contracts must be shown.
- *
- * NOTE: we can't get the list of (paid) contracts from the
- * transactions table because it lacks contract_terms plain JSON.  In
- * facts, the protocol doesn't allow to store contract_terms in
- * transactions table, as /pay handler doesn't receive this data (only
- * /proposal does).
+ * Do a pre-flight check that we are not in an uncommitted transaction.
+ * If we are, try to commit the previous transaction and output a warning.
+ * Does not return anything, as we will continue regardless of the outcome.
  *
- * @param cls closure
- * @param h_contract_terms hash of the contract that is now paid
- * @param merchant_pub merchant's public key
- * @return transaction status
+ * @param cls the `struct PostgresClosure` with the plugin-specific state
  */
-static enum GNUNET_DB_QueryStatus
-postgres_mark_proposal_paid (void *cls,
-                             const struct GNUNET_HashCode *h_contract_terms,
-                             const struct
-                             TALER_MerchantPublicKeyP *merchant_pub)
+static void
+postgres_preflight (void *cls)
 {
   struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_end
+  struct GNUNET_PQ_ExecuteStatement es[] = {
+    GNUNET_PQ_make_execute ("COMMIT"),
+    GNUNET_PQ_EXECUTE_STATEMENT_END
   };
 
-  TALER_LOG_DEBUG ("Marking proposal paid, h_contract_terms: '%s',"
-                   " merchant_pub: '%s'\n",
-                   GNUNET_h2s (h_contract_terms),
-                   TALER_B2S (merchant_pub));
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "mark_proposal_paid",
-                                             params);
+  if (NULL == pg->transaction_name)
+    return; /* all good */
+  if (GNUNET_OK ==
+      GNUNET_PQ_exec_statements (pg->conn,
+                                 es))
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "BUG: Preflight check committed transaction `%s'!\n",
+                pg->transaction_name);
+  }
+  else
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_ERROR,
+                "BUG: Preflight check failed to commit transaction `%s'!\n",
+                pg->transaction_name);
+  }
+  pg->transaction_name = NULL;
 }
 
 
 /**
- * Store the order ID that was used to pay for a resource within a session.
+ * Start a transaction.
  *
- * @param cls closure
- * @param session_id session id
- * @param fulfillment_url URL that canonically identifies the resource
- *        being paid for
- * @param order_id the order ID that was used when paying for the resource URL
- * @param merchant_pub public key of the merchant, identifying the instance
- * @return transaction status
+ * @param cls the `struct PostgresClosure` with the plugin-specific state
+ * @param name unique name identifying the transaction (for debugging),
+ *             must point to a constant
+ * @return #GNUNET_OK on success
  */
-enum GNUNET_DB_QueryStatus
-postgres_insert_session_info (void *cls,
-                              const char *session_id,
-                              const char *fulfillment_url,
-                              const char *order_id,
-                              const struct
-                              TALER_MerchantPublicKeyP *merchant_pub)
+static int
+postgres_start (void *cls,
+                const char *name)
 {
   struct PostgresClosure *pg = cls;
-
-  struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (session_id),
-    GNUNET_PQ_query_param_string (fulfillment_url),
-    GNUNET_PQ_query_param_string (order_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_absolute_time (&now),
-    GNUNET_PQ_query_param_end
+  struct GNUNET_PQ_ExecuteStatement es[] = {
+    GNUNET_PQ_make_execute ("START TRANSACTION ISOLATION LEVEL SERIALIZABLE"),
+    GNUNET_PQ_EXECUTE_STATEMENT_END
   };
 
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_session_info",
-                                             params);
+  check_connection (pg);
+  postgres_preflight (pg);
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Starting merchant DB transaction\n");
+  if (GNUNET_OK !=
+      GNUNET_PQ_exec_statements (pg->conn,
+                                 es))
+  {
+    TALER_LOG_ERROR ("Failed to start transaction\n");
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  pg->transaction_name = name;
+  return GNUNET_OK;
 }
 
 
 /**
- * Retrieve the order ID that was used to pay for a resource within a session.
+ * Roll back the current transaction of a database connection.
  *
- * @param cls closure
- * @param[out] order_id location to store the order ID that was used when
- *             paying for the resource URL
- * @param session_id session id
- * @param fulfillment_url URL that canonically identifies the resource
- *        being paid for
- * @param merchant_pub public key of the merchant, identifying the instance
- * @return transaction status
- */
-enum GNUNET_DB_QueryStatus
-postgres_find_session_info (void *cls,
-                            char **order_id,
-                            const char *session_id,
-                            const char *fulfillment_url,
-                            const struct TALER_MerchantPublicKeyP *merchant_pub)
-{
-  struct PostgresClosure *pg = cls;
-
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (fulfillment_url),
-    GNUNET_PQ_query_param_string (session_id),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_end
-  };
-  struct GNUNET_PQ_ResultSpec rs[] = {
-    GNUNET_PQ_result_spec_string ("order_id",
-                                  order_id),
-    GNUNET_PQ_result_spec_end
-  };
-  // We don't clean up the result spec since we want
-  // to keep around the memory for order_id.
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "find_session_info",
-                                                   params,
-                                                   rs);
-}
-
-
-/**
- * Insert payment confirmation from the exchange into the database.
- *
- * @param cls closure
- * @param order_id identificator of the proposal associated with this revenue
- * @param merchant_pub merchant's public key
- * @param coin_pub public key of the coin
- * @param amount_with_fee amount the exchange will deposit for this coin
- * @param deposit_fee fee the exchange will charge for this coin
- * @param refund_fee fee the exchange will charge for refunding this coin
- * @param wire_fee wire fee changed by the exchange
- * @param signkey_pub public key used by the exchange for @a exchange_proof
- * @param exchange_proof proof from exchange that coin was accepted
- * @return transaction status
+ * @param cls the `struct PostgresClosure` with the plugin-specific state
+ * @return #GNUNET_OK on success
  */
-static enum GNUNET_DB_QueryStatus
-postgres_store_deposit (void *cls,
-                        const struct GNUNET_HashCode *h_contract_terms,
-                        const struct TALER_MerchantPublicKeyP *merchant_pub,
-                        const struct TALER_CoinSpendPublicKeyP *coin_pub,
-                        const char *exchange_url,
-                        const struct TALER_Amount *amount_with_fee,
-                        const struct TALER_Amount *deposit_fee,
-                        const struct TALER_Amount *refund_fee,
-                        const struct TALER_Amount *wire_fee,
-                        const struct TALER_ExchangePublicKeyP *signkey_pub,
-                        const json_t *exchange_proof)
+static void
+postgres_rollback (void *cls)
 {
   struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_auto_from_type (coin_pub),
-    GNUNET_PQ_query_param_string (exchange_url),
-    TALER_PQ_query_param_amount (amount_with_fee),
-    TALER_PQ_query_param_amount (deposit_fee),
-    TALER_PQ_query_param_amount (refund_fee),
-    TALER_PQ_query_param_amount (wire_fee),
-    GNUNET_PQ_query_param_auto_from_type (signkey_pub),
-    TALER_PQ_query_param_json (exchange_proof),
-    GNUNET_PQ_query_param_end
+  struct GNUNET_PQ_ExecuteStatement es[] = {
+    GNUNET_PQ_make_execute ("ROLLBACK"),
+    GNUNET_PQ_EXECUTE_STATEMENT_END
   };
 
   GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Storing payment for h_contract_terms `%s', coin_pub: `%s', amount_with_fee: %s\n",
-              GNUNET_h2s (h_contract_terms),
-              TALER_B2S (coin_pub),
-              TALER_amount2s (amount_with_fee));
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Merchant pub is `%s'\n",
-              TALER_B2S (merchant_pub));
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_deposit",
-                                             params);
+              "Rolling back merchant DB transaction\n");
+  GNUNET_break (GNUNET_OK ==
+                GNUNET_PQ_exec_statements (pg->conn,
+                                           es));
+  pg->transaction_name = NULL;
 }
 
 
 /**
- * Insert mapping of @a coin_pub and @a h_contract_terms to
- * corresponding @a wtid.
+ * Commit the current transaction of a database connection.
  *
- * @param cls closure
- * @param h_contract_terms hashcode of the proposal data paid by @a coin_pub
- * @param coin_pub public key of the coin
- * @param wtid identifier of the wire transfer in which the exchange
- *             send us the money for the coin deposit
- * @return transaction status
+ * @param cls the `struct PostgresClosure` with the plugin-specific state
+ * @return transaction status code
  */
 static enum GNUNET_DB_QueryStatus
-postgres_store_coin_to_transfer (void *cls,
-                                 const struct GNUNET_HashCode *h_contract_terms,
-                                 const struct
-                                 TALER_CoinSpendPublicKeyP *coin_pub,
-                                 const struct
-                                 TALER_WireTransferIdentifierRawP *wtid)
+postgres_commit (void *cls)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (coin_pub),
-    GNUNET_PQ_query_param_auto_from_type (wtid),
     GNUNET_PQ_query_param_end
   };
 
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_transfer",
-                                             params);
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Committing merchant DB transaction\n");
+  pg->transaction_name = NULL;
+  return eval_prepared_non_select (pg,
+                                   "end_transaction",
+                                   params);
 }
 
 
 /**
- * Insert wire transfer confirmation from the exchange into the database.
+ * Retrieve proposal data given its proposal data's hashcode
  *
  * @param cls closure
- * @param exchange_url URL of the exchange
- * @param wtid identifier of the wire transfer
- * @param execution_time when was @a wtid executed
- * @param signkey_pub public key used by the exchange for @a exchange_proof
- * @param exchange_proof proof from exchange about what the deposit was for
- * @return transaction status
- */
-static enum GNUNET_DB_QueryStatus
-postgres_store_transfer_to_proof (void *cls,
-                                  const char *exchange_url,
-                                  const struct
-                                  TALER_WireTransferIdentifierRawP *wtid,
-                                  struct GNUNET_TIME_Absolute execution_time,
-                                  const struct
-                                  TALER_ExchangePublicKeyP *signkey_pub,
-                                  const json_t *exchange_proof)
-{
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (exchange_url),
-    GNUNET_PQ_query_param_auto_from_type (wtid),
-    GNUNET_PQ_query_param_absolute_time (&execution_time),
-    GNUNET_PQ_query_param_auto_from_type (signkey_pub),
-    TALER_PQ_query_param_json (exchange_proof),
-    GNUNET_PQ_query_param_end
-  };
-
-  check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_proof",
-                                             params);
-}
-
-
-/**
- * Lookup for a proposal, respecting the signature used by the
- * /history's db methods.
- *
- * @param cls db plugin handle
- * @param order_id order id used to search for the proposal data
- * @param merchant_pub public key of the merchant using this method
- * @param cb the callback
- * @param cb_cls closure to pass to the callback
+ * @param contract_terms where to store the retrieved proposal data
+ * @param h_contract_terms proposal data's hashcode that will be used to
+ * perform the lookup
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_contract_terms_history (void *cls,
-                                      const char *order_id,
-                                      const struct
-                                      TALER_MerchantPublicKeyP *merchant_pub,
-                                      TALER_MERCHANTDB_ProposalDataCallback cb,
-                                      void *cb_cls)
+postgres_find_contract_terms_from_hash (void *cls,
+                                        json_t **contract_terms,
+                                        const struct
+                                        GNUNET_HashCode *h_contract_terms,
+                                        const struct
+                                        TALER_MerchantPublicKeyP *merchant_pub)
 {
   struct PostgresClosure *pg = cls;
-  json_t *contract_terms;
-  enum GNUNET_DB_QueryStatus qs;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
     GNUNET_PQ_query_param_auto_from_type (merchant_pub),
     GNUNET_PQ_query_param_end
   };
   struct GNUNET_PQ_ResultSpec rs[] = {
     TALER_PQ_result_spec_json ("contract_terms",
-                               &contract_terms),
+                               contract_terms),
     GNUNET_PQ_result_spec_end
   };
 
-  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                 "find_contract_terms_history",
-                                                 params,
-                                                 rs);
-  if (qs <= 0)
-    return qs;
-  if (NULL != cb)
-    cb (cb_cls,
-        order_id,
-        0,
-        contract_terms);
-  GNUNET_PQ_cleanup_result (rs);
-  return qs;
+  check_connection (pg);
+  return eval_prepared_singleton_select (pg,
+                                         "find_contract_terms_from_hash",
+                                         params,
+                                         rs);
 }
 
 
 /**
- * Closure for #find_contracts_cb().
+ * Closure for #find_order_ids_cb().
  */
-struct FindContractsContext
+struct FindOrderIdsContext
 {
   /**
-   * Function to call on each result.
+   * Function to call with results.
    */
-  TALER_MERCHANTDB_ProposalDataCallback cb;
+  TALER_MERCHANTDB_OrderIdCallback cb;
 
   /**
    * Closure for @e cb.
@@ -809,7 +810,12 @@ struct FindContractsContext
   void *cb_cls;
 
   /**
-   * Transaction status code to set.
+   * Number of contracts we are looking for.
+   */
+  unsigned int h_cnt;
+
+  /**
+   * Transaction status (set).
    */
   enum GNUNET_DB_QueryStatus qs;
 };
@@ -819,29 +825,26 @@ struct FindContractsContext
  * Function to be called with the results of a SELECT statement
  * that has returned @a num_results results.
  *
- * @param cls of type `struct FindContractsContext *`
+ * @param cls of type `struct FindOrderIdsContext *`
  * @param result the postgres result
  * @param num_result the number of results in @a result
  */
 static void
-find_contracts_cb (void *cls,
+find_order_ids_cb (void *cls,
                    PGresult *result,
                    unsigned int num_results)
 {
-  struct FindContractsContext *fcctx = cls;
+  struct FindOrderIdsContext *foc = cls;
 
-  for (unsigned int i = 0; i < num_results; i++)
+  for (unsigned int i = 0; i<num_results; i++)
   {
+    uint32_t offset;
     char *order_id;
-    json_t *contract_terms;
-    uint64_t row_id;
     struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_uint32 ("h_off",
+                                    &offset),
       GNUNET_PQ_result_spec_string ("order_id",
                                     &order_id),
-      TALER_PQ_result_spec_json ("contract_terms",
-                                 &contract_terms),
-      GNUNET_PQ_result_spec_uint64 ("row_id",
-                                    &row_id),
       GNUNET_PQ_result_spec_end
     };
 
@@ -851,309 +854,333 @@ find_contracts_cb (void *cls,
                                   i))
     {
       GNUNET_break (0);
-      fcctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      foc->qs = GNUNET_DB_STATUS_HARD_ERROR;
       return;
     }
-    fcctx->qs = i + 1;
-    fcctx->cb (fcctx->cb_cls,
-               order_id,
-               row_id,
-               contract_terms);
+    if (offset >= foc->h_cnt)
+    {
+      GNUNET_break (0);
+      GNUNET_PQ_cleanup_result (rs);
+      foc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    foc->qs = i + 1;
+    foc->cb (foc->cb_cls,
+             offset,
+             order_id);
     GNUNET_PQ_cleanup_result (rs);
   }
 }
 
 
 /**
- * Return proposals whose timestamp are older than `date`.
- * Among those proposals, only those ones being between the
- * start-th and (start-nrows)-th record are returned.  The rows
- * are sorted having the youngest first.
+ * Retrieve the order IDs of many contracts with a single statement,
+ * without fetching the contract terms.  @a cb is called in ascending
+ * order of the offsets, and not at all for unknown contracts.
  *
- * @param cls our plugin handle.
- * @param date only results older than this date are returned.
- * @param merchant_pub instance's public key; only rows related to this
- * instance are returned.
- * @param start only rows with serial id less than start are returned.
- * In other words, you lower `start` to get older records. The tipical
- * usage is to firstly call `find_contract_terms_by_date`, so that you get
- * the `nrows` youngest records. The oldest of those records will tell you
- * from which timestamp and `start` you can query the DB in order to get
- * furtherly older records, and so on. Alternatively, you can use always
- * the same timestamp and just go behind in history by tuning `start`.
- * @param nrows only nrows rows are returned.
- * @param past if set to #GNUNET_YES, retrieves rows older than `date`.
- * @param ascending if #GNUNET_YES, results will be sorted in chronological order.
- * This is typically used to show live updates on the merchant's backoffice
- * Web interface.
- * @param cb function to call with transaction data, can be NULL.
+ * @param cls closure
+ * @param merchant_pub instance's public key
+ * @param h_cnt length of the @a h_contract_terms array
+ * @param h_contract_terms hashcodes of the contracts
+ * @param cb function to call with the order IDs
  * @param cb_cls closure for @a cb
- * @return transaction status
+ * @return transaction status, number of contracts found on success
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_contract_terms_by_date_and_range (void *cls,
-                                                struct GNUNET_TIME_Absolute
-                                                date,
-                                                const struct
-                                                TALER_MerchantPublicKeyP *
-                                                merchant_pub,
-                                                uint64_t start,
-                                                uint64_t nrows,
-                                                int past,
-                                                unsigned int ascending,
-                                                TALER_MERCHANTDB_ProposalDataCallback
-                                                cb,
-                                                void *cb_cls)
+postgres_find_order_ids_by_hashes (void *cls,
+                                   const struct
+                                   TALER_MerchantPublicKeyP *merchant_pub,
+                                   unsigned int h_cnt,
+                                   const struct
+                                   GNUNET_HashCode *h_contract_terms,
+                                   TALER_MERCHANTDB_OrderIdCallback cb,
+                                   void *cb_cls)
 {
   struct PostgresClosure *pg = cls;
+  uint32_t cnt32 = h_cnt;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_absolute_time (&date),
     GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_uint64 (&start),
-    GNUNET_PQ_query_param_uint64 (&nrows),
+    GNUNET_PQ_query_param_fixed_size (h_contract_terms,
+                                      h_cnt * sizeof (*h_contract_terms)),
+    GNUNET_PQ_query_param_uint32 (&cnt32),
     GNUNET_PQ_query_param_end
   };
-  const char *stmt;
-  enum GNUNET_DB_QueryStatus qs;
-  struct FindContractsContext fcctx = {
+  struct FindOrderIdsContext foc = {
     .cb = cb,
-    .cb_cls = cb_cls
+    .cb_cls = cb_cls,
+    .h_cnt = h_cnt
   };
+  enum GNUNET_DB_QueryStatus qs;
 
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "DB serving /history with date %s\n",
-              GNUNET_STRINGS_absolute_time_to_string (date));
-  stmt =
-    (GNUNET_YES == past)
-    ? ( (GNUNET_YES == ascending)
-        ? "find_contract_terms_by_date_and_range_past_asc"
-        : "find_contract_terms_by_date_and_range_past")
-    : ( (GNUNET_YES == ascending)
-        ? "find_contract_terms_by_date_and_range_asc"
-        : "find_contract_terms_by_date_and_range");
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             stmt,
-                                             params,
-                                             &find_contracts_cb,
-                                             &fcctx);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_order_ids_by_hashes",
+                                   params,
+                                   &find_order_ids_cb,
+                                   &foc);
   if (0 >= qs)
     return qs;
-  return fcctx.qs;
+  return foc.qs;
 }
 
 
 /**
- * Closure for #find_tip_authorizations_cb().
+ * Retrieve proposal data given its proposal data's hashcode
+ *
+ * @param cls closure
+ * @param contract_terms where to store the retrieved proposal data
+ * @param h_contract_terms proposal data's hashcode that will be used to
+ * perform the lookup
+ * @return transaction status
  */
-struct GetAuthorizedTipAmountContext
+static enum GNUNET_DB_QueryStatus
+postgres_find_paid_contract_terms_from_hash (void *cls,
+                                             json_t **contract_terms,
+                                             const struct
+                                             GNUNET_HashCode *h_contract_terms,
+                                             const struct
+                                             TALER_MerchantPublicKeyP *
+                                             merchant_pub)
 {
-  /**
-   * Total authorized amount.
-   */
-  struct TALER_Amount authorized_amount;
-
-  /**
-   * Transaction status code to set.
-   */
-  enum GNUNET_DB_QueryStatus qs;
-
-  /**
-   * Plugin context.
-   */
-  struct PostgresClosure *pg;
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    TALER_PQ_result_spec_json ("contract_terms",
+                               contract_terms),
+    GNUNET_PQ_result_spec_end
+  };
 
-};
+  /* no preflight check here, runs in its own transaction from
+     caller (in /pay case) */
+  check_connection (pg);
+  return eval_prepared_singleton_select (pg,
+                                         "find_paid_contract_terms_from_hash",
+                                         params,
+                                         rs);
+}
 
 
 /**
- * Function to be called with the results of a SELECT statement
- * that has returned @a num_results results.
+ * Retrieve proposal data given its order id.  Ignores if the
+ * proposal has been paid or not.
  *
- * @param cls of type `struct GetAuthorizedTipAmountContext *`
- * @param result the postgres result
- * @param num_result the number of results in @a result
+ * @param cls closure
+ * @param[out] contract_terms where to store the retrieved contract terms
+ * @param order id order id used to perform the lookup
+ * @return transaction status
  */
-static void
-find_tip_authorizations_cb (void *cls,
-                            PGresult *result,
-                            unsigned int num_results)
+static enum GNUNET_DB_QueryStatus
+postgres_find_contract_terms (void *cls,
+                              json_t **contract_terms,
+                              const char *order_id,
+                              const struct
+                              TALER_MerchantPublicKeyP *merchant_pub)
 {
-  struct GetAuthorizedTipAmountContext *ctx = cls;
-  struct PostgresClosure *pg = ctx->pg;
-  unsigned int i;
-
-  for (i = 0; i < num_results; i++)
-  {
-    struct TALER_Amount amount;
-    char *just;
-    json_t *extra;
-    struct GNUNET_HashCode h;
-    struct GNUNET_PQ_ResultSpec rs[] = {
-      GNUNET_PQ_result_spec_string ("justification",
-                                    &just),
-      GNUNET_PQ_result_spec_auto_from_type ("tip_id",
-                                            &h),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
-                                   &amount),
-      TALER_PQ_result_spec_json ("extra",
-                                 &extra),
-      GNUNET_PQ_result_spec_end
-    };
-
-    if (GNUNET_OK !=
-        GNUNET_PQ_extract_result (result,
-                                  rs,
-                                  i))
-    {
-      GNUNET_break (0);
-      ctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
-      return;
-    }
-
-    if (0 == i)
-    {
-      ctx->authorized_amount = amount;
-    }
-    else
-    {
-      if (0 >
-          TALER_amount_add (&ctx->authorized_amount,
-                            &ctx->authorized_amount,
-                            &amount))
-      {
-        GNUNET_break (0);
-        GNUNET_PQ_cleanup_result (rs);
-        ctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
-        return;
-      }
-    }
-    GNUNET_PQ_cleanup_result (rs);
-  }
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    TALER_PQ_result_spec_json ("contract_terms",
+                               contract_terms),
+    GNUNET_PQ_result_spec_end
+  };
 
-  if (0 == i)
-  {
-    ctx->qs = GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
-  }
-  else
-  {
-    /* one aggregated result */
-    ctx->qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
-  }
+  *contract_terms = NULL;
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Finding contract term, order_id: '%s', merchant_pub: '%s'.\n",
+              order_id,
+              TALER_B2S (merchant_pub));
+  check_connection (pg);
+  return eval_prepared_singleton_select (pg,
+                                         "find_contract_terms",
+                                         params,
+                                         rs);
 }
 
 
 /**
- * Get the total amount of authorized tips for a tipping reserve.
+ * Retrieve proposal data and its hash given its order id.  Ignores
+ * if the proposal has been paid or not.
  *
- * @param cls closure, typically a connection to the db
- * @param reserve_priv which reserve to check
- * @param[out] authorzed_amount amount we've authorized so far for tips
- * @return transaction status, usually
- *      #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT for success
- *      #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if the reserve_priv
- *      does not identify a known tipping reserve
+ * @param cls closure
+ * @param[out] contract_terms where to store the retrieved contract terms
+ * @param[out] h_contract_terms where to store the hash of @a contract_terms
+ * @param order id order id used to perform the lookup
+ * @param merchant_pub instance's public key
+ * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_get_authorized_tip_amount (void *cls,
-                                    const struct
-                                    TALER_ReservePrivateKeyP *reserve_priv,
-                                    struct TALER_Amount *authorized_amount)
+postgres_find_contract_terms_with_hash (void *cls,
+                                        json_t **contract_terms,
+                                        struct GNUNET_HashCode *h_contract_terms,
+                                        const char *order_id,
+                                        const struct
+                                        TALER_MerchantPublicKeyP *merchant_pub)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
     GNUNET_PQ_query_param_end
   };
-  enum GNUNET_DB_QueryStatus qs;
-  struct GetAuthorizedTipAmountContext ctx = {
-    .pg = pg
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    TALER_PQ_result_spec_json ("contract_terms",
+                               contract_terms),
+    GNUNET_PQ_result_spec_auto_from_type ("h_contract_terms",
+                                          h_contract_terms),
+    GNUNET_PQ_result_spec_end
   };
 
+  *contract_terms = NULL;
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_tip_authorizations",
-                                             params,
-                                             &find_tip_authorizations_cb,
-                                             &ctx);
-  if (0 >= qs)
-    return qs;
-  *authorized_amount = ctx.authorized_amount;
-  return ctx.qs;
+  return eval_prepared_singleton_select (pg,
+                                         "find_contract_terms_with_hash",
+                                         params,
+                                         rs);
 }
 
 
 /**
- * Return proposals whose timestamp are older than `date`.
- * The rows are sorted having the youngest first.
+ * Retrieve order given its order id and the instance's merchant public key.
  *
- * @param cls our plugin handle.
- * @param date only results older than this date are returned.
- * @param merchant_pub instance's public key; only rows related to this
- * instance are returned.
- * @param nrows at most nrows rows are returned.
- * @param cb function to call with transaction data, can be NULL.
- * @param cb_cls closure for @a cb
+ * @param cls closure
+ * @param[out] contract_terms where to store the retrieved contract terms
+ * @param order id order id used to perform the lookup
+ * @param merchant_pub merchant public key that identifies the instance
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_contract_terms_by_date (void *cls,
-                                      struct GNUNET_TIME_Absolute date,
-                                      const struct
-                                      TALER_MerchantPublicKeyP *merchant_pub,
-                                      uint64_t nrows,
-                                      TALER_MERCHANTDB_ProposalDataCallback cb,
-                                      void *cb_cls)
+postgres_find_order (void *cls,
+                     json_t **contract_terms,
+                     const char *order_id,
+                     const struct TALER_MerchantPublicKeyP *merchant_pub)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_absolute_time (&date),
+    GNUNET_PQ_query_param_string (order_id),
     GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_uint64 (&nrows),
     GNUNET_PQ_query_param_end
   };
-  enum GNUNET_DB_QueryStatus qs;
-  struct FindContractsContext fcctx = {
-    .cb = cb,
-    .cb_cls = cb_cls
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    TALER_PQ_result_spec_json ("contract_terms",
+                               contract_terms),
+    GNUNET_PQ_result_spec_end
   };
 
+  *contract_terms = NULL;
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Finding contract term, order_id: '%s', merchant_pub: '%s'.\n",
+              order_id,
+              TALER_B2S (merchant_pub));
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_contract_terms_by_date",
-                                             params,
-                                             &find_contracts_cb,
-                                             &fcctx);
-  if (0 >= qs)
-    return qs;
-  return fcctx.qs;
+  return eval_prepared_singleton_select (pg,
+                                         "find_order",
+                                         params,
+                                         rs);
 }
 
 
 /**
- * Closure for #find_payments_cb().
+ * Extract the `struct TALER_MERCHANTDB_ContractInfo` from the first
+ * row of @a result and pass it to @a cb.
+ *
+ * @param pg plugin state
+ * @param result result of one of the "find_*_info*" statements
+ * @param with_hash #GNUNET_YES if @a result is about contract terms
+ *        and has the "h_contract_terms" and "paid" columns
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return #GNUNET_OK if @a cb was called, #GNUNET_SYSERR if
+ *         the row is malformed
  */
-struct FindPaymentsContext
+static int
+return_contract_info (struct PostgresClosure *pg,
+                      PGresult *result,
+                      int with_hash,
+                      TALER_MERCHANTDB_ContractInfoCallback cb,
+                      void *cb_cls)
+{
+  struct TALER_MERCHANTDB_ContractInfo ci;
+  char *fulfillment_url;
+  char *summary;
+  uint32_t paid32 = 0;
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    GNUNET_PQ_result_spec_string ("fulfillment_url",
+                                  &fulfillment_url),
+    GNUNET_PQ_result_spec_string ("summary",
+                                  &summary),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
+                                 &ci.amount),
+    GNUNET_PQ_result_spec_absolute_time ("refund_deadline",
+                                         &ci.refund_deadline),
+    GNUNET_PQ_result_spec_auto_from_type ("h_contract_terms",
+                                          &ci.h_contract_terms),
+    GNUNET_PQ_result_spec_uint32 ("paid",
+                                  &paid32),
+    GNUNET_PQ_result_spec_end
+  };
+
+  memset (&ci,
+          0,
+          sizeof (ci));
+  if (GNUNET_YES != with_hash)
+    /* orders have no hash and are never paid */
+    rs[4] = (struct GNUNET_PQ_ResultSpec) GNUNET_PQ_result_spec_end;
+  if (GNUNET_OK !=
+      GNUNET_PQ_extract_result (result,
+                                rs,
+                                0))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  ci.fulfillment_url = fulfillment_url;
+  ci.summary = summary;
+  ci.paid = (0 != paid32) ? GNUNET_YES : GNUNET_NO;
+  cb (cb_cls,
+      GNUNET_DB_STATUS_SUCCESS_ONE_RESULT,
+      &ci);
+  GNUNET_PQ_cleanup_result (rs);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Closure for #contract_info_cb().
+ */
+struct ContractInfoContext
 {
   /**
-   * Function to call with results.
-   */
-  TALER_MERCHANTDB_CoinDepositCallback cb;
-
-  /**
-   * Closure for @e cls.
+   * Plugin state.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * Function to call with the result.
+   */
+  TALER_MERCHANTDB_ContractInfoCallback cb;
+
+  /**
+   * Closure for @e cb.
    */
   void *cb_cls;
 
   /**
-   * Plugin context.
+   * #GNUNET_YES if we are looking up contract terms.
    */
-  struct PostgresClosure *pg;
+  int with_hash;
 
   /**
-   * Contract term hash used for the search.
+   * #GNUNET_YES once @e cb was called.
    */
-  const struct GNUNET_HashCode *h_contract_terms;
+  int called;
 
   /**
    * Transaction status (set).
@@ -1166,431 +1193,1728 @@ struct FindPaymentsContext
  * Function to be called with the results of a SELECT statement
  * that has returned @a num_results results.
  *
- * @param cls of type `struct FindPaymentsContext *`
+ * @param cls of type `struct ContractInfoContext *`
  * @param result the postgres result
  * @param num_result the number of results in @a result
  */
 static void
-find_payments_cb (void *cls,
+contract_info_cb (void *cls,
                   PGresult *result,
                   unsigned int num_results)
 {
-  struct FindPaymentsContext *fpc = cls;
-  struct PostgresClosure *pg = fpc->pg;
+  struct ContractInfoContext *cic = cls;
 
-  for (unsigned int i = 0; i<num_results; i++)
+  if (0 == num_results)
+    return;
+  if (1 != num_results)
   {
-    struct TALER_CoinSpendPublicKeyP coin_pub;
-    struct TALER_Amount amount_with_fee;
-    struct TALER_Amount deposit_fee;
-    struct TALER_Amount refund_fee;
-    struct TALER_Amount wire_fee;
-    json_t *exchange_proof;
-    char *exchange_url;
-    struct GNUNET_PQ_ResultSpec rs[] = {
-      GNUNET_PQ_result_spec_auto_from_type ("coin_pub",
-                                            &coin_pub),
-      GNUNET_PQ_result_spec_string ("exchange_url",
-                                    &exchange_url),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("amount_with_fee",
-                                   &amount_with_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("deposit_fee",
-                                   &deposit_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("refund_fee",
-                                   &refund_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("wire_fee",
-                                   &wire_fee),
-      TALER_PQ_result_spec_json ("exchange_proof",
-                                 &exchange_proof),
-      GNUNET_PQ_result_spec_end
-    };
-
-    if (GNUNET_OK !=
-        GNUNET_PQ_extract_result (result,
-                                  rs,
-                                  i))
-    {
-      GNUNET_break (0);
-      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
-      return;
-    }
-    fpc->qs = i + 1;
-    fpc->cb (fpc->cb_cls,
-             fpc->h_contract_terms,
-             &coin_pub,
-             exchange_url,
-             &amount_with_fee,
-             &deposit_fee,
-             &refund_fee,
-             &wire_fee,
-             exchange_proof);
-    GNUNET_PQ_cleanup_result (rs);
+    /* primary key violated!? */
+    GNUNET_break (0);
+    cic->qs = GNUNET_DB_STATUS_HARD_ERROR;
+    return;
+  }
+  if (GNUNET_OK !=
+      return_contract_info (cic->pg,
+                            result,
+                            cic->with_hash,
+                            cic->cb,
+                            cic->cb_cls))
+  {
+    cic->qs = GNUNET_DB_STATUS_HARD_ERROR;
+    return;
   }
+  cic->called = GNUNET_YES;
+  cic->qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
 }
 
 
 /**
- * Lookup information about coin payments by proposal data hash
- * (and @a merchant_pub)
+ * Run statement @a stmt returning the frequently needed fields
+ * of an order or of contract terms, and pass them to @a cb.
  *
- * @param cls closure
- * @param h_contract_terms key for the search
- * @param merchant_pub merchant's public key
- * @param cb function to call with payment data
+ * @param pg plugin state
+ * @param stmt name of the prepared statement
+ * @param params parameters for @a stmt
+ * @param with_hash #GNUNET_YES if @a stmt is about contract terms
+ * @param cb function to call with the result
  * @param cb_cls closure for @a cb
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_payments (void *cls,
-                        const struct GNUNET_HashCode *h_contract_terms,
-                        const struct TALER_MerchantPublicKeyP *merchant_pub,
-                        TALER_MERCHANTDB_CoinDepositCallback cb,
-                        void *cb_cls)
+find_contract_info (struct PostgresClosure *pg,
+                    const char *stmt,
+                    const struct GNUNET_PQ_QueryParam *params,
+                    int with_hash,
+                    TALER_MERCHANTDB_ContractInfoCallback cb,
+                    void *cb_cls)
 {
-  struct PostgresClosure *pg = cls;
-  struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
-    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_end
-  };
-  struct FindPaymentsContext fpc = {
-    .h_contract_terms = h_contract_terms,
+  struct ContractInfoContext cic = {
+    .pg = pg,
     .cb = cb,
     .cb_cls = cb_cls,
-    .pg = pg
+    .with_hash = with_hash,
+    .called = GNUNET_NO,
+    .qs = GNUNET_DB_STATUS_SUCCESS_NO_RESULTS
   };
   enum GNUNET_DB_QueryStatus qs;
 
-  /* no preflight check here, run in its own transaction by the
-     caller! */
-  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
-              "Finding payment for h_contract_terms '%s'\n",
-              GNUNET_h2s (h_contract_terms));
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_deposits",
-                                             params,
-                                             &find_payments_cb,
-                                             &fpc);
-  if (qs <= 0)
-    return qs;
-  return fpc.qs;
+  qs = eval_prepared_multi_select (pg,
+                                   stmt,
+                                   params,
+                                   &contract_info_cb,
+                                   &cic);
+  if (0 <= qs)
+    qs = cic.qs;
+  if (GNUNET_YES != cic.called)
+    cb (cb_cls,
+        qs,
+        NULL);
+  return qs;
 }
 
 
 /**
- * Closure for #find_payments_by_coin_cb().
- */
-struct FindPaymentsByCoinContext
-{
-  /**
-   * Function to call with results.
-   */
-  TALER_MERCHANTDB_CoinDepositCallback cb;
-
-  /**
-   * Closure for @e cls.
-   */
-  void *cb_cls;
-
-  /**
-   * Plugin context.
-   */
-  struct PostgresClosure *pg;
-
-  /**
-   * Coin we are looking for.
-   */
-  const struct TALER_CoinSpendPublicKeyP *coin_pub;
-
-  /**
-   * Hash of the contract we are looking for.
-   */
-  const struct GNUNET_HashCode *h_contract_terms;
-
-  /**
-   * Transaction status (set).
-   */
-  enum GNUNET_DB_QueryStatus qs;
-};
-
-
-/**
- * Function to be called with the results of a SELECT statement
- * that has returned @a num_results results.
+ * Retrieve the frequently needed fields of an order, without
+ * fetching the order itself.  @a cb is called before this
+ * function returns (with the same status).
  *
- * @param cls of type `struct FindPaymentsByCoinContext *`
- * @param result the postgres result
- * @param num_result the number of results in @a result
+ * @param cls closure
+ * @param order_id order id used to perform the lookup
+ * @param merchant_pub merchant public key that identifies the instance
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return transaction status
  */
-static void
-find_payments_by_coin_cb (void *cls,
-                          PGresult *result,
-                          unsigned int num_results)
+static enum GNUNET_DB_QueryStatus
+postgres_find_order_info (void *cls,
+                          const char *order_id,
+                          const struct TALER_MerchantPublicKeyP *merchant_pub,
+                          TALER_MERCHANTDB_ContractInfoCallback cb,
+                          void *cb_cls)
 {
-  struct FindPaymentsByCoinContext *fpc = cls;
-  struct PostgresClosure *pg = fpc->pg;
-
-  for (unsigned int i = 0; i<num_results; i++)
-  {
-    struct TALER_Amount amount_with_fee;
-    struct TALER_Amount deposit_fee;
-    struct TALER_Amount refund_fee;
-    struct TALER_Amount wire_fee;
-    char *exchange_url;
-    json_t *exchange_proof;
-    struct GNUNET_PQ_ResultSpec rs[] = {
-      TALER_PQ_RESULT_SPEC_AMOUNT ("amount_with_fee",
-                                   &amount_with_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("deposit_fee",
-                                   &deposit_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("refund_fee",
-                                   &refund_fee),
-      TALER_PQ_RESULT_SPEC_AMOUNT ("wire_fee",
-                                   &wire_fee),
-      GNUNET_PQ_result_spec_string ("exchange_url",
-                                    &exchange_url),
-      TALER_PQ_result_spec_json ("exchange_proof",
-                                 &exchange_proof),
-      GNUNET_PQ_result_spec_end
-    };
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
 
-    if (GNUNET_OK !=
-        GNUNET_PQ_extract_result (result,
-                                  rs,
-                                  i))
-    {
-      GNUNET_break (0);
-      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
-      return;
-    }
-    fpc->qs = i + 1;
-    fpc->cb (fpc->cb_cls,
-             fpc->h_contract_terms,
-             fpc->coin_pub,
-             exchange_url,
-             &amount_with_fee,
-             &deposit_fee,
-             &refund_fee,
-             &wire_fee,
-             exchange_proof);
-    GNUNET_PQ_cleanup_result (rs);
-  }
+  return find_contract_info (pg,
+                             "find_order_info",
+                             params,
+                             GNUNET_NO,
+                             cb,
+                             cb_cls);
 }
 
 
 /**
- * Retrieve information about a deposited coin.
+ * Retrieve the frequently needed fields of contract terms given
+ * their hashcode, without fetching the contract terms themselves.
+ * @a cb is called before this function returns (with the same
+ * status).
  *
  * @param cls closure
- * @param h_contract_terms hashcode of the proposal data paid by @a coin_pub
- * @param merchant_pub merchant's public key.
- * @param coin_pub coin's public key used for the search
- * @param cb function to call with payment data
+ * @param h_contract_terms hashcode used to lookup
+ * @param merchant_pub instance's public key
+ * @param cb function to call with the result
  * @param cb_cls closure for @a cb
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_payments_by_hash_and_coin (void *cls,
-                                         const struct
-                                         GNUNET_HashCode *h_contract_terms,
-                                         const struct
-                                         TALER_MerchantPublicKeyP *merchant_pub,
-                                         const struct
-                                         TALER_CoinSpendPublicKeyP *coin_pub,
-                                         TALER_MERCHANTDB_CoinDepositCallback cb,
-                                         void *cb_cls)
+postgres_find_contract_info_from_hash (
+  void *cls,
+  const struct GNUNET_HashCode *h_contract_terms,
+  const struct TALER_MerchantPublicKeyP *merchant_pub,
+  TALER_MERCHANTDB_ContractInfoCallback cb,
+  void *cb_cls)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
     GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
     GNUNET_PQ_query_param_auto_from_type (merchant_pub),
-    GNUNET_PQ_query_param_auto_from_type (coin_pub),
     GNUNET_PQ_query_param_end
   };
-  struct FindPaymentsByCoinContext fpc = {
-    .cb = cb,
-    .cb_cls = cb_cls,
-    .pg = pg,
-    .h_contract_terms = h_contract_terms,
-    .coin_pub = coin_pub
-  };
-  enum GNUNET_DB_QueryStatus qs;
 
-  check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_deposits_by_hash_and_coin",
-                                             params,
-                                             &find_payments_by_coin_cb,
-                                             &fpc);
-  if (0 >= qs)
-    return qs;
-  return fpc.qs;
+  return find_contract_info (pg,
+                             "find_contract_info_from_hash",
+                             params,
+                             GNUNET_YES,
+                             cb,
+                             cb_cls);
 }
 
 
 /**
- * Closure for #find_transfers_cb().
+ * Insert proposal data and its hashcode into db
+ *
+ * @param cls closure
+ * @param order_id identificator of the proposal being stored
+ * @param merchant_pub merchant's public key
+ * @param timestamp timestamp of this proposal data
+ * @param contract_terms proposal data to store
+ * @return transaction status
  */
-struct FindTransfersContext
+static enum GNUNET_DB_QueryStatus
+postgres_insert_contract_terms (void *cls,
+                                const char *order_id,
+                                const struct
+                                TALER_MerchantPublicKeyP *merchant_pub,
+                                struct GNUNET_TIME_Absolute timestamp,
+                                const json_t *contract_terms)
 {
-  /**
-   * Function to call on results.
-   */
-  TALER_MERCHANTDB_TransferCallback cb;
-
-  /**
-   * Closure for @e cb.
-   */
-  void *cb_cls;
-
-  /**
-   * Hash of the contract we are looking under.
-   */
-  const struct GNUNET_HashCode *h_contract_terms;
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_HashCode h_contract_terms;
+  const char *nonce = json_string_value (json_object_get (contract_terms,
+                                                         "nonce"));
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&timestamp),
+    TALER_PQ_query_param_json (contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (&h_contract_terms),
+    GNUNET_PQ_query_param_string ((NULL != nonce) ? nonce : ""),
+    GNUNET_PQ_query_param_end
+  };
 
-  /**
-   * Transaction status (set).
-   */
-  enum GNUNET_DB_QueryStatus qs;
-};
+  if (GNUNET_OK !=
+      TALER_JSON_hash (contract_terms,
+                       &h_contract_terms))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "inserting contract terms: order_id: %s, merchant_pub: %s, h_contract_terms: %s.\n",
+              order_id,
+              TALER_B2S (merchant_pub),
+              GNUNET_h2s (&h_contract_terms));
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_contract_terms",
+                                   params);
+}
 
 
 /**
- * Function to be called with the results of a SELECT statement
- * that has returned @a num_results results.
+ * Insert claimed contract terms into db, with their hash, nonce
+ * and signature as computed by the caller.
  *
- * @param cls of type `struct FindTransfersContext *`
- * @param result the postgres result
- * @param num_result the number of results in @a result
+ * @param cls closure
+ * @param order_id identificator of the proposal being stored
+ * @param merchant_pub merchant's public key
+ * @param timestamp timestamp of this proposal data
+ * @param cc the claimed contract to store
+ * @return transaction status
  */
-static void
-find_transfers_cb (void *cls,
-                   PGresult *result,
-                   unsigned int num_results)
+static enum GNUNET_DB_QueryStatus
+postgres_insert_claimed_contract (
+  void *cls,
+  const char *order_id,
+  const struct TALER_MerchantPublicKeyP *merchant_pub,
+  struct GNUNET_TIME_Absolute timestamp,
+  const struct TALER_MERCHANTDB_ClaimedContract *cc)
 {
-  struct FindTransfersContext *ftc = cls;
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&timestamp),
+    GNUNET_PQ_query_param_fixed_size (cc->contract_terms,
+                                      cc->contract_terms_size),
+    GNUNET_PQ_query_param_auto_from_type (&cc->h_contract_terms),
+    GNUNET_PQ_query_param_string (cc->nonce),
+    GNUNET_PQ_query_param_auto_from_type (&cc->merchant_sig),
+    GNUNET_PQ_query_param_end
+  };
 
-  for (unsigned int i = 0; i<num_results; i++)
-  {
-    struct TALER_CoinSpendPublicKeyP coin_pub;
-    struct TALER_WireTransferIdentifierRawP wtid;
-    struct GNUNET_TIME_Absolute execution_time;
-    json_t *proof;
+  GNUNET_break (GNUNET_YES == cc->have_sig);
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "inserting claimed contract terms: order_id: %s, merchant_pub: %s, h_contract_terms: %s.\n",
+              order_id,
+              TALER_B2S (merchant_pub),
+              GNUNET_h2s (&cc->h_contract_terms));
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_claimed_contract",
+                                   params);
+}
 
-    struct GNUNET_PQ_ResultSpec rs[] = {
-      GNUNET_PQ_result_spec_auto_from_type ("coin_pub",
-                                            &coin_pub),
-      GNUNET_PQ_result_spec_auto_from_type ("wtid",
-                                            &wtid),
-      GNUNET_PQ_result_spec_absolute_time ("execution_time",
-                                           &execution_time),
-      TALER_PQ_result_spec_json ("proof",
-                                 &proof),
-      GNUNET_PQ_result_spec_end
-    };
 
-    if (GNUNET_OK !=
-        GNUNET_PQ_extract_result (result,
-                                  rs,
-                                  i))
-    {
-      GNUNET_break (0);
-      ftc->qs = GNUNET_DB_STATUS_HARD_ERROR;
-      return;
-    }
-    ftc->qs = i + 1;
-    ftc->cb (ftc->cb_cls,
-             ftc->h_contract_terms,
-             &coin_pub,
-             &wtid,
-             execution_time,
-             proof);
-    GNUNET_PQ_cleanup_result (rs);
-  }
+/**
+ * Insert order into the DB, unless an order with the same ID
+ * already exists or was already claimed.
+ *
+ * @param cls closure
+ * @param order_id identificator of the proposal being stored
+ * @param merchant_pub merchant's public key
+ * @param timestamp timestamp of this proposal data
+ * @param contract_terms proposal data to store
+ * @return transaction status, #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS
+ *         if the order ID already exists
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_insert_order (void *cls,
+                       const char *order_id,
+                       const struct TALER_MerchantPublicKeyP *merchant_pub,
+                       struct GNUNET_TIME_Absolute timestamp,
+                       const json_t *contract_terms)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&timestamp),
+    TALER_PQ_query_param_json (contract_terms),
+    GNUNET_PQ_query_param_end
+  };
+
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "inserting order: order_id: %s, merchant_pub: %s.\n",
+              order_id,
+              TALER_B2S (merchant_pub));
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_order",
+                                   params);
 }
 
 
 /**
- * Lookup information about a transfer by @a h_contract_terms.  Note
- * that in theory there could be multiple wire transfers for a
- * single @a h_contract_terms, as the transaction may have involved
- * multiple coins and the coins may be spread over different wire
- * transfers.
+ * Mark contract terms as paid.  Needed by /history as only paid
+ * contracts must be shown.
+ *
+ * NOTE: we can't get the list of (paid) contracts from the
+ * transactions table because it lacks contract_terms plain JSON.  In
+ * facts, the protocol doesn't allow to store contract_terms in
+ * transactions table, as /pay handler doesn't receive this data (only
+ * /proposal does).
  *
  * @param cls closure
- * @param h_contract_terms key for the search
- * @param cb function to call with transfer data
- * @param cb_cls closure for @a cb
+ * @param h_contract_terms hash of the contract that is now paid
+ * @param merchant_pub merchant's public key
  * @return transaction status
  */
 static enum GNUNET_DB_QueryStatus
-postgres_find_transfers_by_hash (void *cls,
-                                 const struct GNUNET_HashCode *h_contract_terms,
-                                 TALER_MERCHANTDB_TransferCallback cb,
-                                 void *cb_cls)
+postgres_mark_proposal_paid (void *cls,
+                             const struct GNUNET_HashCode *h_contract_terms,
+                             const struct
+                             TALER_MerchantPublicKeyP *merchant_pub)
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
     GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
     GNUNET_PQ_query_param_end
   };
-  struct FindTransfersContext ftc = {
-    .h_contract_terms = h_contract_terms,
-    .cb = cb,
-    .cb_cls = cb_cls
-  };
-  enum GNUNET_DB_QueryStatus qs;
 
-  check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_transfers_by_hash",
-                                             params,
-                                             &find_transfers_cb,
-                                             &ftc);
-  if (0 >= qs)
-    return qs;
-  return ftc.qs;
+  TALER_LOG_DEBUG ("Marking proposal paid, h_contract_terms: '%s',"
+                   " merchant_pub: '%s'\n",
+                   GNUNET_h2s (h_contract_terms),
+                   TALER_B2S (merchant_pub));
+  return eval_prepared_non_select (pg,
+                                   "mark_proposal_paid",
+                                   params);
 }
 
 
 /**
- * Closure for #find_deposits_cb().
+ * Store the order ID that was used to pay for a resource within a session.
+ *
+ * @param cls closure
+ * @param session_id session id
+ * @param fulfillment_url URL that canonically identifies the resource
+ *        being paid for
+ * @param order_id the order ID that was used when paying for the resource URL
+ * @param merchant_pub public key of the merchant, identifying the instance
+ * @return transaction status
  */
-struct FindDepositsContext
+enum GNUNET_DB_QueryStatus
+postgres_insert_session_info (void *cls,
+                              const char *session_id,
+                              const char *fulfillment_url,
+                              const char *order_id,
+                              const struct
+                              TALER_MerchantPublicKeyP *merchant_pub)
 {
+  struct PostgresClosure *pg = cls;
 
-  /**
-   * Function to call for each result.
-   */
-  TALER_MERCHANTDB_CoinDepositCallback cb;
-
-  /**
-   * Closure for @e cb.
-   */
-  void *cb_cls;
-
-  /**
-   * Plugin context.
-   */
-  struct PostgresClosure *pg;
+  struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (session_id),
+    GNUNET_PQ_query_param_string (fulfillment_url),
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_absolute_time (&now),
+    GNUNET_PQ_query_param_end
+  };
 
-  /**
-   * Transaction status (set).
-   */
-  enum GNUNET_DB_QueryStatus qs;
-};
+  return eval_prepared_non_select (pg,
+                                   "insert_session_info",
+                                   params);
+}
 
 
 /**
- * Function to be called with the results of a SELECT statement
- * that has returned @a num_results results.
+ * Conclude a payment in a single round trip: check that all of
+ * the @a coin_pubs were deposited for the contract, and unless
+ * refunds on these coins reduce @a total_paid below @a total_needed,
+ * mark the contract as paid and store the session information.
  *
- * @param cls of type `struct FindDepositsContext *`
- * @param result the postgres result
- * @param num_result the number of results in @a result
+ * @param cls closure
+ * @param h_contract_terms hash of the contract that is being paid
+ * @param merchant_pub merchant's public key
+ * @param order_id the order ID of the contract
+ * @param session_id session id, NULL for none
+ * @param fulfillment_url fulfillment URL of the contract, NULL for none
+ * @param coins_cnt length of the @a coin_pubs array
+ * @param coin_pubs the coins the payment is made of
+ * @param total_paid sum of the contributions of the @a coin_pubs
+ * @param total_needed amount needed to pay for the contract
+ * @param[out] status set to the outcome
+ * @param[out] total_refunded set to the amount refunded on the @a coin_pubs
+ * @return transaction status
  */
-static void
+static enum GNUNET_DB_QueryStatus
+postgres_pay_commit (void *cls,
+                     const struct GNUNET_HashCode *h_contract_terms,
+                     const struct TALER_MerchantPublicKeyP *merchant_pub,
+                     const char *order_id,
+                     const char *session_id,
+                     const char *fulfillment_url,
+                     unsigned int coins_cnt,
+                     const struct TALER_CoinSpendPublicKeyP *coin_pubs,
+                     const struct TALER_Amount *total_paid,
+                     const struct TALER_Amount *total_needed,
+                     enum TALER_MERCHANTDB_PayCommitStatus *status,
+                     struct TALER_Amount *total_refunded)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
+  uint32_t status32;
+  /* the stored procedure only records the session if both are given */
+  int have_session = ( (NULL != session_id) &&
+                       (NULL != fulfillment_url) );
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_string (have_session ? session_id : ""),
+    GNUNET_PQ_query_param_string (have_session ? fulfillment_url : ""),
+    GNUNET_PQ_query_param_fixed_size (coin_pubs,
+                                      coins_cnt * sizeof (*coin_pubs)),
+    TALER_PQ_query_param_amount (total_paid),
+    TALER_PQ_query_param_amount (total_needed),
+    GNUNET_PQ_query_param_absolute_time (&now),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    GNUNET_PQ_result_spec_uint32 ("out_status",
+                                  &status32),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("out_refunded",
+                                 total_refunded),
+    GNUNET_PQ_result_spec_end
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  check_connection (pg);
+  qs = eval_prepared_singleton_select (pg,
+                                       "pay_commit",
+                                       params,
+                                       rs);
+  if (qs <= 0)
+    return qs;
+  *status = (enum TALER_MERCHANTDB_PayCommitStatus) status32;
+  return qs;
+}
+
+
+/**
+ * Retrieve the order ID that was used to pay for a resource within a session.
+ *
+ * @param cls closure
+ * @param[out] order_id location to store the order ID that was used when
+ *             paying for the resource URL
+ * @param session_id session id
+ * @param fulfillment_url URL that canonically identifies the resource
+ *        being paid for
+ * @param merchant_pub public key of the merchant, identifying the instance
+ * @return transaction status
+ */
+enum GNUNET_DB_QueryStatus
+postgres_find_session_info (void *cls,
+                            char **order_id,
+                            const char *session_id,
+                            const char *fulfillment_url,
+                            const struct TALER_MerchantPublicKeyP *merchant_pub)
+{
+  struct PostgresClosure *pg = cls;
+
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (fulfillment_url),
+    GNUNET_PQ_query_param_string (session_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    GNUNET_PQ_result_spec_string ("order_id",
+                                  order_id),
+    GNUNET_PQ_result_spec_end
+  };
+  // We don't clean up the result spec since we want
+  // to keep around the memory for order_id.
+  return eval_prepared_singleton_select (pg,
+                                         "find_session_info",
+                                         params,
+                                         rs);
+}
+
+
+/**
+ * Insert payment confirmation from the exchange into the database.
+ *
+ * @param cls closure
+ * @param order_id identificator of the proposal associated with this revenue
+ * @param merchant_pub merchant's public key
+ * @param coin_pub public key of the coin
+ * @param amount_with_fee amount the exchange will deposit for this coin
+ * @param deposit_fee fee the exchange will charge for this coin
+ * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee changed by the exchange
+ * @param signkey_pub public key used by the exchange for @a exchange_proof
+ * @param exchange_proof proof from exchange that coin was accepted
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_store_deposit (void *cls,
+                        const struct GNUNET_HashCode *h_contract_terms,
+                        const struct TALER_MerchantPublicKeyP *merchant_pub,
+                        const struct TALER_CoinSpendPublicKeyP *coin_pub,
+                        const char *exchange_url,
+                        const struct TALER_Amount *amount_with_fee,
+                        const struct TALER_Amount *deposit_fee,
+                        const struct TALER_Amount *refund_fee,
+                        const struct TALER_Amount *wire_fee,
+                        const struct TALER_ExchangePublicKeyP *signkey_pub,
+                        const json_t *exchange_proof)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_auto_from_type (coin_pub),
+    GNUNET_PQ_query_param_string (exchange_url),
+    TALER_PQ_query_param_amount (amount_with_fee),
+    TALER_PQ_query_param_amount (deposit_fee),
+    TALER_PQ_query_param_amount (refund_fee),
+    TALER_PQ_query_param_amount (wire_fee),
+    GNUNET_PQ_query_param_auto_from_type (signkey_pub),
+    TALER_PQ_query_param_json (exchange_proof),
+    GNUNET_PQ_query_param_end
+  };
+
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Storing payment for h_contract_terms `%s', coin_pub: `%s', amount_with_fee: %s\n",
+              GNUNET_h2s (h_contract_terms),
+              TALER_B2S (coin_pub),
+              TALER_amount2s (amount_with_fee));
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Merchant pub is `%s'\n",
+              TALER_B2S (merchant_pub));
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_deposit",
+                                   params);
+}
+
+
+/**
+ * Insert mapping of @a coin_pub and @a h_contract_terms to
+ * corresponding @a wtid.
+ *
+ * @param cls closure
+ * @param h_contract_terms hashcode of the proposal data paid by @a coin_pub
+ * @param coin_pub public key of the coin
+ * @param wtid identifier of the wire transfer in which the exchange
+ *             send us the money for the coin deposit
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_store_coin_to_transfer (void *cls,
+                                 const struct GNUNET_HashCode *h_contract_terms,
+                                 const struct
+                                 TALER_CoinSpendPublicKeyP *coin_pub,
+                                 const struct
+                                 TALER_WireTransferIdentifierRawP *wtid)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (coin_pub),
+    GNUNET_PQ_query_param_auto_from_type (wtid),
+    GNUNET_PQ_query_param_end
+  };
+
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_transfer",
+                                   params);
+}
+
+
+/**
+ * Insert mappings of many coins to the wire transfer @a wtid, using
+ * a single statement.  The i-th coin is @a coin_pubs[i], deposited
+ * for @a h_contract_terms[i].  Mappings that already exist are
+ * ignored.
+ *
+ * @param cls closure
+ * @param wtid identifier of the wire transfer in which the exchange
+ *             send us the money for the coin deposits
+ * @param coins_cnt length of the @a h_contract_terms and @a coin_pubs arrays
+ * @param h_contract_terms proposal data's hashcodes
+ * @param coin_pubs public keys of the coins
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_store_coins_to_transfer (void *cls,
+                                  const struct
+                                  TALER_WireTransferIdentifierRawP *wtid,
+                                  unsigned int coins_cnt,
+                                  const struct GNUNET_HashCode *h_contract_terms,
+                                  const struct
+                                  TALER_CoinSpendPublicKeyP *coin_pubs)
+{
+  struct PostgresClosure *pg = cls;
+  uint32_t cnt32 = coins_cnt;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (wtid),
+    GNUNET_PQ_query_param_fixed_size (h_contract_terms,
+                                      coins_cnt * sizeof (*h_contract_terms)),
+    GNUNET_PQ_query_param_fixed_size (coin_pubs,
+                                      coins_cnt * sizeof (*coin_pubs)),
+    GNUNET_PQ_query_param_uint32 (&cnt32),
+    GNUNET_PQ_query_param_end
+  };
+
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_transfers",
+                                   params);
+}
+
+
+/**
+ * Insert wire transfer confirmation from the exchange into the database.
+ *
+ * @param cls closure
+ * @param exchange_url URL of the exchange
+ * @param wtid identifier of the wire transfer
+ * @param execution_time when was @a wtid executed
+ * @param signkey_pub public key used by the exchange for @a exchange_proof
+ * @param exchange_proof proof from exchange about what the deposit was for
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_store_transfer_to_proof (void *cls,
+                                  const char *exchange_url,
+                                  const struct
+                                  TALER_WireTransferIdentifierRawP *wtid,
+                                  struct GNUNET_TIME_Absolute execution_time,
+                                  const struct
+                                  TALER_ExchangePublicKeyP *signkey_pub,
+                                  const json_t *exchange_proof)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (exchange_url),
+    GNUNET_PQ_query_param_auto_from_type (wtid),
+    GNUNET_PQ_query_param_absolute_time (&execution_time),
+    GNUNET_PQ_query_param_auto_from_type (signkey_pub),
+    TALER_PQ_query_param_json (exchange_proof),
+    GNUNET_PQ_query_param_end
+  };
+
+  check_connection (pg);
+  return eval_prepared_non_select (pg,
+                                   "insert_proof",
+                                   params);
+}
+
+
+/**
+ * Lookup for a proposal, respecting the signature used by the
+ * /history's db methods.
+ *
+ * @param cls db plugin handle
+ * @param order_id order id used to search for the proposal data
+ * @param merchant_pub public key of the merchant using this method
+ * @param cb the callback
+ * @param cb_cls closure to pass to the callback
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_contract_terms_history (void *cls,
+                                      const char *order_id,
+                                      const struct
+                                      TALER_MerchantPublicKeyP *merchant_pub,
+                                      TALER_MERCHANTDB_ProposalDataCallback cb,
+                                      void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  json_t *contract_terms;
+  enum GNUNET_DB_QueryStatus qs;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    TALER_PQ_result_spec_json ("contract_terms",
+                               &contract_terms),
+    GNUNET_PQ_result_spec_end
+  };
+
+  qs = eval_prepared_singleton_select (pg,
+                                       "find_contract_terms_history",
+                                       params,
+                                       rs);
+  if (qs <= 0)
+    return qs;
+  if (NULL != cb)
+    cb (cb_cls,
+        order_id,
+        0,
+        contract_terms);
+  GNUNET_PQ_cleanup_result (rs);
+  return qs;
+}
+
+
+/**
+ * Closure for #find_contracts_cb().
+ */
+struct FindContractsContext
+{
+  /**
+   * Function to call on each result.
+   */
+  TALER_MERCHANTDB_ProposalDataCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * Transaction status code to set.
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindContractsContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_contracts_cb (void *cls,
+                   PGresult *result,
+                   unsigned int num_results)
+{
+  struct FindContractsContext *fcctx = cls;
+
+  for (unsigned int i = 0; i < num_results; i++)
+  {
+    char *order_id;
+    json_t *contract_terms;
+    uint64_t row_id;
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_string ("order_id",
+                                    &order_id),
+      TALER_PQ_result_spec_json ("contract_terms",
+                                 &contract_terms),
+      GNUNET_PQ_result_spec_uint64 ("row_id",
+                                    &row_id),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      fcctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    fcctx->qs = i + 1;
+    fcctx->cb (fcctx->cb_cls,
+               order_id,
+               row_id,
+               contract_terms);
+    GNUNET_PQ_cleanup_result (rs);
+  }
+}
+
+
+/**
+ * Return proposals whose timestamp are older than `date`.
+ * Among those proposals, only those ones being between the
+ * start-th and (start-nrows)-th record are returned.  The rows
+ * are sorted having the youngest first.
+ *
+ * @param cls our plugin handle.
+ * @param date only results older than this date are returned.
+ * @param merchant_pub instance's public key; only rows related to this
+ * instance are returned.
+ * @param start only rows with serial id less than start are returned.
+ * In other words, you lower `start` to get older records. The tipical
+ * usage is to firstly call `find_contract_terms_by_date`, so that you get
+ * the `nrows` youngest records. The oldest of those records will tell you
+ * from which timestamp and `start` you can query the DB in order to get
+ * furtherly older records, and so on. Alternatively, you can use always
+ * the same timestamp and just go behind in history by tuning `start`.
+ * @param nrows only nrows rows are returned.
+ * @param past if set to #GNUNET_YES, retrieves rows older than `date`.
+ * @param ascending if #GNUNET_YES, results will be sorted in chronological order.
+ * This is typically used to show live updates on the merchant's backoffice
+ * Web interface.
+ * @param cb function to call with transaction data, can be NULL.
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_contract_terms_by_date_and_range (void *cls,
+                                                struct GNUNET_TIME_Absolute
+                                                date,
+                                                const struct
+                                                TALER_MerchantPublicKeyP *
+                                                merchant_pub,
+                                                uint64_t start,
+                                                uint64_t nrows,
+                                                int past,
+                                                unsigned int ascending,
+                                                TALER_MERCHANTDB_ProposalDataCallback
+                                                cb,
+                                                void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_absolute_time (&date),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_uint64 (&start),
+    GNUNET_PQ_query_param_uint64 (&nrows),
+    GNUNET_PQ_query_param_end
+  };
+  const char *stmt;
+  enum GNUNET_DB_QueryStatus qs;
+  struct FindContractsContext fcctx = {
+    .cb = cb,
+    .cb_cls = cb_cls
+  };
+
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "DB serving /history with date %s\n",
+              GNUNET_STRINGS_absolute_time_to_string (date));
+  stmt =
+    (GNUNET_YES == past)
+    ? ( (GNUNET_YES == ascending)
+        ? "find_contract_terms_by_date_and_range_past_asc"
+        : "find_contract_terms_by_date_and_range_past")
+    : ( (GNUNET_YES == ascending)
+        ? "find_contract_terms_by_date_and_range_asc"
+        : "find_contract_terms_by_date_and_range");
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   stmt,
+                                   params,
+                                   &find_contracts_cb,
+                                   &fcctx);
+  if (0 >= qs)
+    return qs;
+  return fcctx.qs;
+}
+
+
+/**
+ * Return up to @a nrows paid proposals of an instance with
+ * timestamps younger (or older, if @a past is set) than @a date
+ * and serial ids strictly between @a min_row and @a max_row.
+ *
+ * @param cls our plugin handle.
+ * @param date only results younger than this date are returned.
+ * @param merchant_pub instance's public key; only rows related to this
+ * instance are returned.
+ * @param min_row only rows with a serial id above @a min_row are returned
+ * @param max_row only rows with a serial id below @a max_row are returned
+ * @param nrows only nrows rows are returned.
+ * @param past if set to #GNUNET_YES, retrieves rows older than `date`.
+ * @param ascending if #GNUNET_YES, return the rows with the smallest
+ *        serial ids in ascending order, otherwise those with the largest
+ *        serial ids in descending order
+ * @param cb function to call with transaction data, can be NULL.
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_contract_terms_by_date_and_row_range (
+  void *cls,
+  struct GNUNET_TIME_Absolute date,
+  const struct TALER_MerchantPublicKeyP *merchant_pub,
+  uint64_t min_row,
+  uint64_t max_row,
+  uint64_t nrows,
+  int past,
+  unsigned int ascending,
+  TALER_MERCHANTDB_ProposalDataCallback cb,
+  void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_absolute_time (&date),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_uint64 (&min_row),
+    GNUNET_PQ_query_param_uint64 (&max_row),
+    GNUNET_PQ_query_param_uint64 (&nrows),
+    GNUNET_PQ_query_param_end
+  };
+  const char *stmt;
+  enum GNUNET_DB_QueryStatus qs;
+  struct FindContractsContext fcctx = {
+    .cb = cb,
+    .cb_cls = cb_cls
+  };
+
+  stmt =
+    (GNUNET_YES == past)
+    ? ( (GNUNET_YES == ascending)
+        ? "find_contract_terms_by_date_and_row_range_past_asc"
+        : "find_contract_terms_by_date_and_row_range_past")
+    : ( (GNUNET_YES == ascending)
+        ? "find_contract_terms_by_date_and_row_range_asc"
+        : "find_contract_terms_by_date_and_row_range");
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   stmt,
+                                   params,
+                                   &find_contracts_cb,
+                                   &fcctx);
+  if (0 >= qs)
+    return qs;
+  return fcctx.qs;
+}
+
+
+/**
+ * Closure for #find_tip_authorizations_cb().
+ */
+struct GetAuthorizedTipAmountContext
+{
+  /**
+   * Total authorized amount.
+   */
+  struct TALER_Amount authorized_amount;
+
+  /**
+   * Transaction status code to set.
+   */
+  enum GNUNET_DB_QueryStatus qs;
+
+  /**
+   * Plugin context.
+   */
+  struct PostgresClosure *pg;
+
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct GetAuthorizedTipAmountContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_tip_authorizations_cb (void *cls,
+                            PGresult *result,
+                            unsigned int num_results)
+{
+  struct GetAuthorizedTipAmountContext *ctx = cls;
+  struct PostgresClosure *pg = ctx->pg;
+  unsigned int i;
+
+  for (i = 0; i < num_results; i++)
+  {
+    struct TALER_Amount amount;
+    char *just;
+    json_t *extra;
+    struct GNUNET_HashCode h;
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_string ("justification",
+                                    &just),
+      GNUNET_PQ_result_spec_auto_from_type ("tip_id",
+                                            &h),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
+                                   &amount),
+      TALER_PQ_result_spec_json ("extra",
+                                 &extra),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      ctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+
+    if (0 == i)
+    {
+      ctx->authorized_amount = amount;
+    }
+    else
+    {
+      if (0 >
+          TALER_amount_add (&ctx->authorized_amount,
+                            &ctx->authorized_amount,
+                            &amount))
+      {
+        GNUNET_break (0);
+        GNUNET_PQ_cleanup_result (rs);
+        ctx->qs = GNUNET_DB_STATUS_HARD_ERROR;
+        return;
+      }
+    }
+    GNUNET_PQ_cleanup_result (rs);
+  }
+
+  if (0 == i)
+  {
+    ctx->qs = GNUNET_DB_STATUS_SUCCESS_NO_RESULTS;
+  }
+  else
+  {
+    /* one aggregated result */
+    ctx->qs = GNUNET_DB_STATUS_SUCCESS_ONE_RESULT;
+  }
+}
+
+
+/**
+ * Get the total amount of authorized tips for a tipping reserve.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param reserve_priv which reserve to check
+ * @param[out] authorzed_amount amount we've authorized so far for tips
+ * @return transaction status, usually
+ *      #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT for success
+ *      #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if the reserve_priv
+ *      does not identify a known tipping reserve
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_get_authorized_tip_amount (void *cls,
+                                    const struct
+                                    TALER_ReservePrivateKeyP *reserve_priv,
+                                    struct TALER_Amount *authorized_amount)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+    GNUNET_PQ_query_param_end
+  };
+  enum GNUNET_DB_QueryStatus qs;
+  struct GetAuthorizedTipAmountContext ctx = {
+    .pg = pg
+  };
+
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_tip_authorizations",
+                                   params,
+                                   &find_tip_authorizations_cb,
+                                   &ctx);
+  if (0 >= qs)
+    return qs;
+  *authorized_amount = ctx.authorized_amount;
+  return ctx.qs;
+}
+
+
+/**
+ * Return proposals whose timestamp are older than `date`.
+ * The rows are sorted having the youngest first.
+ *
+ * @param cls our plugin handle.
+ * @param date only results older than this date are returned.
+ * @param merchant_pub instance's public key; only rows related to this
+ * instance are returned.
+ * @param nrows at most nrows rows are returned.
+ * @param cb function to call with transaction data, can be NULL.
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_contract_terms_by_date (void *cls,
+                                      struct GNUNET_TIME_Absolute date,
+                                      const struct
+                                      TALER_MerchantPublicKeyP *merchant_pub,
+                                      uint64_t nrows,
+                                      TALER_MERCHANTDB_ProposalDataCallback cb,
+                                      void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_absolute_time (&date),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_uint64 (&nrows),
+    GNUNET_PQ_query_param_end
+  };
+  enum GNUNET_DB_QueryStatus qs;
+  struct FindContractsContext fcctx = {
+    .cb = cb,
+    .cb_cls = cb_cls
+  };
+
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_contract_terms_by_date",
+                                   params,
+                                   &find_contracts_cb,
+                                   &fcctx);
+  if (0 >= qs)
+    return qs;
+  return fcctx.qs;
+}
+
+
+/**
+ * Closure for #find_payments_cb().
+ */
+struct FindPaymentsContext
+{
+  /**
+   * Function to call with results.
+   */
+  TALER_MERCHANTDB_CoinDepositCallback cb;
+
+  /**
+   * Closure for @e cls.
+   */
+  void *cb_cls;
+
+  /**
+   * Plugin context.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * Contract term hash used for the search.
+   */
+  const struct GNUNET_HashCode *h_contract_terms;
+
+  /**
+   * Transaction status (set).
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindPaymentsContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_payments_cb (void *cls,
+                  PGresult *result,
+                  unsigned int num_results)
+{
+  struct FindPaymentsContext *fpc = cls;
+  struct PostgresClosure *pg = fpc->pg;
+
+  for (unsigned int i = 0; i<num_results; i++)
+  {
+    struct TALER_CoinSpendPublicKeyP coin_pub;
+    struct TALER_Amount amount_with_fee;
+    struct TALER_Amount deposit_fee;
+    struct TALER_Amount refund_fee;
+    struct TALER_Amount wire_fee;
+    json_t *exchange_proof;
+    char *exchange_url;
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_auto_from_type ("coin_pub",
+                                            &coin_pub),
+      GNUNET_PQ_result_spec_string ("exchange_url",
+                                    &exchange_url),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("amount_with_fee",
+                                   &amount_with_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("deposit_fee",
+                                   &deposit_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("refund_fee",
+                                   &refund_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("wire_fee",
+                                   &wire_fee),
+      TALER_PQ_result_spec_json ("exchange_proof",
+                                 &exchange_proof),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    fpc->qs = i + 1;
+    fpc->cb (fpc->cb_cls,
+             fpc->h_contract_terms,
+             &coin_pub,
+             exchange_url,
+             &amount_with_fee,
+             &deposit_fee,
+             &refund_fee,
+             &wire_fee,
+             exchange_proof);
+    GNUNET_PQ_cleanup_result (rs);
+  }
+}
+
+
+/**
+ * Lookup information about coin payments by proposal data hash
+ * (and @a merchant_pub)
+ *
+ * @param cls closure
+ * @param h_contract_terms key for the search
+ * @param merchant_pub merchant's public key
+ * @param cb function to call with payment data
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_payments (void *cls,
+                        const struct GNUNET_HashCode *h_contract_terms,
+                        const struct TALER_MerchantPublicKeyP *merchant_pub,
+                        TALER_MERCHANTDB_CoinDepositCallback cb,
+                        void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct FindPaymentsContext fpc = {
+    .h_contract_terms = h_contract_terms,
+    .cb = cb,
+    .cb_cls = cb_cls,
+    .pg = pg
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  /* no preflight check here, run in its own transaction by the
+     caller! */
+  GNUNET_log (GNUNET_ERROR_TYPE_DEBUG,
+              "Finding payment for h_contract_terms '%s'\n",
+              GNUNET_h2s (h_contract_terms));
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_deposits",
+                                   params,
+                                   &find_payments_cb,
+                                   &fpc);
+  if (qs <= 0)
+    return qs;
+  return fpc.qs;
+}
+
+
+/**
+ * Closure for #find_payments_by_coin_cb().
+ */
+struct FindPaymentsByCoinContext
+{
+  /**
+   * Function to call with results.
+   */
+  TALER_MERCHANTDB_CoinDepositCallback cb;
+
+  /**
+   * Closure for @e cls.
+   */
+  void *cb_cls;
+
+  /**
+   * Plugin context.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * Coin we are looking for.
+   */
+  const struct TALER_CoinSpendPublicKeyP *coin_pub;
+
+  /**
+   * Hash of the contract we are looking for.
+   */
+  const struct GNUNET_HashCode *h_contract_terms;
+
+  /**
+   * Transaction status (set).
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindPaymentsByCoinContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_payments_by_coin_cb (void *cls,
+                          PGresult *result,
+                          unsigned int num_results)
+{
+  struct FindPaymentsByCoinContext *fpc = cls;
+  struct PostgresClosure *pg = fpc->pg;
+
+  for (unsigned int i = 0; i<num_results; i++)
+  {
+    struct TALER_Amount amount_with_fee;
+    struct TALER_Amount deposit_fee;
+    struct TALER_Amount refund_fee;
+    struct TALER_Amount wire_fee;
+    char *exchange_url;
+    json_t *exchange_proof;
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      TALER_PQ_RESULT_SPEC_AMOUNT ("amount_with_fee",
+                                   &amount_with_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("deposit_fee",
+                                   &deposit_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("refund_fee",
+                                   &refund_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("wire_fee",
+                                   &wire_fee),
+      GNUNET_PQ_result_spec_string ("exchange_url",
+                                    &exchange_url),
+      TALER_PQ_result_spec_json ("exchange_proof",
+                                 &exchange_proof),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    fpc->qs = i + 1;
+    fpc->cb (fpc->cb_cls,
+             fpc->h_contract_terms,
+             fpc->coin_pub,
+             exchange_url,
+             &amount_with_fee,
+             &deposit_fee,
+             &refund_fee,
+             &wire_fee,
+             exchange_proof);
+    GNUNET_PQ_cleanup_result (rs);
+  }
+}
+
+
+/**
+ * Retrieve information about a deposited coin.
+ *
+ * @param cls closure
+ * @param h_contract_terms hashcode of the proposal data paid by @a coin_pub
+ * @param merchant_pub merchant's public key.
+ * @param coin_pub coin's public key used for the search
+ * @param cb function to call with payment data
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_payments_by_hash_and_coin (void *cls,
+                                         const struct
+                                         GNUNET_HashCode *h_contract_terms,
+                                         const struct
+                                         TALER_MerchantPublicKeyP *merchant_pub,
+                                         const struct
+                                         TALER_CoinSpendPublicKeyP *coin_pub,
+                                         TALER_MERCHANTDB_CoinDepositCallback cb,
+                                         void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_auto_from_type (coin_pub),
+    GNUNET_PQ_query_param_end
+  };
+  struct FindPaymentsByCoinContext fpc = {
+    .cb = cb,
+    .cb_cls = cb_cls,
+    .pg = pg,
+    .h_contract_terms = h_contract_terms,
+    .coin_pub = coin_pub
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_deposits_by_hash_and_coin",
+                                   params,
+                                   &find_payments_by_coin_cb,
+                                   &fpc);
+  if (0 >= qs)
+    return qs;
+  return fpc.qs;
+}
+
+
+/**
+ * Closure for #find_payments_by_coins_cb().
+ */
+struct FindPaymentsByCoinsContext
+{
+  /**
+   * Function to call with results.
+   */
+  TALER_MERCHANTDB_CoinDepositOffsetCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * Number of coins we are looking for.
+   */
+  unsigned int coins_cnt;
+
+  /**
+   * Transaction status (set).
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindPaymentsByCoinsContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_payments_by_coins_cb (void *cls,
+                           PGresult *result,
+                           unsigned int num_results)
+{
+  struct FindPaymentsByCoinsContext *fpc = cls;
+
+  for (unsigned int i = 0; i<num_results; i++)
+  {
+    uint32_t offset;
+    struct TALER_Amount amount_with_fee;
+    struct TALER_Amount deposit_fee;
+    struct TALER_Amount refund_fee;
+    struct TALER_Amount wire_fee;
+    char *exchange_url;
+    json_t *exchange_proof;
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_uint32 ("coin_off",
+                                    &offset),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("amount_with_fee",
+                                   &amount_with_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("deposit_fee",
+                                   &deposit_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("refund_fee",
+                                   &refund_fee),
+      TALER_PQ_RESULT_SPEC_AMOUNT ("wire_fee",
+                                   &wire_fee),
+      GNUNET_PQ_result_spec_string ("exchange_url",
+                                    &exchange_url),
+      TALER_PQ_result_spec_json ("exchange_proof",
+                                 &exchange_proof),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    if (offset >= fpc->coins_cnt)
+    {
+      GNUNET_break (0);
+      GNUNET_PQ_cleanup_result (rs);
+      fpc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    fpc->qs = i + 1;
+    fpc->cb (fpc->cb_cls,
+             offset,
+             exchange_url,
+             &amount_with_fee,
+             &deposit_fee,
+             &refund_fee,
+             &wire_fee,
+             exchange_proof);
+    GNUNET_PQ_cleanup_result (rs);
+  }
+}
+
+
+/**
+ * Retrieve information about many deposited coins with a single
+ * statement.  The i-th coin is @a coin_pubs[i], deposited for
+ * @a h_contract_terms[i].  @a cb is called in ascending order of
+ * the offsets, and not at all for coins that are not in the
+ * database.
+ *
+ * @param cls closure
+ * @param merchant_pub merchant's public key
+ * @param coins_cnt length of the @a h_contract_terms and @a coin_pubs arrays
+ * @param h_contract_terms proposal data's hashcodes
+ * @param coin_pubs public keys of the coins
+ * @param cb function to call with payment data
+ * @param cb_cls closure for @a cb
+ * @return transaction status, number of coins found on success
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_payments_by_coins (void *cls,
+                                 const struct
+                                 TALER_MerchantPublicKeyP *merchant_pub,
+                                 unsigned int coins_cnt,
+                                 const struct GNUNET_HashCode *h_contract_terms,
+                                 const struct
+                                 TALER_CoinSpendPublicKeyP *coin_pubs,
+                                 TALER_MERCHANTDB_CoinDepositOffsetCallback cb,
+                                 void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  uint32_t cnt32 = coins_cnt;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_fixed_size (h_contract_terms,
+                                      coins_cnt * sizeof (*h_contract_terms)),
+    GNUNET_PQ_query_param_fixed_size (coin_pubs,
+                                      coins_cnt * sizeof (*coin_pubs)),
+    GNUNET_PQ_query_param_uint32 (&cnt32),
+    GNUNET_PQ_query_param_end
+  };
+  struct FindPaymentsByCoinsContext fpc = {
+    .cb = cb,
+    .cb_cls = cb_cls,
+    .coins_cnt = coins_cnt
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_deposits_by_coins",
+                                   params,
+                                   &find_payments_by_coins_cb,
+                                   &fpc);
+  if (0 >= qs)
+    return qs;
+  return fpc.qs;
+}
+
+
+/**
+ * Closure for #find_transfers_cb().
+ */
+struct FindTransfersContext
+{
+  /**
+   * Function to call on results.
+   */
+  TALER_MERCHANTDB_TransferCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * Hash of the contract we are looking under.
+   */
+  const struct GNUNET_HashCode *h_contract_terms;
+
+  /**
+   * Transaction status (set).
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindTransfersContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
+find_transfers_cb (void *cls,
+                   PGresult *result,
+                   unsigned int num_results)
+{
+  struct FindTransfersContext *ftc = cls;
+
+  for (unsigned int i = 0; i<num_results; i++)
+  {
+    struct TALER_CoinSpendPublicKeyP coin_pub;
+    struct TALER_WireTransferIdentifierRawP wtid;
+    struct GNUNET_TIME_Absolute execution_time;
+    json_t *proof;
+
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      GNUNET_PQ_result_spec_auto_from_type ("coin_pub",
+                                            &coin_pub),
+      GNUNET_PQ_result_spec_auto_from_type ("wtid",
+                                            &wtid),
+      GNUNET_PQ_result_spec_absolute_time ("execution_time",
+                                           &execution_time),
+      TALER_PQ_result_spec_json ("proof",
+                                 &proof),
+      GNUNET_PQ_result_spec_end
+    };
+
+    if (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  i))
+    {
+      GNUNET_break (0);
+      ftc->qs = GNUNET_DB_STATUS_HARD_ERROR;
+      return;
+    }
+    ftc->qs = i + 1;
+    ftc->cb (ftc->cb_cls,
+             ftc->h_contract_terms,
+             &coin_pub,
+             &wtid,
+             execution_time,
+             proof);
+    GNUNET_PQ_cleanup_result (rs);
+  }
+}
+
+
+/**
+ * Lookup information about a transfer by @a h_contract_terms.  Note
+ * that in theory there could be multiple wire transfers for a
+ * single @a h_contract_terms, as the transaction may have involved
+ * multiple coins and the coins may be spread over different wire
+ * transfers.
+ *
+ * @param cls closure
+ * @param h_contract_terms key for the search
+ * @param cb function to call with transfer data
+ * @param cb_cls closure for @a cb
+ * @return transaction status
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_find_transfers_by_hash (void *cls,
+                                 const struct GNUNET_HashCode *h_contract_terms,
+                                 TALER_MERCHANTDB_TransferCallback cb,
+                                 void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_end
+  };
+  struct FindTransfersContext ftc = {
+    .h_contract_terms = h_contract_terms,
+    .cb = cb,
+    .cb_cls = cb_cls
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  check_connection (pg);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_transfers_by_hash",
+                                   params,
+                                   &find_transfers_cb,
+                                   &ftc);
+  if (0 >= qs)
+    return qs;
+  return ftc.qs;
+}
+
+
+/**
+ * Closure for #find_deposits_cb().
+ */
+struct FindDepositsContext
+{
+
+  /**
+   * Function to call for each result.
+   */
+  TALER_MERCHANTDB_CoinDepositCallback cb;
+
+  /**
+   * Closure for @e cb.
+   */
+  void *cb_cls;
+
+  /**
+   * Plugin context.
+   */
+  struct PostgresClosure *pg;
+
+  /**
+   * Transaction status (set).
+   */
+  enum GNUNET_DB_QueryStatus qs;
+};
+
+
+/**
+ * Function to be called with the results of a SELECT statement
+ * that has returned @a num_results results.
+ *
+ * @param cls of type `struct FindDepositsContext *`
+ * @param result the postgres result
+ * @param num_result the number of results in @a result
+ */
+static void
 find_deposits_cb (void *cls,
                   PGresult *result,
                   unsigned int num_results)
@@ -1681,11 +3005,11 @@ postgres_find_deposits_by_wtid (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_deposits_by_wtid",
-                                             params,
-                                             &find_deposits_cb,
-                                             &fdc);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_deposits_by_wtid",
+                                   params,
+                                   &find_deposits_cb,
+                                   &fdc);
   if (0 >= qs)
     return qs;
   return fdc.qs;
@@ -1817,11 +3141,11 @@ postgres_get_refunds_from_contract_terms_hash (
                    GNUNET_h2s (h_contract_terms),
                    TALER_B2S (merchant_pub));
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_refunds_from_contract_terms_hash",
-                                             params,
-                                             &get_refunds_cb,
-                                             &grc);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_refunds_from_contract_terms_hash",
+                                   params,
+                                   &get_refunds_cb,
+                                   &grc);
   if (0 >= qs)
     return qs;
   return grc.qs;
@@ -1868,10 +3192,10 @@ postgres_get_refund_proof (
   };
 
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "get_refund_proof",
-                                                   params,
-                                                   rs);
+  return eval_prepared_singleton_select (pg,
+                                         "get_refund_proof",
+                                         params,
+                                         rs);
 }
 
 
@@ -1913,9 +3237,9 @@ postgres_put_refund_proof (
                    GNUNET_h2s (h_contract_terms),
                    TALER_B2S (coin_pub));
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_refund_proof",
-                                             params);
+  return eval_prepared_non_select (pg,
+                                   "insert_refund_proof",
+                                   params);
 }
 
 
@@ -1953,9 +3277,9 @@ insert_refund (void *cls,
                    TALER_B2S (merchant_pub));
 
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_refund",
-                                             params);
+  return eval_prepared_non_select (pg,
+                                   "insert_refund",
+                                   params);
 }
 
 
@@ -2007,9 +3331,9 @@ postgres_store_wire_fee_by_exchange (
               TALER_B2S (exchange_pub),
               GNUNET_STRINGS_absolute_time_to_string (start_date),
               TALER_amount2s (wire_fee));
-  return GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_wire_fee",
-                                             params);
+  return eval_prepared_non_select (pg,
+                                   "insert_wire_fee",
+                                   params);
 }
 
 
@@ -2062,10 +3386,10 @@ postgres_lookup_wire_fee (void *cls,
   };
 
   check_connection (pg);
-  return GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "lookup_wire_fee",
-                                                   params,
-                                                   rs);
+  return eval_prepared_singleton_select (pg,
+                                         "lookup_wire_fee",
+                                         params,
+                                         rs);
 }
 
 
@@ -2239,11 +3563,11 @@ process_deposits_for_refund_cb (void *cls,
     GNUNET_assert (GNUNET_OK ==
                    TALER_amount_get_zero (ctx->refund->currency,
                                           &ictx.refunded_amount));
-    ires = GNUNET_PQ_eval_prepared_multi_select (ctx->pg->conn,
-                                                 "find_refunds",
-                                                 params,
-                                                 &process_refund_cb,
-                                                 &ictx);
+    ires = eval_prepared_multi_select (ctx->pg,
+                                       "find_refunds",
+                                       params,
+                                       &process_refund_cb,
+                                       &ictx);
     if ( (GNUNET_OK != ictx.err) ||
          (GNUNET_DB_STATUS_HARD_ERROR == ires) )
     {
@@ -2442,11 +3766,11 @@ postgres_increase_refund_for_contract_NT (
               "Asked to refund %s on contract %s\n",
               TALER_amount2s (refund),
               GNUNET_h2s (h_contract_terms));
-  qs = GNUNET_PQ_eval_prepared_multi_select (pg->conn,
-                                             "find_deposits",
-                                             params,
-                                             &process_deposits_for_refund_cb,
-                                             &ctx);
+  qs = eval_prepared_multi_select (pg,
+                                   "find_deposits",
+                                   params,
+                                   &process_deposits_for_refund_cb,
+                                   &ctx);
   switch (qs)
   {
   case GNUNET_DB_STATUS_SUCCESS_NO_RESULTS:
@@ -2495,10 +3819,10 @@ postgres_find_proof_by_wtid (void *cls,
   enum GNUNET_DB_QueryStatus qs;
 
   check_connection (pg);
-  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                 "find_proof_by_wtid",
-                                                 params,
-                                                 rs);
+  qs = eval_prepared_singleton_select (pg,
+                                       "find_proof_by_wtid",
+                                       params,
+                                       rs);
   if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
   {
     cb (cb_cls,
@@ -2565,10 +3889,10 @@ RETRY:
     struct GNUNET_PQ_ResultSpec rs[] = {
       GNUNET_PQ_result_spec_end
     };
-    qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "lookup_tip_credit_uuid",
-                                                   params,
-                                                   rs);
+    qs = eval_prepared_singleton_select (pg,
+                                         "lookup_tip_credit_uuid",
+                                         params,
+                                         rs);
     if (0 > qs)
     {
       GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR == qs);
@@ -2597,9 +3921,9 @@ RETRY:
 
     now = GNUNET_TIME_absolute_get ();
     (void) GNUNET_TIME_round_abs (&now);
-    qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_tip_credit_uuid",
-                                             params);
+    qs = eval_prepared_non_select (pg,
+                                   "insert_tip_credit_uuid",
+                                   params);
     if (0 > qs)
     {
       GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR == qs);
@@ -2624,10 +3948,10 @@ RETRY:
       GNUNET_PQ_result_spec_end
     };
 
-    qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "lookup_tip_reserve_balance",
-                                                   params,
-                                                   rs);
+    qs = eval_prepared_singleton_select (pg,
+                                         "lookup_tip_reserve_balance",
+                                         params,
+                                         rs);
   }
   if (0 > qs)
   {
@@ -2677,9 +4001,9 @@ RETRY:
     stmt = (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
            ? "update_tip_reserve_balance"
            : "insert_tip_reserve_balance";
-    qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             stmt,
-                                             params);
+    qs = eval_prepared_non_select (pg,
+                                   stmt,
+                                   params);
     if (0 > qs)
     {
       GNUNET_break (GNUNET_DB_STATUS_SOFT_ERROR == qs);
@@ -2732,383 +4056,1061 @@ postgres_authorize_tip_TR (void *cls,
 {
   struct PostgresClosure *pg = cls;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+    GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_TIME_Absolute old_expiration;
+  struct TALER_Amount old_balance;
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    GNUNET_PQ_result_spec_absolute_time ("expiration",
+                                         &old_expiration),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("balance",
+                                 &old_balance),
+    GNUNET_PQ_result_spec_end
+  };
+  enum GNUNET_DB_QueryStatus qs;
+  struct TALER_Amount new_balance;
+  unsigned int retries;
+
+  retries = 0;
+  check_connection (pg);
+RETRY:
+  if (MAX_RETRIES < ++retries)
+    return TALER_EC_TIP_AUTHORIZE_DB_SOFT_ERROR;
+  if (GNUNET_OK !=
+      postgres_start (pg,
+                      "authorize tip"))
+  {
+    GNUNET_break (0);
+    return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+  }
+  qs = eval_prepared_singleton_select (pg,
+                                       "lookup_tip_reserve_balance",
+                                       params,
+                                       rs);
+  if (0 >= qs)
+  {
+    /* reserve unknown */
+    postgres_rollback (pg);
+    if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+      goto RETRY;
+    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+      return TALER_EC_TIP_AUTHORIZE_INSUFFICIENT_FUNDS;
+    return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+  }
+  if (0 == GNUNET_TIME_absolute_get_remaining (old_expiration).rel_value_us)
+  {
+    /* reserve expired, can't be used */
+    postgres_rollback (pg);
+    return TALER_EC_TIP_AUTHORIZE_RESERVE_EXPIRED;
+  }
+  if (0 >
+      TALER_amount_subtract (&new_balance,
+                             &old_balance,
+                             amount))
+  {
+    /* insufficient funds left in reserve */
+    postgres_rollback (pg);
+    return TALER_EC_TIP_AUTHORIZE_INSUFFICIENT_FUNDS;
+  }
+  /* Update reserve balance */
+  {
+    struct GNUNET_PQ_QueryParam params[] = {
+      GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+      GNUNET_PQ_query_param_absolute_time (&old_expiration),
+      TALER_PQ_query_param_amount (&new_balance),
+      GNUNET_PQ_query_param_end
+    };
+
+    qs = eval_prepared_non_select (pg,
+                                   "update_tip_reserve_balance",
+                                   params);
+    if (0 > qs)
+    {
+      postgres_rollback (pg);
+      if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+        goto RETRY;
+      return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+    }
+  }
+  /* Generate and store tip ID */
+  *expiration = old_expiration;
+  GNUNET_CRYPTO_hash_create_random (GNUNET_CRYPTO_QUALITY_STRONG,
+                                    tip_id);
+  {
+    struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
+    struct GNUNET_PQ_QueryParam params[] = {
+      GNUNET_PQ_query_param_auto_from_type (reserve_priv),
+      GNUNET_PQ_query_param_auto_from_type (tip_id),
+      GNUNET_PQ_query_param_string (exchange_url),
+      GNUNET_PQ_query_param_string (justification),
+      TALER_PQ_query_param_json (extra),
+      GNUNET_PQ_query_param_absolute_time (&now),
+      TALER_PQ_query_param_amount (amount), /* overall amount */
+      TALER_PQ_query_param_amount (amount), /* amount left */
+      GNUNET_PQ_query_param_end
+    };
+
+    (void) GNUNET_TIME_round_abs (&now);
+    qs = eval_prepared_non_select (pg,
+                                   "insert_tip_justification",
+                                   params);
+    if (0 > qs)
+    {
+      postgres_rollback (pg);
+      if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+        goto RETRY;
+      return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+    }
+  }
+  qs = postgres_commit (pg);
+  if (0 <= qs)
+    return TALER_EC_NONE; /* success! */
+  if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+    goto RETRY;
+  return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+}
+
+
+/**
+ * Find out tip authorization details associated with @a tip_id
+ *
+ * @param cls closure, typically a connection to the d
+ * @param tip_id the unique ID for the tip
+ * @param[out] exchange_url set to the URL of the exchange (unless NULL)
+ * @param[out] extra extra data to pass to the wallet (unless NULL)
+ * @param[out] amount set to the authorized amount (unless NULL)
+ * @param[out] amount_left set to the amount left (unless NULL)
+ * @param[out] timestamp set to the timestamp of the tip authorization (unless NULL)
+ * @return transaction status, usually
+ *      #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT for success
+ *      #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if @a credit_uuid already known
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_lookup_tip_by_id (void *cls,
+                           const struct GNUNET_HashCode *tip_id,
+                           char **exchange_url,
+                           json_t **extra,
+                           struct TALER_Amount *amount,
+                           struct TALER_Amount *amount_left,
+                           struct GNUNET_TIME_Absolute *timestamp)
+{
+  struct PostgresClosure *pg = cls;
+  char *res_exchange_url;
+  json_t *res_extra;
+  struct TALER_Amount res_amount;
+  struct TALER_Amount res_amount_left;
+  struct GNUNET_TIME_Absolute res_timestamp;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (tip_id),
+    GNUNET_PQ_query_param_end
+  };
+  struct GNUNET_PQ_ResultSpec rs[] = {
+    GNUNET_PQ_result_spec_string ("exchange_url",
+                                  &res_exchange_url),
+    GNUNET_PQ_result_spec_absolute_time ("timestamp",
+                                         &res_timestamp),
+    TALER_PQ_result_spec_json ("extra",
+                               &res_extra),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
+                                 &res_amount),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("left",
+                                 &res_amount_left),
+    GNUNET_PQ_result_spec_end
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  qs = eval_prepared_singleton_select (pg,
+                                       "find_tip_by_id",
+                                       params,
+                                       rs);
+  if (0 >= qs)
+  {
+    if (NULL != exchange_url)
+      *exchange_url = NULL;
+    return qs;
+  }
+  if (NULL != exchange_url)
+    *exchange_url = strdup (res_exchange_url);
+  if (NULL != amount)
+    *amount = res_amount;
+  if (NULL != amount_left)
+    *amount_left = res_amount_left;
+  if (NULL != timestamp)
+    *timestamp = res_timestamp;
+  if (NULL != extra)
+  {
+    json_incref (res_extra);
+    *extra = res_extra;
+  }
+  GNUNET_PQ_cleanup_result (rs);
+  return qs;
+}
+
+
+/**
+ * Pickup a tip over @a amount using pickup id @a pickup_id.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param amount how high is the amount picked up (with fees)
+ * @param tip_id the unique ID from the tip authorization
+ * @param pickup_id the unique ID identifying the pick up operation
+ *        (to allow replays, hash over the coin envelope and denomination key)
+ * @param[out] reserve_priv which reserve key to use to sign
+ * @return taler error code
+ *      #TALER_EC_TIP_PICKUP_ID_UNKNOWN if @a tip_id is unknown
+ *      #TALER_EC_TIP_PICKUP_NO_FUNDS if @a tip_id has insufficient funds left
+ *      #TALER_EC_TIP_PICKUP_DB_ERROR_HARD on hard database errors
+ *      #TALER_EC_TIP_PICKUP_AMOUNT_CHANGED if @a amount is different for known @a pickup_id
+ *      #TALER_EC_TIP_PICKUP_DB_ERROR_SOFT on soft database errors (client should retry)
+ *      #TALER_EC_NONE upon success (@a reserve_priv was set)
+ */
+static enum TALER_ErrorCode
+postgres_pickup_tip_TR (void *cls,
+                        const struct TALER_Amount *amount,
+                        const struct GNUNET_HashCode *tip_id,
+                        const struct GNUNET_HashCode *pickup_id,
+                        struct TALER_ReservePrivateKeyP *reserve_priv)
+{
+  struct PostgresClosure *pg = cls;
+  struct TALER_Amount left_amount;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (tip_id),
     GNUNET_PQ_query_param_end
   };
-  struct GNUNET_TIME_Absolute old_expiration;
-  struct TALER_Amount old_balance;
   struct GNUNET_PQ_ResultSpec rs[] = {
-    GNUNET_PQ_result_spec_absolute_time ("expiration",
-                                         &old_expiration),
-    TALER_PQ_RESULT_SPEC_AMOUNT ("balance",
-                                 &old_balance),
+    GNUNET_PQ_result_spec_auto_from_type ("reserve_priv",
+                                          reserve_priv),
+    TALER_PQ_RESULT_SPEC_AMOUNT ("left",
+                                 &left_amount),
     GNUNET_PQ_result_spec_end
   };
   enum GNUNET_DB_QueryStatus qs;
-  struct TALER_Amount new_balance;
   unsigned int retries;
 
   retries = 0;
   check_connection (pg);
 RETRY:
   if (MAX_RETRIES < ++retries)
-    return TALER_EC_TIP_AUTHORIZE_DB_SOFT_ERROR;
+    return TALER_EC_TIP_PICKUP_DB_ERROR_SOFT;
   if (GNUNET_OK !=
       postgres_start (pg,
-                      "authorize tip"))
+                      "pickup tip"))
   {
     GNUNET_break (0);
-    return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+    return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
   }
-  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                 "lookup_tip_reserve_balance",
-                                                 params,
-                                                 rs);
+  qs = eval_prepared_singleton_select (pg,
+                                       "lookup_reserve_by_tip_id",
+                                       params,
+                                       rs);
   if (0 >= qs)
   {
-    /* reserve unknown */
+    /* tip ID unknown */
+    memset (reserve_priv,
+            0,
+            sizeof (*reserve_priv));
     postgres_rollback (pg);
+    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+      return TALER_EC_TIP_PICKUP_TIP_ID_UNKNOWN;
     if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
       goto RETRY;
-    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
-      return TALER_EC_TIP_AUTHORIZE_INSUFFICIENT_FUNDS;
-    return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
-  }
-  if (0 == GNUNET_TIME_absolute_get_remaining (old_expiration).rel_value_us)
-  {
-    /* reserve expired, can't be used */
-    postgres_rollback (pg);
-    return TALER_EC_TIP_AUTHORIZE_RESERVE_EXPIRED;
-  }
-  if (0 >
-      TALER_amount_subtract (&new_balance,
-                             &old_balance,
-                             amount))
-  {
-    /* insufficient funds left in reserve */
-    postgres_rollback (pg);
-    return TALER_EC_TIP_AUTHORIZE_INSUFFICIENT_FUNDS;
+    return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
   }
-  /* Update reserve balance */
+
+  /* Check if pickup_id already exists */
   {
+    struct TALER_Amount existing_amount;
     struct GNUNET_PQ_QueryParam params[] = {
-      GNUNET_PQ_query_param_auto_from_type (reserve_priv),
-      GNUNET_PQ_query_param_absolute_time (&old_expiration),
-      TALER_PQ_query_param_amount (&new_balance),
+      GNUNET_PQ_query_param_auto_from_type (pickup_id),
+      GNUNET_PQ_query_param_auto_from_type (tip_id),
       GNUNET_PQ_query_param_end
     };
+    struct GNUNET_PQ_ResultSpec rs[] = {
+      TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
+                                   &existing_amount),
+      GNUNET_PQ_result_spec_end
+    };
 
-    qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "update_tip_reserve_balance",
-                                             params);
+    qs = eval_prepared_singleton_select (pg,
+                                         "lookup_amount_by_pickup",
+                                         params,
+                                         rs);
     if (0 > qs)
     {
+      /* DB error */
+      memset (reserve_priv,
+              0,
+              sizeof (*reserve_priv));
       postgres_rollback (pg);
       if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
         goto RETRY;
-      return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+      return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+    }
+    if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
+    {
+      if (0 !=
+          TALER_amount_cmp (&existing_amount,
+                            amount))
+      {
+        GNUNET_break_op (0);
+        postgres_rollback (pg);
+        return TALER_EC_TIP_PICKUP_AMOUNT_CHANGED;
+      }
+      postgres_commit (pg);
+      return TALER_EC_NONE; /* we are done! */
     }
   }
-  /* Generate and store tip ID */
-  *expiration = old_expiration;
-  GNUNET_CRYPTO_hash_create_random (GNUNET_CRYPTO_QUALITY_STRONG,
-                                    tip_id);
+
+  /* Calculate new balance */
   {
-    struct GNUNET_TIME_Absolute now = GNUNET_TIME_absolute_get ();
-    struct GNUNET_PQ_QueryParam params[] = {
-      GNUNET_PQ_query_param_auto_from_type (reserve_priv),
-      GNUNET_PQ_query_param_auto_from_type (tip_id),
-      GNUNET_PQ_query_param_string (exchange_url),
-      GNUNET_PQ_query_param_string (justification),
-      TALER_PQ_query_param_json (extra),
-      GNUNET_PQ_query_param_absolute_time (&now),
-      TALER_PQ_query_param_amount (amount), /* overall amount */
-      TALER_PQ_query_param_amount (amount), /* amount left */
-      GNUNET_PQ_query_param_end
-    };
+    struct TALER_Amount new_left;
 
-    (void) GNUNET_TIME_round_abs (&now);
-    qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                             "insert_tip_justification",
-                                             params);
-    if (0 > qs)
+    if (0 >
+        TALER_amount_subtract (&new_left,
+                               &left_amount,
+                               amount))
     {
+      /* attempt to take more tips than the tipping amount */
+      GNUNET_break_op (0);
+      memset (reserve_priv,
+              0,
+              sizeof (*reserve_priv));
       postgres_rollback (pg);
-      if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-        goto RETRY;
-      return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+      return TALER_EC_TIP_PICKUP_NO_FUNDS;
+    }
+
+    /* Update DB: update balance */
+    {
+      struct GNUNET_PQ_QueryParam params[] = {
+        GNUNET_PQ_query_param_auto_from_type (tip_id),
+        TALER_PQ_query_param_amount (&new_left),
+        GNUNET_PQ_query_param_end
+      };
+
+      qs = eval_prepared_non_select (pg,
+                                     "update_tip_balance",
+                                     params);
+      if (0 > qs)
+      {
+        postgres_rollback (pg);
+        memset (reserve_priv,
+                0,
+                sizeof (*reserve_priv));
+        if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+          goto RETRY;
+        return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+      }
+    }
+
+    /* Update DB: remember pickup_id */
+    {
+      struct GNUNET_PQ_QueryParam params[] = {
+        GNUNET_PQ_query_param_auto_from_type (tip_id),
+        GNUNET_PQ_query_param_auto_from_type (pickup_id),
+        TALER_PQ_query_param_amount (amount),
+        GNUNET_PQ_query_param_end
+      };
+
+      qs = eval_prepared_non_select (pg,
+                                     "insert_pickup_id",
+                                     params);
+      if (0 > qs)
+      {
+        postgres_rollback (pg);
+        memset (reserve_priv,
+                0,
+                sizeof (*reserve_priv));
+        if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+          goto RETRY;
+        return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+      }
+    }
+  }
+  qs = postgres_commit (pg);
+  if (0 <= qs)
+    return TALER_EC_NONE; /* success  */
+  if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
+    goto RETRY;
+  return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+}
+
+
+/**
+ * Start a batch.
+ *
+ * @param cls closure
+ * @return the batch
+ */
+static struct TALER_MERCHANTDB_Batch *
+postgres_batch_start (void *cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct TALER_MERCHANTDB_Batch *batch;
+
+  batch = GNUNET_new (struct TALER_MERCHANTDB_Batch);
+  batch->b = PGA_batch_create (pg->async);
+  return batch;
+}
+
+
+/**
+ * Add prepared statement @a name with @a params to @a batch.
+ *
+ * @param batch batch to add to
+ * @param name name of the prepared statement
+ * @param params parameters for the statement
+ */
+static void
+batch_add (struct TALER_MERCHANTDB_Batch *batch,
+           const char *name,
+           const struct GNUNET_PQ_QueryParam *params)
+{
+  if (GNUNET_OK !=
+      PGA_batch_add (batch->b,
+                     name,
+                     params))
+  {
+    GNUNET_break (0);
+    batch->failed = GNUNET_YES;
+  }
+}
+
+
+/**
+ * Add #postgres_store_deposit() for the given arguments to @a batch.
+ *
+ * @param cls closure
+ * @param batch batch to add to
+ * @param h_contract_terms proposal data's hashcode
+ * @param merchant_pub merchant's public key
+ * @param coin_pub public key of the coin
+ * @param exchange_url URL of the exchange that issued @a coin_pub
+ * @param amount_with_fee amount the exchange will deposit for this coin
+ * @param deposit_fee fee the exchange will charge for this coin
+ * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee the exchange charges
+ * @param signkey_pub public key used by the exchange for @a exchange_proof
+ * @param exchange_proof proof from exchange that coin was accepted
+ */
+static void
+postgres_batch_store_deposit (void *cls,
+                              struct TALER_MERCHANTDB_Batch *batch,
+                              const struct GNUNET_HashCode *h_contract_terms,
+                              const struct
+                              TALER_MerchantPublicKeyP *merchant_pub,
+                              const struct TALER_CoinSpendPublicKeyP *coin_pub,
+                              const char *exchange_url,
+                              const struct TALER_Amount *amount_with_fee,
+                              const struct TALER_Amount *deposit_fee,
+                              const struct TALER_Amount *refund_fee,
+                              const struct TALER_Amount *wire_fee,
+                              const struct
+                              TALER_ExchangePublicKeyP *signkey_pub,
+                              const json_t *exchange_proof)
+{
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_auto_from_type (coin_pub),
+    GNUNET_PQ_query_param_string (exchange_url),
+    TALER_PQ_query_param_amount (amount_with_fee),
+    TALER_PQ_query_param_amount (deposit_fee),
+    TALER_PQ_query_param_amount (refund_fee),
+    TALER_PQ_query_param_amount (wire_fee),
+    GNUNET_PQ_query_param_auto_from_type (signkey_pub),
+    TALER_PQ_query_param_json (exchange_proof),
+    GNUNET_PQ_query_param_end
+  };
+
+  (void) cls;
+  batch_add (batch,
+             "insert_deposit",
+             params);
+}
+
+
+/**
+ * Execute all statements of @a batch in one transaction (retrying
+ * on serialization failures) and free @a batch.
+ *
+ * @param cls closure
+ * @param batch batch to execute
+ * @return transaction status, #GNUNET_DB_STATUS_HARD_ERROR
+ *         if adding a statement to @a batch failed
+ */
+static enum GNUNET_DB_QueryStatus
+postgres_batch_commit_TR (void *cls,
+                          struct TALER_MERCHANTDB_Batch *batch)
+{
+  struct PostgresClosure *pg = cls;
+  enum GNUNET_DB_QueryStatus qs;
+
+  qs = GNUNET_DB_STATUS_HARD_ERROR;
+  if (GNUNET_YES != batch->failed)
+  {
+    for (unsigned int r = 0; r<MAX_RETRIES; r++)
+    {
+      struct GNUNET_TIME_Absolute start = GNUNET_TIME_absolute_get ();
+
+      qs = PGA_batch_execute (batch->b);
+      record_statement (pg,
+                        BATCH_STATEMENT_NAME,
+                        start);
+      if (GNUNET_DB_STATUS_SOFT_ERROR != qs)
+        break;
     }
   }
-  qs = postgres_commit (pg);
-  if (0 <= qs)
-    return TALER_EC_NONE; /* success! */
-  if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-    goto RETRY;
-  return TALER_EC_TIP_AUTHORIZE_DB_HARD_ERROR;
+  PGA_batch_destroy (batch->b);
+  GNUNET_free (batch);
+  return qs;
+}
+
+
+/**
+ * Function called with the result of an asynchronous lookup of
+ * the frequently needed fields of contract terms.
+ *
+ * @param cls a `struct TALER_MERCHANTDB_AsyncHandle`
+ * @param result result from Postgres, NULL on failure
+ */
+static void
+contract_info_async_cb (void *cls,
+                        PGresult *result)
+{
+  struct TALER_MERCHANTDB_AsyncHandle *ah = cls;
+  enum GNUNET_DB_QueryStatus qs;
+
+  record_statement (ah->pg,
+                    ah->stmt,
+                    ah->start);
+  qs = PGA_result_to_qs (result,
+                         ah->stmt);
+  if (qs > GNUNET_DB_STATUS_SUCCESS_ONE_RESULT)
+  {
+    /* primary key violated!? */
+    GNUNET_break (0);
+    qs = GNUNET_DB_STATUS_HARD_ERROR;
+  }
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT != qs) ||
+       (GNUNET_OK !=
+        return_contract_info (ah->pg,
+                              result,
+                              GNUNET_YES,
+                              ah->info_cb,
+                              ah->cb_cls)) )
+    ah->info_cb (ah->cb_cls,
+                 (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
+                 ? GNUNET_DB_STATUS_HARD_ERROR
+                 : qs,
+                 NULL);
+  GNUNET_free (ah);
+}
+
+
+/**
+ * Start asynchronous lookup of the frequently needed fields of
+ * contract terms using prepared statement @a stmt.
+ *
+ * @param pg plugin state
+ * @param stmt name of the prepared statement
+ * @param params query parameters
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return handle for the operation, NULL on error
+ */
+static struct TALER_MERCHANTDB_AsyncHandle *
+start_contract_info_lookup (struct PostgresClosure *pg,
+                            const char *stmt,
+                            const struct GNUNET_PQ_QueryParam *params,
+                            TALER_MERCHANTDB_ContractInfoCallback cb,
+                            void *cb_cls)
+{
+  struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+  ah = GNUNET_new (struct TALER_MERCHANTDB_AsyncHandle);
+  ah->pg = pg;
+  ah->stmt = stmt;
+  ah->start = GNUNET_TIME_absolute_get ();
+  ah->info_cb = cb;
+  ah->cb_cls = cb_cls;
+  ah->q = PGA_query (pg->async,
+                     stmt,
+                     params,
+                     &contract_info_async_cb,
+                     ah);
+  if (NULL == ah->q)
+  {
+    GNUNET_break (0);
+    GNUNET_free (ah);
+    return NULL;
+  }
+  return ah;
 }
 
 
 /**
- * Find out tip authorization details associated with @a tip_id
+ * Asynchronously retrieve the frequently needed fields of
+ * contract terms given their order id.
  *
- * @param cls closure, typically a connection to the d
- * @param tip_id the unique ID for the tip
- * @param[out] exchange_url set to the URL of the exchange (unless NULL)
- * @param[out] extra extra data to pass to the wallet (unless NULL)
- * @param[out] amount set to the authorized amount (unless NULL)
- * @param[out] amount_left set to the amount left (unless NULL)
- * @param[out] timestamp set to the timestamp of the tip authorization (unless NULL)
- * @return transaction status, usually
- *      #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT for success
- *      #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if @a credit_uuid already known
+ * @param cls closure
+ * @param order_id order id used to perform the lookup
+ * @param merchant_pub instance's public key
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return handle to cancel the operation, NULL on error
  */
-static enum GNUNET_DB_QueryStatus
-postgres_lookup_tip_by_id (void *cls,
-                           const struct GNUNET_HashCode *tip_id,
-                           char **exchange_url,
-                           json_t **extra,
-                           struct TALER_Amount *amount,
-                           struct TALER_Amount *amount_left,
-                           struct GNUNET_TIME_Absolute *timestamp)
+static struct TALER_MERCHANTDB_AsyncHandle *
+postgres_find_contract_info_async (void *cls,
+                                   const char *order_id,
+                                   const struct
+                                   TALER_MerchantPublicKeyP *merchant_pub,
+                                   TALER_MERCHANTDB_ContractInfoCallback cb,
+                                   void *cb_cls)
 {
   struct PostgresClosure *pg = cls;
-  char *res_exchange_url;
-  json_t *res_extra;
-  struct TALER_Amount res_amount;
-  struct TALER_Amount res_amount_left;
-  struct GNUNET_TIME_Absolute res_timestamp;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (tip_id),
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
+    GNUNET_PQ_query_param_end
+  };
+
+  return start_contract_info_lookup (pg,
+                                     "find_contract_info",
+                                     params,
+                                     cb,
+                                     cb_cls);
+}
+
+
+/**
+ * Asynchronously retrieve the frequently needed fields of
+ * contract terms given their hashcode.
+ *
+ * @param cls closure
+ * @param h_contract_terms hashcode used to lookup
+ * @param merchant_pub instance's public key
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return handle to cancel the operation, NULL on error
+ */
+static struct TALER_MERCHANTDB_AsyncHandle *
+postgres_find_contract_info_from_hash_async (
+  void *cls,
+  const struct GNUNET_HashCode *h_contract_terms,
+  const struct TALER_MerchantPublicKeyP *merchant_pub,
+  TALER_MERCHANTDB_ContractInfoCallback cb,
+  void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_PQ_QueryParam params[] = {
+    GNUNET_PQ_query_param_auto_from_type (h_contract_terms),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
     GNUNET_PQ_query_param_end
   };
+
+  return start_contract_info_lookup (pg,
+                                     "find_contract_info_from_hash",
+                                     params,
+                                     cb,
+                                     cb_cls);
+}
+
+
+/**
+ * Process the result of an asynchronous lookup of claimed
+ * contract terms.  The contract terms are handed to the
+ * callback straight from @a result, without copying them.
+ *
+ * @param cls a `struct TALER_MERCHANTDB_AsyncHandle`
+ * @param result result from Postgres, NULL on failure
+ */
+static void
+claimed_contract_async_cb (void *cls,
+                           PGresult *result)
+{
+  struct TALER_MERCHANTDB_AsyncHandle *ah = cls;
+  enum GNUNET_DB_QueryStatus qs;
+  struct TALER_MERCHANTDB_ClaimedContract cc = { 0 };
+  char *nonce = NULL;
   struct GNUNET_PQ_ResultSpec rs[] = {
-    GNUNET_PQ_result_spec_string ("exchange_url",
-                                  &res_exchange_url),
-    GNUNET_PQ_result_spec_absolute_time ("timestamp",
-                                         &res_timestamp),
-    TALER_PQ_result_spec_json ("extra",
-                               &res_extra),
-    TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
-                                 &res_amount),
-    TALER_PQ_RESULT_SPEC_AMOUNT ("left",
-                                 &res_amount_left),
+    GNUNET_PQ_result_spec_auto_from_type ("h_contract_terms",
+                                          &cc.h_contract_terms),
+    GNUNET_PQ_result_spec_string ("nonce",
+                                  &nonce),
     GNUNET_PQ_result_spec_end
   };
-  enum GNUNET_DB_QueryStatus qs;
 
-  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                 "find_tip_by_id",
-                                                 params,
-                                                 rs);
-  if (0 >= qs)
+  record_statement (ah->pg,
+                    ah->stmt,
+                    ah->start);
+  qs = PGA_result_to_qs (result,
+                         ah->stmt);
+  if (qs > GNUNET_DB_STATUS_SUCCESS_ONE_RESULT)
   {
-    if (NULL != exchange_url)
-      *exchange_url = NULL;
-    return qs;
+    /* primary key violated!? */
+    GNUNET_break (0);
+    qs = GNUNET_DB_STATUS_HARD_ERROR;
   }
-  if (NULL != exchange_url)
-    *exchange_url = strdup (res_exchange_url);
-  if (NULL != amount)
-    *amount = res_amount;
-  if (NULL != amount_left)
-    *amount_left = res_amount_left;
-  if (NULL != timestamp)
-    *timestamp = res_timestamp;
-  if (NULL != extra)
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs) &&
+       (GNUNET_OK !=
+        GNUNET_PQ_extract_result (result,
+                                  rs,
+                                  0)) )
   {
-    json_incref (res_extra);
-    *extra = res_extra;
+    GNUNET_break (0);
+    qs = GNUNET_DB_STATUS_HARD_ERROR;
   }
-  GNUNET_PQ_cleanup_result (rs);
-  return qs;
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
+  {
+    int ct_off = PQfnumber (result,
+                            "contract_terms");
+    int sig_off = PQfnumber (result,
+                             "merchant_sig");
+
+    /* results are in binary format, so this is the BYTEA itself */
+    cc.contract_terms = PQgetvalue (result,
+                                    0,
+                                    ct_off);
+    cc.contract_terms_size = PQgetlength (result,
+                                          0,
+                                          ct_off);
+    cc.nonce = nonce;
+    /* the signature is NULL for contracts claimed before merchant-0004 */
+    if ( (! PQgetisnull (result,
+                         0,
+                         sig_off)) &&
+         (sizeof (cc.merchant_sig) == PQgetlength (result,
+                                                   0,
+                                                   sig_off)) )
+    {
+      cc.have_sig = GNUNET_YES;
+      memcpy (&cc.merchant_sig,
+              PQgetvalue (result,
+                          0,
+                          sig_off),
+              sizeof (cc.merchant_sig));
+    }
+  }
+  ah->claimed_cb (ah->cb_cls,
+                  qs,
+                  (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
+                  ? &cc
+                  : NULL);
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
+    GNUNET_PQ_cleanup_result (rs);
+  GNUNET_free (ah);
 }
 
 
 /**
- * Pickup a tip over @a amount using pickup id @a pickup_id.
+ * Asynchronously retrieve claimed contract terms given their
+ * order id.
  *
- * @param cls closure, typically a connection to the db
- * @param amount how high is the amount picked up (with fees)
- * @param tip_id the unique ID from the tip authorization
- * @param pickup_id the unique ID identifying the pick up operation
- *        (to allow replays, hash over the coin envelope and denomination key)
- * @param[out] reserve_priv which reserve key to use to sign
- * @return taler error code
- *      #TALER_EC_TIP_PICKUP_ID_UNKNOWN if @a tip_id is unknown
- *      #TALER_EC_TIP_PICKUP_NO_FUNDS if @a tip_id has insufficient funds left
- *      #TALER_EC_TIP_PICKUP_DB_ERROR_HARD on hard database errors
- *      #TALER_EC_TIP_PICKUP_AMOUNT_CHANGED if @a amount is different for known @a pickup_id
- *      #TALER_EC_TIP_PICKUP_DB_ERROR_SOFT on soft database errors (client should retry)
- *      #TALER_EC_NONE upon success (@a reserve_priv was set)
+ * @param cls closure
+ * @param order_id order id used to perform the lookup
+ * @param merchant_pub instance's public key
+ * @param cb function to call with the result
+ * @param cb_cls closure for @a cb
+ * @return handle to cancel the operation, NULL on error
  */
-static enum TALER_ErrorCode
-postgres_pickup_tip_TR (void *cls,
-                        const struct TALER_Amount *amount,
-                        const struct GNUNET_HashCode *tip_id,
-                        const struct GNUNET_HashCode *pickup_id,
-                        struct TALER_ReservePrivateKeyP *reserve_priv)
+static struct TALER_MERCHANTDB_AsyncHandle *
+postgres_find_claimed_contract_async (
+  void *cls,
+  const char *order_id,
+  const struct TALER_MerchantPublicKeyP *merchant_pub,
+  TALER_MERCHANTDB_ClaimedContractCallback cb,
+  void *cb_cls)
 {
   struct PostgresClosure *pg = cls;
-  struct TALER_Amount left_amount;
   struct GNUNET_PQ_QueryParam params[] = {
-    GNUNET_PQ_query_param_auto_from_type (tip_id),
+    GNUNET_PQ_query_param_string (order_id),
+    GNUNET_PQ_query_param_auto_from_type (merchant_pub),
     GNUNET_PQ_query_param_end
   };
-  struct GNUNET_PQ_ResultSpec rs[] = {
-    GNUNET_PQ_result_spec_auto_from_type ("reserve_priv",
-                                          reserve_priv),
-    TALER_PQ_RESULT_SPEC_AMOUNT ("left",
-                                 &left_amount),
-    GNUNET_PQ_result_spec_end
-  };
-  enum GNUNET_DB_QueryStatus qs;
-  unsigned int retries;
-
-  retries = 0;
-  check_connection (pg);
-RETRY:
-  if (MAX_RETRIES < ++retries)
-    return TALER_EC_TIP_PICKUP_DB_ERROR_SOFT;
-  if (GNUNET_OK !=
-      postgres_start (pg,
-                      "pickup tip"))
+  struct TALER_MERCHANTDB_AsyncHandle *ah;
+
+  ah = GNUNET_new (struct TALER_MERCHANTDB_AsyncHandle);
+  ah->pg = pg;
+  ah->stmt = "find_claimed_contract";
+  ah->start = GNUNET_TIME_absolute_get ();
+  ah->claimed_cb = cb;
+  ah->cb_cls = cb_cls;
+  ah->q = PGA_query (pg->async,
+                     ah->stmt,
+                     params,
+                     &claimed_contract_async_cb,
+                     ah);
+  if (NULL == ah->q)
   {
     GNUNET_break (0);
-    return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+    GNUNET_free (ah);
+    return NULL;
   }
-  qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                 "lookup_reserve_by_tip_id",
-                                                 params,
-                                                 rs);
-  if (0 >= qs)
+  return ah;
+}
+
+
+/**
+ * Cancel asynchronous operation.
+ *
+ * @param cls closure
+ * @param ah operation to cancel
+ */
+static void
+postgres_async_cancel (void *cls,
+                       struct TALER_MERCHANTDB_AsyncHandle *ah)
+{
+  (void) cls;
+  PGA_query_cancel (ah->q);
+  GNUNET_free (ah);
+}
+
+
+/**
+ * Obtain statistics about the connection pool used for
+ * asynchronous operations.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param[out] stats set to the current statistics
+ */
+static void
+postgres_get_pool_statistics (void *cls,
+                              struct TALER_MERCHANTDB_PoolStatistics *stats)
+{
+  struct PostgresClosure *pg = cls;
+  struct PGA_Statistics ps;
+
+  PGA_get_statistics (pg->async,
+                      &ps);
+  stats->queries = ps.queries;
+  stats->total_wait = ps.total_wait;
+  stats->max_wait = ps.max_wait;
+  stats->queue_length = ps.queue_length;
+  stats->max_queue_length = ps.max_queue_length;
+  stats->busy = ps.busy;
+  stats->size = ps.size;
+}
+
+
+/**
+ * Obtain latency statistics for all prepared statements that
+ * were executed at least once.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param cb function to call for each statement
+ * @param cb_cls closure for @a cb
+ */
+static void
+postgres_iterate_statement_statistics (
+  void *cls,
+  TALER_MERCHANTDB_StatementStatisticsCallback cb,
+  void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+
+  for (unsigned int i = 0; i<pg->num_stmt_stats; i++)
   {
-    /* tip ID unknown */
-    memset (reserve_priv,
-            0,
-            sizeof (*reserve_priv));
-    postgres_rollback (pg);
-    if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
-      return TALER_EC_TIP_PICKUP_TIP_ID_UNKNOWN;
-    if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-      goto RETRY;
-    return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+    const struct StatementStatistics *ss = &pg->stmt_stats[i];
+
+    if (0 == ss->calls)
+      continue;
+    cb (cb_cls,
+        ss->name,
+        ss->calls,
+        ss->total,
+        ss->max);
   }
+}
 
-  /* Check if pickup_id already exists */
-  {
-    struct TALER_Amount existing_amount;
-    struct GNUNET_PQ_QueryParam params[] = {
-      GNUNET_PQ_query_param_auto_from_type (pickup_id),
-      GNUNET_PQ_query_param_auto_from_type (tip_id),
-      GNUNET_PQ_query_param_end
-    };
-    struct GNUNET_PQ_ResultSpec rs[] = {
-      TALER_PQ_RESULT_SPEC_AMOUNT ("amount",
-                                   &existing_amount),
-      GNUNET_PQ_result_spec_end
-    };
 
-    qs = GNUNET_PQ_eval_prepared_singleton_select (pg->conn,
-                                                   "lookup_amount_by_pickup",
-                                                   params,
-                                                   rs);
-    if (0 > qs)
-    {
-      /* DB error */
-      memset (reserve_priv,
-              0,
-              sizeof (*reserve_priv));
-      postgres_rollback (pg);
-      if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-        goto RETRY;
-      return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
-    }
-    if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs)
-    {
-      if (0 !=
-          TALER_amount_cmp (&existing_amount,
-                            amount))
-      {
-        GNUNET_break_op (0);
-        postgres_rollback (pg);
-        return TALER_EC_TIP_PICKUP_AMOUNT_CHANGED;
-      }
-      postgres_commit (pg);
-      return TALER_EC_NONE; /* we are done! */
-    }
+/**
+ * Process the result of sending a payment event notification.
+ *
+ * @param cls a `struct PaymentNotification`
+ * @param result result from Postgres, NULL on failure
+ */
+static void
+notify_payment_event_cb (void *cls,
+                         PGresult *result)
+{
+  struct PaymentNotification *pn = cls;
+  struct PostgresClosure *pg = pn->pg;
+
+  record_statement (pg,
+                    "notify_payment_event",
+                    pn->start);
+  if (0 > PGA_result_to_qs (result,
+                            "notify_payment_event"))
+    GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                "Failed to notify other processes about payment event\n");
+  GNUNET_CONTAINER_DLL_remove (pg->pn_head,
+                               pg->pn_tail,
+                               pn);
+  GNUNET_free (pn);
+}
+
+
+/**
+ * Tell all processes listening on the database that a payment or
+ * refund was recorded for the order identified by @a key.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param key key identifying the order
+ * @param refund_amount total refunded amount if the event is a
+ *        refund, NULL for payments
+ */
+static void
+postgres_notify_payment_event (void *cls,
+                               const struct GNUNET_HashCode *key,
+                               const struct TALER_Amount *refund_amount)
+{
+  struct PostgresClosure *pg = cls;
+  struct PaymentNotification *pn;
+  char *ks;
+  char *payload;
+
+  ks = GNUNET_STRINGS_data_to_string_alloc (key,
+                                            sizeof (*key));
+  if (NULL == refund_amount)
+  {
+    GNUNET_asprintf (&payload,
+                     "%s %s",
+                     pg->origin,
+                     ks);
+  }
+  else
+  {
+    char *as;
+
+    as = TALER_amount_to_string (refund_amount);
+    GNUNET_asprintf (&payload,
+                     "%s %s %s",
+                     pg->origin,
+                     ks,
+                     as);
+    GNUNET_free (as);
   }
+  GNUNET_free (ks);
+  {
+    struct GNUNET_PQ_QueryParam params[] = {
+      GNUNET_PQ_query_param_string (PAYMENT_EVENT_CHANNEL),
+      GNUNET_PQ_query_param_string (payload),
+      GNUNET_PQ_query_param_end
+    };
 
-  /* Calculate new balance */
+    pn = GNUNET_new (struct PaymentNotification);
+    pn->pg = pg;
+    pn->start = GNUNET_TIME_absolute_get ();
+    pn->q = PGA_query (pg->async,
+                       "notify_payment_event",
+                       params,
+                       &notify_payment_event_cb,
+                       pn);
+  }
+  GNUNET_free (payload);
+  if (NULL == pn->q)
   {
-    struct TALER_Amount new_left;
+    GNUNET_break (0);
+    GNUNET_free (pn);
+    return;
+  }
+  GNUNET_CONTAINER_DLL_insert (pg->pn_head,
+                               pg->pn_tail,
+                               pn);
+}
 
-    if (0 >
-        TALER_amount_subtract (&new_left,
-                               &left_amount,
-                               amount))
-    {
-      /* attempt to take more tips than the tipping amount */
-      GNUNET_break_op (0);
-      memset (reserve_priv,
-              0,
-              sizeof (*reserve_priv));
-      postgres_rollback (pg);
-      return TALER_EC_TIP_PICKUP_NO_FUNDS;
-    }
 
-    /* Update DB: update balance */
-    {
-      struct GNUNET_PQ_QueryParam params[] = {
-        GNUNET_PQ_query_param_auto_from_type (tip_id),
-        TALER_PQ_query_param_amount (&new_left),
-        GNUNET_PQ_query_param_end
-      };
+/**
+ * Parse a notification on the payment event channel and pass it on
+ * to the application, unless we sent it ourselves.
+ *
+ * @param cls a `struct PostgresClosure`
+ * @param payload payload of the notification, NULL if
+ *        notifications may have been lost
+ */
+static void
+payment_event_cb (void *cls,
+                  const char *payload)
+{
+  struct PostgresClosure *pg = cls;
+  struct GNUNET_HashCode key;
+  struct TALER_Amount refund_amount;
+  const char *ks;
+  const char *as;
 
-      qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                               "update_tip_balance",
-                                               params);
-      if (0 > qs)
-      {
-        postgres_rollback (pg);
-        memset (reserve_priv,
-                0,
-                sizeof (*reserve_priv));
-        if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-          goto RETRY;
-        return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
-      }
-    }
+  if (NULL == payload)
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                "Reconnected to database, payment events may have been lost\n");
+    pg->event_cb (pg->event_cb_cls,
+                  NULL,
+                  NULL);
+    return;
+  }
+  ks = strchr (payload,
+               ' ');
+  if (NULL == ks)
+  {
+    GNUNET_break_op (0);
+    return;
+  }
+  if ( ((size_t) (ks - payload) == strlen (pg->origin)) &&
+       (0 == strncmp (payload,
+                      pg->origin,
+                      ks - payload)) )
+    return; /* our own */
+  ks++;
+  as = strchr (ks,
+               ' ');
+  if ( (GNUNET_OK !=
+        GNUNET_STRINGS_string_to_data (ks,
+                                       (NULL == as)
+                                       ? strlen (ks)
+                                       : (size_t) (as - ks),
+                                       &key,
+                                       sizeof (key))) ||
+       ( (NULL != as) &&
+         (GNUNET_OK !=
+          TALER_string_to_amount (as + 1,
+                                  &refund_amount)) ) )
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_WARNING,
+                "Malformed payment event `%s'\n",
+                payload);
+    return;
+  }
+  pg->event_cb (pg->event_cb_cls,
+                &key,
+                (NULL == as)
+                ? NULL
+                : &refund_amount);
+}
 
-    /* Update DB: remember pickup_id */
-    {
-      struct GNUNET_PQ_QueryParam params[] = {
-        GNUNET_PQ_query_param_auto_from_type (tip_id),
-        GNUNET_PQ_query_param_auto_from_type (pickup_id),
-        TALER_PQ_query_param_amount (amount),
-        GNUNET_PQ_query_param_end
-      };
 
-      qs = GNUNET_PQ_eval_prepared_non_select (pg->conn,
-                                               "insert_pickup_id",
-                                               params);
-      if (0 > qs)
-      {
-        postgres_rollback (pg);
-        memset (reserve_priv,
-                0,
-                sizeof (*reserve_priv));
-        if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-          goto RETRY;
-        return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
-      }
-    }
-  }
-  qs = postgres_commit (pg);
-  if (0 <= qs)
-    return TALER_EC_NONE; /* success  */
-  if (GNUNET_DB_STATUS_SOFT_ERROR == qs)
-    goto RETRY;
-  return TALER_EC_TIP_PICKUP_DB_ERROR_HARD;
+/**
+ * Start listening for payment events sent by other processes.
+ *
+ * @param cls closure, typically a connection to the db
+ * @param cb function to call for each event
+ * @param cb_cls closure for @a cb
+ */
+static void
+postgres_listen_payment_events (void *cls,
+                                TALER_MERCHANTDB_PaymentEventCallback cb,
+                                void *cb_cls)
+{
+  struct PostgresClosure *pg = cls;
+
+  GNUNET_break (NULL == pg->listener);
+  if (NULL != pg->listener)
+    return;
+  pg->event_cb = cb;
+  pg->event_cb_cls = cb_cls;
+  pg->listener = PGA_listen (pg->async,
+                             PAYMENT_EVENT_CHANNEL,
+                             &payment_event_cb,
+                             pg);
 }
 
 
@@ -3125,6 +5127,48 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
   struct PostgresClosure *pg;
   struct TALER_MERCHANTDB_Plugin *plugin;
   struct GNUNET_PQ_PreparedStatement ps[] = {
+    GNUNET_PQ_make_prepare ("create_partitions",
+                            "SELECT"
+                            " merchant_create_partitions ($1, $2) AS created",
+                            2),
+    GNUNET_PQ_make_prepare ("archive_partitions",
+                            "SELECT"
+                            " merchant_archive_partitions ($1) AS archived",
+                            1),
+    /* The GC statements delete in batches and skip rows locked
+       by concurrent requests, so they hold their locks only briefly
+       and never wait for a request to finish. */
+    GNUNET_PQ_make_prepare ("gc_claimed_orders",
+                            "DELETE FROM merchant_orders"
+                            " WHERE ctid IN"
+                            " (SELECT o.ctid"
+                            "    FROM merchant_orders o"
+                            "   WHERE EXISTS"
+                            "     (SELECT 1"
+                            "        FROM merchant_contract_terms c"
+                            "       WHERE c.order_id=o.order_id"
+                            "         AND c.merchant_pub=o.merchant_pub)"
+                            "   LIMIT $1"
+                            "   FOR UPDATE SKIP LOCKED)",
+                            1),
+    GNUNET_PQ_make_prepare ("gc_expired_orders",
+                            "DELETE FROM merchant_orders"
+                            " WHERE ctid IN"
+                            " (SELECT ctid"
+                            "    FROM merchant_orders"
+                            "   WHERE pay_deadline<$1"
+                            "   LIMIT $2"
+                            "   FOR UPDATE SKIP LOCKED)",
+                            2),
+    GNUNET_PQ_make_prepare ("gc_sessions",
+                            "DELETE FROM merchant_session_info"
+                            " WHERE ctid IN"
+                            " (SELECT ctid"
+                            "    FROM merchant_session_info"
+                            "   WHERE timestamp<$1"
+                            "   LIMIT $2"
+                            "   FOR UPDATE SKIP LOCKED)",
+                            2),
     GNUNET_PQ_make_prepare ("insert_deposit",
                             "INSERT INTO merchant_deposits"
                             "(h_contract_terms"
@@ -3140,16 +5184,54 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",wire_fee_val"
                             ",wire_fee_frac"
                             ",signkey_pub"
-                            ",exchange_proof) VALUES "
-                            "($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14)",
+                            ",exchange_proof"
+                            ",contract_timestamp) VALUES "
+                            "($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14"
+                            /* NULL (and thus failing) if the contract
+                               is unknown or archived */
+                            ",(SELECT timestamp"
+                            "    FROM merchant_contract_terms"
+                            "   WHERE h_contract_terms=$1"
+                            "     AND merchant_pub=$2))"
+                            " ON CONFLICT DO NOTHING",
                             14),
     GNUNET_PQ_make_prepare ("insert_transfer",
                             "INSERT INTO merchant_transfers"
                             "(h_contract_terms"
                             ",coin_pub"
-                            ",wtid) VALUES "
-                            "($1, $2, $3)",
+                            ",wtid"
+                            ",contract_timestamp) VALUES "
+                            "($1, $2, $3"
+                            ",COALESCE ((SELECT timestamp"
+                            "              FROM merchant_contract_terms"
+                            "             WHERE h_contract_terms=$1"
+                            "             LIMIT 1), 0))"
+                            " ON CONFLICT DO NOTHING",
                             3),
+    /* The keys are passed as concatenations of fixed-size values
+       as libgnunetpq cannot bind arrays. */
+    GNUNET_PQ_make_prepare ("insert_transfers",
+                            "INSERT INTO merchant_transfers"
+                            "(h_contract_terms"
+                            ",coin_pub"
+                            ",wtid"
+                            ",contract_timestamp)"
+                            " SELECT"
+                            " k.h_contract_terms"
+                            ",k.coin_pub"
+                            ",$1"
+                            ",COALESCE ((SELECT c.timestamp"
+                            "              FROM merchant_contract_terms c"
+                            "             WHERE c.h_contract_terms=k.h_contract_terms"
+                            "             LIMIT 1), 0)"
+                            " FROM (SELECT"
+                            "   SUBSTRING($2::BYTEA FROM 64*i+1 FOR 64)"
+                            "     AS h_contract_terms"
+                            "  ,SUBSTRING($3::BYTEA FROM 32*i+1 FOR 32)"
+                            "     AS coin_pub"
+                            "   FROM generate_series(0, $4::INT4-1) AS i) k"
+                            " ON CONFLICT DO NOTHING",
+                            4),
     GNUNET_PQ_make_prepare ("insert_refund",
                             "INSERT INTO merchant_refunds"
                             "(merchant_pub"
@@ -3158,8 +5240,13 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",reason"
                             ",refund_amount_val"
                             ",refund_amount_frac"
-                            ") VALUES"
-                            "($1, $2, $3, $4, $5, $6)",
+                            ",contract_timestamp)"
+                            " SELECT"
+                            " $1, $2, $3, $4, $5, $6"
+                            ",timestamp"
+                            " FROM merchant_contract_terms"
+                            " WHERE h_contract_terms=$2"
+                            "   AND merchant_pub=$1",
                             6),
     GNUNET_PQ_make_prepare ("insert_proof",
                             "INSERT INTO merchant_proofs"
@@ -3176,18 +5263,39 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",merchant_pub"
                             ",timestamp"
                             ",contract_terms"
-                            ",h_contract_terms)"
+                            ",h_contract_terms"
+                            ",nonce)"
                             " VALUES "
-                            "($1, $2, $3, $4, $5)",
-                            5),
+                            "($1, $2, $3, $4, $5, $6)",
+                            6),
+    GNUNET_PQ_make_prepare ("insert_claimed_contract",
+                            "INSERT INTO merchant_contract_terms"
+                            "(order_id"
+                            ",merchant_pub"
+                            ",timestamp"
+                            ",contract_terms"
+                            ",h_contract_terms"
+                            ",nonce"
+                            ",merchant_sig)"
+                            " VALUES "
+                            "($1, $2, $3, $4, $5, $6, $7)",
+                            7),
+    /* Inserts nothing if the order ID exists.  Claimed orders may
+       have been garbage collected and their contract terms archived,
+       so also check the order IDs of all contracts ever claimed. */
     GNUNET_PQ_make_prepare ("insert_order",
                             "INSERT INTO merchant_orders"
                             "(order_id"
                             ",merchant_pub"
                             ",timestamp"
                             ",contract_terms)"
-                            " VALUES "
-                            "($1, $2, $3, $4)",
+                            " SELECT $1, $2, $3, $4"
+                            " WHERE NOT EXISTS"
+                            "  (SELECT 1"
+                            "     FROM merchant_order_ids"
+                            "    WHERE order_id=$1"
+                            "      AND merchant_pub=$2)"
+                            " ON CONFLICT DO NOTHING",
                             4),
     GNUNET_PQ_make_prepare ("insert_session_info",
                             "INSERT INTO merchant_session_info"
@@ -3199,6 +5307,14 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " VALUES "
                             "($1, $2, $3, $4, $5)",
                             5),
+    GNUNET_PQ_make_prepare ("pay_commit",
+                            "SELECT"
+                            " out_status"
+                            ",out_refunded_val"
+                            ",out_refunded_frac"
+                            " FROM merchant_do_pay"
+                            "($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11)",
+                            11),
     GNUNET_PQ_make_prepare ("mark_proposal_paid",
                             "UPDATE merchant_contract_terms SET"
                             " paid=TRUE"
@@ -3241,6 +5357,20 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " WHERE h_contract_terms=$1"
                             "   AND merchant_pub=$2",
                             2),
+    GNUNET_PQ_make_prepare ("find_order_ids_by_hashes",
+                            "SELECT"
+                            " k.h_off"
+                            ",c.order_id"
+                            " FROM (SELECT"
+                            "   i AS h_off"
+                            "  ,SUBSTRING($2::BYTEA FROM 64*i+1 FOR 64)"
+                            "     AS h_contract_terms"
+                            "   FROM generate_series(0, $3::INT4-1) AS i) k"
+                            " JOIN merchant_contract_terms c"
+                            "   USING (h_contract_terms)"
+                            " WHERE c.merchant_pub=$1"
+                            " ORDER BY k.h_off",
+                            3),
     GNUNET_PQ_make_prepare ("find_paid_contract_terms_from_hash",
                             "SELECT"
                             " contract_terms"
@@ -3252,6 +5382,9 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
     GNUNET_PQ_make_prepare ("end_transaction",
                             "COMMIT",
                             0),
+    GNUNET_PQ_make_prepare ("notify_payment_event",
+                            "SELECT pg_notify($1, $2)",
+                            2),
 
     GNUNET_PQ_make_prepare ("find_refunds",
                             "SELECT"
@@ -3277,6 +5410,26 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " order_id=$1"
                             " AND merchant_pub=$2",
                             2),
+    GNUNET_PQ_make_prepare ("find_contract_terms_with_hash",
+                            "SELECT"
+                            " contract_terms"
+                            ",h_contract_terms"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " order_id=$1"
+                            " AND merchant_pub=$2",
+                            2),
+    GNUNET_PQ_make_prepare ("find_claimed_contract",
+                            "SELECT"
+                            " contract_terms"
+                            ",h_contract_terms"
+                            ",nonce"
+                            ",merchant_sig"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " order_id=$1"
+                            " AND merchant_pub=$2",
+                            2),
     GNUNET_PQ_make_prepare ("find_order",
                             "SELECT"
                             " contract_terms"
@@ -3285,6 +5438,45 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " order_id=$1"
                             " AND merchant_pub=$2",
                             2),
+    GNUNET_PQ_make_prepare ("find_order_info",
+                            "SELECT"
+                            " fulfillment_url"
+                            ",summary"
+                            ",amount_val"
+                            ",amount_frac"
+                            ",refund_deadline"
+                            " FROM merchant_orders"
+                            " WHERE"
+                            " order_id=$1"
+                            " AND merchant_pub=$2",
+                            2),
+    GNUNET_PQ_make_prepare ("find_contract_info",
+                            "SELECT"
+                            " fulfillment_url"
+                            ",summary"
+                            ",amount_val"
+                            ",amount_frac"
+                            ",refund_deadline"
+                            ",h_contract_terms"
+                            ",paid::INT4 AS paid"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " order_id=$1"
+                            " AND merchant_pub=$2",
+                            2),
+    GNUNET_PQ_make_prepare ("find_contract_info_from_hash",
+                            "SELECT"
+                            " fulfillment_url"
+                            ",summary"
+                            ",amount_val"
+                            ",amount_frac"
+                            ",refund_deadline"
+                            ",h_contract_terms"
+                            ",paid::INT4 AS paid"
+                            " FROM merchant_contract_terms"
+                            " WHERE h_contract_terms=$1"
+                            "   AND merchant_pub=$2",
+                            2),
     GNUNET_PQ_make_prepare ("find_session_info",
                             "SELECT"
                             " order_id"
@@ -3320,7 +5512,9 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " FROM merchant_refunds"
                             "   JOIN merchant_deposits USING (merchant_pub, coin_pub)"
                             " WHERE merchant_refunds.merchant_pub=$1"
-                            "   AND merchant_refunds.h_contract_terms=$2",
+                            "   AND merchant_refunds.h_contract_terms=$2"
+                            "   AND merchant_refunds.contract_timestamp="
+                            CONTRACT_TIMESTAMP ("$2", "$1"),
                             2),
     GNUNET_PQ_make_prepare ("get_refund_proof",
                             "SELECT"
@@ -3331,7 +5525,9 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " h_contract_terms=$1"
                             " AND merchant_pub=$2"
                             " AND coin_pub=$3"
-                            " AND rtransaction_id=$4",
+                            " AND rtransaction_id=$4"
+                            " AND contract_timestamp="
+                            CONTRACT_TIMESTAMP ("$1", "$2"),
                             4),
     GNUNET_PQ_make_prepare ("insert_refund_proof",
                             "INSERT INTO merchant_refund_proofs"
@@ -3340,9 +5536,14 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",h_contract_terms"
                             ",coin_pub"
                             ",exchange_sig"
-                            ",exchange_pub)"
-                            " VALUES "
-                            "($1, $2, $3, $4, $5, $6)",
+                            ",exchange_pub"
+                            ",contract_timestamp)"
+                            " SELECT"
+                            " $1, $2, $3, $4, $5, $6"
+                            ",timestamp"
+                            " FROM merchant_contract_terms"
+                            " WHERE h_contract_terms=$3"
+                            "   AND merchant_pub=$2",
                             6),
     GNUNET_PQ_make_prepare ("find_contract_terms_by_date_and_range_asc",
                             "SELECT"
@@ -3400,6 +5601,66 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " ORDER BY row_id DESC, timestamp DESC"
                             " LIMIT $4",
                             4),
+    GNUNET_PQ_make_prepare ("find_contract_terms_by_date_and_row_range_asc",
+                            "SELECT"
+                            " contract_terms"
+                            ",order_id"
+                            ",row_id"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " timestamp>$1"
+                            " AND merchant_pub=$2"
+                            " AND row_id>$3"
+                            " AND row_id<$4"
+                            " AND paid=TRUE"
+                            " ORDER BY row_id ASC"
+                            " LIMIT $5",
+                            5),
+    GNUNET_PQ_make_prepare ("find_contract_terms_by_date_and_row_range",
+                            "SELECT"
+                            " contract_terms"
+                            ",order_id"
+                            ",row_id"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " timestamp>$1"
+                            " AND merchant_pub=$2"
+                            " AND row_id>$3"
+                            " AND row_id<$4"
+                            " AND paid=TRUE"
+                            " ORDER BY row_id DESC"
+                            " LIMIT $5",
+                            5),
+    GNUNET_PQ_make_prepare ("find_contract_terms_by_date_and_row_range_past_asc",
+                            "SELECT"
+                            " contract_terms"
+                            ",order_id"
+                            ",row_id"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " timestamp<$1"
+                            " AND merchant_pub=$2"
+                            " AND row_id>$3"
+                            " AND row_id<$4"
+                            " AND paid=TRUE"
+                            " ORDER BY row_id ASC"
+                            " LIMIT $5",
+                            5),
+    GNUNET_PQ_make_prepare ("find_contract_terms_by_date_and_row_range_past",
+                            "SELECT"
+                            " contract_terms"
+                            ",order_id"
+                            ",row_id"
+                            " FROM merchant_contract_terms"
+                            " WHERE"
+                            " timestamp<$1"
+                            " AND merchant_pub=$2"
+                            " AND row_id>$3"
+                            " AND row_id<$4"
+                            " AND paid=TRUE"
+                            " ORDER BY row_id DESC"
+                            " LIMIT $5",
+                            5),
     GNUNET_PQ_make_prepare ("find_deposits",
                             "SELECT"
                             " coin_pub"
@@ -3415,7 +5676,9 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",exchange_proof"
                             " FROM merchant_deposits"
                             " WHERE h_contract_terms=$1"
-                            " AND merchant_pub=$2",
+                            " AND merchant_pub=$2"
+                            " AND contract_timestamp="
+                            CONTRACT_TIMESTAMP ("$1", "$2"),
                             2),
     GNUNET_PQ_make_prepare ("find_deposits_by_hash_and_coin",
                             "SELECT"
@@ -3432,8 +5695,40 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             " FROM merchant_deposits"
                             " WHERE h_contract_terms=$1"
                             " AND merchant_pub=$2"
-                            " AND coin_pub=$3",
+                            " AND coin_pub=$3"
+                            " AND contract_timestamp="
+                            CONTRACT_TIMESTAMP ("$1", "$2"),
                             3),
+    GNUNET_PQ_make_prepare ("find_deposits_by_coins",
+                            "SELECT"
+                            " k.coin_off"
+                            ",d.amount_with_fee_val"
+                            ",d.amount_with_fee_frac"
+                            ",d.deposit_fee_val"
+                            ",d.deposit_fee_frac"
+                            ",d.refund_fee_val"
+                            ",d.refund_fee_frac"
+                            ",d.wire_fee_val"
+                            ",d.wire_fee_frac"
+                            ",d.exchange_url"
+                            ",d.exchange_proof"
+                            " FROM (SELECT"
+                            "   i AS coin_off"
+                            "  ,SUBSTRING($2::BYTEA FROM 64*i+1 FOR 64)"
+                            "     AS h_contract_terms"
+                            "  ,SUBSTRING($3::BYTEA FROM 32*i+1 FOR 32)"
+                            "     AS coin_pub"
+                            "   FROM generate_series(0, $4::INT4-1) AS i) k"
+                            " JOIN merchant_contract_terms c"
+                            "   ON (c.h_contract_terms=k.h_contract_terms"
+                            "       AND c.merchant_pub=$1)"
+                            " JOIN merchant_deposits d"
+                            "   ON (d.h_contract_terms=k.h_contract_terms"
+                            "       AND d.coin_pub=k.coin_pub"
+                            "       AND d.contract_timestamp=c.timestamp)"
+                            " WHERE d.merchant_pub=$1"
+                            " ORDER BY k.coin_off",
+                            4),
     GNUNET_PQ_make_prepare ("find_transfers_by_hash",
                             "SELECT"
                             " coin_pub"
@@ -3442,7 +5737,12 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",merchant_proofs.proof"
                             " FROM merchant_transfers"
                             "   JOIN merchant_proofs USING (wtid)"
-                            " WHERE h_contract_terms=$1",
+                            " WHERE h_contract_terms=$1"
+                            "   AND contract_timestamp=COALESCE ("
+                            "     (SELECT timestamp"
+                            "        FROM merchant_contract_terms"
+                            "       WHERE h_contract_terms=$1"
+                            "       LIMIT 1), 0)",
                             1),
     GNUNET_PQ_make_prepare ("find_deposits_by_wtid",
                             "SELECT"
@@ -3460,7 +5760,7 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
                             ",merchant_deposits.exchange_proof"
                             " FROM merchant_transfers"
                             "   JOIN merchant_deposits"
-                            "     USING (h_contract_terms,coin_pub)"
+                            "     USING (h_contract_terms,coin_pub,contract_timestamp)"
                             " WHERE wtid=$1",
                             1),
     GNUNET_PQ_make_prepare ("find_proof_by_wtid",
@@ -3614,30 +5914,98 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
     GNUNET_free (pg);
     return NULL;
   }
+  {
+    char *conninfo;
+    unsigned long long pool_size;
+
+    if (GNUNET_OK !=
+        GNUNET_CONFIGURATION_get_value_string (cfg,
+                                               "merchantdb-postgres",
+                                               "CONFIG",
+                                               &conninfo))
+      conninfo = GNUNET_strdup ("");
+    if (GNUNET_OK !=
+        GNUNET_CONFIGURATION_get_value_number (cfg,
+                                               "merchantdb-postgres",
+                                               "POOL_SIZE",
+                                               &pool_size))
+      pool_size = 4;
+    if ( (0 == pool_size) ||
+         (pool_size > 1024) )
+    {
+      GNUNET_log_config_invalid (GNUNET_ERROR_TYPE_ERROR,
+                                 "merchantdb-postgres",
+                                 "POOL_SIZE",
+                                 "must be between 1 and 1024");
+      GNUNET_free (conninfo);
+      GNUNET_PQ_disconnect (pg->conn);
+      GNUNET_free (pg->sql_dir);
+      GNUNET_free (pg->currency);
+      GNUNET_free (pg);
+      return NULL;
+    }
+    pg->async = PGA_connect (conninfo,
+                             (unsigned int) pool_size,
+                             ps);
+    GNUNET_free (conninfo);
+  }
+  while (NULL != ps[pg->num_stmt_stats].name)
+    pg->num_stmt_stats++;
+  /* one more for batches */
+  pg->stmt_stats = GNUNET_new_array (pg->num_stmt_stats + 1,
+                                     struct StatementStatistics);
+  for (unsigned int i = 0; i<pg->num_stmt_stats; i++)
+    pg->stmt_stats[i].name = ps[i].name;
+  pg->stmt_stats[pg->num_stmt_stats++].name = BATCH_STATEMENT_NAME;
+  qsort (pg->stmt_stats,
+         pg->num_stmt_stats,
+         sizeof (struct StatementStatistics),
+         &cmp_statement_statistics);
+  GNUNET_snprintf (pg->origin,
+                   sizeof (pg->origin),
+                   "%016llx",
+                   (unsigned long long) GNUNET_CRYPTO_random_u64 (
+                     GNUNET_CRYPTO_QUALITY_NONCE,
+                     UINT64_MAX));
   plugin = GNUNET_new (struct TALER_MERCHANTDB_Plugin);
   plugin->cls = pg;
   plugin->drop_tables = &postgres_drop_tables;
   plugin->store_deposit = &postgres_store_deposit;
   plugin->store_coin_to_transfer = &postgres_store_coin_to_transfer;
+  plugin->store_coins_to_transfer = &postgres_store_coins_to_transfer;
   plugin->store_transfer_to_proof = &postgres_store_transfer_to_proof;
   plugin->store_wire_fee_by_exchange = &postgres_store_wire_fee_by_exchange;
   plugin->find_payments_by_hash_and_coin =
     &postgres_find_payments_by_hash_and_coin;
+  plugin->find_payments_by_coins = &postgres_find_payments_by_coins;
   plugin->find_payments = &postgres_find_payments;
   plugin->find_transfers_by_hash = &postgres_find_transfers_by_hash;
   plugin->find_deposits_by_wtid = &postgres_find_deposits_by_wtid;
   plugin->find_proof_by_wtid = &postgres_find_proof_by_wtid;
+  plugin->create_partitions = &postgres_create_partitions;
+  plugin->archive_partitions = &postgres_archive_partitions;
+  plugin->gc_orders = &postgres_gc_orders;
+  plugin->gc_sessions = &postgres_gc_sessions;
   plugin->insert_contract_terms = &postgres_insert_contract_terms;
+  plugin->insert_claimed_contract = &postgres_insert_claimed_contract;
   plugin->insert_order = &postgres_insert_order;
   plugin->find_order = &postgres_find_order;
+  plugin->find_order_info = &postgres_find_order_info;
+  plugin->find_contract_info_from_hash =
+    &postgres_find_contract_info_from_hash;
   plugin->find_contract_terms = &postgres_find_contract_terms;
+  plugin->find_contract_terms_with_hash =
+    &postgres_find_contract_terms_with_hash;
   plugin->find_contract_terms_history = &postgres_find_contract_terms_history;
   plugin->find_contract_terms_by_date = &postgres_find_contract_terms_by_date;
   plugin->get_authorized_tip_amount = &postgres_get_authorized_tip_amount;
   plugin->find_contract_terms_by_date_and_range =
     &postgres_find_contract_terms_by_date_and_range;
+  plugin->find_contract_terms_by_date_and_row_range =
+    &postgres_find_contract_terms_by_date_and_row_range;
   plugin->find_contract_terms_from_hash =
     &postgres_find_contract_terms_from_hash;
+  plugin->find_order_ids_by_hashes = &postgres_find_order_ids_by_hashes;
   plugin->find_paid_contract_terms_from_hash =
     &postgres_find_paid_contract_terms_from_hash;
   plugin->get_refunds_from_contract_terms_hash =
@@ -3648,6 +6016,7 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
   plugin->get_refund_proof = &postgres_get_refund_proof;
   plugin->put_refund_proof = &postgres_put_refund_proof;
   plugin->mark_proposal_paid = &postgres_mark_proposal_paid;
+  plugin->pay_commit = &postgres_pay_commit;
   plugin->insert_session_info = &postgres_insert_session_info;
   plugin->find_session_info = &postgres_find_session_info;
   plugin->enable_tip_reserve_TR = &postgres_enable_tip_reserve_TR;
@@ -3658,6 +6027,20 @@ libtaler_plugin_merchantdb_postgres_init (void *cls)
   plugin->commit = postgres_commit;
   plugin->preflight = postgres_preflight;
   plugin->rollback = postgres_rollback;
+  plugin->find_contract_info_async = &postgres_find_contract_info_async;
+  plugin->find_contract_info_from_hash_async =
+    &postgres_find_contract_info_from_hash_async;
+  plugin->find_claimed_contract_async =
+    &postgres_find_claimed_contract_async;
+  plugin->async_cancel = &postgres_async_cancel;
+  plugin->get_pool_statistics = &postgres_get_pool_statistics;
+  plugin->iterate_statement_statistics =
+    &postgres_iterate_statement_statistics;
+  plugin->notify_payment_event = &postgres_notify_payment_event;
+  plugin->listen_payment_events = &postgres_listen_payment_events;
+  plugin->batch_start = &postgres_batch_start;
+  plugin->batch_store_deposit = &postgres_batch_store_deposit;
+  plugin->batch_commit_TR = &postgres_batch_commit_TR;
 
   return plugin;
 }
@@ -3674,8 +6057,24 @@ libtaler_plugin_merchantdb_postgres_done (void *cls)
 {
   struct TALER_MERCHANTDB_Plugin *plugin = cls;
   struct PostgresClosure *pg = plugin->cls;
+  struct PaymentNotification *pn;
 
+  while (NULL != (pn = pg->pn_head))
+  {
+    GNUNET_CONTAINER_DLL_remove (pg->pn_head,
+                                 pg->pn_tail,
+                                 pn);
+    PGA_query_cancel (pn->q);
+    GNUNET_free (pn);
+  }
+  if (NULL != pg->listener)
+  {
+    PGA_listen_cancel (pg->listener);
+    pg->listener = NULL;
+  }
+  PGA_disconnect (pg->async);
   GNUNET_PQ_disconnect (pg->conn);
+  GNUNET_free (pg->stmt_stats);
   GNUNET_free (pg->sql_dir);
   GNUNET_free (pg->currency);
   GNUNET_free (pg);
@@ -336,6 +336,743 @@ proof_cb (void *cls,
 #undef CHECK
 
 
+/**
+ * Check that #TALER_MERCHANTDB_Plugin::find_session_info() finds
+ * (or does not find) @a session_id and @a fulfillment_url.
+ *
+ * @param session_id session to look up
+ * @param fulfillment_url fulfillment URL to look up
+ * @param expected_order_id order ID we expect, NULL if none
+ * @return #GNUNET_OK if the result was as expected
+ */
+static int
+check_session (const char *session_id,
+               const char *fulfillment_url,
+               const char *expected_order_id)
+{
+  enum GNUNET_DB_QueryStatus qs;
+  char *oid = NULL;
+  int ret;
+
+  qs = plugin->find_session_info (plugin->cls,
+                                  &oid,
+                                  session_id,
+                                  fulfillment_url,
+                                  &merchant_pub);
+  if (NULL == expected_order_id)
+    ret = (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS == qs)
+          ? GNUNET_OK : GNUNET_SYSERR;
+  else
+    ret = ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT == qs) &&
+            (0 == strcmp (oid,
+                          expected_order_id)) )
+          ? GNUNET_OK : GNUNET_SYSERR;
+  GNUNET_free_non_null (oid);
+  return ret;
+}
+
+
+/**
+ * Test committing payments with #TALER_MERCHANTDB_Plugin::pay_commit().
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+test_pay_commit ()
+{
+  const char *pc_order_id = "test_pay_commit";
+  const char *fulfillment_url = "https://example.com/article";
+  json_t *pc_contract_terms;
+  struct GNUNET_HashCode pc_h_contract_terms;
+  struct GNUNET_HashCode unknown_h_contract_terms;
+  struct TALER_CoinSpendPublicKeyP pc_coins[3];
+  struct GNUNET_TIME_Absolute pc_timestamp;
+  struct TALER_Amount paid;
+  struct TALER_Amount needed;
+  struct TALER_Amount pc_refund;
+  struct TALER_Amount refunded;
+  struct TALER_Amount zero;
+  enum TALER_MERCHANTDB_PayCommitStatus status;
+
+  pc_contract_terms = json_pack ("{s:s}",
+                                 "order",
+                                 "pay_commit");
+  GNUNET_assert (NULL != pc_contract_terms);
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_JSON_hash (pc_contract_terms,
+                                  &pc_h_contract_terms));
+  RND_BLK (&unknown_h_contract_terms);
+  for (unsigned int i = 0; i<3; i++)
+    RND_BLK (&pc_coins[i]);
+  pc_timestamp = GNUNET_TIME_absolute_get ();
+  (void) GNUNET_TIME_round_abs (&pc_timestamp);
+  /* two coins of 5 each, the third one is never deposited */
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_string_to_amount (CURRENCY ":10",
+                                         &paid));
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_string_to_amount (CURRENCY ":8",
+                                         &needed));
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_string_to_amount (CURRENCY ":3",
+                                         &pc_refund));
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_amount_get_zero (CURRENCY,
+                                        &zero));
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->insert_contract_terms (plugin->cls,
+                                     pc_order_id,
+                                     &merchant_pub,
+                                     pc_timestamp,
+                                     pc_contract_terms))
+  {
+    GNUNET_break (0);
+    json_decref (pc_contract_terms);
+    return GNUNET_SYSERR;
+  }
+  json_decref (pc_contract_terms);
+  for (unsigned int i = 0; i<2; i++)
+    if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->store_deposit (plugin->cls,
+                               &pc_h_contract_terms,
+                               &merchant_pub,
+                               &pc_coins[i],
+                               EXCHANGE_URL,
+                               &amount_with_fee,
+                               &deposit_fee,
+                               &refund_fee,
+                               &wire_fee,
+                               &signkey_pub,
+                               deposit_proof))
+    {
+      GNUNET_break (0);
+      return GNUNET_SYSERR;
+    }
+  /* deposits for an unknown contract are not silently dropped */
+  if (GNUNET_DB_STATUS_HARD_ERROR !=
+      plugin->store_deposit (plugin->cls,
+                             &unknown_h_contract_terms,
+                             &merchant_pub,
+                             &pc_coins[0],
+                             EXCHANGE_URL,
+                             &amount_with_fee,
+                             &deposit_fee,
+                             &refund_fee,
+                             &wire_fee,
+                             &signkey_pub,
+                             deposit_proof))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+
+  /* unknown contract */
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &unknown_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            NULL,
+                            NULL,
+                            2,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_UNKNOWN_COINS != status) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* unknown coin */
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &pc_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            "session-1",
+                            fulfillment_url,
+                            3,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_UNKNOWN_COINS != status) ||
+       (GNUNET_OK !=
+        check_session ("session-1",
+                       fulfillment_url,
+                       NULL)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* paid, no session given */
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &pc_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            "session-1",
+                            NULL,
+                            2,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_PAID != status) ||
+       (0 != TALER_amount_cmp (&refunded,
+                               &zero)) ||
+       (GNUNET_OK !=
+        check_session ("session-1",
+                       fulfillment_url,
+                       NULL)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* an empty session ID is not recorded either */
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &pc_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            "",
+                            fulfillment_url,
+                            2,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_PAID != status) ||
+       (GNUNET_OK !=
+        check_session ("",
+                       fulfillment_url,
+                       NULL)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* paid again, now within a session */
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &pc_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            "session-1",
+                            fulfillment_url,
+                            2,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_PAID != status) ||
+       (GNUNET_OK !=
+        check_session ("session-1",
+                       fulfillment_url,
+                       pc_order_id)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* refunds push the payment below what is needed */
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->increase_refund_for_contract_NT (plugin->cls,
+                                               &pc_h_contract_terms,
+                                               &merchant_pub,
+                                               &pc_refund,
+                                               "pay commit test"))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->pay_commit (plugin->cls,
+                            &pc_h_contract_terms,
+                            &merchant_pub,
+                            pc_order_id,
+                            "session-2",
+                            fulfillment_url,
+                            2,
+                            pc_coins,
+                            &paid,
+                            &needed,
+                            &status,
+                            &refunded)) ||
+       (TALER_MERCHANTDB_PCS_REFUNDED != status) ||
+       (0 != TALER_amount_cmp (&refunded,
+                               &pc_refund)) ||
+       (GNUNET_OK !=
+        check_session ("session-2",
+                       fulfillment_url,
+                       NULL)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Closure for #coin_offset_cb().
+ */
+struct CoinOffsetContext
+{
+  /**
+   * Offsets we were called with, in the order of the calls.
+   */
+  unsigned int offsets[3];
+
+  /**
+   * Number of calls so far.
+   */
+  unsigned int calls;
+
+  /**
+   * Set to #GNUNET_SYSERR if a result was not as expected.
+   */
+  int ret;
+};
+
+
+/**
+ * Function called with information about a coin found by
+ * #TALER_MERCHANTDB_Plugin::find_payments_by_coins().
+ *
+ * @param cls a `struct CoinOffsetContext`
+ * @param offset offset of the coin in the query arrays
+ * @param exchange_url exchange associated with the coin in DB
+ * @param aamount_with_fee amount the exchange will deposit for this coin
+ * @param adeposit_fee fee the exchange will charge for this coin
+ * @param arefund_fee fee the exchange will charge for refunding this coin
+ * @param awire_fee wire fee the exchange charges
+ * @param exchange_proof proof from exchange that coin was accepted
+ */
+static void
+coin_offset_cb (void *cls,
+                unsigned int offset,
+                const char *exchange_url,
+                const struct TALER_Amount *aamount_with_fee,
+                const struct TALER_Amount *adeposit_fee,
+                const struct TALER_Amount *arefund_fee,
+                const struct TALER_Amount *awire_fee,
+                const json_t *exchange_proof)
+{
+  struct CoinOffsetContext *coc = cls;
+
+  if ( (coc->calls >= 3) ||
+       (0 != strcmp (exchange_url,
+                     EXCHANGE_URL)) ||
+       (0 != TALER_amount_cmp (aamount_with_fee,
+                               &amount_with_fee)) ||
+       (0 != TALER_amount_cmp (adeposit_fee,
+                               &deposit_fee)) ||
+       (0 != TALER_amount_cmp (arefund_fee,
+                               &refund_fee)) ||
+       (0 != TALER_amount_cmp (awire_fee,
+                               &wire_fee)) ||
+       (1 != json_equal ((json_t *) exchange_proof,
+                         deposit_proof)) )
+  {
+    GNUNET_break (0);
+    coc->ret = GNUNET_SYSERR;
+    return;
+  }
+  coc->offsets[coc->calls++] = offset;
+}
+
+
+/**
+ * Function called with the wire transfers of a contract; checks
+ * that the coin was mapped to the wire transfer given in @a cls.
+ *
+ * @param cls the expected `struct TALER_WireTransferIdentifierRawP`
+ * @param ah_contract_terms hashcode of the proposal data
+ * @param acoin_pub public key of the coin
+ * @param awtid identifier of the wire transfer
+ * @param execution_time when was the wire transfer executed?
+ * @param exchange_proof proof from exchange about what the deposit was for
+ */
+static void
+transfer_wtid_cb (void *cls,
+                  const struct GNUNET_HashCode *ah_contract_terms,
+                  const struct TALER_CoinSpendPublicKeyP *acoin_pub,
+                  const struct TALER_WireTransferIdentifierRawP *awtid,
+                  struct GNUNET_TIME_Absolute execution_time,
+                  const json_t *exchange_proof)
+{
+  const struct TALER_WireTransferIdentifierRawP *expected = cls;
+
+  if (0 != GNUNET_memcmp (awtid,
+                          expected))
+  {
+    GNUNET_break (0);
+    result = 3;
+  }
+}
+
+
+/**
+ * Test the multi-coin calls used when tracking a wire transfer,
+ * #TALER_MERCHANTDB_Plugin::find_payments_by_coins() and
+ * #TALER_MERCHANTDB_Plugin::store_coins_to_transfer().
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+test_transfer_coins ()
+{
+  const char *tc_order_id = "test_transfer_coins";
+  json_t *tc_contract_terms;
+  struct GNUNET_HashCode tc_h_contract_terms[3];
+  struct TALER_CoinSpendPublicKeyP tc_coins[3];
+  struct TALER_WireTransferIdentifierRawP tc_wtid;
+  struct GNUNET_TIME_Absolute tc_timestamp;
+  struct CoinOffsetContext coc = {
+    .ret = GNUNET_OK
+  };
+  enum GNUNET_DB_QueryStatus qs;
+
+  tc_contract_terms = json_pack ("{s:s}",
+                                 "order",
+                                 "transfer_coins");
+  GNUNET_assert (NULL != tc_contract_terms);
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_JSON_hash (tc_contract_terms,
+                                  &tc_h_contract_terms[0]));
+  tc_h_contract_terms[1] = tc_h_contract_terms[0];
+  tc_h_contract_terms[2] = tc_h_contract_terms[0];
+  for (unsigned int i = 0; i<3; i++)
+    RND_BLK (&tc_coins[i]);
+  RND_BLK (&tc_wtid);
+  tc_timestamp = GNUNET_TIME_absolute_get ();
+  (void) GNUNET_TIME_round_abs (&tc_timestamp);
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->insert_contract_terms (plugin->cls,
+                                     tc_order_id,
+                                     &merchant_pub,
+                                     tc_timestamp,
+                                     tc_contract_terms))
+  {
+    GNUNET_break (0);
+    json_decref (tc_contract_terms);
+    return GNUNET_SYSERR;
+  }
+  json_decref (tc_contract_terms);
+  /* the coin in the middle is never deposited */
+  for (unsigned int i = 0; i<3; i += 2)
+    if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->store_deposit (plugin->cls,
+                               &tc_h_contract_terms[i],
+                               &merchant_pub,
+                               &tc_coins[i],
+                               EXCHANGE_URL,
+                               &amount_with_fee,
+                               &deposit_fee,
+                               &refund_fee,
+                               &wire_fee,
+                               &signkey_pub,
+                               deposit_proof))
+    {
+      GNUNET_break (0);
+      return GNUNET_SYSERR;
+    }
+
+  /* hits are reported by offset, the unknown coin is skipped */
+  qs = plugin->find_payments_by_coins (plugin->cls,
+                                       &merchant_pub,
+                                       3,
+                                       tc_h_contract_terms,
+                                       tc_coins,
+                                       &coin_offset_cb,
+                                       &coc);
+  if ( (2 != qs) ||
+       (GNUNET_OK != coc.ret) ||
+       (2 != coc.calls) ||
+       (0 != coc.offsets[0]) ||
+       (2 != coc.offsets[1]) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* only the unknown coin */
+  coc.calls = 0;
+  if ( (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+        plugin->find_payments_by_coins (plugin->cls,
+                                        &merchant_pub,
+                                        1,
+                                        &tc_h_contract_terms[1],
+                                        &tc_coins[1],
+                                        &coin_offset_cb,
+                                        &coc)) ||
+       (0 != coc.calls) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+
+  /* duplicate mappings are ignored */
+  if (2 !=
+      plugin->store_coins_to_transfer (plugin->cls,
+                                       &tc_wtid,
+                                       2,
+                                       tc_h_contract_terms,
+                                       tc_coins))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if (1 !=
+      plugin->store_coins_to_transfer (plugin->cls,
+                                       &tc_wtid,
+                                       3,
+                                       tc_h_contract_terms,
+                                       tc_coins))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+      plugin->store_coins_to_transfer (plugin->cls,
+                                       &tc_wtid,
+                                       3,
+                                       tc_h_contract_terms,
+                                       tc_coins))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if ( (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+        plugin->store_transfer_to_proof (plugin->cls,
+                                         EXCHANGE_URL,
+                                         &tc_wtid,
+                                         GNUNET_TIME_UNIT_ZERO_ABS,
+                                         &signkey_pub,
+                                         transfer_proof)) ||
+       (3 !=
+        plugin->find_transfers_by_hash (plugin->cls,
+                                        &tc_h_contract_terms[0],
+                                        &transfer_wtid_cb,
+                                        &tc_wtid)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  return GNUNET_OK;
+}
+
+
+/**
+ * Closure for #batch_deposit_cb().
+ */
+struct BatchDepositContext
+{
+  /**
+   * Coins we deposited.
+   */
+  const struct TALER_CoinSpendPublicKeyP *coins;
+
+  /**
+   * How often each of the @e coins was returned.
+   */
+  unsigned int seen[3];
+
+  /**
+   * Set to #GNUNET_SYSERR if a result was not as expected.
+   */
+  int ret;
+};
+
+
+/**
+ * Function called with information about a coin deposited
+ * by #test_batch_deposits().
+ *
+ * @param cls a `struct BatchDepositContext`
+ * @param ah_contract_terms hashcode of the contract
+ * @param acoin_pub public key of the coin
+ * @param aexchange_url exchange associated with @a acoin_pub in DB
+ * @param aamount_with_fee amount the exchange will deposit for this coin
+ * @param adeposit_fee fee the exchange will charge for this coin
+ * @param arefund_fee fee the exchange will charge for refunding this coin
+ * @param awire_fee wire fee the exchange charges
+ * @param aexchange_proof proof from exchange that coin was accepted
+ */
+static void
+batch_deposit_cb (void *cls,
+                  const struct GNUNET_HashCode *ah_contract_terms,
+                  const struct TALER_CoinSpendPublicKeyP *acoin_pub,
+                  const char *aexchange_url,
+                  const struct TALER_Amount *aamount_with_fee,
+                  const struct TALER_Amount *adeposit_fee,
+                  const struct TALER_Amount *arefund_fee,
+                  const struct TALER_Amount *awire_fee,
+                  const json_t *aexchange_proof)
+{
+  struct BatchDepositContext *bdc = cls;
+
+  if ( (0 != strcmp (aexchange_url,
+                     EXCHANGE_URL)) ||
+       (0 != TALER_amount_cmp (aamount_with_fee,
+                               &amount_with_fee)) ||
+       (0 != TALER_amount_cmp (adeposit_fee,
+                               &deposit_fee)) ||
+       (1 != json_equal ((json_t *) aexchange_proof,
+                         deposit_proof)) )
+  {
+    GNUNET_break (0);
+    bdc->ret = GNUNET_SYSERR;
+    return;
+  }
+  for (unsigned int i = 0; i<3; i++)
+    if (0 == GNUNET_memcmp (acoin_pub,
+                            &bdc->coins[i]))
+    {
+      bdc->seen[i]++;
+      return;
+    }
+  GNUNET_break (0);
+  bdc->ret = GNUNET_SYSERR;
+}
+
+
+/**
+ * Function called with the latency statistics of a prepared
+ * statement; remembers how often batches were executed.
+ *
+ * @param cls an `unsigned long long` to set to the number of batches
+ * @param name name of the prepared statement
+ * @param calls number of times the statement was executed
+ * @param total total time spent executing the statement
+ * @param max longest execution of the statement
+ */
+static void
+batch_stats_cb (void *cls,
+                const char *name,
+                unsigned long long calls,
+                struct GNUNET_TIME_Relative total,
+                struct GNUNET_TIME_Relative max)
+{
+  unsigned long long *batches = cls;
+
+  (void) total;
+  (void) max;
+  if (0 == strcmp (name,
+                   "batch_commit"))
+    *batches = calls;
+}
+
+
+/**
+ * Test storing deposits with the batch API.
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+test_batch_deposits ()
+{
+  const char *bd_order_id = "test_batch_deposits";
+  json_t *bd_contract_terms;
+  struct GNUNET_HashCode bd_h_contract_terms;
+  struct TALER_CoinSpendPublicKeyP bd_coins[3];
+  struct GNUNET_TIME_Absolute bd_timestamp;
+  struct TALER_MERCHANTDB_Batch *batch;
+  struct BatchDepositContext bdc = {
+    .coins = bd_coins,
+    .ret = GNUNET_OK
+  };
+  unsigned long long batches = 0;
+
+  bd_contract_terms = json_pack ("{s:s}",
+                                 "order",
+                                 "batch_deposits");
+  GNUNET_assert (NULL != bd_contract_terms);
+  GNUNET_assert (GNUNET_OK ==
+                 TALER_JSON_hash (bd_contract_terms,
+                                  &bd_h_contract_terms));
+  for (unsigned int i = 0; i<3; i++)
+    RND_BLK (&bd_coins[i]);
+  bd_timestamp = GNUNET_TIME_absolute_get ();
+  (void) GNUNET_TIME_round_abs (&bd_timestamp);
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->insert_contract_terms (plugin->cls,
+                                     bd_order_id,
+                                     &merchant_pub,
+                                     bd_timestamp,
+                                     bd_contract_terms))
+  {
+    GNUNET_break (0);
+    json_decref (bd_contract_terms);
+    return GNUNET_SYSERR;
+  }
+  json_decref (bd_contract_terms);
+
+  /* an empty batch does nothing */
+  batch = plugin->batch_start (plugin->cls);
+  if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+      plugin->batch_commit_TR (plugin->cls,
+                               batch))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* the first coin is added twice, the duplicate is ignored */
+  batch = plugin->batch_start (plugin->cls);
+  for (unsigned int i = 0; i<4; i++)
+    plugin->batch_store_deposit (plugin->cls,
+                                 batch,
+                                 &bd_h_contract_terms,
+                                 &merchant_pub,
+                                 &bd_coins[i % 3],
+                                 EXCHANGE_URL,
+                                 &amount_with_fee,
+                                 &deposit_fee,
+                                 &refund_fee,
+                                 &wire_fee,
+                                 &signkey_pub,
+                                 deposit_proof);
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->batch_commit_TR (plugin->cls,
+                               batch))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if ( (3 !=
+        plugin->find_payments (plugin->cls,
+                               &bd_h_contract_terms,
+                               &merchant_pub,
+                               &batch_deposit_cb,
+                               &bdc)) ||
+       (GNUNET_OK != bdc.ret) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  for (unsigned int i = 0; i<3; i++)
+    if (1 != bdc.seen[i])
+    {
+      GNUNET_break (0);
+      return GNUNET_SYSERR;
+    }
+  /* both batches are accounted */
+  plugin->iterate_statement_statistics (plugin->cls,
+                                        &batch_stats_cb,
+                                        &batches);
+  if (2 != batches)
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  return GNUNET_OK;
+}
+
+
 /**
  * Test the wire fee storage.
  *
@@ -735,6 +1472,86 @@ test_tipping ()
 }
 
 
+/**
+ * Test that order IDs of contracts stay unique, also after their
+ * partitions were archived.  Must be run last, as it archives all
+ * contracts stored so far.
+ *
+ * @return #GNUNET_OK on success
+ */
+static int
+test_order_ids ()
+{
+  struct GNUNET_TIME_Absolute later;
+  unsigned int archived;
+
+  /* the timestamp is part of the primary key of the contract terms,
+     but must not allow claiming an order ID twice */
+  later = GNUNET_TIME_absolute_add (timestamp,
+                                    GNUNET_TIME_UNIT_SECONDS);
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT ==
+      plugin->insert_contract_terms (plugin->cls,
+                                     order_id,
+                                     &merchant_pub,
+                                     later,
+                                     contract_terms_future))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if ( (0 >
+        plugin->archive_partitions (plugin->cls,
+                                    GNUNET_TIME_relative_to_absolute (
+                                      GNUNET_TIME_relative_multiply (
+                                        GNUNET_TIME_UNIT_DAYS,
+                                        62)),
+                                    &archived)) ||
+       (0 == archived) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+      plugin->find_contract_terms_history (plugin->cls,
+                                           order_id,
+                                           &merchant_pub,
+                                           &pd_cb,
+                                           NULL))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  /* archived order IDs cannot be reused either */
+  if ( (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+        plugin->insert_order (plugin->cls,
+                              order_id,
+                              &merchant_pub,
+                              later,
+                              contract_terms_future)) ||
+       (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT ==
+        plugin->insert_contract_terms (plugin->cls,
+                                       order_id,
+                                       &merchant_pub,
+                                       later,
+                                       contract_terms_future)) )
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  if (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+      plugin->insert_order (plugin->cls,
+                            "test_order_ids",
+                            &merchant_pub,
+                            later,
+                            contract_terms_future))
+  {
+    GNUNET_break (0);
+    return GNUNET_SYSERR;
+  }
+  return GNUNET_OK;
+}
+
+
 /**
  * Main function that will be run by the scheduler.
  *
@@ -766,6 +1583,21 @@ run (void *cls)
     result = 77;
     return;
   }
+  {
+    unsigned int created;
+
+    FAILIF (0 >
+            plugin->create_partitions (plugin->cls,
+                                       GNUNET_TIME_relative_to_absolute (
+                                         GNUNET_TIME_UNIT_WEEKS),
+                                       &created));
+  }
+  FAILIF (0 > plugin->gc_orders (plugin->cls,
+                                 GNUNET_TIME_absolute_get (),
+                                 16));
+  FAILIF (0 > plugin->gc_sessions (plugin->cls,
+                                   GNUNET_TIME_absolute_get (),
+                                   16));
 
   /* Prepare data for 'store_payment()' */
   RND_BLK (&h_wire);
@@ -839,6 +1671,25 @@ run (void *cls)
                                          &merchant_pub,
                                          timestamp,
                                          contract_terms));
+  /* order IDs of claimed contracts cannot be reused */
+  FAILIF (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+          plugin->insert_order (plugin->cls,
+                                order_id,
+                                &merchant_pub,
+                                timestamp,
+                                contract_terms));
+  FAILIF (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+          plugin->insert_order (plugin->cls,
+                                order_id_future,
+                                &merchant_pub,
+                                timestamp,
+                                contract_terms));
+  FAILIF (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
+          plugin->insert_order (plugin->cls,
+                                order_id_future,
+                                &merchant_pub,
+                                timestamp,
+                                contract_terms));
 
   FAILIF (GNUNET_DB_STATUS_SUCCESS_NO_RESULTS !=
           plugin->find_paid_contract_terms_from_hash (plugin->cls,
@@ -874,6 +1725,18 @@ run (void *cls)
                                                  &out,
                                                  &h_contract_terms,
                                                  &merchant_pub));
+  {
+    struct GNUNET_HashCode h_stored;
+
+    FAILIF (GNUNET_DB_STATUS_SUCCESS_ONE_RESULT !=
+            plugin->find_contract_terms_with_hash (plugin->cls,
+                                                   &out,
+                                                   &h_stored,
+                                                   order_id,
+                                                   &merchant_pub));
+    FAILIF (0 != GNUNET_memcmp (&h_stored,
+                                &h_contract_terms));
+  }
   FAILIF (1 !=
           plugin->find_contract_terms_by_date_and_range (plugin->cls,
                                                          fake_now,
@@ -914,6 +1777,28 @@ run (void *cls)
                                                          GNUNET_NO,
                                                          &pd_cb,
                                                          NULL));
+  FAILIF (2 !=
+          plugin->find_contract_terms_by_date_and_row_range (plugin->cls,
+                                                             fake_now,
+                                                             &merchant_pub,
+                                                             0,
+                                                             INT64_MAX,
+                                                             5,
+                                                             GNUNET_NO,
+                                                             GNUNET_YES,
+                                                             &pd_cb,
+                                                             NULL));
+  FAILIF (1 !=
+          plugin->find_contract_terms_by_date_and_row_range (plugin->cls,
+                                                             fake_now,
+                                                             &merchant_pub,
+                                                             0,
+                                                             INT64_MAX,
+                                                             1,
+                                                             GNUNET_NO,
+                                                             GNUNET_NO,
+                                                             &pd_cb,
+                                                             NULL));
 
   FAILIF (0 !=
           plugin->find_contract_terms_by_date (plugin->cls,
@@ -1010,10 +1895,18 @@ run (void *cls)
                                                    &too_big_refund_amount,
                                                    "make refund testing fail due to too big refund amount"));
 
+  FAILIF (GNUNET_OK !=
+          test_pay_commit ());
+  FAILIF (GNUNET_OK !=
+          test_transfer_coins ());
+  FAILIF (GNUNET_OK !=
+          test_batch_deposits ());
   FAILIF (GNUNET_OK !=
           test_wire_fee ());
   FAILIF (GNUNET_OK !=
           test_tipping ());
+  FAILIF (GNUNET_OK !=
+          test_order_ids ());
 
 
   if (-1 == result)
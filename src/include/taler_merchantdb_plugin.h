@@ -26,12 +26,83 @@
 #include <gnunet/gnunet_db_lib.h>
 #include <jansson.h>
 
+/**
+ * Statistics about the connections used for asynchronous
+ * database operations.
+ */
+struct TALER_MERCHANTDB_PoolStatistics
+{
+
+  /**
+   * Number of asynchronous operations started so far.
+   */
+  unsigned long long queries;
+
+  /**
+   * Total time operations waited for an idle connection.
+   */
+  struct GNUNET_TIME_Relative total_wait;
+
+  /**
+   * Longest time an operation waited for an idle connection.
+   */
+  struct GNUNET_TIME_Relative max_wait;
+
+  /**
+   * Number of operations currently waiting for a connection.
+   */
+  unsigned int queue_length;
+
+  /**
+   * Largest number of operations that were ever waiting at once.
+   */
+  unsigned int max_queue_length;
+
+  /**
+   * Number of connections currently executing an operation.
+   */
+  unsigned int busy;
+
+  /**
+   * Maximum number of connections in the pool.
+   */
+  unsigned int size;
+
+};
+
+
 /**
  * Handle to interact with the database.
  */
 struct TALER_MERCHANTDB_Plugin;
 
 
+/**
+ * Outcome of #TALER_MERCHANTDB_Plugin::pay_commit().
+ */
+enum TALER_MERCHANTDB_PayCommitStatus
+{
+
+  /**
+   * The contract is now marked as paid.
+   */
+  TALER_MERCHANTDB_PCS_PAID = 0,
+
+  /**
+   * Refunds on the coins reduced the payment below the
+   * amount needed, nothing was changed.
+   */
+  TALER_MERCHANTDB_PCS_REFUNDED = 1,
+
+  /**
+   * The contract or some of the coins are not in the
+   * database, nothing was changed.
+   */
+  TALER_MERCHANTDB_PCS_UNKNOWN_COINS = 2
+
+};
+
+
 /**
  * Typically called by `find_contract_terms_by_date`.
  *
@@ -95,6 +166,46 @@ typedef void
   const json_t *exchange_proof);
 
 
+/**
+ * Function called with the order ID of a contract, as part of a
+ * lookup for many contracts at once.
+ *
+ * @param cls closure
+ * @param offset offset of the contract in the array given to the lookup
+ * @param order_id order ID of the contract
+ */
+typedef void
+(*TALER_MERCHANTDB_OrderIdCallback)(void *cls,
+                                    unsigned int offset,
+                                    const char *order_id);
+
+
+/**
+ * Function called with information about a coin that was deposited,
+ * as part of a lookup for many coins at once.
+ *
+ * @param cls closure
+ * @param offset offset of the coin in the arrays given to the lookup
+ * @param exchange_url URL of the exchange that issued the coin
+ * @param amount_with_fee amount the exchange will deposit for this coin
+ * @param deposit_fee fee the exchange will charge for this coin
+ * @param refund_fee fee the exchange will charge for refunding this coin
+ * @param wire_fee wire fee the exchange charges
+ * @param exchange_proof proof from exchange that coin was accepted,
+ *        matches the `interface DepositSuccess` of the documentation.
+ */
+typedef void
+(*TALER_MERCHANTDB_CoinDepositOffsetCallback)(
+  void *cls,
+  unsigned int offset,
+  const char *exchange_url,
+  const struct TALER_Amount *amount_with_fee,
+  const struct TALER_Amount *deposit_fee,
+  const struct TALER_Amount *refund_fee,
+  const struct TALER_Amount *wire_fee,
+  const json_t *exchange_proof);
+
+
 /**
  * Information about the wire transfer corresponding to
  * a deposit operation.  Note that it is in theory possible
@@ -155,6 +266,172 @@ typedef void
   const struct TALER_Amount *refund_fee);
 
 
+/**
+ * Handle for an asynchronous database operation.
+ */
+struct TALER_MERCHANTDB_AsyncHandle;
+
+
+/**
+ * Statements to be executed together, see
+ * #TALER_MERCHANTDB_Plugin::batch_start().
+ */
+struct TALER_MERCHANTDB_Batch;
+
+
+/**
+ * Frequently needed fields of an order or of contract terms,
+ * available without fetching the full JSON document.
+ */
+struct TALER_MERCHANTDB_ContractInfo
+{
+
+  /**
+   * Hash of the contract terms, all zeros for orders.
+   */
+  struct GNUNET_HashCode h_contract_terms;
+
+  /**
+   * Fulfillment URL, empty string if there is none.
+   */
+  const char *fulfillment_url;
+
+  /**
+   * Summary of the order, empty string if there is none.
+   */
+  const char *summary;
+
+  /**
+   * Total amount of the order.
+   */
+  struct TALER_Amount amount;
+
+  /**
+   * Refund deadline of the order, zero if there is none.
+   */
+  struct GNUNET_TIME_Absolute refund_deadline;
+
+  /**
+   * #GNUNET_YES if the contract was paid, always #GNUNET_NO
+   * for orders.
+   */
+  int paid;
+
+};
+
+
+/**
+ * Function called with the result of a lookup of the frequently
+ * needed fields of an order or of contract terms.
+ *
+ * @param cls closure
+ * @param qs transaction status
+ * @param ci the fields, NULL unless @a qs is
+ *        #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT; only valid
+ *        for the duration of the call
+ */
+typedef void
+(*TALER_MERCHANTDB_ContractInfoCallback)(
+  void *cls,
+  enum GNUNET_DB_QueryStatus qs,
+  const struct TALER_MERCHANTDB_ContractInfo *ci);
+
+
+/**
+ * Contract terms as stored when they were claimed, with what is
+ * needed to answer another claim without re-processing them.
+ */
+struct TALER_MERCHANTDB_ClaimedContract
+{
+
+  /**
+   * The contract terms in canonical form, as hashed into
+   * @e h_contract_terms (not 0-terminated).
+   */
+  const void *contract_terms;
+
+  /**
+   * Number of bytes in @e contract_terms.
+   */
+  size_t contract_terms_size;
+
+  /**
+   * Hash of the contract terms.
+   */
+  struct GNUNET_HashCode h_contract_terms;
+
+  /**
+   * Nonce the contract terms were claimed with.
+   */
+  const char *nonce;
+
+  /**
+   * #GNUNET_YES if @e merchant_sig is set.
+   */
+  int have_sig;
+
+  /**
+   * Signature of the merchant over @e h_contract_terms.
+   */
+  struct GNUNET_CRYPTO_EddsaSignature merchant_sig;
+
+};
+
+
+/**
+ * Function called with the result of a lookup of claimed
+ * contract terms.
+ *
+ * @param cls closure
+ * @param qs transaction status
+ * @param cc the claimed contract, NULL unless @a qs is
+ *        #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT; only valid
+ *        for the duration of the call
+ */
+typedef void
+(*TALER_MERCHANTDB_ClaimedContractCallback)(
+  void *cls,
+  enum GNUNET_DB_QueryStatus qs,
+  const struct TALER_MERCHANTDB_ClaimedContract *cc);
+
+
+/**
+ * Function called with the latency statistics of a prepared statement.
+ *
+ * @param cls closure
+ * @param name name of the prepared statement
+ * @param calls number of times the statement was executed
+ * @param total total time spent executing the statement
+ * @param max longest execution of the statement
+ */
+typedef void
+(*TALER_MERCHANTDB_StatementStatisticsCallback)(
+  void *cls,
+  const char *name,
+  unsigned long long calls,
+  struct GNUNET_TIME_Relative total,
+  struct GNUNET_TIME_Relative max);
+
+
+/**
+ * Function called when a payment or refund was recorded for an
+ * order, possibly by another process using the same database.
+ *
+ * @param cls closure
+ * @param key key identifying the order, see TMH_compute_pay_key();
+ *        NULL if events may have been lost (i.e. while reconnecting
+ *        to the database), so that the state of all orders
+ *        anybody is waiting for must be checked again
+ * @param refund_amount total refunded amount if the event was a
+ *        refund, NULL for payments
+ */
+typedef void
+(*TALER_MERCHANTDB_PaymentEventCallback)(
+  void *cls,
+  const struct GNUNET_HashCode *key,
+  const struct TALER_Amount *refund_amount);
+
+
 /**
  * Handle to interact with the database.
  *
@@ -188,14 +465,88 @@ struct TALER_MERCHANTDB_Plugin
   (*drop_tables) (void *cls);
 
   /**
-   * Insert order into db.
+   * Make sure the tables partitioned by (contract) timestamp
+   * (contract terms, deposits, transfers, refunds and refund
+   * proofs) have partitions for all months from now until @a end.
+   * Should be run periodically, as rows for which no partition
+   * exists go to a default partition that is never archived.
+   * Fails if rows for one of these months are in a default
+   * partition already.
+   *
+   * @param cls closure
+   * @param end create partitions up to this time
+   * @param[out] created set to the number of partitions created
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*create_partitions)(void *cls,
+                       struct GNUNET_TIME_Absolute end,
+                       unsigned int *created);
+
+  /**
+   * Detach the monthly partitions of the tables partitioned by
+   * (contract) timestamp that only hold data from before @a before
+   * and move them to the "merchant_archive" schema, from where they
+   * can be dumped and dropped.  The backend no longer sees any of
+   * the archived contracts, deposits, transfers or refunds.
+   *
+   * @param cls closure
+   * @param before archive partitions with data from before this time
+   * @param[out] archived set to the number of partitions archived
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*archive_partitions)(void *cls,
+                        struct GNUNET_TIME_Absolute before,
+                        unsigned int *archived);
+
+  /**
+   * Delete up to @a limit orders that are no longer needed: orders
+   * that were claimed (the contract terms are used from then on) and
+   * unclaimed orders whose pay deadline is before @a expired_before.
+   * Rows locked by other transactions are skipped, so this never
+   * waits for or blocks the processing of requests for long.
+   *
+   * @param cls closure
+   * @param expired_before delete unclaimed orders with a pay deadline
+   *        before this time
+   * @param limit maximum number of orders to delete
+   * @return transaction status, number of orders deleted on success
+   */
+  enum GNUNET_DB_QueryStatus
+  (*gc_orders)(void *cls,
+               struct GNUNET_TIME_Absolute expired_before,
+               uint32_t limit);
+
+  /**
+   * Delete up to @a limit session-to-order mappings created
+   * before @a older_than.  Afterwards a wallet has to replay the
+   * payment to get the fulfillment URL marked as paid for the session.
+   *
+   * @param cls closure
+   * @param older_than delete sessions recorded before this time
+   * @param limit maximum number of sessions to delete
+   * @return transaction status, number of sessions deleted on success
+   */
+  enum GNUNET_DB_QueryStatus
+  (*gc_sessions)(void *cls,
+                 struct GNUNET_TIME_Absolute older_than,
+                 uint32_t limit);
+
+  /**
+   * Insert order into db.  Inserts nothing if an order with the
+   * same ID exists or was already claimed (even if the order itself
+   * was garbage collected or its contract archived since), so that
+   * the caller learns about duplicates without a second query.
    *
    * @param cls closure
    * @param order_id alphanumeric string that uniquely identifies the proposal
    * @param merchant_pub merchant's public key
    * @param timestamp timestamp of this proposal data
    * @param contract_terms proposal data to store
-   * @return transaction status
+   * @return #GNUNET_DB_STATUS_SUCCESS_ONE_RESULT if the order was stored,
+   *         #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS if the order ID already exists,
+   *         error status on database errors
    */
   enum GNUNET_DB_QueryStatus
   (*insert_order)(void *cls,
@@ -214,7 +565,9 @@ struct TALER_MERCHANTDB_Plugin
    * @param merchant_pub merchant's public key
    * @param timestamp timestamp of this proposal data
    * @param contract_terms proposal data to store
-   * @return transaction status
+   * @return transaction status, #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS
+   *         if contract terms with @a order_id were stored before
+   *         (even if they were archived since)
    */
   enum GNUNET_DB_QueryStatus
   (*insert_contract_terms)(void *cls,
@@ -223,6 +576,27 @@ struct TALER_MERCHANTDB_Plugin
                            struct GNUNET_TIME_Absolute timestamp,
                            const json_t *contract_terms);
 
+  /**
+   * Insert claimed contract terms into db, with their hash, nonce
+   * and signature as computed by the caller.
+   *
+   * @param cls closure
+   * @param order_id alphanumeric string that uniquely identifies the proposal
+   * @param merchant_pub merchant's public key
+   * @param timestamp timestamp of this proposal data
+   * @param cc the claimed contract to store, @e have_sig must be set
+   * @return transaction status, #GNUNET_DB_STATUS_SUCCESS_NO_RESULTS
+   *         if contract terms with @a order_id were stored before
+   *         (even if they were archived since)
+   */
+  enum GNUNET_DB_QueryStatus
+  (*insert_claimed_contract)(
+    void *cls,
+    const char *order_id,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    struct GNUNET_TIME_Absolute timestamp,
+    const struct TALER_MERCHANTDB_ClaimedContract *cc);
+
   /**
    * Mark contract terms as paid.  Needed by /history as only paid
    * contracts must be shown.
@@ -261,6 +635,41 @@ struct TALER_MERCHANTDB_Plugin
                          const char *order_id,
                          const struct TALER_MerchantPublicKeyP *merchant_pub);
 
+  /**
+   * Conclude a payment in a single round trip: check that all of
+   * the @a coin_pubs were deposited for the contract, and unless
+   * refunds on these coins reduce @a total_paid below @a total_needed,
+   * mark the contract as paid (like @e mark_proposal_paid) and store
+   * the session information (like @e insert_session_info).
+   *
+   * @param cls closure
+   * @param h_contract_terms hash of the contract that is being paid
+   * @param merchant_pub merchant's public key
+   * @param order_id the order ID of the contract
+   * @param session_id session id, NULL for none
+   * @param fulfillment_url fulfillment URL of the contract, NULL for none
+   * @param coins_cnt length of the @a coin_pubs array
+   * @param coin_pubs the coins the payment is made of
+   * @param total_paid sum of the contributions of the @a coin_pubs
+   * @param total_needed amount needed to pay for the contract
+   * @param[out] status set to the outcome
+   * @param[out] total_refunded set to the amount refunded on the @a coin_pubs
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*pay_commit)(void *cls,
+                const struct GNUNET_HashCode *h_contract_terms,
+                const struct TALER_MerchantPublicKeyP *merchant_pub,
+                const char *order_id,
+                const char *session_id,
+                const char *fulfillment_url,
+                unsigned int coins_cnt,
+                const struct TALER_CoinSpendPublicKeyP *coin_pubs,
+                const struct TALER_Amount *total_paid,
+                const struct TALER_Amount *total_needed,
+                enum TALER_MERCHANTDB_PayCommitStatus *status,
+                struct TALER_Amount *total_refunded);
+
   /**
    * Retrieve the order ID that was used to pay for a resource within a session.
    *
@@ -295,6 +704,24 @@ struct TALER_MERCHANTDB_Plugin
                          const char *order_id,
                          const struct TALER_MerchantPublicKeyP *merchant_pub);
 
+  /**
+   * Retrieve proposal data and its hash given its order ID.
+   *
+   * @param cls closure
+   * @param[out] contract_terms where to store the result
+   * @param[out] h_contract_terms where to store the hash of @a contract_terms
+   * @param order_id order_id used to lookup.
+   * @param merchant_pub instance's public key.
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_contract_terms_with_hash)(
+    void *cls,
+    json_t **contract_terms,
+    struct GNUNET_HashCode *h_contract_terms,
+    const char *order_id,
+    const struct TALER_MerchantPublicKeyP *merchant_pub);
+
   /**
    * Retrieve order given its order id and the instance's merchant public key.
    *
@@ -311,6 +738,48 @@ struct TALER_MERCHANTDB_Plugin
                 const struct TALER_MerchantPublicKeyP *merchant_pub);
 
 
+  /**
+   * Retrieve the frequently needed fields of an order, without
+   * fetching the order itself.  @a cb is called before this
+   * function returns (with the same status).
+   *
+   * @param cls closure
+   * @param order_id order id used to perform the lookup
+   * @param merchant_pub merchant public key that identifies the instance
+   * @param cb function to call with the result
+   * @param cb_cls closure for @a cb
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_order_info)(void *cls,
+                     const char *order_id,
+                     const struct TALER_MerchantPublicKeyP *merchant_pub,
+                     TALER_MERCHANTDB_ContractInfoCallback cb,
+                     void *cb_cls);
+
+
+  /**
+   * Retrieve the frequently needed fields of contract terms given
+   * their hashcode, without fetching the contract terms themselves.
+   * @a cb is called before this function returns (with the same
+   * status).
+   *
+   * @param cls closure
+   * @param h_contract_terms hashcode used to lookup
+   * @param merchant_pub instance's public key
+   * @param cb function to call with the result
+   * @param cb_cls closure for @a cb
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_contract_info_from_hash)(
+    void *cls,
+    const struct GNUNET_HashCode *h_contract_terms,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    TALER_MERCHANTDB_ContractInfoCallback cb,
+    void *cb_cls);
+
+
   /**
    * Retrieve proposal data given its hashcode
    *
@@ -328,6 +797,29 @@ struct TALER_MERCHANTDB_Plugin
     const struct TALER_MerchantPublicKeyP *merchant_pub);
 
 
+  /**
+   * Retrieve the order IDs of many contracts with a single statement,
+   * without fetching the contract terms.  @a cb is called in ascending
+   * order of the offsets, and not at all for unknown contracts.
+   *
+   * @param cls closure
+   * @param merchant_pub instance's public key
+   * @param h_cnt length of the @a h_contract_terms array
+   * @param h_contract_terms hashcodes of the contracts
+   * @param cb function to call with the order IDs
+   * @param cb_cls closure for @a cb
+   * @return transaction status, number of contracts found on success
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_order_ids_by_hashes)(
+    void *cls,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    unsigned int h_cnt,
+    const struct GNUNET_HashCode *h_contract_terms,
+    TALER_MERCHANTDB_OrderIdCallback cb,
+    void *cb_cls);
+
+
   /**
    * Retrieve paid contract terms data given its hashcode.
    *
@@ -376,6 +868,40 @@ struct TALER_MERCHANTDB_Plugin
     TALER_MERCHANTDB_ProposalDataCallback cb,
     void *cb_cls);
 
+  /**
+   * Return up to @a nrows paid proposals of an instance with
+   * timestamps younger (or older, if @a past is set) than @a date
+   * and serial ids strictly between @a min_row and @a max_row.
+   * Used to page through large histories in chunks.
+   *
+   * @param cls our plugin handle.
+   * @param date only results younger than this date are returned.
+   * @param merchant_pub instance's public key; only rows related to this
+   * instance are returned.
+   * @param min_row only rows with a serial id above @a min_row are returned
+   * @param max_row only rows with a serial id below @a max_row are returned
+   * @param nrows only nrows rows are returned.
+   * @param past if set to #GNUNET_YES, retrieves rows older than `date`.
+   * @param ascending if #GNUNET_YES, return the rows with the smallest
+   *        serial ids in ascending order, otherwise those with the largest
+   *        serial ids in descending order
+   * @param cb function to call with transaction data, can be NULL.
+   * @param cb_cls closure for @a cb
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_contract_terms_by_date_and_row_range)(
+    void *cls,
+    struct GNUNET_TIME_Absolute date,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    uint64_t min_row,
+    uint64_t max_row,
+    uint64_t nrows,
+    int past,
+    unsigned int ascending,
+    TALER_MERCHANTDB_ProposalDataCallback cb,
+    void *cb_cls);
+
   /**
    * Lookup for a proposal, respecting the signature used by the
    * /history's db methods.
@@ -432,7 +958,8 @@ struct TALER_MERCHANTDB_Plugin
    * @param wire_fee wire fee the exchange charges
    * @param signkey_pub public key used by the exchange for @a exchange_proof
    * @param exchange_proof proof from exchange that coin was accepted
-   * @return transaction status
+   * @return transaction status, #GNUNET_DB_STATUS_HARD_ERROR if the
+   *         contract is unknown (or archived)
    */
   enum GNUNET_DB_QueryStatus
   (*store_deposit)(void *cls,
@@ -467,6 +994,29 @@ struct TALER_MERCHANTDB_Plugin
     const struct TALER_WireTransferIdentifierRawP *wtid);
 
 
+  /**
+   * Insert mappings of many coins to the wire transfer @a wtid, using
+   * a single statement.  The i-th coin is @a coin_pubs[i], deposited
+   * for @a h_contract_terms[i].  Mappings that already exist are
+   * ignored.
+   *
+   * @param cls closure
+   * @param wtid identifier of the wire transfer in which the exchange
+   *             send us the money for the coin deposits
+   * @param coins_cnt length of the @a h_contract_terms and @a coin_pubs arrays
+   * @param h_contract_terms proposal data's hashcodes
+   * @param coin_pubs public keys of the coins
+   * @return transaction status
+   */
+  enum GNUNET_DB_QueryStatus
+  (*store_coins_to_transfer)(
+    void *cls,
+    const struct TALER_WireTransferIdentifierRawP *wtid,
+    unsigned int coins_cnt,
+    const struct GNUNET_HashCode *h_contract_terms,
+    const struct TALER_CoinSpendPublicKeyP *coin_pubs);
+
+
   /**
    * Insert wire transfer confirmation from the exchange into the database.
    *
@@ -556,6 +1106,33 @@ struct TALER_MERCHANTDB_Plugin
     void *cb_cls);
 
 
+  /**
+   * Retrieve information about many deposited coins with a single
+   * statement.  The i-th coin is @a coin_pubs[i], deposited for
+   * @a h_contract_terms[i].  @a cb is called in ascending order of
+   * the offsets, and not at all for coins that are not in the
+   * database.
+   *
+   * @param cls closure
+   * @param merchant_pub merchant's public key
+   * @param coins_cnt length of the @a h_contract_terms and @a coin_pubs arrays
+   * @param h_contract_terms proposal data's hashcodes
+   * @param coin_pubs public keys of the coins
+   * @param cb function to call with payment data
+   * @param cb_cls closure for @a cb
+   * @return transaction status, number of coins found on success
+   */
+  enum GNUNET_DB_QueryStatus
+  (*find_payments_by_coins)(
+    void *cls,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    unsigned int coins_cnt,
+    const struct GNUNET_HashCode *h_contract_terms,
+    const struct TALER_CoinSpendPublicKeyP *coin_pubs,
+    TALER_MERCHANTDB_CoinDepositOffsetCallback cb,
+    void *cb_cls);
+
+
   /**
    * Lookup information about a transfer by @a h_contract_terms.  Note
    * that in theory there could be multiple wire transfers for a
@@ -897,6 +1474,206 @@ struct TALER_MERCHANTDB_Plugin
   enum GNUNET_DB_QueryStatus
   (*commit)(void *cls);
 
+
+  /* ***************** Asynchronous API ********************* */
+
+  /* The following functions do not block: the query is run on a
+     separate database connection and the callback is invoked from
+     the scheduler once the result is available.  They must not be
+     used within a transaction started with @e start. */
+
+  /**
+   * Asynchronously retrieve the frequently needed fields of
+   * contract terms given their order id.
+   *
+   * @param cls closure
+   * @param order_id order id used to perform the lookup
+   * @param merchant_pub instance's public key
+   * @param cb function to call with the result
+   * @param cb_cls closure for @a cb
+   * @return handle to cancel the operation, NULL on error
+   */
+  struct TALER_MERCHANTDB_AsyncHandle *
+  (*find_contract_info_async)(void *cls,
+                              const char *order_id,
+                              const struct TALER_MerchantPublicKeyP *
+                              merchant_pub,
+                              TALER_MERCHANTDB_ContractInfoCallback cb,
+                              void *cb_cls);
+
+
+  /**
+   * Asynchronously retrieve the frequently needed fields of
+   * contract terms given their hashcode.
+   *
+   * @param cls closure
+   * @param h_contract_terms hashcode used to lookup
+   * @param merchant_pub instance's public key
+   * @param cb function to call with the result
+   * @param cb_cls closure for @a cb
+   * @return handle to cancel the operation, NULL on error
+   */
+  struct TALER_MERCHANTDB_AsyncHandle *
+  (*find_contract_info_from_hash_async)(
+    void *cls,
+    const struct GNUNET_HashCode *h_contract_terms,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    TALER_MERCHANTDB_ContractInfoCallback cb,
+    void *cb_cls);
+
+
+  /**
+   * Asynchronously retrieve claimed contract terms given their
+   * order id, as stored when they were claimed.
+   *
+   * @param cls closure
+   * @param order_id order id used to perform the lookup
+   * @param merchant_pub instance's public key
+   * @param cb function to call with the result
+   * @param cb_cls closure for @a cb
+   * @return handle to cancel the operation, NULL on error
+   */
+  struct TALER_MERCHANTDB_AsyncHandle *
+  (*find_claimed_contract_async)(
+    void *cls,
+    const char *order_id,
+    const struct TALER_MerchantPublicKeyP *merchant_pub,
+    TALER_MERCHANTDB_ClaimedContractCallback cb,
+    void *cb_cls);
+
+
+  /**
+   * Cancel asynchronous operation.  The callback will not be called.
+   *
+   * @param cls closure
+   * @param ah operation to cancel
+   */
+  void
+  (*async_cancel)(void *cls,
+                  struct TALER_MERCHANTDB_AsyncHandle *ah);
+
+
+  /**
+   * Obtain statistics about the connection pool used for
+   * asynchronous operations.
+   *
+   * @param cls closure
+   * @param[out] stats set to the current statistics
+   */
+  void
+  (*get_pool_statistics)(void *cls,
+                         struct TALER_MERCHANTDB_PoolStatistics *stats);
+
+
+  /**
+   * Obtain latency statistics for all prepared statements that
+   * were executed at least once, including those of the asynchronous
+   * API.  Batches are reported as one statement, "batch_commit".
+   *
+   * @param cls closure
+   * @param cb function to call for each statement
+   * @param cb_cls closure for @a cb
+   */
+  void
+  (*iterate_statement_statistics)(
+    void *cls,
+    TALER_MERCHANTDB_StatementStatisticsCallback cb,
+    void *cb_cls);
+
+
+  /**
+   * Tell all processes listening on the database that a payment or
+   * refund was recorded for the order identified by @a key.  The
+   * notification is sent asynchronously and not reported back to the
+   * process that sent it.
+   *
+   * @param cls closure
+   * @param key key identifying the order
+   * @param refund_amount total refunded amount if the event is a
+   *        refund, NULL for payments
+   */
+  void
+  (*notify_payment_event)(void *cls,
+                          const struct GNUNET_HashCode *key,
+                          const struct TALER_Amount *refund_amount);
+
+
+  /**
+   * Start listening for events sent by other processes with
+   * @e notify_payment_event, until the plugin is unloaded.  Events
+   * sent while the connection to the database is broken are lost.
+   *
+   * @param cls closure
+   * @param cb function to call for each event
+   * @param cb_cls closure for @a cb
+   */
+  void
+  (*listen_payment_events)(void *cls,
+                           TALER_MERCHANTDB_PaymentEventCallback cb,
+                           void *cb_cls);
+
+
+  /* ***************** Batch API ********************* */
+
+  /* Statements added to a batch are sent to the database together
+     (pipelined, if libpq supports it) and executed in a transaction
+     of their own by @e batch_commit_TR, so that the whole batch
+     takes about one round trip instead of one per statement. */
+
+  /**
+   * Start a batch.
+   *
+   * @param cls closure
+   * @return the batch
+   */
+  struct TALER_MERCHANTDB_Batch *
+  (*batch_start)(void *cls);
+
+
+  /**
+   * Add @e store_deposit for the given arguments to @a batch.
+   *
+   * @param cls closure
+   * @param batch batch to add to
+   * @param h_contract_terms proposal data's hashcode
+   * @param merchant_pub merchant's public key
+   * @param coin_pub public key of the coin
+   * @param exchange_url URL of the exchange that issued @a coin_pub
+   * @param amount_with_fee amount the exchange will deposit for this coin
+   * @param deposit_fee fee the exchange will charge for this coin
+   * @param refund_fee fee the exchange will charge for refunding this coin
+   * @param wire_fee wire fee the exchange charges
+   * @param signkey_pub public key used by the exchange for @a exchange_proof
+   * @param exchange_proof proof from exchange that coin was accepted
+   */
+  void
+  (*batch_store_deposit)(void *cls,
+                         struct TALER_MERCHANTDB_Batch *batch,
+                         const struct GNUNET_HashCode *h_contract_terms,
+                         const struct TALER_MerchantPublicKeyP *merchant_pub,
+                         const struct TALER_CoinSpendPublicKeyP *coin_pub,
+                         const char *exchange_url,
+                         const struct TALER_Amount *amount_with_fee,
+                         const struct TALER_Amount *deposit_fee,
+                         const struct TALER_Amount *refund_fee,
+                         const struct TALER_Amount *wire_fee,
+                         const struct TALER_ExchangePublicKeyP *signkey_pub,
+                         const json_t *exchange_proof);
+
+
+  /**
+   * Execute all statements of @a batch in one transaction (retrying
+   * on serialization failures) and free @a batch.
+   *
+   * @param cls closure
+   * @param batch batch to execute
+   * @return transaction status, #GNUNET_DB_STATUS_HARD_ERROR
+   *         if adding a statement to @a batch failed
+   */
+  enum GNUNET_DB_QueryStatus
+  (*batch_commit_TR)(void *cls,
+                     struct TALER_MERCHANTDB_Batch *batch);
+
 };
 
 #endif
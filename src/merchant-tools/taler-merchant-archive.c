@@ -0,0 +1,165 @@
+/*
+  This file is part of TALER
+  Copyright (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file merchant-tools/taler-merchant-archive.c
+ * @brief Maintain the partitions of the merchant database: create
+ *        partitions for the coming months and archive old ones.
+ *        Meant to be run periodically (e.g. daily from cron).
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <taler/taler_util.h>
+#include <gnunet/gnunet_util_lib.h>
+#include "taler_merchantdb_lib.h"
+
+
+/**
+ * Return value from main().
+ */
+static int global_ret;
+
+/**
+ * -a option: create partitions for this long into the future.
+ */
+static struct GNUNET_TIME_Relative ahead;
+
+/**
+ * -o option: archive partitions with data older than this,
+ * zero to not archive anything.
+ */
+static struct GNUNET_TIME_Relative older_than;
+
+
+/**
+ * Main function that will be run.
+ *
+ * @param cls closure
+ * @param args remaining command-line arguments
+ * @param cfgfile name of the configuration file used (for saving, can be NULL!)
+ * @param config configuration
+ */
+static void
+run (void *cls,
+     char *const *args,
+     const char *cfgfile,
+     const struct GNUNET_CONFIGURATION_Handle *config)
+{
+  struct TALER_MERCHANTDB_Plugin *plugin;
+  struct GNUNET_CONFIGURATION_Handle *cfg;
+  enum GNUNET_DB_QueryStatus qs;
+  unsigned int cnt;
+
+  cfg = GNUNET_CONFIGURATION_dup (config);
+  if (NULL ==
+      (plugin = TALER_MERCHANTDB_plugin_load (cfg)))
+  {
+    fprintf (stderr,
+             "Failed to initialize database plugin.\n");
+    global_ret = 1;
+    GNUNET_CONFIGURATION_destroy (cfg);
+    return;
+  }
+  qs = plugin->create_partitions (plugin->cls,
+                                  GNUNET_TIME_relative_to_absolute (ahead),
+                                  &cnt);
+  if (0 > qs)
+  {
+    fprintf (stderr,
+             "Failed to create partitions.\n");
+    global_ret = 1;
+  }
+  else
+  {
+    GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                "Created %u partitions\n",
+                cnt);
+  }
+  if ( (0 == global_ret) &&
+       (0 != older_than.rel_value_us) )
+  {
+    qs = plugin->archive_partitions (plugin->cls,
+                                     GNUNET_TIME_absolute_subtract (
+                                       GNUNET_TIME_absolute_get (),
+                                       older_than),
+                                     &cnt);
+    if (0 > qs)
+    {
+      fprintf (stderr,
+               "Failed to archive partitions.\n");
+      global_ret = 1;
+    }
+    else
+    {
+      GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+                  "Moved %u partitions to the `merchant_archive' schema\n",
+                  cnt);
+    }
+  }
+  TALER_MERCHANTDB_plugin_unload (plugin);
+  GNUNET_CONFIGURATION_destroy (cfg);
+}
+
+
+/**
+ * The main function of the database archival tool.
+ *
+ * @param argc number of arguments from the command line
+ * @param argv command line arguments
+ * @return 0 ok, 1 on error
+ */
+int
+main (int argc,
+      char *const *argv)
+{
+  struct GNUNET_GETOPT_CommandLineOption options[] = {
+
+    GNUNET_GETOPT_option_relative_time ('a',
+                                        "ahead",
+                                        "RELATIVETIME",
+                                        "create partitions for this long into the future (default: 90 days)",
+                                        &ahead),
+
+    GNUNET_GETOPT_option_relative_time ('o',
+                                        "older-than",
+                                        "RELATIVETIME",
+                                        "archive partitions that only hold contracts older than this (the backend no longer sees them afterwards)",
+                                        &older_than),
+
+    GNUNET_GETOPT_OPTION_END
+  };
+
+  /* force linker to link against libtalerutil; if we do
+     not do this, the linker may "optimize" libtalerutil
+     away and skip #TALER_OS_init(), which we do need */
+  (void) TALER_project_data_default ();
+  GNUNET_assert (GNUNET_OK ==
+                 GNUNET_log_setup ("taler-merchant-archive",
+                                   "INFO",
+                                   NULL));
+  ahead = GNUNET_TIME_relative_multiply (GNUNET_TIME_UNIT_DAYS,
+                                         90);
+  if (GNUNET_OK !=
+      GNUNET_PROGRAM_run (argc, argv,
+                          "taler-merchant-archive",
+                          "Maintain partitions of the Taler merchant database",
+                          options,
+                          &run, NULL))
+    return 1;
+  return global_ret;
+}
+
+
+/* end of taler-merchant-archive.c */
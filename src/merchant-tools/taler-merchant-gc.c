@@ -0,0 +1,231 @@
+/*
+  This file is part of TALER
+  Copyright (C) 2020 Taler Systems SA
+
+  TALER is free software; you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation; either version 3, or (at your option) any later version.
+
+  TALER is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+  A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License along with
+  TALER; see the file COPYING.  If not, see <http://www.gnu.org/licenses/>
+*/
+/**
+ * @file merchant-tools/taler-merchant-gc.c
+ * @brief Delete orders that were claimed or expired and old sessions
+ *        from the merchant database.  Deletes in small batches (each
+ *        in its own transaction), so it can run (e.g. hourly from
+ *        cron) while the backend is serving requests.
+ * @author Christian Grothoff
+ */
+#include "platform.h"
+#include <taler/taler_util.h>
+#include <gnunet/gnunet_util_lib.h>
+#include "taler_merchantdb_lib.h"
+
+
+/**
+ * How often do we retry a batch on serialization errors?
+ */
+#define MAX_RETRIES 3
+
+
+/**
+ * Signature of the plugin's garbage collection functions.
+ *
+ * @param cls closure
+ * @param cutoff delete rows that expired before this time
+ * @param limit maximum number of rows to delete
+ * @return transaction status, number of rows deleted on success
+ */
+typedef enum GNUNET_DB_QueryStatus
+(*GcFunction)(void *cls,
+              struct GNUNET_TIME_Absolute cutoff,
+              uint32_t limit);
+
+
+/**
+ * Return value from main().
+ */
+static int global_ret;
+
+/**
+ * -b option: number of rows to delete per transaction.
+ */
+static unsigned int batch_size = 1000;
+
+/**
+ * -e option: keep unclaimed orders for this long after their
+ * pay deadline.
+ */
+static struct GNUNET_TIME_Relative expired_grace;
+
+/**
+ * -s option: keep session-to-order mappings for this long.
+ */
+static struct GNUNET_TIME_Relative session_lifetime;
+
+/**
+ * Our database plugin.
+ */
+static struct TALER_MERCHANTDB_Plugin *plugin;
+
+
+/**
+ * Call @a gc in batches of #batch_size rows until it deletes fewer
+ * than #batch_size rows.
+ *
+ * @param gc garbage collection function of the plugin
+ * @param cutoff cutoff to pass to @a gc
+ * @param what description of the rows, for logging
+ * @return #GNUNET_OK on success
+ */
+static enum GNUNET_GenericReturnValue
+gc_batches (GcFunction gc,
+            struct GNUNET_TIME_Absolute cutoff,
+            const char *what)
+{
+  unsigned long long total = 0;
+  unsigned int retries = 0;
+  enum GNUNET_DB_QueryStatus qs;
+
+  do {
+    plugin->preflight (plugin->cls);
+    qs = gc (plugin->cls,
+             cutoff,
+             batch_size);
+    if ( (GNUNET_DB_STATUS_SOFT_ERROR == qs) &&
+         (retries++ < MAX_RETRIES) )
+      continue;
+    if (0 > qs)
+    {
+      fprintf (stderr,
+               "Failed to delete %s after deleting %llu.\n",
+               what,
+               total);
+      return GNUNET_SYSERR;
+    }
+    retries = 0;
+    total += qs;
+  } while ( (GNUNET_DB_STATUS_SOFT_ERROR == qs) ||
+            (batch_size == (unsigned int) qs) );
+  GNUNET_log (GNUNET_ERROR_TYPE_INFO,
+              "Deleted %llu %s\n",
+              total,
+              what);
+  return GNUNET_OK;
+}
+
+
+/**
+ * Main function that will be run.
+ *
+ * @param cls closure
+ * @param args remaining command-line arguments
+ * @param cfgfile name of the configuration file used (for saving, can be NULL!)
+ * @param config configuration
+ */
+static void
+run (void *cls,
+     char *const *args,
+     const char *cfgfile,
+     const struct GNUNET_CONFIGURATION_Handle *config)
+{
+  struct GNUNET_CONFIGURATION_Handle *cfg;
+  struct GNUNET_TIME_Absolute now;
+
+  if (0 == batch_size)
+  {
+    fprintf (stderr,
+             "Batch size must be positive.\n");
+    global_ret = 1;
+    return;
+  }
+  cfg = GNUNET_CONFIGURATION_dup (config);
+  if (NULL ==
+      (plugin = TALER_MERCHANTDB_plugin_load (cfg)))
+  {
+    fprintf (stderr,
+             "Failed to initialize database plugin.\n");
+    global_ret = 1;
+    GNUNET_CONFIGURATION_destroy (cfg);
+    return;
+  }
+  now = GNUNET_TIME_absolute_get ();
+  if ( (GNUNET_OK !=
+        gc_batches (plugin->gc_orders,
+                    GNUNET_TIME_absolute_subtract (now,
+                                                   expired_grace),
+                    "claimed or expired orders")) ||
+       (GNUNET_OK !=
+        gc_batches (plugin->gc_sessions,
+                    GNUNET_TIME_absolute_subtract (now,
+                                                   session_lifetime),
+                    "sessions")) )
+    global_ret = 1;
+  TALER_MERCHANTDB_plugin_unload (plugin);
+  plugin = NULL;
+  GNUNET_CONFIGURATION_destroy (cfg);
+}
+
+
+/**
+ * The main function of the database garbage collection tool.
+ *
+ * @param argc number of arguments from the command line
+ * @param argv command line arguments
+ * @return 0 ok, 1 on error
+ */
+int
+main (int argc,
+      char *const *argv)
+{
+  struct GNUNET_GETOPT_CommandLineOption options[] = {
+
+    GNUNET_GETOPT_option_uint ('b',
+                               "batch-size",
+                               "ROWS",
+                               "delete at most ROWS rows per transaction (default: 1000)",
+                               &batch_size),
+
+    GNUNET_GETOPT_option_relative_time ('e',
+                                        "expired-grace",
+                                        "RELATIVETIME",
+                                        "keep unclaimed orders for this long after their pay deadline (default: 1 day)",
+                                        &expired_grace),
+
+    GNUNET_GETOPT_option_relative_time ('s',
+                                        "session-lifetime",
+                                        "RELATIVETIME",
+                                        "keep the orders paid in a session for this long (default: 30 days)",
+                                        &session_lifetime),
+
+    GNUNET_GETOPT_OPTION_END
+  };
+
+  /* force linker to link against libtalerutil; if we do
+     not do this, the linker may "optimize" libtalerutil
+     away and skip #TALER_OS_init(), which we do need */
+  (void) TALER_project_data_default ();
+  GNUNET_assert (GNUNET_OK ==
+                 GNUNET_log_setup ("taler-merchant-gc",
+                                   "INFO",
+                                   NULL));
+  expired_grace = GNUNET_TIME_UNIT_DAYS;
+  session_lifetime = GNUNET_TIME_relative_multiply (GNUNET_TIME_UNIT_DAYS,
+                                                    30);
+  if (GNUNET_OK !=
+      GNUNET_PROGRAM_run (argc, argv,
+                          "taler-merchant-gc",
+                          "Delete orders and sessions the merchant backend no longer needs",
+                          options,
+                          &run, NULL))
+    return 1;
+  return global_ret;
+}
+
+
+/* end of taler-merchant-gc.c */